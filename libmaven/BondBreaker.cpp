@@ -1,10 +1,213 @@
 #include "BondBreaker.h"
+#include "mzSample.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace Smiley;
 using namespace std;
 
+/**
+ * @brief heavy atom graph of a molecule, hydrogens are folded into the atom they are bonded to.
+ * Component labels of the graph for a set of cut bonds are shared by all of its supersets,
+ * so that adding a cut only needs to re-walk the one component that the bond belongs to.
+ */
+struct FragmentGraph {
+
+    vector<int> elements;                     //by heavy atom
+    vector<int> hydrogenCounts;               //by heavy atom
+    vector<vector<pair<int, int> > > adjacency; //by heavy atom: (heavy atom, bond index)
+    vector<pair<int, int> > bondAtoms;        //by bond index: heavy atoms, (-1, -1) for bonds to hydrogens
+
+    //walk the component of atom from, without crossing cut bonds, and label it with label
+    void walk(int from, int label, const vector<bool>& isCut, vector<int>& labels, vector<int>& visited) const {
+        visited.clear();
+        visited.push_back(from);
+        labels[from] = label;
+        for (unsigned int i = 0; i < visited.size(); i++) {
+            for (const pair<int, int>& neighbor : adjacency[visited[i]]) {
+                if (isCut[neighbor.second] || labels[neighbor.first] == label) continue;
+                labels[neighbor.first] = label;
+                visited.push_back(neighbor.first);
+            }
+        }
+    }
+};
+
+/**
+ * @brief ring membership from the bridges of the heavy atom graph: as in Molecule::calculateRings(),
+ * both atoms of a bond are in a ring if the molecule stays connected without that bond.
+ */
+static void markRingAtoms(Molecule& mol, const FragmentGraph& graph, const vector<int>& atomIdxByHeavyAtom) {
+
+    int numAtoms = graph.elements.size();
+    if (numAtoms == 0) return;
+
+    vector<int> order(numAtoms, -1);
+    vector<int> low(numAtoms, 0);
+    int counter = 0;
+    int numComponents = 0;
+
+    vector<bool> isBridge(graph.bondAtoms.size(), false);
+
+    //iterative Tarjan, edges are identified by bond index so that parallel bonds are handled
+    for (int root = 0; root < numAtoms; root++) {
+        if (order[root] != -1) continue;
+        numComponents++;
+
+        vector<pair<int, int> > stack; //(atom, bond index used to reach it)
+        vector<unsigned int> nextNeighbor(numAtoms, 0);
+        stack.push_back(make_pair(root, -1));
+        order[root] = low[root] = counter++;
+
+        while (!stack.empty()) {
+            int atom = stack.back().first;
+            int parentBond = stack.back().second;
+
+            if (nextNeighbor[atom] < graph.adjacency[atom].size()) {
+                const pair<int, int>& neighbor = graph.adjacency[atom][nextNeighbor[atom]++];
+                if (neighbor.second == parentBond) continue;
+                if (order[neighbor.first] == -1) {
+                    order[neighbor.first] = low[neighbor.first] = counter++;
+                    stack.push_back(make_pair(neighbor.first, neighbor.second));
+                } else {
+                    low[atom] = min(low[atom], order[neighbor.first]);
+                }
+            } else {
+                stack.pop_back();
+                if (!stack.empty()) {
+                    int parent = stack.back().first;
+                    low[parent] = min(low[parent], low[atom]);
+                    if (low[atom] > order[parent]) isBridge[parentBond] = true;
+                }
+            }
+        }
+    }
+
+    //a disconnected molecule never becomes a single component, so nothing is in a ring
+    if (numComponents != 1) return;
+
+    for (unsigned int bi = 0; bi < graph.bondAtoms.size(); bi++) {
+        if (graph.bondAtoms[bi].first < 0 || isBridge[bi]) continue;
+        mol.atoms[atomIdxByHeavyAtom[graph.bondAtoms[bi].first]].inRing = true;
+        mol.atoms[atomIdxByHeavyAtom[graph.bondAtoms[bi].second]].inRing = true;
+    }
+}
+
+/**
+ * @brief state of the cut set enumeration of one molecule
+ */
+struct BondBreakingState {
+    const FragmentGraph& graph;
+    Molecule& mol;
+    const vector<int>& breakableBonds;
+    int maxBondBreaks;
+    double minMW;
+
+    vector<bool> isCut;
+    vector<int> visited;
+    unordered_set<vector<bool> > seenFragments;
+    map<string, double>& fragments;
+
+    BondBreakingState(const FragmentGraph& graph, Molecule& mol, const vector<int>& breakableBonds, int maxBondBreaks, double minMW, map<string, double>& fragments) :
+        graph(graph), mol(mol), breakableBonds(breakableBonds), maxBondBreaks(maxBondBreaks), minMW(minMW), fragments(fragments) {
+        isCut.assign(graph.bondAtoms.size(), false);
+    }
+
+    //formula of the atoms labelled label, with a hydrogen added for every cut bond leaving it.
+    //Fragments already seen (as atom sets) are skipped.
+    void addFragment(const vector<int>& labels, int label) {
+
+        vector<bool> atomSet(labels.size(), false);
+        for (unsigned int ai = 0; ai < labels.size(); ai++) atomSet[ai] = (labels[ai] == label);
+
+        if (!seenFragments.insert(atomSet).second) return;
+
+        map<int, int> atomCounts;
+        int stubCount = 0;
+        for (unsigned int ai = 0; ai < labels.size(); ai++) {
+            if (!atomSet[ai]) continue;
+            atomCounts[graph.elements[ai]]++;
+            if (graph.hydrogenCounts[ai] > 0) atomCounts[1] += graph.hydrogenCounts[ai];
+            for (const pair<int, int>& neighbor : graph.adjacency[ai]) {
+                if (labels[neighbor.first] != label) stubCount++;
+            }
+        }
+        if (stubCount >= 1) atomCounts[1] += stubCount; //ADD HYDROGENS to stubs
+
+        double compMW = 0;
+        for (auto p : atomCounts) {
+            compMW += mol.atominfo.ELEMEMNT_MASS[p.first] * p.second;
+        }
+
+        if (compMW > minMW) fragments[mol.prettyFormula(atomCounts)] = compMW;
+    }
+
+    //cut every breakable bond from firstBond on in addition to the current cut set
+    void breakBonds(const vector<int>& labels, int numLabels, unsigned int firstBond, int numBroken) {
+
+        for (unsigned int t = firstBond; t < breakableBonds.size(); t++) {
+            int bi = breakableBonds[t];
+            int source = graph.bondAtoms[bi].first;
+            int target = graph.bondAtoms[bi].second;
+
+            isCut[bi] = true;
+
+            vector<int> cutLabels(labels);
+            int cutNumLabels = numLabels;
+
+            graph.walk(source, numLabels + 1, isCut, cutLabels, visited);
+
+            if (cutLabels[target] == numLabels + 1) {
+                //ring bond, still one component: same fragments, but later cuts can split it
+                cutLabels = labels;
+            } else {
+                cutNumLabels++;
+                addFragment(cutLabels, cutNumLabels);
+                addFragment(cutLabels, labels[target]);
+            }
+
+            if (numBroken + 1 < maxBondBreaks) {
+                breakBonds(cutLabels, cutNumLabels, t + 1, numBroken + 1);
+            }
+
+            isCut[bi] = false;
+        }
+    }
+};
+
+//libraries list the same structure for many compounds and adducts
+static unordered_map<string, map<string, double> > fragmentsBySmile{};
+static mutex fragmentsMutex;
+
+void BondBreaker::clearFragmentCache() {
+        lock_guard<mutex> lock(fragmentsMutex);
+        fragmentsBySmile.clear();
+}
+
 void BondBreaker::breakBonds(string smile) {
 
+        string key = smile + "|" + to_string(_breakCBonds) + to_string(_breakDoubleBonds) + "|" + to_string(_minMW) + "|" + to_string(_maxBondBreaks);
+        {
+            lock_guard<mutex> lock(fragmentsMutex);
+            auto it = fragmentsBySmile.find(key);
+            if (it != fragmentsBySmile.end()) {
+                allfragments = it->second;
+                return;
+            }
+        }
+
+        computeFragments(smile);
+
+        lock_guard<mutex> lock(fragmentsMutex);
+        if (fragmentsBySmile.size() >= maxCachedFragmentSets) fragmentsBySmile.clear();
+        fragmentsBySmile.insert(make_pair(key, allfragments));
+}
+
+void BondBreaker::computeFragments(string smile) {
+
         MoleculeSmilesCallback callback;
         Molecule &mol = callback.molecule;
         Parser<MoleculeSmilesCallback> parser(callback);
@@ -13,58 +216,103 @@ void BondBreaker::breakBonds(string smile) {
         } catch (Exception &e) {
             if (e.type() == Exception::SyntaxError)
                 std::cerr << "Smile Syntax Parse Error" << smile << endl;
-            return; 
+            return;
         }
         mol.addHydrogens();
-        mol.calculateRings();
+
+        //heavy atom graph
+        FragmentGraph graph;
+        vector<int> heavyAtomByAtomIdx(mol.atoms.size(), -1);
+        vector<int> atomIdxByHeavyAtom;
+        for (unsigned int ai = 0; ai < mol.atoms.size(); ai++) {
+            if (mol.atoms[ai].element == 1) continue;
+            heavyAtomByAtomIdx[ai] = graph.elements.size();
+            atomIdxByHeavyAtom.push_back(ai);
+            graph.elements.push_back(mol.atoms[ai].element);
+        }
+        graph.hydrogenCounts.assign(graph.elements.size(), 0);
+        graph.adjacency.resize(graph.elements.size());
+        graph.bondAtoms.assign(mol.bonds.size(), make_pair(-1, -1));
+
+        for (unsigned int bi = 0; bi < mol.bonds.size(); bi++) {
+            int source = heavyAtomByAtomIdx[mol.bonds[bi].source];
+            int target = heavyAtomByAtomIdx[mol.bonds[bi].target];
+            if (source >= 0 && target >= 0) {
+                graph.bondAtoms[bi] = make_pair(source, target);
+                graph.adjacency[source].push_back(make_pair(target, bi));
+                graph.adjacency[target].push_back(make_pair(source, bi));
+            } else if (source >= 0) {
+                graph.hydrogenCounts[source]++;
+            } else if (target >= 0) {
+                graph.hydrogenCounts[target]++;
+            }
+        }
+
+        markRingAtoms(mol, graph, atomIdxByHeavyAtom);
 
         if (!mol.isOrganic() ) {
             cerr <<  "NOT ORGANIC!  " << smile << endl;
             return;
         }
 
-        //if ( comp.formula != mol.getFormula() ) {
-        //    cerr << "HMMM FORMULA MISMATCH: " << comp.formula << " " << mol.getFormula() << " " << comp.id << " " << smile << endl;
-        //   return;
-        //}
-
         allfragments[mol.getFormula()] = mol.MW();
 
-        //single bond break
-        for(int bi=0; bi < mol.bonds.size(); bi++) {
-            if (checkBondBreakable(mol,bi) == false) continue;
-
-            vector<int>breakBonds;
-            breakBonds.push_back(bi);
-            vector<int> fragments = mol.getFragments(breakBonds);
-            map<string,double> fragmentFormulas = mol.getFragmentFormulas(fragments);
-            for (auto f : fragmentFormulas )  if(f.second>_minMW) allfragments[f.first] = f.second;
-            //two bonds breaks
-            for(int bj=0; bj < mol.bonds.size(); bj++) {
-                if(bj == bi) continue;
-
-                if (checkBondBreakable(mol, bj) == false) continue;
-                breakBonds.push_back(bj);
-                vector<int> fragments = mol.getFragments(breakBonds);
-                map<string,double> fragmentFormulas = mol.getFragmentFormulas(fragments);
-                for (auto f : fragmentFormulas )  if(f.second>_minMW) allfragments[f.first] = f.second;
-
-                //three bonds breaks 
-                for(int bk=bj+1; bk < mol.bonds.size(); bk++) {
-                    if (checkBondBreakable(mol, bk) == false) continue;
-                    breakBonds.push_back(bk);
-                    vector<int> fragments = mol.getFragments(breakBonds);
-                    map<string,double> fragmentFormulas = mol.getFragmentFormulas(fragments);
-                    for (auto f : fragmentFormulas )  if(f.second>_minMW) allfragments[f.first] = f.second;
-                }
+        vector<int> breakableBonds;
+        for (unsigned int bi = 0; bi < mol.bonds.size(); bi++) {
+            if (checkBondBreakable(mol, bi)) breakableBonds.push_back(bi);
+        }
+
+        if (!breakableBonds.empty()) {
+
+            BondBreakingState state(graph, mol, breakableBonds, _maxBondBreaks, _minMW, allfragments);
+
+            //components of the uncut molecule (more than one for salts etc.)
+            vector<int> labels(graph.elements.size(), 0);
+            int numLabels = 0;
+            for (unsigned int ai = 0; ai < labels.size(); ai++) {
+                if (labels[ai] != 0) continue;
+                graph.walk(ai, ++numLabels, state.isCut, labels, state.visited);
             }
+            for (int label = 1; label <= numLabels; label++) {
+                state.addFragment(labels, label);
+            }
+
+            //one, two, three... bond breaks
+            state.breakBonds(labels, numLabels, 0, 0);
         }
 }
 
+void BondBreaker::fragmentCompounds(const vector<Compound*>& compounds, int ionizationMode) {
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int) compounds.size(); i++) {
+            Compound* compound = compounds[i];
+            if (!compound || compound->smileString.empty()) continue;
 
+            BondBreaker bondBreaker(*this);
+            bondBreaker.setSmile(compound->smileString);
+
+            //singly charged fragments, by m/z
+            vector<pair<float, string> > fragmentMzs;
+            for (auto& fragment : bondBreaker.allfragments) {
+                float mz = static_cast<float>(fragment.second + (ionizationMode < 0 ? -PROTON : PROTON));
+                fragmentMzs.push_back(make_pair(mz, fragment.first));
+            }
+            sort(fragmentMzs.begin(), fragmentMzs.end());
+
+            compound->fragment_mzs.resize(fragmentMzs.size());
+            compound->fragment_intensity.assign(fragmentMzs.size(), 1.0f);
+            compound->fragment_labels.resize(fragmentMzs.size());
+            for (unsigned int j = 0; j < fragmentMzs.size(); j++) {
+                compound->fragment_mzs[j] = fragmentMzs[j].first;
+                compound->fragment_labels[j] = fragmentMzs[j].second;
+            }
+            compound->virtualFragmentation = true;
+        }
+}
 
 
-bool BondBreaker::checkBondBreakable(Molecule& mol, int bi) { 
+bool BondBreaker::checkBondBreakable(Molecule& mol, int bi) {
     Bond* bond1 =    mol.getBond(bi);
     Atom* atom1 =    mol.getAtom(bond1->source);
     Atom* atom2 =    mol.getAtom(bond1->target);
@@ -10,6 +10,8 @@
 #include "smiley.h"
 #include "molecule.h"
 
+class Compound;
+
 class BondBreaker {
 
 public:
@@ -17,11 +19,13 @@ public:
         _breakCBonds=false;
         _breakDoubleBonds=false;
         _minMW=60;
+        _maxBondBreaks=3;
     }
 
     void breakCarbonBonds(bool flag) { _breakCBonds=flag; }
     void breakDoubleBonds(bool flag) { _breakDoubleBonds=flag; }
     void setMinMW(double mw) { _minMW=mw; }
+    void setMaxBondBreaks(int n) { _maxBondBreaks=n; }
 
     void setSmile(std::string smile) {
         _smile = smile;
@@ -33,15 +37,30 @@ public:
         return allfragments; 
     }
 
+    /**
+     * @brief fragment the SMILES of compounds in parallel, with the settings of this BondBreaker.
+     * Sets fragment_mzs (singly charged, sorted), fragment_intensity and fragment_labels (formulas).
+     */
+    void fragmentCompounds(const std::vector<Compound*>& compounds, int ionizationMode = +1);
+
+    /**
+     * @brief fragments are cached by SMILES and settings, for at most maxCachedFragmentSets
+     * structures (the cache is emptied when it is full). clearFragmentCache() frees it, e.g. after a library scan.
+     */
+    static void clearFragmentCache();
+    static const unsigned int maxCachedFragmentSets = 10000;
+
 private:
         std::string _smile;
         std::map<string,double> allfragments;
         void breakBonds(std::string smile);
+        void computeFragments(std::string smile);
         bool checkBondBreakable(Smiley::Molecule& mol, int bi);
 
         bool _breakCBonds;
         bool _breakDoubleBonds;
         double _minMW;
+        int _maxBondBreaks;
 
 
 };
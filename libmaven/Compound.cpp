@@ -44,13 +44,12 @@ float Compound::ajustedMass(int charge) {
 }
 
 
-FragmentationMatchScore Compound::scoreCompoundHit(Fragment* f, float productPpmTolr=20, bool searchProton=true) {
-        FragmentationMatchScore s;
-        Compound* cpd = this;
-
-        if (!cpd or cpd->fragment_mzs.size() == 0) return s;
+/**
+ * @brief libraryFragment
+ * library spectrum of a compound, as scored by Compound::scoreCompoundHit()
+ */
+static void libraryFragment(Compound* cpd, Fragment& t, bool searchProton) {
 
-        Fragment t;
         t.precursorMz = cpd->precursorMz;
         t.mzs = cpd->fragment_mzs;
         t.intensity_array = cpd->fragment_intensity;
@@ -70,6 +69,16 @@ FragmentationMatchScore Compound::scoreCompoundHit(Fragment* f, float productPpm
                 t.fragment_labels.push_back(t.fragment_labels[i]+"-H");
             }
         }
+}
+
+FragmentationMatchScore Compound::scoreCompoundHit(Fragment* f, float productPpmTolr=20, bool searchProton=true) {
+        FragmentationMatchScore s;
+        Compound* cpd = this;
+
+        if (!cpd or cpd->fragment_mzs.size() == 0) return s;
+
+        Fragment t;
+        libraryFragment(cpd, t, searchProton);
 
         //theory fragmentation or library fragmentation = t
         //experimental data = f
@@ -105,6 +114,39 @@ FragmentationMatchScore Compound::scoreCompoundHit(Fragment* f, float productPpm
         return s;
 }
 
+/**
+ * @brief Compound::scoreCompoundHits
+ * same scores as scoreCompoundHit() of each compound, computed with a FragmentBatchScorer:
+ * the observed spectrum f is preprocessed once, and is not annotated.
+ */
+vector<FragmentationMatchScore> Compound::scoreCompoundHits(const vector<Compound*>& compounds, Fragment* f, float productPpmTolr, bool searchProton) {
+
+        vector<FragmentationMatchScore> scores(compounds.size());
+        if (!f) return scores;
+
+        vector<Fragment> libraryFragments(compounds.size());
+        vector<Fragment*> candidates;
+        vector<unsigned int> candidateIndexes;
+
+        for (unsigned int i = 0; i < compounds.size(); i++) {
+            Compound* cpd = compounds[i];
+            if (!cpd or cpd->fragment_mzs.size() == 0) continue;
+
+            libraryFragment(cpd, libraryFragments[i], searchProton);
+            candidates.push_back(&libraryFragments[i]);
+            candidateIndexes.push_back(i);
+        }
+
+        FragmentBatchScorer scorer(f);
+        vector<FragmentationMatchScore> candidateScores = scorer.scoreAll(candidates, productPpmTolr);
+
+        for (unsigned int i = 0; i < candidateIndexes.size(); i++) {
+            scores[candidateIndexes[i]] = candidateScores[i];
+        }
+
+        return scores;
+}
+
 vector<Compound*> Compound::getChildren() {return vector<Compound*>(0);}
 
 vector<int> Compound::getConstituentMzs(){return vector<int>{static_cast<int>(mzUtils::mzToIntKey(precursorMz))};}
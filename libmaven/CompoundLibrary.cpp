@@ -0,0 +1,558 @@
+#include "CompoundLibrary.h"
+#include "mzSample.h"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace mzUtils;
+
+void StringPool::clear() {
+    chars.clear();
+    offsets.assign(1, 0);
+    ids.clear();
+    intern("");
+}
+
+uint32_t StringPool::intern(const string& s) {
+    auto it = ids.find(s);
+    if (it != ids.end()) return it->second;
+
+    uint32_t id = static_cast<uint32_t>(offsets.size() - 1);
+    chars.append(s);
+    offsets.push_back(static_cast<uint32_t>(chars.size()));
+    ids.insert(make_pair(s, id));
+    return id;
+}
+
+void StringPool::rebuildIds() {
+    ids.clear();
+    ids.reserve(size());
+    for (uint32_t id = 0; id < size(); id++) ids.insert(make_pair(get(id), id));
+}
+
+void CompoundLibrary::clear() {
+    *this = CompoundLibrary();
+}
+
+uint32_t CompoundLibrary::add(const Compound* compound) {
+
+    Compound* c = const_cast<Compound*>(compound);  // for the non-const getters
+    uint32_t i = static_cast<uint32_t>(size());
+
+    idIds.push_back(strings.intern(c->id));
+    nameIds.push_back(strings.intern(c->name));
+    formulaIds.push_back(strings.intern(c->formula));
+    smileIds.push_back(strings.intern(c->smileString));
+    adductIds.push_back(strings.intern(c->adductString));
+    dbIds.push_back(strings.intern(c->db));
+    methodIds.push_back(strings.intern(c->method_id));
+    srmIds.push_back(strings.intern(c->srmId));
+
+    exactMasses.push_back(c->getExactMass());
+    precursorMzs.push_back(c->precursorMz);
+    productMzs.push_back(c->productMz);
+    collisionEnergies.push_back(c->collisionEnergy);
+    expectedRts.push_back(c->expectedRt);
+    logPs.push_back(c->logP);
+    charges.push_back(c->charge);
+    ionizationModes.push_back(c->ionizationMode);
+    flags.push_back((c->isDecoy ? 1 : 0) | (c->virtualFragmentation ? 2 : 0));
+
+    for (unsigned int j = 0; j < c->fragment_mzs.size(); j++) {
+        fragmentMzs.push_back(c->fragment_mzs[j]);
+        fragmentIntensities.push_back(j < c->fragment_intensity.size() ? c->fragment_intensity[j] : 0.0f);
+        fragmentLabelIds.push_back(j < c->fragment_labels.size() ? strings.intern(c->fragment_labels[j]) : 0);
+
+        auto ionType = c->fragment_iontype.find(static_cast<int>(j));
+        fragmentIonTypeIds.push_back(ionType != c->fragment_iontype.end() ? strings.intern(ionType->second) : 0);
+    }
+    fragmentOffsets.push_back(static_cast<uint32_t>(fragmentMzs.size()));
+
+    for (const string& category : c->category) categoryIds.push_back(strings.intern(category));
+    categoryOffsets.push_back(static_cast<uint32_t>(categoryIds.size()));
+
+    for (const auto& it : c->metaDataMap) metaDataIds.push_back(make_pair(strings.intern(it.first), strings.intern(it.second)));
+    metaDataOffsets.push_back(static_cast<uint32_t>(metaDataIds.size()));
+
+    return i;
+}
+
+Compound* CompoundLibrary::getCompound(uint32_t i) const {
+
+    Compound* c = new Compound(getId(i), getName(i), getFormula(i), charges[i], exactMasses[i]);
+
+    c->cid = static_cast<int>(i);
+    c->smileString = strings.get(smileIds[i]);
+    c->adductString = getAdductString(i);
+    c->db = strings.get(dbIds[i]);
+    c->method_id = strings.get(methodIds[i]);
+    c->srmId = strings.get(srmIds[i]);
+
+    c->precursorMz = precursorMzs[i];
+    c->productMz = productMzs[i];
+    c->collisionEnergy = collisionEnergies[i];
+    c->expectedRt = expectedRts[i];
+    c->logP = logPs[i];
+    c->ionizationMode = ionizationModes[i];
+    c->isDecoy = flags[i] & 1;
+    c->virtualFragmentation = flags[i] & 2;
+
+    uint32_t first = fragmentOffsets[i];
+    uint32_t last = fragmentOffsets[i+1];
+
+    c->fragment_mzs.assign(fragmentMzs.begin() + first, fragmentMzs.begin() + last);
+    c->fragment_intensity.assign(fragmentIntensities.begin() + first, fragmentIntensities.begin() + last);
+    c->fragment_labels.reserve(last - first);
+    for (uint32_t j = first; j < last; j++) {
+        c->fragment_labels.push_back(strings.get(fragmentLabelIds[j]));
+        if (fragmentIonTypeIds[j]) c->fragment_iontype[static_cast<int>(j - first)] = strings.get(fragmentIonTypeIds[j]);
+    }
+
+    for (uint32_t j = categoryOffsets[i]; j < categoryOffsets[i+1]; j++) c->category.push_back(strings.get(categoryIds[j]));
+
+    for (uint32_t j = metaDataOffsets[i]; j < metaDataOffsets[i+1]; j++) {
+        c->metaDataMap.insert(make_pair(strings.get(metaDataIds[j].first), strings.get(metaDataIds[j].second)));
+    }
+
+    return c;
+}
+
+vector<Compound*> CompoundLibrary::getCompounds(const vector<uint32_t>& ids) const {
+    vector<Compound*> compounds(ids.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < ids.size(); i++) compounds[i] = getCompound(ids[i]);
+
+    return compounds;
+}
+
+/**
+ * @brief parse the peaks of an msp peak line: "mz intensity" pairs separated by ';',
+ * or a single pair followed by an optional "quoted" annotation.
+ */
+static void parseMspPeakLine(const string& line, Compound* compound) {
+
+    size_t quote = line.find('"');
+    if (quote != string::npos) {
+        char* end = nullptr;
+        float mz = strtof(line.c_str(), &end);
+        float intensity = strtof(end, nullptr);
+
+        size_t closingQuote = line.find('"', quote+1);
+        string label = line.substr(quote+1, closingQuote == string::npos ? string::npos : closingQuote-quote-1);
+
+        compound->fragment_mzs.push_back(mz);
+        compound->fragment_intensity.push_back(intensity);
+        compound->fragment_labels.push_back(label);
+        return;
+    }
+
+    const char* p = line.c_str();
+    while (*p) {
+        char* end = nullptr;
+        float mz = strtof(p, &end);
+        if (end == p) break;
+        p = end;
+        float intensity = strtof(p, &end);
+        if (end == p) break;
+        p = end;
+
+        compound->fragment_mzs.push_back(mz);
+        compound->fragment_intensity.push_back(intensity);
+        compound->fragment_labels.push_back("");
+
+        while (*p == ' ' || *p == '\t' || *p == ';' || *p == ',') p++;
+    }
+}
+
+size_t CompoundLibrary::loadMsp(istream& input) {
+
+    size_t numAdded = 0;
+    Compound* compound = nullptr;
+    bool isExactMassSet = false;
+    int ionMode = 0;
+
+    auto finishCompound = [&]() {
+        if (!compound) return;
+
+        if (!isExactMassSet && !compound->formula.empty()) {
+            compound->setExactMass(static_cast<float>(MassCalculator::computeNeutralMass(compound->formula)));
+        }
+        if (compound->ionizationMode == 0) compound->ionizationMode = ionMode;
+        if (compound->charge == 0) compound->charge = compound->ionizationMode;
+
+        if (compound->id.empty()) compound->id = compound->name;
+
+        add(compound);
+        numAdded++;
+
+        delete compound;
+        compound = nullptr;
+        isExactMassSet = false;
+        ionMode = 0;
+    };
+
+    string line;
+    while (getline(input, line)) {
+        if (!line.empty() && line[line.size()-1] == '\r') line.erase(line.size()-1);
+
+        if (line.empty()) {
+            finishCompound();
+            continue;
+        }
+
+        size_t colon = line.find(':');
+        bool isPeakLine = isdigit(static_cast<unsigned char>(line[0]));
+
+        if (isPeakLine || colon == string::npos) {
+            if (compound && isPeakLine) parseMspPeakLine(line, compound);
+            continue;
+        }
+
+        string key = line.substr(0, colon);
+        makeLowerCase(key);
+        size_t valueStart = line.find_first_not_of(" \t", colon+1);
+        string value = valueStart == string::npos ? "" : line.substr(valueStart);
+
+        if (key == "name") {
+            finishCompound();
+            compound = new Compound("", value, "", 0, 0.0f);
+            continue;
+        }
+
+        if (!compound) continue;
+
+        if (key == "id" || key == "db#") {
+            compound->id = value;
+        } else if (key == "formula") {
+            compound->formula = value;
+        } else if (key == "exactmass" || key == "exact_mass" || key == "exact mass") {
+            compound->setExactMass(string2float(value));
+            isExactMassSet = true;
+        } else if (key == "precursormz" || key == "precursor_mz") {
+            compound->precursorMz = string2float(value);
+        } else if (key == "precursortype" || key == "precursor_type" || key == "adduct") {
+            compound->adductString = value;
+            if (!value.empty() && (value.back() == '-' || value.back() == '+')) ionMode = value.back() == '-' ? -1 : 1;
+        } else if (key == "ion_mode" || key == "ionmode" || key == "ion mode") {
+            makeLowerCase(value);
+            if (!value.empty()) compound->ionizationMode = (value[0] == 'n') ? -1 : 1;
+        } else if (key == "charge") {
+            compound->charge = string2integer(value);
+        } else if (key == "rt" || key == "retentiontime" || key == "retention_time") {
+            compound->expectedRt = string2float(value);
+        } else if (key == "smiles" || key == "smile") {
+            compound->smileString = value;
+        } else if (key == "logp") {
+            compound->logP = string2float(value);
+        } else if (key == "collisionenergy" || key == "collision_energy") {
+            compound->collisionEnergy = string2float(value);
+        } else if (key == "category") {
+            compound->category.push_back(value);
+        } else if (key == "num peaks") {
+            int numPeaks = string2integer(value);
+            if (numPeaks > 0) {
+                compound->fragment_mzs.reserve(numPeaks);
+                compound->fragment_intensity.reserve(numPeaks);
+                compound->fragment_labels.reserve(numPeaks);
+            }
+        } else {
+            compound->metaDataMap[line.substr(0, colon)] = value;
+        }
+    }
+    finishCompound();
+
+    return numAdded;
+}
+
+size_t CompoundLibrary::loadMsp(const string& mspFile) {
+    ifstream input(mspFile.c_str());
+    if (!input.is_open()) {
+        cerr << "CompoundLibrary::loadMsp(): can't open " << mspFile << endl;
+        return 0;
+    }
+    return loadMsp(input);
+}
+
+void CompoundLibrary::buildMzIndex(const vector<Adduct*>& adducts, bool isRequireAdductPrecursorMatch) {
+
+    vector<vector<MzIndexEntry> > indexes(adducts.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int a = 0; a < adducts.size(); a++) {
+        Adduct* adduct = adducts[a];
+        vector<MzIndexEntry>& index = indexes[a];
+
+        uint32_t adductId = 0;
+        bool isAdductInLibrary = false;
+        if (isRequireAdductPrecursorMatch) {
+            auto it = strings.ids.find(adduct->name);
+            isAdductInLibrary = it != strings.ids.end();
+            if (isAdductInLibrary) adductId = it->second;
+        }
+
+        for (uint32_t i = 0; i < size(); i++) {
+            if (SIGN(adduct->charge) != SIGN(charges[i])) continue;
+
+            float mz;
+            if (isRequireAdductPrecursorMatch) {
+                if (!isAdductInLibrary || adductIds[i] != adductId) continue;
+                mz = precursorMzs[i];
+            } else {
+                mz = adduct->computeAdductMass(exactMasses[i]);
+            }
+            index.push_back({mz, i});
+        }
+
+        sort(index.begin(), index.end(), [](const MzIndexEntry& lhs, const MzIndexEntry& rhs) {
+            return lhs.mz < rhs.mz || (lhs.mz == rhs.mz && lhs.compoundId < rhs.compoundId);
+        });
+    }
+
+    for (unsigned int a = 0; a < adducts.size(); a++) mzIndexes[adducts[a]->name].swap(indexes[a]);
+}
+
+const vector<CompoundLibrary::MzIndexEntry>& CompoundLibrary::getMzIndex(const string& adductName) const {
+    static const vector<MzIndexEntry> noEntries;
+
+    auto it = mzIndexes.find(adductName);
+    return it == mzIndexes.end() ? noEntries : it->second;
+}
+
+pair<size_t, size_t> CompoundLibrary::getMzRange(const string& adductName, float minMz, float maxMz) const {
+
+    const vector<MzIndexEntry>& index = getMzIndex(adductName);
+
+    auto first = lower_bound(index.begin(), index.end(), minMz, [](const MzIndexEntry& entry, float mz) { return entry.mz < mz; });
+    auto last = upper_bound(first, index.end(), maxMz, [](float mz, const MzIndexEntry& entry) { return mz < entry.mz; });
+
+    return make_pair(static_cast<size_t>(first - index.begin()), static_cast<size_t>(last - index.begin()));
+}
+
+pair<size_t, size_t> CompoundLibrary::getMzRangeByPpm(const string& adductName, float mz, float ppm) const {
+    float delta = mz * ppm / 1e6f;
+    return getMzRange(adductName, mz - delta, mz + delta);
+}
+
+vector<uint32_t> CompoundLibrary::findByMz(const string& adductName, float minMz, float maxMz) const {
+
+    const vector<MzIndexEntry>& index = getMzIndex(adductName);
+    pair<size_t, size_t> range = getMzRange(adductName, minMz, maxMz);
+
+    vector<uint32_t> ids;
+    ids.reserve(range.second - range.first);
+    for (size_t i = range.first; i < range.second; i++) ids.push_back(index[i].compoundId);
+
+    return ids;
+}
+
+//
+// binary snapshot: magic, version, then every column as (uint64 count, raw elements)
+//
+
+static const char SNAPSHOT_MAGIC[8] = {'M', 'A', 'V', 'E', 'N', 'C', 'L', 'B'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+template <typename T>
+static void writeColumn(ostream& out, const vector<T>& column) {
+    uint64_t n = column.size();
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    if (n) out.write(reinterpret_cast<const char*>(column.data()), static_cast<streamsize>(n * sizeof(T)));
+}
+
+static void writeString(ostream& out, const string& s) {
+    uint64_t n = s.size();
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    out.write(s.data(), static_cast<streamsize>(n));
+}
+
+template <typename T>
+static bool readColumn(istream& in, vector<T>& column) {
+    uint64_t n = 0;
+    if (!in.read(reinterpret_cast<char*>(&n), sizeof(n))) return false;
+    if (n > (1ULL << 40) / sizeof(T)) return false;
+
+    column.resize(n);
+    if (n) in.read(reinterpret_cast<char*>(column.data()), static_cast<streamsize>(n * sizeof(T)));
+    return static_cast<bool>(in);
+}
+
+static bool readString(istream& in, string& s) {
+    uint64_t n = 0;
+    if (!in.read(reinterpret_cast<char*>(&n), sizeof(n))) return false;
+    if (n > (1ULL << 40)) return false;
+
+    s.resize(n);
+    if (n) in.read(&s[0], static_cast<streamsize>(n));
+    return static_cast<bool>(in);
+}
+
+//offsets into a flat column start at 0 and never decrease
+static bool isValidOffsets(const vector<uint32_t>& offsets) {
+    if (offsets.empty() || offsets[0] != 0) return false;
+    for (size_t i = 1; i < offsets.size(); i++) {
+        if (offsets[i] < offsets[i-1]) return false;
+    }
+    return true;
+}
+
+bool CompoundLibrary::saveSnapshot(const string& fileName) const {
+
+    ofstream out(fileName.c_str(), ios::binary);
+    if (!out.is_open()) {
+        cerr << "CompoundLibrary::saveSnapshot(): can't write " << fileName << endl;
+        return false;
+    }
+
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    out.write(reinterpret_cast<const char*>(&SNAPSHOT_VERSION), sizeof(SNAPSHOT_VERSION));
+
+    writeString(out, strings.chars);
+    writeColumn(out, strings.offsets);
+
+    writeColumn(out, idIds);
+    writeColumn(out, nameIds);
+    writeColumn(out, formulaIds);
+    writeColumn(out, smileIds);
+    writeColumn(out, adductIds);
+    writeColumn(out, dbIds);
+    writeColumn(out, methodIds);
+    writeColumn(out, srmIds);
+
+    writeColumn(out, exactMasses);
+    writeColumn(out, precursorMzs);
+    writeColumn(out, productMzs);
+    writeColumn(out, collisionEnergies);
+    writeColumn(out, expectedRts);
+    writeColumn(out, logPs);
+    writeColumn(out, charges);
+    writeColumn(out, ionizationModes);
+    writeColumn(out, flags);
+
+    writeColumn(out, fragmentOffsets);
+    writeColumn(out, fragmentMzs);
+    writeColumn(out, fragmentIntensities);
+    writeColumn(out, fragmentLabelIds);
+    writeColumn(out, fragmentIonTypeIds);
+
+    writeColumn(out, categoryOffsets);
+    writeColumn(out, categoryIds);
+
+    writeColumn(out, metaDataOffsets);
+    writeColumn(out, metaDataIds);
+
+    uint64_t numIndexes = mzIndexes.size();
+    out.write(reinterpret_cast<const char*>(&numIndexes), sizeof(numIndexes));
+    for (const auto& it : mzIndexes) {
+        writeString(out, it.first);
+        writeColumn(out, it.second);
+    }
+
+    if (!out) {
+        cerr << "CompoundLibrary::saveSnapshot(): error writing " << fileName << endl;
+        return false;
+    }
+    return true;
+}
+
+bool CompoundLibrary::loadSnapshot(const string& fileName) {
+
+    clear();
+
+    ifstream in(fileName.c_str(), ios::binary);
+    if (!in.is_open()) {
+        cerr << "CompoundLibrary::loadSnapshot(): can't open " << fileName << endl;
+        return false;
+    }
+
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    uint32_t version = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&version), sizeof(version));
+
+    if (!in || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 || version != SNAPSHOT_VERSION) {
+        cerr << "CompoundLibrary::loadSnapshot(): " << fileName << " is not a compound library snapshot" << endl;
+        return false;
+    }
+
+    bool isOk = readString(in, strings.chars)
+            && readColumn(in, strings.offsets)
+            && readColumn(in, idIds)
+            && readColumn(in, nameIds)
+            && readColumn(in, formulaIds)
+            && readColumn(in, smileIds)
+            && readColumn(in, adductIds)
+            && readColumn(in, dbIds)
+            && readColumn(in, methodIds)
+            && readColumn(in, srmIds)
+            && readColumn(in, exactMasses)
+            && readColumn(in, precursorMzs)
+            && readColumn(in, productMzs)
+            && readColumn(in, collisionEnergies)
+            && readColumn(in, expectedRts)
+            && readColumn(in, logPs)
+            && readColumn(in, charges)
+            && readColumn(in, ionizationModes)
+            && readColumn(in, flags)
+            && readColumn(in, fragmentOffsets)
+            && readColumn(in, fragmentMzs)
+            && readColumn(in, fragmentIntensities)
+            && readColumn(in, fragmentLabelIds)
+            && readColumn(in, fragmentIonTypeIds)
+            && readColumn(in, categoryOffsets)
+            && readColumn(in, categoryIds)
+            && readColumn(in, metaDataOffsets)
+            && readColumn(in, metaDataIds);
+
+    uint64_t numIndexes = 0;
+    if (isOk) isOk = static_cast<bool>(in.read(reinterpret_cast<char*>(&numIndexes), sizeof(numIndexes)));
+    for (uint64_t i = 0; isOk && i < numIndexes; i++) {
+        string adductName;
+        isOk = readString(in, adductName) && readColumn(in, mzIndexes[adductName]);
+    }
+
+    size_t n = exactMasses.size();
+    isOk = isOk
+            && !strings.offsets.empty() && strings.offsets.back() == strings.chars.size()
+            && idIds.size() == n && nameIds.size() == n && formulaIds.size() == n && smileIds.size() == n
+            && adductIds.size() == n && dbIds.size() == n && methodIds.size() == n && srmIds.size() == n
+            && precursorMzs.size() == n && productMzs.size() == n && collisionEnergies.size() == n
+            && expectedRts.size() == n && logPs.size() == n && charges.size() == n
+            && ionizationModes.size() == n && flags.size() == n
+            && fragmentOffsets.size() == n+1 && fragmentOffsets.back() == fragmentMzs.size()
+            && fragmentIntensities.size() == fragmentMzs.size() && fragmentLabelIds.size() == fragmentMzs.size()
+            && fragmentIonTypeIds.size() == fragmentMzs.size()
+            && categoryOffsets.size() == n+1 && categoryOffsets.back() == categoryIds.size()
+            && metaDataOffsets.size() == n+1 && metaDataOffsets.back() == metaDataIds.size()
+            && isValidOffsets(strings.offsets) && isValidOffsets(fragmentOffsets)
+            && isValidOffsets(categoryOffsets) && isValidOffsets(metaDataOffsets);
+
+    for (auto it = mzIndexes.begin(); isOk && it != mzIndexes.end(); ++it) {
+        isOk = all_of(it->second.begin(), it->second.end(), [n](const MzIndexEntry& entry) { return entry.compoundId < n; });
+    }
+
+    if (isOk) {
+        uint32_t numStrings = static_cast<uint32_t>(strings.size());
+        auto isValidIds = [numStrings](const vector<uint32_t>& ids) {
+            return all_of(ids.begin(), ids.end(), [numStrings](uint32_t id) { return id < numStrings; });
+        };
+        isOk = isValidIds(idIds) && isValidIds(nameIds) && isValidIds(formulaIds) && isValidIds(smileIds)
+                && isValidIds(adductIds) && isValidIds(dbIds) && isValidIds(methodIds) && isValidIds(srmIds)
+                && isValidIds(fragmentLabelIds) && isValidIds(fragmentIonTypeIds) && isValidIds(categoryIds)
+                && all_of(metaDataIds.begin(), metaDataIds.end(), [numStrings](const pair<uint32_t, uint32_t>& ids) {
+                       return ids.first < numStrings && ids.second < numStrings;
+                   });
+    }
+
+    if (!isOk) {
+        cerr << "CompoundLibrary::loadSnapshot(): " << fileName << " is truncated or corrupt" << endl;
+        clear();
+        return false;
+    }
+
+    strings.rebuildIds();
+    return true;
+}
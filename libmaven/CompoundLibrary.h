@@ -0,0 +1,162 @@
+#ifndef COMPOUNDLIBRARY_H
+#define COMPOUNDLIBRARY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <istream>
+#include <stdint.h>
+
+using namespace std;
+
+class Compound;
+class Adduct;
+
+/* Class: StringPool
+ *
+ * Interned strings, stored back to back in a single buffer. Id 0 is always the empty string.
+ */
+class StringPool {
+
+public:
+    StringPool() { clear(); }
+
+    uint32_t intern(const string& s);
+    string get(uint32_t id) const { return string(chars, offsets[id], offsets[id+1] - offsets[id]); }
+    size_t size() const { return offsets.size() - 1; }
+
+    void clear();
+
+private:
+    friend class CompoundLibrary;
+
+    string chars;
+    vector<uint32_t> offsets;
+    unordered_map<string, uint32_t> ids;
+
+    void rebuildIds();
+};
+
+/* Class: CompoundLibrary
+ *
+ * Column-oriented store for large (e.g. in-silico) compound libraries. Every compound is a row
+ * index: strings are interned ids into a StringPool, numeric fields are contiguous columns, and
+ * fragments, categories and metadata of all compounds share flat arrays addressed by offsets.
+ *
+ * Compounds are searched through per-adduct m/z indexes (see buildMzIndex()), and only the hits
+ * need to be materialized as Compound objects with getCompound().
+ */
+class CompoundLibrary {
+
+public:
+    struct MzIndexEntry {
+        float mz;
+        uint32_t compoundId;
+    };
+
+    /**
+     * @brief append a compound (its data is copied), returns its id
+     */
+    uint32_t add(const Compound* compound);
+
+    /**
+     * @brief read compounds from an NIST-style .msp stream (or file), returns the number added
+     */
+    size_t loadMsp(istream& input);
+    size_t loadMsp(const string& mspFile);
+
+    /**
+     * @brief write / read the library (columns and m/z indexes) as a binary snapshot
+     */
+    bool saveSnapshot(const string& fileName) const;
+    bool loadSnapshot(const string& fileName);
+
+    void clear();
+
+    size_t size() const { return exactMasses.size(); }
+
+    string getId(uint32_t i) const { return strings.get(idIds[i]); }
+    string getName(uint32_t i) const { return strings.get(nameIds[i]); }
+    string getFormula(uint32_t i) const { return strings.get(formulaIds[i]); }
+    string getAdductString(uint32_t i) const { return strings.get(adductIds[i]); }
+    float getExactMass(uint32_t i) const { return exactMasses[i]; }
+    float getPrecursorMz(uint32_t i) const { return precursorMzs[i]; }
+    float getExpectedRt(uint32_t i) const { return expectedRts[i]; }
+    int getCharge(uint32_t i) const { return charges[i]; }
+
+    size_t getNumFragments(uint32_t i) const { return fragmentOffsets[i+1] - fragmentOffsets[i]; }
+    const float* getFragmentMzs(uint32_t i) const { return fragmentMzs.data() + fragmentOffsets[i]; }
+    const float* getFragmentIntensities(uint32_t i) const { return fragmentIntensities.data() + fragmentOffsets[i]; }
+
+    /**
+     * @brief new Compound with all the data of compound i (owned by the caller)
+     */
+    Compound* getCompound(uint32_t i) const;
+    vector<Compound*> getCompounds(const vector<uint32_t>& ids) const;
+
+    /**
+     * @brief index every compound by its m/z as each of the adducts, with the same matching rules
+     * as DirectInfusionProcessor::getSearchSet(): adduct and compound charges must have the same sign,
+     * and with isRequireAdductPrecursorMatch only compounds whose adductString is the adduct name
+     * are indexed, at their precursorMz; otherwise the m/z is computed from the exact mass.
+     * Existing indexes of the same adducts are replaced.
+     */
+    void buildMzIndex(const vector<Adduct*>& adducts, bool isRequireAdductPrecursorMatch);
+
+    /**
+     * @brief index entries of an adduct sorted by m/z, empty if there is no index for the adduct
+     */
+    const vector<MzIndexEntry>& getMzIndex(const string& adductName) const;
+
+    /**
+     * @brief [first, last) range of getMzIndex(adductName) entries with m/z in [minMz, maxMz]
+     */
+    pair<size_t, size_t> getMzRange(const string& adductName, float minMz, float maxMz) const;
+    pair<size_t, size_t> getMzRangeByPpm(const string& adductName, float mz, float ppm) const;
+
+    /**
+     * @brief ids of the compounds with an m/z (as adductName) in [minMz, maxMz]
+     */
+    vector<uint32_t> findByMz(const string& adductName, float minMz, float maxMz) const;
+
+private:
+    StringPool strings;
+
+    vector<uint32_t> idIds;
+    vector<uint32_t> nameIds;
+    vector<uint32_t> formulaIds;
+    vector<uint32_t> smileIds;
+    vector<uint32_t> adductIds;
+    vector<uint32_t> dbIds;
+    vector<uint32_t> methodIds;
+    vector<uint32_t> srmIds;
+
+    vector<float> exactMasses;
+    vector<float> precursorMzs;
+    vector<float> productMzs;
+    vector<float> collisionEnergies;
+    vector<float> expectedRts;
+    vector<float> logPs;
+    vector<int32_t> charges;
+    vector<int32_t> ionizationModes;
+    vector<uint8_t> flags;  // bit 0: isDecoy, bit 1: virtualFragmentation
+
+    // fragments of compound i are [fragmentOffsets[i], fragmentOffsets[i+1])
+    vector<uint32_t> fragmentOffsets = {0};
+    vector<float> fragmentMzs;
+    vector<float> fragmentIntensities;
+    vector<uint32_t> fragmentLabelIds;
+    vector<uint32_t> fragmentIonTypeIds;
+
+    vector<uint32_t> categoryOffsets = {0};
+    vector<uint32_t> categoryIds;
+
+    // (key, value) string ids of metaDataMap
+    vector<uint32_t> metaDataOffsets = {0};
+    vector<pair<uint32_t, uint32_t> > metaDataIds;
+
+    map<string, vector<MzIndexEntry> > mzIndexes;
+};
+
+#endif
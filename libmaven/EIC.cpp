@@ -870,7 +870,7 @@ vector<PeakGroup> EIC::groupPeaksB(vector<EIC*>& eics, int smoothingWindow, floa
                 grp.groupId = static_cast<int>(i);
                 grp.addPeak(m->peaks[i]);
                 grp.groupStatistics();
-                pgroups.push_back(grp);
+                pgroups.push_back(std::move(grp));
             }
             if (debug) {
                 cout << "Case with 1 eic produces " << pgroups.size() <<  "peak groups." << endl;
@@ -1211,7 +1211,7 @@ vector<PeakGroup> EIC::groupPeaksB(vector<EIC*>& eics, int smoothingWindow, floa
             }
 
             grp.groupStatistics();
-            pgroups.push_back(grp);
+            pgroups.push_back(std::move(grp));
         }
 
         if (debug) {
@@ -1244,7 +1244,7 @@ vector<PeakGroup> EIC::groupPeaks(vector<EIC*>& eics, int smoothingWindow, float
 			grp.groupId = i;
 			grp.addPeak(m->peaks[i]);
 			grp.groupStatistics();
-			pgroups.push_back(grp);
+			pgroups.push_back(std::move(grp));
 		}
 		return pgroups;
 	}
@@ -1262,7 +1262,7 @@ vector<PeakGroup> EIC::groupPeaks(vector<EIC*>& eics, int smoothingWindow, float
 	for(unsigned int i=0; i< m->peaks.size(); i++ ) {
 		PeakGroup grp;
 		grp.groupId = i;
-		pgroups.push_back(grp);
+		pgroups.push_back(std::move(grp));
   	}
 
 //    cerr << "EIC::groupPeaks() eics=" << eics.size() << endl;
@@ -1421,18 +1421,8 @@ void EIC::cubicSplineFit()  {
 
 
 vector<Scan*> EIC::getFragmentationEvents() {
-    vector<Scan*>matchedscans;
-	if(!sample) return matchedscans;
-
-    for( unsigned int j=0; j < sample->scans.size(); j++ ) {
-            Scan* scan = sample->scans[j];
-            if (!scan or scan->mslevel <= 1 or scan->rt < rtmin) continue; //skip ms1 events
-            if (scan->rt > rtmax) break;
-            if (scan->precursorMz >= mzmin and scan->precursorMz <= mzmax) {
-                matchedscans.push_back(scan);
-            }
-     }
-    return matchedscans;
+	if(!sample) return vector<Scan*>();
+    return sample->getFragmentationEvents(rtmin, rtmax, mzmin, mzmax);
 }   
 
 void EIC::removeOverlapingPeaks() { 
@@ -138,6 +138,42 @@ Fragment::~Fragment() {
     if(consensus) delete(consensus);
 }
 
+Fragment::Fragment(Fragment&& other) noexcept : Fragment() {
+    *this = std::move(other);
+}
+
+Fragment& Fragment::operator=(Fragment&& other) noexcept {
+    if (this == &other) return *this;
+
+    precursorMz = other.precursorMz;
+    polarity = other.polarity;
+    mzs = std::move(other.mzs);
+    intensity_array = std::move(other.intensity_array);
+    fragment_labels = std::move(other.fragment_labels);
+    sampleName = std::move(other.sampleName);
+    scanNum = other.scanNum;
+    rt = other.rt;
+    collisionEnergy = other.collisionEnergy;
+    precursorCharge = other.precursorCharge;
+    isDecoy = other.isDecoy;
+    sortedBy = other.sortedBy;
+    mergeCount = other.mergeCount;
+    purity = other.purity;
+    clusterId = other.clusterId;
+    mergedScore = other.mergedScore;
+    scanNumMap = std::move(other.scanNumMap);
+    tmtQuant = std::move(other.tmtQuant);
+    group = other.group;
+    obscount = std::move(other.obscount);
+    annotations = std::move(other.annotations);
+
+    //previous brothers and consensus are deleted with other
+    swap(brothers, other.brothers);
+    swap(consensus, other.consensus);
+
+    return *this;
+}
+
 //make a copy of Fragment.
 Fragment::Fragment( Fragment* other) { 
     this->precursorMz = other->precursorMz;
@@ -554,7 +590,11 @@ vector<int> Fragment::findFragPairsGreedyMz(Fragment* a, Fragment* b, float maxM
 
         float mz_a = a->mzs.at(i);
 
-        for (unsigned int j = 0; j < b->mzs.size(); j++) {
+        //b is sorted by m/z: skip peaks that are well out of tolerance.
+        //the 2x margin keeps the exact tolerance checks below responsible for all boundary cases.
+        unsigned int jStart = static_cast<unsigned int>(lower_bound(b->mzs.begin(), b->mzs.end(), mz_a - 2*maxMzDiff) - b->mzs.begin());
+
+        for (unsigned int j = jStart; j < b->mzs.size(); j++) {
 
             float mz_b = b->mzs.at(j);
 
@@ -580,7 +620,7 @@ vector<int> Fragment::findFragPairsGreedyMz(Fragment* a, Fragment* b, float maxM
 
     //sort standard ions by m/z for matching.
     sort(fragPairsWithMzDeltas.begin(), fragPairsWithMzDeltas.end(),
-         [ ](const pair < float,pair < int, int > > & lhs, const pair < float,pair < int, int > > & rhs){
+         [ ](const pair<float,pair<unsigned int, unsigned int>>& lhs, const pair<float,pair<unsigned int, unsigned int>>& rhs){
            if (abs(static_cast<double>(lhs.first) - static_cast<double>(rhs.first)) < 1e-6) {
              if (lhs.second.first == rhs.second.first) {
                return lhs.second.second < rhs.second.second;
@@ -596,8 +636,8 @@ vector<int> Fragment::findFragPairsGreedyMz(Fragment* a, Fragment* b, float maxM
     //frag pair.
     vector<pair<unsigned int, unsigned int>> matches;
     vector<int> ranks (a->mzs.size(),-1);
-    set<unsigned int> claimedAFrags;
-    set<unsigned int> claimedBFrags;
+    vector<bool> claimedAFrags(a->mzs.size(), false);
+    vector<bool> claimedBFrags(b->mzs.size(), false);
 
 //    cerr << "match: ref <--> obs" << endl;
 
@@ -606,15 +646,15 @@ vector<int> Fragment::findFragPairsGreedyMz(Fragment* a, Fragment* b, float maxM
         unsigned int a_frag = fragPair.first;
         unsigned int b_frag = fragPair.second;
 
-        if (claimedAFrags.count(a_frag) == 0 && claimedBFrags.count(b_frag) == 0){
+        if (!claimedAFrags[a_frag] && !claimedBFrags[b_frag]){
 
             matches.push_back(fragPair);
             ranks[a_frag] = static_cast<int>(b_frag);
 
 //            cerr << "match: " << a->mzs.at(a_frag) << " <--> " << b->mzs.at(b_frag) << endl;
 
-            claimedAFrags.insert(a_frag);
-            claimedBFrags.insert(b_frag);
+            claimedAFrags[a_frag] = true;
+            claimedBFrags[b_frag] = true;
         }
     }
 
@@ -1250,3 +1290,611 @@ int Fragment::getNumDiagnosticFragmentsMatched(string fragLblStartsWith, vector<
     return numDiagnosticFragmentsMatched;
 }
 
+
+FragmentBatchScorer::FragmentBatchScorer(Fragment* observed, unsigned int scoreFields) {
+    this->observed = observed;
+    this->scoreFields = scoreFields;
+
+    //sort once, so that Fragment::findFragPairsGreedyMz() never re-sorts the shared observed spectrum
+    observed->sortByMz();
+
+    observedTIC = observed->totalIntensity();
+
+    observedMzWeightedTIC = 0;
+    for(unsigned int j=0; j<observed->nobs(); j++) observedMzWeightedTIC += observed->mzs[j] * observed->intensity_array[j];
+
+    observedDenseSum = 0;
+    observedDenseSumSq = 0;
+    if (scoreFields & FragmentationMatchScore::DotProductField) {
+        observedDense = observed->asDenseVector(100,2000,2000);
+        for (unsigned int i = 0; i < observedDense.size(); i++) {
+            observedDenseSum += observedDense[i];
+            observedDenseSumSq += observedDense[i]*observedDense[i];
+        }
+    }
+
+    int n = static_cast<int>(observed->nobs());
+    logNchooseKObserved = logNchooseK(hypergeomN, n);
+
+    mvhAm = 0.2 * n;
+    mvhBm = 0.5 * n;
+    mvhCm = 0.8 * n;
+}
+
+/**
+ * @brief FragmentBatchScorer::logNchooseK
+ * Same approximation as Fragment::logNchooseK(), with log values read from a table.
+ * Equal to Fragment::logNchooseK() up to floating point rounding.
+ */
+double FragmentBatchScorer::logNchooseK(int N, int k) {
+    if (N == k || k == 0) return 0;
+
+    static const vector<double> logTable = [](){
+        vector<double> table(hypergeomN+1, 0);
+        for (int i = 1; i <= hypergeomN; i++) table[i] = log(static_cast<double>(i));
+        return table;
+    }();
+
+    if (N <= 0 || k < 0 || k > N || N > hypergeomN) {
+        double x = k / (double) N;
+        return N*x*log(1/x)+(1-x)*log(1/(1-x));
+    }
+
+    double x = k / (double) N;
+    double logN = logTable[N];
+    return N*x*(logN-logTable[k])+(1-x)*(logN-logTable[N-k]);
+}
+
+/**
+ * @brief FragmentBatchScorer::addRow
+ * append the binned candidate spectrum to the matrix, bins with several peaks are summed
+ * in m/z order (as in Fragment::asDenseVector()).
+ */
+void FragmentBatchScorer::addRow(CandidateMatrix& matrix, Fragment* candidate) const {
+    const float mzmin = 100;
+    const float mzmax = 2000;
+    const int nbins = 2000;
+    double mzrange = mzmax-mzmin;
+
+    vector<pair<int, float>> binned;
+    binned.reserve(candidate->mzs.size());
+
+    //empty row: zero dot product
+    unsigned int numPeaks = candidate->totalIntensity() == 0 ? 0 : candidate->mzs.size();
+
+    for (unsigned int i = 0; i < numPeaks; i++) {
+        float mz = candidate->mzs[i];
+        if(mz<mzmin or mz>mzmax) continue;
+        int bin = (int) (mz-mzmin)/mzrange*nbins;
+        if(bin>0 and bin<nbins) binned.push_back(make_pair(bin, candidate->intensity_array[i]));
+    }
+
+    stable_sort(binned.begin(), binned.end(), [](const pair<int, float>& lhs, const pair<int, float>& rhs){
+        return lhs.first < rhs.first;
+    });
+
+    for (unsigned int i = 0; i < binned.size(); i++) {
+        if (i > 0 && binned[i].first == binned[i-1].first) {
+            matrix.values.back() += binned[i].second;
+        } else {
+            matrix.bins.push_back(binned[i].first);
+            matrix.values.push_back(binned[i].second);
+        }
+    }
+
+    matrix.rowStarts.push_back(static_cast<unsigned int>(matrix.bins.size()));
+}
+
+/**
+ * @brief FragmentBatchScorer::dotProducts
+ * dot product (Fragment::dotProduct()) of every matrix row against the observed spectrum.
+ */
+vector<double> FragmentBatchScorer::dotProducts(const CandidateMatrix& matrix) const {
+    unsigned int numRows = static_cast<unsigned int>(matrix.rowStarts.size()-1);
+    vector<double> dotProducts(numRows, 0);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (unsigned int i = 0; i < numRows; i++) {
+        unsigned int start = matrix.rowStarts[i];
+        dotProducts[i] = dotProduct(matrix.bins.data()+start, matrix.values.data()+start, matrix.rowStarts[i+1]-start);
+    }
+
+    return dotProducts;
+}
+
+/**
+ * @brief FragmentBatchScorer::dotProduct
+ * Equivalent to candidate->dotProduct(observed), for one binned candidate.
+ *
+ * Empty candidate bins contribute zeros to the correlation sums, so only the occupied bins
+ * are visited, against the precomputed observed dense vector and sums.
+ */
+double FragmentBatchScorer::dotProduct(const int* bins, const float* values, unsigned int n) const {
+    if (observedTIC == 0) return 0;
+
+    const int nbins = 2000;
+
+    float sumx = 0;
+    float sumy = observedDenseSum;
+    float sumxy = 0;
+    float x2 = 0;
+    float y2 = observedDenseSumSq;
+
+    const float* y = observedDense.data();
+
+    #pragma omp simd reduction(+:sumx,sumxy,x2)
+    for (unsigned int k = 0; k < n; k++) {
+        float x = values[k];
+        sumx += x;
+        sumxy += x*y[bins[k]];
+        x2 += x*x;
+    }
+
+    float var1 = x2-(sumx*sumx)/nbins;
+    float var2 = y2-(sumy*sumy)/nbins;
+    if ( var1 == 0 || var2 == 0 ) return 0;
+    return (sumxy -( sumx*sumy)/nbins) / sqrt((x2-(sumx*sumx)/nbins)*(y2-(sumy*sumy)/nbins));
+}
+
+/**
+ * @brief FragmentBatchScorer::mvh
+ * Equivalent to candidate->MVH(X, observed).
+ */
+double FragmentBatchScorer::mvh(const vector<int>& X) {
+    if (X.size() == 0) return 0;
+    int n = observed->nobs();
+
+    int Ak = 0; int Bk = 0; int Ck = 0;
+
+    for(unsigned int i=0; i<X.size(); i++ ) {
+        int j = X[i];
+        if (j == -1)  continue;
+        else if (j < 0.2*n)   Ak++;
+        else if (j < 0.5*n)   Bk++;
+        else if (j < 0.8*n)   Ck++;
+    }
+
+    if (Ak>mvhAm) Ak=mvhAm;
+    if (Bk>mvhBm) Bk=mvhBm;
+    if (Ck>mvhCm) Ck=mvhCm;
+
+    double A=logNchooseK(mvhAm,Ak) + 0.1*logNchooseK(mvhBm,Bk) + 0.001*logNchooseK(mvhCm,Ck);
+    double B=logNchooseK(hypergeomN-mvhAm-mvhBm-mvhCm,n-Ak-Bk-Ck);
+    return -(A+B-logNchooseKObserved);
+}
+
+/**
+ * @brief FragmentBatchScorer::score
+ * @param candidate: library spectrum (plays the role of 'this' in Fragment::scoreMatch())
+ * @param productPpmTolr: tolerance used to match candidate and observed fragments
+ * @return match score, with only the requested fields computed.
+ */
+FragmentationMatchScore FragmentBatchScorer::score(Fragment* candidate, float productPpmTolr) {
+    return score(candidate, productPpmTolr, true);
+}
+
+FragmentationMatchScore FragmentBatchScorer::score(Fragment* candidate, float productPpmTolr, bool isComputeDotProduct) {
+    FragmentationMatchScore s;
+    if (candidate->mzs.size() < 2 or observed->mzs.size() < 2) return s;
+
+    Fragment* a = candidate;
+    Fragment* b = observed;
+
+    s.ppmError = abs((a->precursorMz-b->precursorMz)/a->precursorMz*1e6);
+
+    double precursorMz = a->precursorMz > 0 ? a->precursorMz : b->precursorMz;
+    float maxDeltaMz = (productPpmTolr * static_cast<float>(precursorMz))/ 1000000;
+
+    s.ranks = Fragment::findFragPairsGreedyMz(a, b, maxDeltaMz);
+
+    for(int rank: s.ranks) { if(rank != -1) s.numMatches++; }
+
+    s.fractionMatched = s.numMatches / a->nobs();
+
+    if (scoreFields & FragmentationMatchScore::SpearmanRankField) {
+        s.spearmanRankCorrelation = a->spearmanRankCorrelation(s.ranks);
+    }
+
+    if (scoreFields & (FragmentationMatchScore::TICMatchedField | FragmentationMatchScore::HyperGeomScoreField)) {
+        s.ticMatched = a->ticMatched(s.ranks);
+    }
+
+    if (scoreFields & FragmentationMatchScore::MzFragErrorField) {
+        s.mzFragError = a->mzErr(s.ranks, b);
+    }
+
+    if (isComputeDotProduct && (scoreFields & FragmentationMatchScore::DotProductField)) {
+        CandidateMatrix matrix;
+        addRow(matrix, a);
+        s.dotProduct = dotProduct(matrix.bins.data(), matrix.values.data(), matrix.rowStarts[1]);
+    }
+
+    if (scoreFields & FragmentationMatchScore::HyperGeomScoreField) {
+        //equivalent to Fragment::SHP(), with observed-only term precomputed
+        int k = static_cast<int>(s.numMatches);
+        int m = static_cast<int>(a->nobs());
+        int n = static_cast<int>(b->nobs());
+        double shp = 0;
+        if (k > 0) {
+            if (k > min(m,n)) k = min(m,n);
+            double A=logNchooseK(m,k);
+            double B=logNchooseK(hypergeomN-m,n-k);
+            shp = -(A+B-logNchooseKObserved);
+        }
+        s.hypergeomScore = shp + s.ticMatched;
+    }
+
+    if (scoreFields & FragmentationMatchScore::MVHScoreField) {
+        s.mvhScore = mvh(s.ranks);
+    }
+
+    if (scoreFields & FragmentationMatchScore::WeightedDotProductField) {
+        double candidateTIC = 0;
+        for(unsigned int i=0; i<a->nobs(); i++) candidateTIC += a->mzs[i] * a->intensity_array[i];
+
+        if (candidateTIC != 0 && observedMzWeightedTIC != 0 && s.ranks.size() > 0) {
+            double dotP=0;
+            for(unsigned int i=0; i<s.ranks.size(); i++ ) {
+                int j = s.ranks[i];
+                if (j != -1)  dotP += a->mzs[i]*a->intensity_array[i] * b->mzs[j]*b->intensity_array[j];
+            }
+            s.weightedDotProduct = sqrt(dotP)/sqrt(candidateTIC*observedMzWeightedTIC);
+        }
+    }
+
+    if (scoreFields & FragmentationMatchScore::MatchedQuantilesField) {
+        s.matchedQuantiles = a->matchedRankVector(s.ranks, b);
+    }
+
+    return s;
+}
+
+/**
+ * @brief FragmentBatchScorer::scoreAll
+ * score every candidate against the observed spectrum.
+ * Candidates must be distinct Fragment objects (each candidate is sorted by m/z in place).
+ */
+vector<FragmentationMatchScore> FragmentBatchScorer::scoreAll(const vector<Fragment*>& candidates, float productPpmTolr) {
+    vector<FragmentationMatchScore> scores(candidates.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+        scores[i] = score(candidates[i], productPpmTolr, false);
+    }
+
+    if (!(scoreFields & FragmentationMatchScore::DotProductField) || observed->mzs.size() < 2) return scores;
+
+    CandidateMatrix matrix;
+    for (Fragment* candidate : candidates) addRow(matrix, candidate);
+
+    vector<double> dotProducts = this->dotProducts(matrix);
+
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+        if (candidates[i]->mzs.size() < 2) continue; //not scored
+        scores[i].dotProduct = dotProducts[i];
+    }
+
+    return scores;
+}
+
+StreamingQuantile::StreamingQuantile(float quantile) {
+    p = quantile;
+    n = 0;
+    for (unsigned int i = 0; i < 5; i++) {
+        q[i] = 0;
+        pos[i] = i+1;
+    }
+    np[0] = 1;
+    np[1] = 1+2*p;
+    np[2] = 1+4*p;
+    np[3] = 3+2*p;
+    np[4] = 5;
+}
+
+void StreamingQuantile::add(float x) {
+
+    //first five observations are retained exactly, and become the initial markers.
+    if (n < 5) {
+        q[n] = x;
+        n++;
+        if (n == 5) sort(q, q+5);
+        return;
+    }
+
+    int k;
+    if (x < q[0]) {
+        q[0] = x;
+        k = 0;
+    } else if (x >= q[4]) {
+        q[4] = x;
+        k = 3;
+    } else {
+        k = 0;
+        while (k < 3 && x >= q[k+1]) k++;
+    }
+
+    for (int i = k+1; i < 5; i++) pos[i] += 1;
+
+    np[1] += p/2;
+    np[2] += p;
+    np[3] += (1+p)/2;
+    np[4] += 1;
+
+    for (int i = 1; i <= 3; i++) {
+        float d = np[i] - pos[i];
+        if ((d >= 1 && pos[i+1]-pos[i] > 1) || (d <= -1 && pos[i-1]-pos[i] < -1)) {
+            int ds = d >= 0 ? 1 : -1;
+
+            //piecewise-parabolic prediction
+            float qp = q[i] + ds/(pos[i+1]-pos[i-1]) *
+                    ((pos[i]-pos[i-1]+ds)*(q[i+1]-q[i])/(pos[i+1]-pos[i]) +
+                     (pos[i+1]-pos[i]-ds)*(q[i]-q[i-1])/(pos[i]-pos[i-1]));
+
+            if (q[i-1] < qp && qp < q[i+1]) {
+                q[i] = qp;
+            } else {
+                q[i] = q[i] + ds*(q[i+ds]-q[i])/(pos[i+ds]-pos[i]);
+            }
+            pos[i] += ds;
+        }
+    }
+
+    n++;
+}
+
+float StreamingQuantile::value() const {
+    if (n == 0) return 0;
+    if (n > 5) return q[2];
+
+    //exact, linearly interpolated between closest ranks
+    float sorted[5];
+    for (unsigned int i = 0; i < n; i++) sorted[i] = q[i];
+    sort(sorted, sorted+n);
+
+    float rank = p*(n-1);
+    unsigned int lo = static_cast<unsigned int>(rank);
+    unsigned int hi = lo+1 < n ? lo+1 : lo;
+    if (lo == hi || rank == lo) return sorted[lo];
+    return sorted[lo] + (rank-lo)*(sorted[hi]-sorted[lo]);
+}
+
+ConsensusSpectrumBuilder::ConsensusSpectrumBuilder(float productPpmTolr,
+                                                   Fragment::ConsensusIntensityAgglomerationType consensusIntensityAgglomerationType,
+                                                   bool isIntensityAvgByObserved,
+                                                   bool isNormalizeIntensityArray,
+                                                   int minNumScansForConsensus,
+                                                   float minFractionScansForConsensus) {
+    this->productPpmTolr = productPpmTolr;
+    this->consensusIntensityAgglomerationType = consensusIntensityAgglomerationType;
+    this->isIntensityAvgByObserved = isIntensityAvgByObserved;
+    this->isNormalizeIntensityArray = isNormalizeIntensityArray;
+    this->minNumScansForConsensus = minNumScansForConsensus;
+    this->minFractionScansForConsensus = minFractionScansForConsensus;
+
+    N = 0;
+    firstScan = nullptr;
+    precursorMz = 0;
+    rtSum = 0;
+    puritySum = 0;
+}
+
+/**
+ * @brief ConsensusSpectrumBuilder::addScan
+ * Filter scan peaks exactly as Fragment::Fragment(Scan*, ...) would, and merge them into the consensus.
+ */
+void ConsensusSpectrumBuilder::addScan(Scan* scan,
+                                       float minFracIntensity,
+                                       float minSNRatio,
+                                       int maxNumberOfFragments,
+                                       int baseLinePercentile,
+                                       bool isRetainFragmentsAbovePrecursorMz,
+                                       float precursorPurityPpm,
+                                       float minIntensity) {
+    if (!scan) return;
+
+    scanMzs.clear();
+    scanIntensities.clear();
+
+    if (minSNRatio <= 0 && (maxNumberOfFragments < 0 || maxNumberOfFragments >= scan->nobs()) && baseLinePercentile <= 0 && isRetainFragmentsAbovePrecursorMz){
+        for (unsigned int i = 0; i < scan->nobs(); i++) {
+            if (minIntensity <= 0 || scan->intensity[i] >= minIntensity) {
+                scanMzs.push_back(scan->mz[i]);
+                scanIntensities.push_back(scan->intensity[i]);
+            }
+        }
+    } else {
+
+        //<intensity, mz>
+        vector<pair<float,float> >mzarray = scan->getTopPeaks(minFracIntensity, minSNRatio, baseLinePercentile, minIntensity);
+
+        if (maxNumberOfFragments < 0) {
+            maxNumberOfFragments = INT_MAX;
+        }
+
+        unsigned int numRetained = 0;
+        for (unsigned int j=0; j<mzarray.size() && j < maxNumberOfFragments; j++ ) {
+            if (isRetainFragmentsAbovePrecursorMz || mzarray[j].second <= scan->precursorMz) {
+                mzarray[numRetained] = make_pair(mzarray[j].second, mzarray[j].first);
+                numRetained++;
+            }
+        }
+        mzarray.resize(numRetained);
+
+        //<mz, intensity>
+        sort(mzarray.begin(), mzarray.end());
+
+        for (auto& peak : mzarray) {
+            scanMzs.push_back(peak.first);
+            scanIntensities.push_back(peak.second);
+        }
+    }
+
+    if (!firstScan) firstScan = scan;
+
+    //Issue 245: MS1 scans have no precursor m/z, fall back to largest m/z
+    float referenceMz = scan->precursorMz;
+    if (referenceMz <= 0 && !scanMzs.empty()) referenceMz = scanMzs.back();
+    if (firstScan->precursorMz > 0) {
+        precursorMz = firstScan->precursorMz;
+    } else if (referenceMz > precursorMz) {
+        precursorMz = referenceMz;
+    }
+
+    rtSum += scan->rt;
+    puritySum += precursorPurityPpm > 0 ? scan->getPrecursorPurity(precursorPurityPpm) : 0.0f;
+    scanNumMap[scan->sample].insert(scan->scannum);
+
+    addSpectrum(scanMzs, scanIntensities, referenceMz);
+}
+
+/**
+ * @brief ConsensusSpectrumBuilder::addSpectrum
+ * Match peaks to existing bins (closest pairs first, each peak and bin used at most once,
+ * as in Fragment::findFragPairsGreedyMz()), and insert unmatched peaks as new bins.
+ */
+void ConsensusSpectrumBuilder::addSpectrum(const vector<float>& mzs, const vector<float>& intensities, float referenceMz) {
+
+    N++;
+
+    bool isMedian = consensusIntensityAgglomerationType == Fragment::ConsensusIntensityAgglomerationType::Median;
+    float maxMzDiff = (productPpmTolr * referenceMz)/ 1000000;
+
+    candidatePairs.clear();
+    peakNumCandidates.assign(mzs.size(), 0);
+    binNumCandidates.assign(bins.size(), 0);
+
+    //peaks are sorted, so each search can start from the previous result
+    auto lb = bins.begin();
+
+    for (unsigned int i = 0; i < mzs.size(); i++) {
+        float mz = mzs[i];
+
+        lb = lower_bound(lb, bins.end(), mz - 2*maxMzDiff,
+                         [](const ConsensusBin& bin, float value){ return bin.mz < value; });
+
+        for (unsigned int j = static_cast<unsigned int>(lb - bins.begin()); j < bins.size(); j++) {
+            if (mz - bins[j].mz > maxMzDiff) continue;
+            if (bins[j].mz - mz > maxMzDiff) break;
+            candidatePairs.push_back(make_pair(abs(mz - bins[j].mz), make_pair(i, j)));
+            peakNumCandidates[i]++;
+            binNumCandidates[j]++;
+        }
+    }
+
+    binForPeak.assign(mzs.size(), -1);
+    isBinClaimed.assign(bins.size(), false);
+
+    //a pair whose peak and bin have no other candidates is claimed regardless of ranking.
+    //Only the remaining pairs need to be ranked by m/z difference.
+    auto ambiguousEnd = partition(candidatePairs.begin(), candidatePairs.end(),
+                                  [this](const pair<float,pair<unsigned int, unsigned int>>& candidatePair){
+        return peakNumCandidates[candidatePair.second.first] > 1 || binNumCandidates[candidatePair.second.second] > 1;
+    });
+
+    for (auto it = ambiguousEnd; it != candidatePairs.end(); ++it) {
+        binForPeak[it->second.first] = static_cast<int>(it->second.second);
+        isBinClaimed[it->second.second] = true;
+    }
+
+    sort(candidatePairs.begin(), ambiguousEnd,
+         [ ](const pair<float,pair<unsigned int, unsigned int>>& lhs, const pair<float,pair<unsigned int, unsigned int>>& rhs){
+           if (abs(static_cast<double>(lhs.first) - static_cast<double>(rhs.first)) < 1e-6) {
+             if (lhs.second.first == rhs.second.first) {
+               return lhs.second.second < rhs.second.second;
+             } else {
+               return lhs.second.first < rhs.second.first;
+             }
+           } else {
+             return lhs.first < rhs.first;
+           }
+         });
+
+    for (auto it = candidatePairs.begin(); it != ambiguousEnd; ++it) {
+        unsigned int peak = it->second.first;
+        unsigned int bin = it->second.second;
+        if (binForPeak[peak] == -1 && !isBinClaimed[bin]) {
+            binForPeak[peak] = static_cast<int>(bin);
+            isBinClaimed[bin] = true;
+        }
+    }
+
+    newBins.clear();
+
+    for (unsigned int i = 0; i < mzs.size(); i++) {
+        if (binForPeak[i] >= 0) {
+            ConsensusBin& bin = bins[static_cast<unsigned int>(binForPeak[i])];
+            bin.intensity += intensities[i];
+            bin.obscount++;
+            if (isMedian) bin.median.add(intensities[i]);
+        } else {
+            ConsensusBin bin;
+            bin.mz = mzs[i];
+            bin.intensity = intensities[i];
+            bin.obscount = 1;
+            if (isMedian) bin.median.add(intensities[i]);
+            newBins.push_back(bin);
+        }
+    }
+
+    //new bins are already sorted by m/z: single linear merge
+    if (!newBins.empty()) {
+        auto numOldBins = bins.size();
+        bins.insert(bins.end(), newBins.begin(), newBins.end());
+        inplace_merge(bins.begin(), bins.begin() + numOldBins, bins.end());
+    }
+}
+
+Fragment* ConsensusSpectrumBuilder::getConsensus() {
+    if (N == 0) return nullptr;
+
+    Fragment *Cons = new Fragment();
+
+    if (firstScan) {
+        Cons->polarity = firstScan->getPolarity();
+        Cons->sampleName = firstScan->sample ? firstScan->sample->sampleName : "";
+        Cons->scanNum = firstScan->scannum;
+        Cons->collisionEnergy = firstScan->collisionEnergy;
+        Cons->precursorCharge = firstScan->precursorCharge;
+    }
+
+    Cons->precursorMz = precursorMz;
+    Cons->rt = static_cast<float>(rtSum / N);
+    Cons->purity = static_cast<float>(puritySum / N);
+    Cons->scanNumMap = scanNumMap;
+
+    Cons->mzs.reserve(bins.size());
+    Cons->intensity_array.reserve(bins.size());
+    Cons->obscount.reserve(bins.size());
+
+    for (auto& bin : bins) {
+
+        float frac = static_cast<float>(bin.obscount) / static_cast<float>(N);
+        if (bin.obscount < minNumScansForConsensus || frac < minFractionScansForConsensus) continue;
+
+        float intensity = bin.intensity;
+        if (N > 1) {
+            if (consensusIntensityAgglomerationType == Fragment::ConsensusIntensityAgglomerationType::Mean) {
+                intensity /= (isIntensityAvgByObserved ? bin.obscount : N);
+            } else if (consensusIntensityAgglomerationType == Fragment::ConsensusIntensityAgglomerationType::Median) {
+                intensity = bin.median.value();
+            }
+        }
+
+        Cons->mzs.push_back(bin.mz);
+        Cons->intensity_array.push_back(intensity);
+        Cons->obscount.push_back(bin.obscount);
+    }
+
+    Cons->fragment_labels = vector<string>(Cons->mzs.size(), "");
+
+    if (isNormalizeIntensityArray && Cons->intensity_array.size() > 1) {
+        float maxValue = *max_element(Cons->intensity_array.begin(), Cons->intensity_array.end());
+        for (unsigned int i = 0; i < Cons->intensity_array.size(); i++) {
+            Cons->intensity_array[i] = Cons->intensity_array[i]/maxValue*10000;
+        }
+    }
+
+    Cons->sortedBy = Fragment::SortType::Mz;
+
+    return Cons;
+}
@@ -42,6 +42,23 @@ class TMT {
 
 struct FragmentationMatchScore {
 
+    /**
+     * @brief The ScoreField enum
+     * bit flags selecting which fields are computed by FragmentBatchScorer.
+     * numMatches, fractionMatched, ppmError and ranks are always computed.
+     */
+    enum ScoreField {
+        SpearmanRankField      = 1 << 0,
+        TICMatchedField        = 1 << 1,
+        MzFragErrorField       = 1 << 2,
+        DotProductField        = 1 << 3,
+        HyperGeomScoreField    = 1 << 4,
+        MVHScoreField          = 1 << 5,
+        WeightedDotProductField= 1 << 6,
+        MatchedQuantilesField  = 1 << 7,
+        AllScoreFields         = (1 << 8) - 1
+    };
+
     double fractionMatched;
     double spearmanRankCorrelation;
     double ticMatched;
@@ -136,6 +153,10 @@ struct FragmentationMatchScore {
 
         return *this;
     }
+
+    FragmentationMatchScore(const FragmentationMatchScore& b) = default;
+    FragmentationMatchScore(FragmentationMatchScore&& b) noexcept = default;
+    FragmentationMatchScore& operator=(FragmentationMatchScore&& b) noexcept = default;
 };
 
 class Fragment {
@@ -180,6 +201,14 @@ class Fragment {
         //copy constructor
         Fragment(Fragment* other);
 
+        //copies share brothers and consensus with the original
+        Fragment(const Fragment& other) = default;
+        Fragment& operator=(const Fragment& other) = default;
+
+        //moves take ownership of brothers and consensus
+        Fragment(Fragment&& other) noexcept;
+        Fragment& operator=(Fragment&& other) noexcept;
+
         //fragment is just a direct copy of everything in scan, with no filtering or adjustment.
         Fragment(Scan* scan);
 
@@ -256,5 +285,164 @@ class Fragment {
         bool operator==(const Fragment* b) const{ return fabs(this->precursorMz-b->precursorMz)<0.001; }
 };
 
+/**
+ * @brief The StreamingQuantile class
+ *
+ * P-square estimator (Jain & Chlamtac, 1985) of a single quantile, in constant memory.
+ * Values are exact (linearly interpolated between closest ranks) while at most five observations have been added.
+ */
+class StreamingQuantile {
+    public:
+        explicit StreamingQuantile(float quantile=0.5f);
+        void add(float x);
+        float value() const;
+        inline unsigned int count() const { return n; }
+
+    private:
+        float p;
+        unsigned int n;
+        float q[5];     //marker heights
+        float pos[5];   //marker positions
+        float np[5];    //desired marker positions
+};
+
+/**
+ * @brief The ConsensusSpectrumBuilder class
+ *
+ * Incremental alternative to Fragment::buildConsensus().
+ * Scans are filtered (same arguments as Fragment::Fragment(Scan*, ...)) and merged directly into a
+ * sorted, tolerance-binned accumulator, so no per-scan Fragment objects are created.
+ * Peaks are matched to existing bins by binary search, and unmatched peaks are merged in as new bins.
+ *
+ * Differences from Fragment::buildConsensus():
+ * bins keep the m/z of the first scan they were observed in (instead of the scan with the most peaks),
+ * the matching tolerance is derived from each scan's own precursor m/z (or largest m/z, for MS1 scans),
+ * and median intensities are estimated with StreamingQuantile once a bin has more than 4 observations.
+ */
+class ConsensusSpectrumBuilder {
+    public:
+        ConsensusSpectrumBuilder(float productPpmTolr,
+                                 Fragment::ConsensusIntensityAgglomerationType consensusIntensityAgglomerationType=Fragment::Mean,
+                                 bool isIntensityAvgByObserved=false,
+                                 bool isNormalizeIntensityArray=true,
+                                 int minNumScansForConsensus=0,
+                                 float minFractionScansForConsensus=0.0f);
+
+        void addScan(Scan* scan,
+                     float minFractionalIntensity,
+                     float minSigNoiseRatio,
+                     int maxNumberOfFragments,
+                     int baseLineLevel=5,
+                     bool isRetainFragmentsAbovePrecursorMz=false,
+                     float precursorPurityPpm=10,
+                     float minIntensity=0);
+
+        //mzs must be sorted by increasing m/z
+        void addSpectrum(const vector<float>& mzs, const vector<float>& intensities, float referenceMz);
+
+        //caller owns returned Fragment, sorted by m/z. nullptr if no scans were added.
+        Fragment* getConsensus();
+
+        inline unsigned int numScans() { return N; }
+        inline unsigned int numBins() { return bins.size(); }
+
+    private:
+        struct ConsensusBin {
+            float mz;
+            float intensity;
+            int obscount;
+            StreamingQuantile median;
+            bool operator<(const ConsensusBin& b) const { return mz < b.mz; }
+        };
+
+        float productPpmTolr;
+        Fragment::ConsensusIntensityAgglomerationType consensusIntensityAgglomerationType;
+        bool isIntensityAvgByObserved;
+        bool isNormalizeIntensityArray;
+        int minNumScansForConsensus;
+        float minFractionScansForConsensus;
+
+        vector<ConsensusBin> bins;
+        unsigned int N;
+
+        //summary of first scan
+        Scan* firstScan;
+        double precursorMz;
+
+        double rtSum;
+        double puritySum;
+        map<mzSample*, unordered_set<int>> scanNumMap;
+
+        //reusable buffers, to avoid allocation for each scan
+        vector<float> scanMzs;
+        vector<float> scanIntensities;
+        vector<pair<float,pair<unsigned int, unsigned int>>> candidatePairs;
+        vector<unsigned int> peakNumCandidates;
+        vector<unsigned int> binNumCandidates;
+        vector<int> binForPeak;
+        vector<bool> isBinClaimed;
+        vector<ConsensusBin> newBins;
+};
+
+/**
+ * @brief The FragmentBatchScorer class
+ *
+ * Scores a single observed spectrum against many library candidates.
+ * Everything that depends only on the observed spectrum (sorting, TIC, dense vector sums,
+ * log n choose k terms) is computed once in the constructor, and each candidate
+ * only pays for its own peaks.
+ *
+ * Scores are equal to Fragment::scoreMatch(), with candidate = this and observed = other,
+ * except that the observed spectrum is not annotated with candidate labels
+ * (the observed spectrum is shared by all candidates), and that dot products are summed
+ * in a different order (equal up to float rounding).
+ *
+ * scoreAll() bins all candidates into one sparse candidate x bin matrix, and computes the
+ * dot products of all rows against the observed dense vector with a simd kernel.
+ */
+class FragmentBatchScorer {
+    public:
+        FragmentBatchScorer(Fragment* observed, unsigned int scoreFields=FragmentationMatchScore::AllScoreFields);
+
+        FragmentationMatchScore score(Fragment* candidate, float productPpmTolr);
+        vector<FragmentationMatchScore> scoreAll(const vector<Fragment*>& candidates, float productPpmTolr);
+
+        //log(i) lookup, used in place of repeated log() calls in logNchooseK
+        static double logNchooseK(int N, int k);
+
+        static const int hypergeomN = 100000;
+
+    private:
+        Fragment* observed;
+        unsigned int scoreFields;
+
+        double observedTIC;
+        double observedMzWeightedTIC;
+
+        //Fragment::asDenseVector(100,2000,2000) of observed spectrum, with correlation sums
+        vector<float> observedDense;
+        float observedDenseSum;
+        float observedDenseSumSq;
+
+        //terms of SHP() and MVH() that only depend on the observed spectrum
+        double logNchooseKObserved;
+        int mvhAm, mvhBm, mvhCm;
+
+        //candidate spectra binned as in Fragment::asDenseVector(100,2000,2000), one row per candidate,
+        //with the bins of each row in increasing order
+        struct CandidateMatrix {
+            vector<unsigned int> rowStarts{0};
+            vector<int> bins;
+            vector<float> values;
+        };
+
+        void addRow(CandidateMatrix& matrix, Fragment* candidate) const;
+        vector<double> dotProducts(const CandidateMatrix& matrix) const;
+        double dotProduct(const int* bins, const float* values, unsigned int n) const;
+
+        FragmentationMatchScore score(Fragment* candidate, float productPpmTolr, bool isComputeDotProduct);
+        double mvh(const vector<int>& X);
+};
+
 
 #endif
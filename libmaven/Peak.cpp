@@ -142,16 +142,7 @@ vector<Scan*> Peak::getFragmentationEvents(float ppmWindow) {
         maxMz = mzmax;
     }
 
-    for( unsigned int j=0; j < sample->scans.size(); j++ ) {
-         	Scan* scan = sample->scans[j];
-            if (scan->mslevel != 2) continue; //ms2 scans only
-       		if (scan->rt < rtmin) continue;
-            if (scan->rt > rtmax) break;
-            if( scan->precursorMz >= minMz and scan->precursorMz <= maxMz) {
-                matchedscans.push_back(scan);
-            }
-    }
-    return matchedscans;
+    return sample->getFragmentationEvents(rtmin, rtmax, minMz, maxMz, true); //ms2 scans only
 }
 
 
@@ -533,6 +533,84 @@ PeakGroup& PeakGroup::operator=(const PeakGroup& o)  {
     return *this;
 }
 
+PeakGroup::PeakGroup(PeakGroup&& o) noexcept {
+    moveObj(o);
+}
+
+PeakGroup& PeakGroup::operator=(PeakGroup&& o) noexcept {
+    if (this != &o) moveObj(o);
+    return *this;
+}
+
+//same as copyObj(), but peaks, children, strings and fragmentation pattern are taken over from o
+void PeakGroup::moveObj(PeakGroup& o) {
+    groupId= o.groupId;
+    metaGroupId= o.metaGroupId;
+    groupRank= o.groupRank;
+
+    maxIntensity= o.maxIntensity;
+    meanRt=o.meanRt;
+    meanMz=o.meanMz;
+
+    blankMax=o.blankMax;
+    blankSampleCount=o.blankSampleCount;
+    blankMean=o.blankMean;
+
+    sampleMax=o.sampleMax;
+    sampleCount=o.sampleCount;
+    sampleMean=o.sampleMean;
+
+    ms2EventCount=o.ms2EventCount;
+    maxNoNoiseObs=o.maxNoNoiseObs;
+    maxPeakFracionalArea=o.maxPeakFracionalArea;
+    maxSignalBaseRatio=o.maxSignalBaseRatio;
+    maxSignalBaselineRatio=o.maxSignalBaselineRatio;
+    maxPeakOverlap=o.maxPeakOverlap;
+    maxQuality=o.maxQuality;
+    expectedRtDiff=o.expectedRtDiff;
+    expectedAbundance = o.expectedAbundance;
+    isotopeC13count=o.isotopeC13count;
+
+    minRt=o.minRt;
+    maxRt=o.maxRt;
+
+    minMz=o.minMz;
+    maxMz=o.maxMz;
+
+    parent = o.parent;
+    compound = o.compound;
+    adduct = o.adduct;
+
+    compoundId = std::move(o.compoundId);
+    compoundDb = std::move(o.compoundDb);
+
+    srmId = std::move(o.srmId);
+    isFocused=o.isFocused;
+    displayName = std::move(o.displayName);
+    labels = std::move(o.labels);
+    importedCompoundName = std::move(o.importedCompoundName);
+
+    goodPeakCount=o.goodPeakCount;
+    _type = o._type;
+    tagString = std::move(o.tagString);
+    searchTableName = std::move(o.searchTableName);
+    deletedFlag = o.deletedFlag;
+
+    fragMatchScore = std::move(o.fragMatchScore);
+    fragmentationPattern = std::move(o.fragmentationPattern);
+
+    changeFoldRatio = o.changeFoldRatio;
+    changePValue    = o.changePValue;
+    peaks = std::move(o.peaks);
+
+    chargeState=o.chargeState;
+    isotopicIndex=o.isotopicIndex;
+
+    //children keep their addresses, only their parent moves
+    children = std::move(o.children);
+    for(unsigned int i=0; i < children.size(); i++ ) children[i].parent = this;
+}
+
 bool PeakGroup::operator==(const PeakGroup& o)  {
     if ( this->meanMz == o.meanMz
          && this->meanRt == o.meanRt
@@ -596,15 +674,8 @@ vector<Scan*> PeakGroup::getFragmentationEvents() {
         mzSample* sample = peaks[i].getSample();
         if (!sample) continue;
 
-        for( unsigned int j=0; j < sample->scans.size(); j++ ) {
-            Scan* scan = sample->scans[j];
-            if (scan->mslevel <= 1) continue; //ms2 + scans only
-            if (scan->rt < peaks[i].rtmin) continue;
-            if (scan->rt > peaks[i].rtmax) break;
-            if( scan->precursorMz >= minMz and scan->precursorMz <= maxMz) {
-                matchedscans.push_back(scan);
-            }
-        }
+        vector<Scan*> sampleScans = sample->getFragmentationEvents(peaks[i].rtmin, peaks[i].rtmax, minMz, maxMz);
+        matchedscans.insert(matchedscans.end(), sampleScans.begin(), sampleScans.end());
     }
     return matchedscans;
 }
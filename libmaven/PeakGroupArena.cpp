@@ -0,0 +1,46 @@
+#include "PeakGroupArena.h"
+
+#include <new>
+
+PeakGroupArena::PeakGroupArena(size_t groupsPerBlock) : groupsPerBlock(max(groupsPerBlock, static_cast<size_t>(1))) {}
+
+PeakGroup* PeakGroupArena::nextSlot() {
+    if (numGroups == blocks.size() * groupsPerBlock) {
+        void* block = ::operator new(groupsPerBlock * sizeof(PeakGroup));
+        blocks.push_back(static_cast<PeakGroup*>(block));
+    }
+    return blocks.back() + numGroups % groupsPerBlock;
+}
+
+PeakGroup* PeakGroupArena::create() {
+    PeakGroup* group = new (nextSlot()) PeakGroup();
+    numGroups++;
+    return group;
+}
+
+PeakGroup* PeakGroupArena::add(PeakGroup&& group) {
+    PeakGroup* added = new (nextSlot()) PeakGroup(std::move(group));
+    numGroups++;
+    return added;
+}
+
+PeakGroup* PeakGroupArena::add(const PeakGroup& group) {
+    PeakGroup* added = new (nextSlot()) PeakGroup(group);
+    numGroups++;
+    return added;
+}
+
+vector<PeakGroup*> PeakGroupArena::addAll(vector<PeakGroup>& groups) {
+    vector<PeakGroup*> added;
+    added.reserve(groups.size());
+    for (PeakGroup& group : groups) added.push_back(add(std::move(group)));
+    groups.clear();
+    return added;
+}
+
+void PeakGroupArena::clear() {
+    for (size_t i = 0; i < numGroups; i++) (*this)[i]->~PeakGroup();
+    for (PeakGroup* block : blocks) ::operator delete(block);
+    blocks.clear();
+    numGroups = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef PEAKGROUPARENA_H
+#define PEAKGROUPARENA_H
+
+#include "mzSample.h"
+
+/* Class: PeakGroupArena
+ *
+ * Storage for the peak groups of one detection run. Groups are moved into fixed size blocks,
+ * so they never move again once added: PeakGroup* pointers (and the parent pointers of their
+ * children) stay valid until clear(), which destroys every group and releases all blocks at once.
+ */
+class PeakGroupArena {
+
+public:
+    explicit PeakGroupArena(size_t groupsPerBlock=1024);
+    ~PeakGroupArena() { clear(); }
+
+    PeakGroupArena(const PeakGroupArena&) = delete;
+    PeakGroupArena& operator=(const PeakGroupArena&) = delete;
+
+    /**
+     * @brief new empty group, owned by the arena
+     */
+    PeakGroup* create();
+
+    /**
+     * @brief move (or copy) a group into the arena, returns its new address
+     */
+    PeakGroup* add(PeakGroup&& group);
+    PeakGroup* add(const PeakGroup& group);
+
+    /**
+     * @brief move all groups into the arena (groups is left empty), e.g. the output of
+     * EIC::groupPeaksB(). Returns the new addresses, in the same order.
+     */
+    vector<PeakGroup*> addAll(vector<PeakGroup>& groups);
+
+    size_t size() const { return numGroups; }
+    PeakGroup* operator[](size_t i) const { return blocks[i / groupsPerBlock] + i % groupsPerBlock; }
+
+    /**
+     * @brief destroy all groups and free their storage
+     */
+    void clear();
+
+private:
+    size_t groupsPerBlock;
+    size_t numGroups = 0;
+    vector<PeakGroup*> blocks;  //raw storage for groupsPerBlock groups each
+
+    PeakGroup* nextSlot();
+};
+
+#endif
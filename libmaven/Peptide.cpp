@@ -805,82 +805,19 @@ double Peptide::averageMZFragment(char type, unsigned int numAA, unsigned int ch
 
 // monoisotopicMZFragment - calculates the m/z value of a fragment. type is either y, b or a.
 // for instance, to calculate the m/z of the y7++ fragment, type = 'y', numAA = 7, charge = 2.
+// Builds a FragmentLadder: to compute many fragments, build the ladder once and use the ladder overload.
 double Peptide::monoisotopicMZFragment(char type, unsigned int numAA, unsigned int charge) {
 
   if (type != 'y' && type != 'b' && type != 'a' && type != 'z' && type != 'c') return (0.0);
   
-  unsigned int len = NAA();
-  
-  if (numAA < 1 || numAA >= len) return (0.0);
+  if (numAA < 1 || numAA >= NAA()) return (0.0);
   
   if (charge < 1) return (0.0);
-  
-  if (type == 'y' || type == 'z') {
-    double sum = 0.0;
-    // y ions are on the C-term side. Have to include the C-term mod, if any.
-    if (isModsSet && !cTermMod.empty()) {
-      sum += getModMonoisotopicMass(cTermMod);
-    }
-    for (unsigned int i = len - numAA; i < len; i++) {
-      sum += (*AAMonoisotopicMassTable)[stripped[i]];
-      if (isModsSet && !mods.empty()) {
-        map<int, string>::iterator j = mods.find((int)i);
-        if (j != mods.end()) {
-          // modified at this position
-          sum += getModMonoisotopicMass((*j).second);
-        }
-      }
-    }
-    // add a water for the y ion
-    sum += (*AAMonoisotopicMassTable)['!'];
-    // add a proton for each charge
-    sum += ((double)charge * ((*AAMonoisotopicMassTable)['+']));
-    
-    // if it's a z ion, subtract an ammonia from the y ion
-    if (type == 'z') {
-      sum -= ((*AAMonoisotopicMassTable)['a'] - (*AAMonoisotopicMassTable)['+']);
-    }
-    
-    return (sum / (double)charge);
-    
-  } 
-  if (type == 'b' || type == 'a' || type == 'c') {
-    double sum = 0.0;
-    
-    // b or a ions are on the N-term side. Add the N-term modification mass, if any
-    if (isModsSet && !nTermMod.empty()) {
-      sum += getModMonoisotopicMass(nTermMod);
-    }
-    
-    for (unsigned int i = 0; i < numAA; i++) {
-      sum += (*AAMonoisotopicMassTable)[stripped[i]];
-      if (isModsSet && !mods.empty()) {
-        map<int, string>::iterator j = mods.find((int)i);
-        if (j != mods.end()) {
-          // modified at this position
-          sum += getModMonoisotopicMass((*j).second);
-        }
-      }
-    }
-    
-    // add a proton for each charge
-    sum += ((double)charge * ((*AAMonoisotopicMassTable)['+']));
-  
-    // if it's the a ion, subtract the carbonyl (C=O) from the b ion.
-    if (type == 'a') {
-      sum -= ((*AAMonoisotopicMassTable)['$'] + (*AAMonoisotopicMassTable)['o']);
-    }
-    
-    // if it's the c ion, add an ammonia to the b ion
-    if (type == 'c') {
-      sum += (*AAMonoisotopicMassTable)['a'];
-    }
 
-    return (sum / (double)charge);
-    
-  }
+  FragmentLadder ladder;
+  buildFragmentLadder(ladder);
 
-  return (0.0);
+  return (monoisotopicMZFragment(ladder, type, numAA, charge));
 }
 
 double Peptide::monoisotopicMZResidue(unsigned int pos, unsigned int charge) {
@@ -906,15 +843,19 @@ double Peptide::monoisotopicMZResidue(unsigned int pos, unsigned int charge) {
 }
 
 double Peptide::monoisotopicMZInternalFragment(unsigned int startAAPos, unsigned int endAAPos, unsigned int charge) {
- 
-  double mz = monoisotopicMZFragment('b', endAAPos, charge);
-  
-  if (isModsSet && !nTermMod.empty()) {
-    mz -= getModMonoisotopicMass(nTermMod) / (double)charge;
-  }
+
+  if (charge < 1) return (0.0);
+
+  FragmentLadder ladder;
+  buildFragmentLadder(ladder);
+
+  // b ion of the first endAAPos residues, without the N-term mod and the first startAAPos - 1 residues
+  double mz = monoisotopicMZFragment(ladder, 'b', endAAPos, charge);
+
+  mz -= ladder.nTermModMass / (double)charge;
   
-  for (int i = 1; i < startAAPos; i++) {
-    mz -= monoisotopicMZResidue(i, charge);
+  for (unsigned int i = 1; i < startAAPos && i <= ladder.numAA; i++) {
+    mz -= ladder.residueMasses[i - 1] / (double)charge;
   }
   
   return (mz);
@@ -1990,6 +1931,155 @@ void Peptide::SEQUESTTheoreticalSpectrum(map<int, float>& peaks) {
 // ===============================================================================
 // METHODS TO CREATE ALL COMMON FRAGMENT IONS (FOR ANNOTATION OF PEAK LIST)
 
+// buildFragmentLadder - resolves the modified residue masses, neutral losses and terminal mods of this
+// peptide once, and sums them up from both termini, so that fragment series can be computed without
+// looking up the mass tables for every fragment.
+void Peptide::buildFragmentLadder(FragmentLadder& ladder) {
+
+  unsigned int len = NAA();
+
+  ladder.numAA = len;
+  ladder.nTermModMass = 0.0;
+  ladder.cTermModMass = 0.0;
+  if (isModsSet && !nTermMod.empty()) {
+    ladder.nTermModMass = getModMonoisotopicMass(nTermMod);
+  }
+  if (isModsSet && !cTermMod.empty()) {
+    ladder.cTermModMass = getModMonoisotopicMass(cTermMod);
+  }
+
+  ladder.residueMasses.assign(len, 0.0);
+  ladder.residueNeutralLosses.assign(len, NULL);
+  ladder.modNeutralLosses.assign(len, NULL);
+
+  for (unsigned int i = 0; i < len; i++) {
+    ladder.residueMasses[i] = getAAMonoisotopicMass(stripped[i]);
+
+    map<char, double*>::iterator nls = AAMonoisotopicNeutralLossTable->find(stripped[i]);
+    if (nls != AAMonoisotopicNeutralLossTable->end()) {
+      ladder.residueNeutralLosses[i] = nls->second;
+    }
+  }
+
+  if (isModsSet) {
+    for (map<int, string>::iterator m = mods.begin(); m != mods.end(); m++) {
+      if (m->first < 0 || m->first >= (int)len) continue;
+
+      ladder.residueMasses[m->first] += getModMonoisotopicMass(m->second);
+
+      // hack - loss of 64 only applies to methionine oxidation, not to other oxidations, so check:
+      if (m->second == "Oxidation" && stripped[m->first] != 'M') continue;
+
+      map<string, double*>::iterator nls = modMonoisotopicNeutralLossTable->find(m->second);
+      if (nls != modMonoisotopicNeutralLossTable->end()) {
+        ladder.modNeutralLosses[m->first] = nls->second;
+      }
+    }
+  }
+
+  ladder.prefixMasses.assign(len + 1, 0.0);
+  ladder.suffixMasses.assign(len + 1, 0.0);
+  for (unsigned int k = 1; k <= len; k++) {
+    ladder.prefixMasses[k] = ladder.prefixMasses[k - 1] + ladder.residueMasses[k - 1];
+    ladder.suffixMasses[k] = ladder.suffixMasses[k - 1] + ladder.residueMasses[len - k];
+  }
+
+  ladder.protonMass = getAAMonoisotopicMass('+');
+  ladder.hydrogenMass = getAAMonoisotopicMass('h');
+  ladder.waterMass = getAAMonoisotopicMass('!');
+  ladder.ammoniaMass = getAAMonoisotopicMass('a');
+  ladder.carbonylMass = getAAMonoisotopicMass('$') + getAAMonoisotopicMass('o');
+}
+
+// monoisotopicMZFragment - calculates the m/z value of a fragment from a prebuilt ladder, in constant time.
+// type is one of a, b, c, x, y or z (z is z-dot, as in the ETD annotations); lossMass is subtracted from the fragment.
+double Peptide::monoisotopicMZFragment(const FragmentLadder& ladder, char type, unsigned int numAA, unsigned int charge, double lossMass) {
+
+  if (numAA < 1 || numAA >= ladder.numAA) return (0.0);
+
+  if (charge < 1) return (0.0);
+
+  double protons = (double)charge * ladder.protonMass;
+
+  switch (type) {
+    case 'a': return ((ladder.nTermResidueMass(numAA) + protons - ladder.carbonylMass - lossMass) / (double)charge);
+    case 'b': return ((ladder.nTermResidueMass(numAA) + protons - lossMass) / (double)charge);
+    case 'c': return ((ladder.nTermResidueMass(numAA) + protons + ladder.ammoniaMass - lossMass) / (double)charge);
+    case 'x': return ((ladder.cTermResidueMass(numAA) + ladder.waterMass + protons + ladder.carbonylMass - 2.0 * ladder.hydrogenMass - lossMass) / (double)charge);
+    case 'y': return ((ladder.cTermResidueMass(numAA) + ladder.waterMass + protons - lossMass) / (double)charge);
+    case 'z': return ((ladder.cTermResidueMass(numAA) + ladder.waterMass + protons - ladder.ammoniaMass + ladder.protonMass - lossMass) / (double)charge);
+    default: return (0.0);
+  }
+}
+
+// fillFragmentMZLadder - writes the m/z values of a whole fragment series into mzs, which must hold at least
+// ladder.numAA - 1 values: mzs[k - 1] is the fragment with k residues. Returns the number of values written.
+unsigned int Peptide::fillFragmentMZLadder(const FragmentLadder& ladder, char type, unsigned int charge, double* mzs, double lossMass) {
+
+  if (type != 'a' && type != 'b' && type != 'c' && type != 'x' && type != 'y' && type != 'z') return (0);
+
+  if (charge < 1 || ladder.numAA < 2) return (0);
+
+  // everything but the residues is constant along the series
+  double offset = (double)charge * ladder.protonMass - lossMass;
+  if (type == 'a') offset -= ladder.carbonylMass;
+  if (type == 'c') offset += ladder.ammoniaMass;
+  if (type == 'x' || type == 'y' || type == 'z') offset += ladder.waterMass;
+  if (type == 'x') offset += ladder.carbonylMass - 2.0 * ladder.hydrogenMass;
+  if (type == 'z') offset += ladder.protonMass - ladder.ammoniaMass;
+
+  unsigned int numFragments = ladder.numAA - 1;
+
+  if (type == 'a' || type == 'b' || type == 'c') {
+    for (unsigned int k = 1; k <= numFragments; k++) {
+      mzs[k - 1] = (ladder.nTermResidueMass(k) + offset) / (double)charge;
+    }
+  } else {
+    for (unsigned int k = 1; k <= numFragments; k++) {
+      mzs[k - 1] = (ladder.cTermResidueMass(k) + offset) / (double)charge;
+    }
+  }
+
+  return (numFragments);
+}
+
+// addNeutralLosses - adds the neutral losses made possible by the residue at pos to losses.
+static void addNeutralLosses(const FragmentLadder& ladder, unsigned int pos, bool isPrecursorCharge, map<int, double>& losses) {
+
+  const double* nls = ladder.residueNeutralLosses[pos];
+  if (nls) {
+    unsigned int x = 0;
+    double nl = 0.0;
+    while ((nl = nls[x++]) > 0.00001) {
+      int intLoss = (int)(nl + 0.5);
+
+      // allow double H2O/NH3 losses
+      if (intLoss == 17 || intLoss == 18) {
+        if (losses.find(18) != losses.end()) {
+          losses[intLoss + 18] = nl + losses[18];
+        } else if (losses.find(17) != losses.end()) {
+          losses[intLoss + 17] = nl + losses[17];
+        }
+      }
+      losses[intLoss] = nl;
+    }
+  }
+
+  nls = ladder.modNeutralLosses[pos];
+  if (nls) {
+    unsigned int x = 0;
+    double nl = 0.0;
+    while ((nl = nls[x++]) > 0.00001) {
+      // hack - if neutral loss is too heavy - over 250 Da, this is really not a "neutral loss"
+      // but rather a charge-carrying loss (e.g. the old ICAT losses), so we will not add
+      // this fragment if the fragment charge == precursor charge.
+      if (nl > 250.0 && isPrecursorCharge) continue;
+
+      losses[(int)(nl + 0.5)] = nl;
+    }
+  }
+}
+
 // generateFragmentIons - generates all theoretical fragment ions for this peptides.
 // They include precursor, y and b (for all charges <= precursor charge) with neutral losses (see NeutralLossTable), and a ions.
 void Peptide::generateFragmentIons(vector<FragmentIon*>& ions, string fragmentationType) {
@@ -2012,229 +2102,137 @@ void Peptide::generateFragmentIons(vector<FragmentIon*>& ions, string fragmentat
 
 void Peptide::generateFragmentIonsCID(vector<FragmentIon*>& ions) {
 
+  FragmentLadder ladder;
+  buildFragmentLadder(ladder);
+
+  unsigned int len = ladder.numAA;
   double precursorMH = 0.0;
-  
-  for (unsigned int ch = 1; ch <= (unsigned int)charge; ch++) {
-    
-    map<int, double> losses; // store losses as pairs of (int value of mod mass, double value of mod mass)
-    double sum = 0.0;
-    
-    
-    // BEGIN y ions and precursor
-    
-    // add a water for the y ion
-    sum += (*AAMonoisotopicMassTable)['!'];
 
-    // add C-terminal modifcation mass, if any
-    if (isModsSet && !cTermMod.empty()) {
-      sum += getModMonoisotopicMass(cTermMod);
-    }
-    
-    losses[18] = (*AAMonoisotopicMassTable)['!'];
+  // The losses available to a fragment only grow as residues are added, and only depend on the charge
+  // through the charge-carrying loss hack, so they are worked out once per series for both cases.
+  // Index 0 is for fragments below the precursor charge, index 1 for those at the precursor charge.
+  vector<vector<pair<int, double> > > yLosses[2];
+  vector<vector<pair<int, double> > > bLosses[2];
+
+  for (int isPrecursorCharge = 0; isPrecursorCharge < 2; isPrecursorCharge++) {
+
+    map<int, double> losses; // store losses as pairs of (int value of mod mass, double value of mod mass)
+    losses[18] = ladder.waterMass;
     losses[44] = 43.98982; // CO2
     losses[46] = 46.00548; // HCOOH
-    
-    // add a proton for each charge
-    sum += (double)ch * (*AAMonoisotopicMassTable)['+'];
-    
-    for (int i = (int)(stripped.length()) - 1; i >= 0; i--) { 
-     
-      sum += (*AAMonoisotopicMassTable)[stripped[i]];
-        
-      double* nls = (*AAMonoisotopicNeutralLossTable)[stripped[i]];
-      if (nls) {
-        unsigned int x = 0;
-        double nl = 0.0;
-	while((nl = nls[x++]) > 0.00001) {
-          int intLoss = (int)(nl + 0.5);
-
-	  // allow double H2O/NH3 losses
-	  if (intLoss == 17 || intLoss == 18) {
-	    if (losses.find(18) != losses.end()) {
-	      losses[intLoss + 18] = nl + losses[18];
-	    } else if (losses.find(17) != losses.end()) {
-	      losses[intLoss + 17] = nl + losses[17];
-	    }
-	  }
 
-	  losses[intLoss] = nl;
-        }
-  
-      }
-        
-      if (isModsSet && !mods.empty()) {
-        map<int, string>::iterator j = mods.find(i);
-        if (j != mods.end()) {
-          // modified at this position
-          sum += getModMonoisotopicMass(j->second);
-          double* nls = (*modMonoisotopicNeutralLossTable)[j->second];
-
-	  // hack - loss of 64 only applies to methionine oxidation, not to other oxidations, so check:
-	  if (j->second == "Oxidation" && stripped[i] != 'M') nls = NULL;
-
-          if (nls) { 
-            unsigned int x = 0;
-            double nl = 0.0;
-            while ((nl = nls[x++]) > 0.00001) {
-              // hack - if neutral loss is too heavy - over 250 Da, this is really not a "neutral loss"
-              // but rather a charge-carrying loss (e.g. the old ICAT losses), so we will not add
-              // this fragment if the fragment charge == precursor charge. 
-              if (nl > 250.0 && ch == charge) continue;
-
-              losses[(int)(nl + 0.5)] = nl;
-            }
+    yLosses[isPrecursorCharge].resize(len);
+    for (int i = (int)len - 1; i >= 0; i--) {
+      addNeutralLosses(ladder, (unsigned int)i, isPrecursorCharge, losses);
+      yLosses[isPrecursorCharge][i].assign(losses.begin(), losses.end());
+    }
+
+    losses.clear();
+    losses[17] = 17.026549; // loss of NH3
+
+    bLosses[isPrecursorCharge].resize(len);
+    for (int i = 0; i < (int)len - 1; i++) {
+      addNeutralLosses(ladder, (unsigned int)i, isPrecursorCharge, losses);
+      bLosses[isPrecursorCharge][i].assign(losses.begin(), losses.end());
+    }
+  }
+
+  vector<double> yMzs(len);
+  vector<double> bMzs(len);
+  vector<double> aMzs(len);
+
+  for (unsigned int ch = 1; ch <= (unsigned int)charge; ch++) {
+
+    bool isPrecursorCharge = (ch == (unsigned int)charge);
+
+    // BEGIN y ions and precursor
+
+    fillFragmentMZLadder(ladder, 'y', ch, yMzs.data());
+
+    for (int i = (int)len - 1; i > 0; i--) {
+      // this is a y ion
+      unsigned int position = len - (unsigned int)i;
+      unsigned int prom = 9;
+      if (isPrecursorCharge && stripped[i] != 'P' && (double)position > (double)len * 0.77) prom = 6;
+      ions.push_back(new FragmentIon("y", position, 0, yMzs[position - 1], ch, prom));
+
+      double sum = ladder.cTermResidueMass(position) + ladder.waterMass + (double)ch * ladder.protonMass;
+      vector<pair<int, double> >& losses = yLosses[isPrecursorCharge][i];
+      for (vector<pair<int, double> >::iterator n = losses.begin(); n != losses.end(); n++) {
+        prom = 4;
+        if (n->first == 17 || n->first == 18 || n->first == 64 || n->first == 91 || n->first == 98) {
+          if (isPrecursorCharge) {
+            prom = 5;
+          } else {
+            prom = 7;
           }
         }
+        ions.push_back(new FragmentIon("y", position, n->first, (sum - n->second) / (double)ch, ch, prom));
       }
-        
-      
-      if (i > 0) {
-        // this is a y ion
-        unsigned int position = NAA() - (unsigned int)i;
-    	unsigned prom = 9;
-	if (ch == charge && stripped[i] != 'P' && (double)position > (double)(stripped.length()) * 0.77) prom = 6;
-        ions.push_back(new FragmentIon("y", position, 0, sum / (double)ch, ch, prom));
-        
-        for (map<int, double>::iterator n = losses.begin(); n != losses.end(); n++) {
-	  prom = 4;
-	  if (n->first == 17 || n->first == 18 || n->first == 64 || n->first == 91 || n->first == 98) {
-	    if (ch == charge) {
-	      prom = 5;
-	    } else {
-	      prom = 7;
-	    }
-	  }
-          ions.push_back(new FragmentIon("y", position, n->first, (sum - n->second) / (double)ch, ch, prom));
-        }
-          
-          
-      } else {
-        // this is really just the precursor!
-        
-        // add N-terminus mod, if any
-        if (isModsSet && !nTermMod.empty()) {
-          sum += getModMonoisotopicMass(nTermMod);
-        }
-        
-        precursorMH = sum;
-        
-        // precursor -- don't consider all charges, since the precursor should carry all the charges 
-        if (ch == charge) {
-          ions.push_back(new FragmentIon("p", 0, 0, sum / (double)ch, ch, 9));
-        
-          for (map<int, double>::iterator n = losses.begin(); n != losses.end(); n++) {
-            ions.push_back(new FragmentIon("p", 0, n->first, (sum - n->second) / (double)ch, ch, 9));
-          }    
+    }
+
+    if (len > 0) {
+      // this is really just the precursor!
+      double sum = ladder.monoisotopicMH(ch);
+
+      precursorMH = sum;
+
+      // precursor -- don't consider all charges, since the precursor should carry all the charges
+      if (isPrecursorCharge) {
+        ions.push_back(new FragmentIon("p", 0, 0, sum / (double)ch, ch, 9));
+
+        vector<pair<int, double> >& losses = yLosses[1][0];
+        for (vector<pair<int, double> >::iterator n = losses.begin(); n != losses.end(); n++) {
+          ions.push_back(new FragmentIon("p", 0, n->first, (sum - n->second) / (double)ch, ch, 9));
         }
       }
-        
     }
     // END y ions and precursor
-    
-    // reset
-    sum = 0.0;
-    losses.clear();
-    
+
     // BEGIN b and a ions
-    
-    // add the N-term modification mass, if any
-    if (isModsSet && !nTermMod.empty()) {
-      sum += getModMonoisotopicMass(nTermMod);
-    }
-    losses[17] = 17.026549; // loss of NH3
 
-    // add a proton for each charge
-    sum += (double)ch * (*AAMonoisotopicMassTable)['+'];
-    
+    fillFragmentMZLadder(ladder, 'b', ch, bMzs.data());
+    fillFragmentMZLadder(ladder, 'a', ch, aMzs.data());
+
     bool hasBasicAA = false;
-    
-    for (int i = 0; i < (int)(stripped.length()) - 1; i++) {
-      
+
+    for (int i = 0; i < (int)len - 1; i++) {
+
       if (stripped[i] == 'R' || stripped[i] == 'K' || stripped[i] == 'H') hasBasicAA = true;
-      
-      sum += (*AAMonoisotopicMassTable)[stripped[i]];
-      
-      double* nls = (*AAMonoisotopicNeutralLossTable)[stripped[i]];
 
-      if (nls) {
-        unsigned int x = 0;
-        double nl = 0.0;
-        while ((nl = nls[x++]) > 0.00001) {
-	  int intLoss = (int)(nl + 0.5);
-	  
-	  // allow double H2O/NH3 losses
-	  if (intLoss == 17 || intLoss == 18) {
-	    if (losses.find(18) != losses.end()) {
-	      losses[intLoss + 18] = nl + losses[18];
-	    } else if (losses.find(17) != losses.end()) {
-	      losses[intLoss + 17] = nl + losses[17];
-	    }
-	  }
-          losses[intLoss] = nl;
-        }
-      }
-      
-      if (isModsSet && !mods.empty()) {
-        map<int, string>::iterator j = mods.find(i);
-        if (j != mods.end()) {
-          // modified at this position
-          sum += getModMonoisotopicMass(j->second);
-          double* nls = (*modMonoisotopicNeutralLossTable)[j->second];
-
-	  // hack - loss of 64 only applies to methionine oxidation, not to other oxidations, so check:
-	  if (j->second == "Oxidation" && stripped[i] != 'M') nls = NULL;
-
-          if (nls) { 
-            unsigned int x = 0;
-            double nl = 0.0;
-            while ((nl = nls[x++]) > 0.00001) {
-              // hack - if neutral loss is too heavy - over 250 Da, this is really not a "neutral loss"
-              // but rather a charge-carrying loss (e.g. the old ICAT losses), so we will not add
-              // this fragment if the fragment charge == precursor charge. 
-              if (nl > 250.0 && ch == charge) continue;
-
-              losses[(int)(nl + 0.5)] = nl;
-            }
-          }
-        }
-      }
-    
       // b ion
       unsigned int position = (unsigned int)i + 1;
       unsigned int prom = 8;
-      if (ch == charge && (double)position > (double)(stripped.length()) * 0.77) prom = 5;
+      if (isPrecursorCharge && (double)position > (double)len * 0.77) prom = 5;
       if (hasBasicAA) prom++;
-      ions.push_back(new FragmentIon("b", position, 0, sum / (double)ch, ch, prom));
-        
-      for (map<int, double>::iterator n = losses.begin(); n != losses.end(); n++) {
-	prom = 4;
-	if (n->first == 17 || n->first == 18 || n->first == 64 || n->first == 91 || n->first == 98) {
-	  if (ch == charge) {
-	    prom = 5;
-	  } else {
-	    prom = 6;
-	  }
-	}
-	
+      ions.push_back(new FragmentIon("b", position, 0, bMzs[i], ch, prom));
+
+      double sum = ladder.nTermResidueMass(position) + (double)ch * ladder.protonMass;
+      vector<pair<int, double> >& losses = bLosses[isPrecursorCharge][i];
+      for (vector<pair<int, double> >::iterator n = losses.begin(); n != losses.end(); n++) {
+        prom = 4;
+        if (n->first == 17 || n->first == 18 || n->first == 64 || n->first == 91 || n->first == 98) {
+          if (isPrecursorCharge) {
+            prom = 5;
+          } else {
+            prom = 6;
+          }
+        }
         ions.push_back(new FragmentIon("b", position, n->first, (sum - n->second) / (double)ch, ch, prom));
       }
 
       // special case, b(n-1) ion can have +18 neutral "gain"
-      if (position == NAA() - 1) {
-	ions.push_back(new FragmentIon("b", position, -18, (sum + (*AAMonoisotopicMassTable)['!']) / (double)ch, ch, ch == charge ? 5 : 6));
+      if (position == len - 1) {
+        ions.push_back(new FragmentIon("b", position, -18, (sum + ladder.waterMass) / (double)ch, ch, isPrecursorCharge ? 5 : 6));
       }
 
       // a ion
       // small a ions are more common
-      ions.push_back(new FragmentIon("a", position, 0, (sum - (*AAMonoisotopicMassTable)['$'] - (*AAMonoisotopicMassTable)['o']) / (double)ch, ch, position <= 3 && ch == 1 ? 7 : 4));
-
-
-  
-           
+      ions.push_back(new FragmentIon("a", position, 0, aMzs[i], ch, position <= 3 && ch == 1 ? 7 : 4));
     }
-      
+
     // END b and a ions
-  
+
   } // for all charges <= pep.charge
 
   // check "special" modifications, namely phospho and old ICAT
@@ -2347,201 +2345,78 @@ void Peptide::generateFragmentIonsCID(vector<FragmentIon*>& ions) {
 
 void Peptide::generateFragmentIonsETD(vector<FragmentIon*>& ions) {
 
-  double precursorMH = 0.0;
-  
-  for (unsigned int ch = 1; ch <= (unsigned int)charge; ch++) { 
+  FragmentLadder ladder;
+  buildFragmentLadder(ladder);
 
-    map<int, double> losses; // store losses as pairs of (int value of mod mass, double value of mod mass)
-    double sum = 0.0;
-    
-    // BEGIN y/z ions and precursor
-    
-    // add a water for the y ion
-    sum += (*AAMonoisotopicMassTable)['!'];
+  unsigned int len = ladder.numAA;
 
-    // add C-terminal modifcation mass, if any
-    if (isModsSet && !cTermMod.empty()) {
-      sum += getModMonoisotopicMass(cTermMod);
+  // in ETD, there are charge-reduced precursors, depending on how many e- it absorbs, but
+  // they retain the precursor's protons
+  double precursorMH = monoisotopicMH();
+
+  // only the precursors get neutral losses, so only the losses of the whole peptide are needed.
+  // Index 0 is for charges below the precursor charge, index 1 for the precursor charge.
+  map<int, double> precursorLosses[2]; // store losses as pairs of (int value of mod mass, double value of mod mass)
+  for (int isPrecursorCharge = 0; isPrecursorCharge < 2; isPrecursorCharge++) {
+    for (int i = (int)len - 1; i >= 0; i--) {
+      addNeutralLosses(ladder, (unsigned int)i, isPrecursorCharge, precursorLosses[isPrecursorCharge]);
     }
-    
-    // losses[18] = (*AAMonoisotopicMassTable)['!'];
-    // losses[44] = 43.98982; // CO2
-    // losses[46] = 46.00548; // HCOOH
-    
-    // add a proton for each charge
-    sum += (double)ch * (*AAMonoisotopicMassTable)['+'];
-    
-    for (int i = (int)(stripped.length()) - 1; i >= 0; i--) { 
-     
-      sum += (*AAMonoisotopicMassTable)[stripped[i]];
-        
-      double* nls = (*AAMonoisotopicNeutralLossTable)[stripped[i]];
-      if (nls) {
-        unsigned int x = 0;
-        double nl = 0.0;
-	while((nl = nls[x++]) > 0.00001) {
-          int intLoss = (int)(nl + 0.5);
-
-	  // allow double H2O/NH3 losses
-	  if (intLoss == 17 || intLoss == 18) {
-	    if (losses.find(18) != losses.end()) {
-	      losses[intLoss + 18] = nl + losses[18];
-	    } else if (losses.find(17) != losses.end()) {
-	      losses[intLoss + 17] = nl + losses[17];
-	    }
-	  }
+  }
 
-	  losses[intLoss] = nl;
-        }
-  
-      }
-        
+  vector<double> yMzs(len);
+  vector<double> zMzs(len);
+  vector<double> bMzs(len);
+  vector<double> cMzs(len);
 
-      if (isModsSet && !mods.empty()) {
-        map<int, string>::iterator j = mods.find(i);
-        if (j != mods.end()) {
-          // modified at this position
-          sum += getModMonoisotopicMass(j->second);
+  for (unsigned int ch = 1; ch <= (unsigned int)charge; ch++) {
 
-          double* nls = (*modMonoisotopicNeutralLossTable)[j->second];
+    bool isPrecursorCharge = (ch == (unsigned int)charge);
 
-	  // hack - loss of 64 only applies to methionine oxidation, not to other oxidations, so check:
-	  if (j->second == "Oxidation" && stripped[i] != 'M') nls = NULL;
+    // BEGIN y/z ions and precursor
 
-          if (nls) { 
-            unsigned int x = 0;
-            double nl = 0.0;
-            while ((nl = nls[x++]) > 0.00001) {
-              // hack - if neutral loss is too heavy - over 250 Da, this is really not a "neutral loss"
-              // but rather a charge-carrying loss (e.g. the old ICAT losses), so we will not add
-              // this fragment if the fragment charge == precursor charge. 
-              if (nl > 250.0 && ch == charge) continue;
+    if (ch <= (unsigned int)(charge - 1)) {
 
-              losses[(int)(nl + 0.5)] = nl;
-            }
-          }
-        }
+      fillFragmentMZLadder(ladder, 'y', ch, yMzs.data());
+
+      // NOTE: In annotations, "z" actually means zdot!!
+      fillFragmentMZLadder(ladder, 'z', ch, zMzs.data());
+
+      for (int i = (int)len - 1; i > 0; i--) {
+        // this is a y/z ion
+        unsigned int position = len - (unsigned int)i;
+        ions.push_back(new FragmentIon("y", position, 0, yMzs[position - 1], ch, 6));
+        ions.push_back(new FragmentIon("z", position, 0, zMzs[position - 1], ch, 8));
       }
-      
-      if (i > 0) {
-	if (ch <= (unsigned int) (charge - 1)) {
+    }
 
-	  // this is a y/z ion
-	  unsigned int position = NAA() - (unsigned int)i;
-	  ions.push_back(new FragmentIon("y", position, 0, sum / (double)ch, ch, 6));
-	  
-	  // subtract an ammonia to get the z, add a proton to get zdot
-	  // NOTE: In annotations, "z" actually means zdot!!
-	  double zsum = sum - (*AAMonoisotopicMassTable)['a'] + (*AAMonoisotopicMassTable)['+'];
-	  ions.push_back(new FragmentIon("z", position, 0, zsum / (double)ch, ch, 8));
-	}	  
-          
-      } else {
-        // this is really just the precursor!
-        
-        // add N-terminus mod, if any
-        if (isModsSet && !nTermMod.empty()) {
-          sum += getModMonoisotopicMass(nTermMod);
-        }
-       
-        
-        // in ETD, there are charge-reduced precursors, depending on how many e- it absorbs, but
-	// they retain the precursor's protons
-        precursorMH = monoisotopicMH();
-	ions.push_back(new FragmentIon("p", 0, 0, precursorMH / (double)ch, ch, 9));
-        
-	for (map<int, double>::iterator n = losses.begin(); n != losses.end(); n++) {
-	  ions.push_back(new FragmentIon("p", 0, n->first, (precursorMH - n->second) / (double)ch, ch, 9));
-	}    
-        
+    if (len > 0) {
+      // this is really just the precursor!
+      ions.push_back(new FragmentIon("p", 0, 0, precursorMH / (double)ch, ch, 9));
+
+      map<int, double>& losses = precursorLosses[isPrecursorCharge];
+      for (map<int, double>::iterator n = losses.begin(); n != losses.end(); n++) {
+        ions.push_back(new FragmentIon("p", 0, n->first, (precursorMH - n->second) / (double)ch, ch, 9));
       }
-        
     }
     // END y ions and precursor
-    
-    // reset
-    sum = 0.0;
-    // losses.clear();
-    
-    // BEGIN b and a ions
-    
-    // add the N-term modification mass, if any
-    if (isModsSet && !nTermMod.empty()) {
-      sum += getModMonoisotopicMass(nTermMod);
-    }
 
-    // losses[17] = 17.026549; // loss of NH3
+    // BEGIN b and c ions
 
-    // add a proton for each charge
-    sum += (double)ch * (*AAMonoisotopicMassTable)['+'];
-    
-    for (int i = 0; i < (int)(stripped.length()) - 1; i++) {
-      sum += (*AAMonoisotopicMassTable)[stripped[i]];
-      
-      /*
-      double* nls = (*AAMonoisotopicNeutralLossTable)[stripped[i]];
+    fillFragmentMZLadder(ladder, 'b', ch, bMzs.data());
 
-      if (nls) {
-        unsigned int x = 0;
-        double nl = 0.0;
-        while ((nl = nls[x++]) > 0.00001) {
-	  int intLoss = (int)(nl + 0.5);
-	  
-	  // allow double H2O/NH3 losses
-	  if (intLoss == 17 || intLoss == 18) {
-	    if (losses.find(18) != losses.end()) {
-	      losses[intLoss + 18] = nl + losses[18];
-	    } else if (losses.find(17) != losses.end()) {
-	      losses[intLoss + 17] = nl + losses[17];
-	    }
-	  }
-          losses[intLoss] = nl;
-        }
-      }
-      */
-      if (isModsSet && !mods.empty()) {
-        map<int, string>::iterator j = mods.find(i);
-        if (j != mods.end()) {
-          // modified at this position
-          sum += getModMonoisotopicMass(j->second);
-       
-	  /*
-	  double* nls = (*modMonoisotopicNeutralLossTable)[j->second];
-
-	  // hack - loss of 64 only applies to methionine oxidation, not to other oxidations, so check:
-	  if (j->second == "Oxidation" && stripped[i] != 'M') nls = NULL;
-
-          if (nls) { 
-            unsigned int x = 0;
-            double nl = 0.0;
-            while ((nl = nls[x++]) > 0.00001) {
-              // hack - if neutral loss is too heavy - over 250 Da, this is really not a "neutral loss"
-              // but rather a charge-carrying loss (e.g. the old ICAT losses), so we will not add
-              // this fragment if the fragment charge == precursor charge. 
-              if (nl > 250.0 && ch == charge) continue;
-
-              losses[(int)(nl + 0.5)] = nl;
-            }
-          }
-	  */
-        }
-      }
-    
-      // b ion
-      unsigned int position = (unsigned int)i + 1;
-      ions.push_back(new FragmentIon("b", position, 0, sum / (double)ch, ch, 5));
-
-      // add an ammonium to get the c ion
-      double csum = sum + (*AAMonoisotopicMassTable)['a'];
-      ions.push_back(new FragmentIon("c", position, 0, csum / (double)ch, ch, 8));
+    // add an ammonium to get the c ion
+    fillFragmentMZLadder(ladder, 'c', ch, cMzs.data());
 
-   
+    for (int i = 0; i < (int)len - 1; i++) {
+      unsigned int position = (unsigned int)i + 1;
+      ions.push_back(new FragmentIon("b", position, 0, bMzs[i], ch, 5));
+      ions.push_back(new FragmentIon("c", position, 0, cMzs[i], ch, 8));
     }
-      
+
     // END b and c ions
-  
-  } // for all charges <= pep.charge - 1
-  
+
+  } // for all charges <= pep.charge
+
   sort(ions.begin(), ions.end(), FragmentIon::sortFragmentIonPtrsByProminence);
 
 }
@@ -3522,24 +3397,25 @@ FragmentIon::FragmentIon(string ionType, int pos, int loss, double mz, unsigned
   m_bracket(bracket),
   m_assigned(false) {
   
-  stringstream ss;
-  ss << ionType;
+  // built by appending rather than through a stringstream, as whole fragment ladders are created at a time
+  m_ion = ionType;
   
   if (pos > 0) {
-    ss << pos;
+    m_ion += to_string(pos);
   }
   
   if (loss > 0) {
-    ss << '-' << loss;
+    m_ion += '-';
+    m_ion += to_string(loss);
   } else if (loss < 0) {
-    ss << '+' << -loss;
+    m_ion += '+';
+    m_ion += to_string(-loss);
   }
 
   if (ch != 1) {
-    ss << '^' << ch;
+    m_ion += '^';
+    m_ion += to_string(ch);
   }
-
-  m_ion = ss.str();
   
 }
 
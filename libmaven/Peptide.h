@@ -74,6 +74,40 @@ public:
   static bool sortFragmentIonPtrsByProminence(FragmentIon* a, FragmentIon* b); 
 };
 
+/* Struct: FragmentLadder
+ *
+ * A flat, table-resolved view of a peptide for fragment mass calculation. The modified residue
+ * masses are looked up once, and the prefix (N-term) and suffix (C-term) sums are stored, so that
+ * the mass of any a/b/c/x/y/z fragment is a constant-time lookup. Build with Peptide::buildFragmentLadder().
+ * The ladder is a snapshot: rebuild it if the peptide's mods or the mass tables change.
+ */
+struct FragmentLadder {
+
+  unsigned int numAA;
+  double nTermModMass;
+  double cTermModMass;
+
+  vector<double> residueMasses; // residue + side chain mod, by position
+  vector<double> prefixMasses;  // prefixMasses[k] = sum of the first k residue masses
+  vector<double> suffixMasses;  // suffixMasses[k] = sum of the last k residue masses
+
+  // zero-terminated neutral loss lists by position (NULL if none)
+  vector<const double*> residueNeutralLosses;
+  vector<const double*> modNeutralLosses;
+
+  double protonMass;
+  double hydrogenMass;
+  double waterMass;
+  double ammoniaMass;
+  double carbonylMass;
+
+  // neutral masses of the residues (with terminal mods) of the N-term and C-term fragments of n residues
+  double nTermResidueMass(unsigned int n) const { return (nTermModMass + prefixMasses[n]); }
+  double cTermResidueMass(unsigned int n) const { return (cTermModMass + suffixMasses[n]); }
+
+  double monoisotopicMH(unsigned int charge = 1) const { return (nTermModMass + cTermModMass + prefixMasses[numAA] + waterMass + (double)charge * protonMass); }
+};
+
 class Peptide {
 	
 public:
@@ -151,6 +185,11 @@ public:
   void generateFragmentIonsCID(vector<FragmentIon*>& ions);
   void generateFragmentIonsETD(vector<FragmentIon*>& ions);
 
+  // methods to compute whole fragment series from a FragmentLadder
+  void buildFragmentLadder(FragmentLadder& ladder);
+  static double monoisotopicMZFragment(const FragmentLadder& ladder, char type, unsigned int numAA, unsigned int charge, double lossMass = 0.0);
+  static unsigned int fillFragmentMZLadder(const FragmentLadder& ladder, char type, unsigned int charge, double* mzs, double lossMass = 0.0);
+
   // method to shuffle the peptide sequence randomly
   // string shufflePeptideSequence();
   Peptide* shufflePeptideSequence(map<int, set<string> >& allSequences);
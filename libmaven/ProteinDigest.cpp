@@ -0,0 +1,382 @@
+#include "ProteinDigest.h"
+#include "Peptide.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+
+Enzyme::Enzyme(string name, string cleaveAfter, string restrictBefore, string cleaveBefore, string restrictAfter) :
+    name(name),
+    cleaveAfter(cleaveAfter),
+    restrictBefore(restrictBefore),
+    cleaveBefore(cleaveBefore),
+    restrictAfter(restrictAfter) {
+
+    fill(cleavesAfter, cleavesAfter + 256, false);
+    fill(restrictsBefore, restrictsBefore + 256, false);
+    fill(cleavesBefore, cleavesBefore + 256, false);
+    fill(restrictsAfter, restrictsAfter + 256, false);
+
+    for (char aa : cleaveAfter) cleavesAfter[(unsigned char) aa] = true;
+    for (char aa : restrictBefore) restrictsBefore[(unsigned char) aa] = true;
+    for (char aa : cleaveBefore) cleavesBefore[(unsigned char) aa] = true;
+    for (char aa : restrictAfter) restrictsAfter[(unsigned char) aa] = true;
+}
+
+Enzyme Enzyme::fromName(string name) {
+
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+    if (name == "trypsin/p") return trypsinP();
+    if (name == "lys-c" || name == "lysc") return lysC();
+    if (name == "arg-c" || name == "argc") return argC();
+    if (name == "glu-c" || name == "gluc") return gluC();
+    if (name == "asp-n" || name == "aspn") return aspN();
+    if (name == "chymotrypsin") return chymotrypsin();
+
+    if (name != "trypsin") cerr << "Enzyme::fromName(): unknown enzyme " << name << ", using trypsin" << endl;
+    return trypsin();
+}
+
+bool FastaReader::next(ProteinRecord& protein) {
+
+    protein.header.clear();
+    protein.accession.clear();
+    protein.sequence.clear();
+
+    string line;
+    if (pendingHeader.empty()) {
+        //skip anything before the first header
+        while (getline(input, line)) {
+            if (!line.empty() && line[0] == '>') { pendingHeader = line; break; }
+        }
+        if (pendingHeader.empty()) return false;
+    }
+
+    protein.header = pendingHeader;
+    pendingHeader.clear();
+
+    while (getline(input, line)) {
+        if (!line.empty() && line[0] == '>') { pendingHeader = line; break; }
+        for (char aa : line) {
+            if (isspace((unsigned char) aa) || aa == '*') continue;
+            protein.sequence += toupper((unsigned char) aa);
+        }
+    }
+
+    //accession is the first word of the header
+    size_t end = protein.header.find_first_of(" \t\r", 1);
+    protein.accession = protein.header.substr(1, end == string::npos ? string::npos : end - 1);
+
+    return true;
+}
+
+size_t FastaReader::nextChunk(vector<ProteinRecord>& proteins, size_t maxProteins) {
+
+    proteins.resize(maxProteins);
+
+    size_t numProteins = 0;
+    while (numProteins < maxProteins && next(proteins[numProteins])) numProteins++;
+
+    proteins.resize(numProteins);
+    return numProteins;
+}
+
+void PeptideIndex::digest(const string& seq, const DigestionParameters& params, vector<pair<uint32_t, uint32_t> >& peptides) {
+
+    peptides.clear();
+    if (seq.empty()) return;
+
+    static const string STANDARD_AA = "ACDEFGHIKLMNOPQRSTUVWY";
+
+    //number of ambiguous residues (B, J, X, Z, ...) before each position, peptides with any are skipped
+    vector<uint32_t> numAmbiguous(seq.length() + 1, 0);
+    for (size_t i = 0; i < seq.length(); i++) {
+        numAmbiguous[i+1] = numAmbiguous[i] + (STANDARD_AA.find(seq[i]) == string::npos ? 1 : 0);
+    }
+
+    vector<uint32_t> sites;
+    sites.push_back(0);
+    for (size_t i = 1; i < seq.length(); i++) {
+        if (params.enzyme.isCleavageSite(seq, i)) sites.push_back((uint32_t) i);
+    }
+    sites.push_back((uint32_t) seq.length());
+
+    uint32_t minLength = (uint32_t) max(1, params.minLength);
+    uint32_t maxLength = (uint32_t) max(1, min(64, params.maxLength));
+
+    auto addPeptide = [&](uint32_t start, uint32_t end) {
+        uint32_t length = end - start;
+        if (length < minLength || length > maxLength) return;
+        if (numAmbiguous[end] != numAmbiguous[start]) return;
+        peptides.push_back(make_pair(start, end));
+    };
+
+    bool isClipMethionine = params.isClipNTermMethionine && seq[0] == 'M';
+
+    for (size_t i = 0; i + 1 < sites.size(); i++) {
+        for (size_t j = i + 1; j < sites.size() && (int)(j - i - 1) <= params.maxMissedCleavages; j++) {
+            addPeptide(sites[i], sites[j]);
+            if (i == 0 && isClipMethionine) addPeptide(1, sites[j]);
+
+            if (sites[j] - sites[i] > maxLength + (isClipMethionine && i == 0 ? 1 : 0)) break;
+        }
+    }
+}
+
+/* Class: PeptideIndexBuilder
+ *
+ * Merges the digests of successive protein chunks into an index, keeping one copy of each peptide.
+ */
+class PeptideIndexBuilder {
+
+public:
+    PeptideIndexBuilder(PeptideIndex& index) : index(index) {
+        index.sequencePool.clear();
+        index.sequenceOffsets.assign(1, 0);
+    }
+
+    void addChunk(const vector<ProteinRecord>& proteins) {
+
+        const DigestionParameters& params = index.params;
+
+        size_t numProteins = proteins.size();
+        size_t numSequences = params.isIncludeDecoys ? 2 * numProteins : numProteins;
+
+        vector<string> decoySequences(params.isIncludeDecoys ? numProteins : 0);
+        vector<vector<pair<uint32_t, uint32_t> > > peptidesBySequence(numSequences);
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int) numSequences; i++) {
+            if (i < (int) numProteins) {
+                PeptideIndex::digest(proteins[i].sequence, params, peptidesBySequence[i]);
+            } else {
+                const string& target = proteins[i - numProteins].sequence;
+                decoySequences[i - numProteins] = string(target.rbegin(), target.rend());
+                PeptideIndex::digest(decoySequences[i - numProteins], params, peptidesBySequence[i]);
+            }
+        }
+
+        //merge in input order, so that peptide and protein ids do not depend on the scheduling
+        for (size_t i = 0; i < numProteins; i++) {
+            addProtein(proteins[i].accession, proteins[i].sequence, peptidesBySequence[i]);
+            if (params.isIncludeDecoys) {
+                addProtein(params.decoyPrefix + proteins[i].accession, decoySequences[i], peptidesBySequence[numProteins + i]);
+            }
+        }
+    }
+
+    void finish() {
+
+        peptideIdsBySequence.clear();
+
+        index.proteinOffsets.assign(1, 0);
+        index.proteinIds.clear();
+        for (vector<uint32_t>& ids : proteinIdsByPeptide) {
+            index.proteinIds.insert(index.proteinIds.end(), ids.begin(), ids.end());
+            index.proteinOffsets.push_back((uint32_t) index.proteinIds.size());
+            vector<uint32_t>().swap(ids);
+        }
+        proteinIdsByPeptide.clear();
+
+        index.addEntries();
+    }
+
+private:
+    PeptideIndex& index;
+    unordered_map<string, uint32_t> peptideIdsBySequence;
+    vector<vector<uint32_t> > proteinIdsByPeptide;
+
+    void addProtein(const string& accession, const string& seq, const vector<pair<uint32_t, uint32_t> >& peptides) {
+
+        uint32_t proteinId = (uint32_t) index.proteinAccessions.size();
+        index.proteinAccessions.push_back(accession);
+
+        string peptideSeq;
+        for (const pair<uint32_t, uint32_t>& peptide : peptides) {
+            peptideSeq.assign(seq, peptide.first, peptide.second - peptide.first);
+
+            auto inserted = peptideIdsBySequence.emplace(peptideSeq, (uint32_t) proteinIdsByPeptide.size());
+            if (inserted.second) {
+                index.sequencePool += peptideSeq;
+                index.sequenceOffsets.push_back((uint32_t) index.sequencePool.size());
+                proteinIdsByPeptide.push_back(vector<uint32_t>());
+            }
+
+            //a peptide can occur more than once in a protein
+            vector<uint32_t>& ids = proteinIdsByPeptide[inserted.first->second];
+            if (ids.empty() || ids.back() != proteinId) ids.push_back(proteinId);
+        }
+    }
+};
+
+PeptideIndex PeptideIndex::build(istream& fasta, const DigestionParameters& params) {
+
+    PeptideIndex index;
+    index.params = params;
+
+    PeptideIndexBuilder builder(index);
+    FastaReader reader(fasta);
+
+    vector<ProteinRecord> proteins;
+    while (reader.nextChunk(proteins, max((size_t) 1, params.numProteinsPerChunk)) > 0) {
+        builder.addChunk(proteins);
+    }
+
+    builder.finish();
+    return index;
+}
+
+PeptideIndex PeptideIndex::build(const string& fastaFile, const DigestionParameters& params) {
+
+    ifstream fasta(fastaFile);
+    if (!fasta.is_open()) {
+        cerr << "PeptideIndex::build(): Can't open file " << fastaFile << endl;
+        PeptideIndex index;
+        index.params = params;
+        return index;
+    }
+
+    return build(fasta, params);
+}
+
+PeptideIndex PeptideIndex::build(const vector<ProteinRecord>& proteins, const DigestionParameters& params) {
+
+    PeptideIndex index;
+    index.params = params;
+
+    PeptideIndexBuilder builder(index);
+    builder.addChunk(proteins);
+    builder.finish();
+
+    return index;
+}
+
+// adds the masses of all combinations of up to maxMods of the variable mod sites, from site i on
+static void addModForms(const vector<int>& sites, const vector<double>& deltas, size_t i, int maxMods, double mass, uint64_t mask, vector<pair<double, uint64_t> >& forms) {
+
+    forms.push_back(make_pair(mass, mask));
+    if (maxMods == 0) return;
+
+    for (; i < sites.size(); i++) {
+        addModForms(sites, deltas, i + 1, maxMods - 1, mass + deltas[i], mask | ((uint64_t) 1 << sites[i]), forms);
+    }
+}
+
+void PeptideIndex::addEntries() {
+
+    if (!Peptide::AAMonoisotopicMassTable) Peptide::defaultTables();
+
+    //flat tables of the (fixed modified) residue masses and variable mod deltas
+    vector<double> residueMasses(256, 0.0);
+    vector<double> variableModMasses(256, 0.0);
+    vector<bool> isVariableModSite(256, false);
+
+    for (int aa = 'A'; aa <= 'Z'; aa++) residueMasses[aa] = Peptide::getAAMonoisotopicMass((char) aa);
+    for (auto& mod : params.fixedMods) residueMasses[(unsigned char) mod.first] += mod.second;
+    for (auto& mod : params.variableMods) {
+        variableModMasses[(unsigned char) mod.first] = mod.second;
+        isVariableModSite[(unsigned char) mod.first] = true;
+    }
+
+    double terminiMass = Peptide::getAAMonoisotopicMass('n') + Peptide::getAAMonoisotopicMass('c') + params.nTermFixedModMass;
+
+    size_t numPeptides = this->numPeptides();
+    vector<vector<pair<double, uint64_t> > > formsByPeptide(numPeptides);
+
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < (int) numPeptides; i++) {
+
+        double mass = terminiMass;
+        vector<int> sites;
+        vector<double> deltas;
+
+        for (uint32_t pos = sequenceOffsets[i]; pos < sequenceOffsets[i+1]; pos++) {
+            unsigned char aa = sequencePool[pos];
+            mass += residueMasses[aa];
+            if (isVariableModSite[aa]) {
+                sites.push_back((int) (pos - sequenceOffsets[i]));
+                deltas.push_back(variableModMasses[aa]);
+            }
+        }
+
+        vector<pair<double, uint64_t> > forms;
+        addModForms(sites, deltas, 0, params.maxVariableMods, mass, 0, forms);
+
+        for (pair<double, uint64_t>& form : forms) {
+            if (form.first >= params.minMass && form.first <= params.maxMass) formsByPeptide[i].push_back(form);
+        }
+    }
+
+    entries.clear();
+    modSiteMasks.assign(1, 0);
+
+    for (size_t i = 0; i < numPeptides; i++) {
+        for (pair<double, uint64_t>& form : formsByPeptide[i]) {
+            Entry entry;
+            entry.mass = form.first;
+            entry.peptideId = (uint32_t) i;
+            entry.modFormId = 0;
+            if (form.second != 0) {
+                entry.modFormId = (uint32_t) modSiteMasks.size();
+                modSiteMasks.push_back(form.second);
+            }
+            entries.push_back(entry);
+        }
+        vector<pair<double, uint64_t> >().swap(formsByPeptide[i]);
+    }
+
+    sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        if (a.mass != b.mass) return a.mass < b.mass;
+        if (a.peptideId != b.peptideId) return a.peptideId < b.peptideId;
+        return a.modFormId < b.modFormId;
+    });
+}
+
+string PeptideIndex::getSequence(uint32_t peptideId) const {
+    return sequencePool.substr(sequenceOffsets[peptideId], sequenceOffsets[peptideId+1] - sequenceOffsets[peptideId]);
+}
+
+vector<uint32_t> PeptideIndex::getProteinIds(uint32_t peptideId) const {
+    return vector<uint32_t>(proteinIds.begin() + proteinOffsets[peptideId], proteinIds.begin() + proteinOffsets[peptideId+1]);
+}
+
+string PeptideIndex::getModifiedSequence(const Entry& entry) const {
+
+    if (!Peptide::AAMonoisotopicMassTable) Peptide::defaultTables();
+
+    string seq = getSequence(entry.peptideId);
+    uint64_t mask = getModSiteMask(entry);
+
+    stringstream ss;
+    if (params.nTermFixedModMass != 0) {
+        ss << "n[" << (int) (Peptide::getAAMonoisotopicMass('n') + params.nTermFixedModMass + 0.5) << "]";
+    }
+
+    for (size_t i = 0; i < seq.length(); i++) {
+        double delta = 0;
+        auto fixedMod = params.fixedMods.find(seq[i]);
+        if (fixedMod != params.fixedMods.end()) delta += fixedMod->second;
+        if (mask & ((uint64_t) 1 << i)) delta += params.variableMods.at(seq[i]);
+
+        ss << seq[i];
+        if (delta != 0) ss << "[" << (int) (Peptide::getAAMonoisotopicMass(seq[i]) + delta + 0.5) << "]";
+    }
+
+    return ss.str();
+}
+
+pair<size_t, size_t> PeptideIndex::getEntryRange(double minMass, double maxMass) const {
+
+    auto first = lower_bound(entries.begin(), entries.end(), minMass, [](const Entry& entry, double mass) { return entry.mass < mass; });
+    auto last = upper_bound(first, entries.end(), maxMass, [](double mass, const Entry& entry) { return mass < entry.mass; });
+
+    return make_pair((size_t) (first - entries.begin()), (size_t) (last - entries.begin()));
+}
+
+pair<size_t, size_t> PeptideIndex::getEntryRangeByPpm(double mass, double ppm) const {
+    double tolerance = mass * ppm / 1e6;
+    return getEntryRange(mass - tolerance, mass + tolerance);
+}
@@ -0,0 +1,184 @@
+#ifndef PROTEINDIGEST_H
+#define PROTEINDIGEST_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <istream>
+#include <stdint.h>
+
+using namespace std;
+
+/* Class: Enzyme
+ *
+ * Cleavage rule of a protease: the peptide bond after any of cleaveAfter residues, or before any
+ * of cleaveBefore residues, is cut unless the residue on the other side of the bond is in
+ * restrictAfter / restrictBefore (e.g. trypsin cuts after K and R, but not before P).
+ */
+class Enzyme {
+
+public:
+    string name;
+    string cleaveAfter;
+    string restrictBefore;
+    string cleaveBefore;
+    string restrictAfter;
+
+    Enzyme(string name = "", string cleaveAfter = "", string restrictBefore = "", string cleaveBefore = "", string restrictAfter = "");
+
+    static Enzyme trypsin() { return Enzyme("Trypsin", "KR", "P"); }
+    static Enzyme trypsinP() { return Enzyme("Trypsin/P", "KR"); }
+    static Enzyme lysC() { return Enzyme("Lys-C", "K", "P"); }
+    static Enzyme argC() { return Enzyme("Arg-C", "R", "P"); }
+    static Enzyme gluC() { return Enzyme("Glu-C", "DE", "P"); }
+    static Enzyme aspN() { return Enzyme("Asp-N", "", "", "D"); }
+    static Enzyme chymotrypsin() { return Enzyme("Chymotrypsin", "FWYL", "P"); }
+
+    /**
+     * @brief known enzyme by (case-insensitive) name, trypsin if the name is not recognized
+     */
+    static Enzyme fromName(string name);
+
+    /**
+     * @brief true if the bond between residues pos-1 and pos of seq is cut
+     */
+    inline bool isCleavageSite(const string& seq, size_t pos) const {
+        char before = seq[pos-1];
+        char after = seq[pos];
+        return (cleavesAfter[(unsigned char) before] && !restrictsBefore[(unsigned char) after])
+            || (cleavesBefore[(unsigned char) after] && !restrictsAfter[(unsigned char) before]);
+    }
+
+private:
+    bool cleavesAfter[256];
+    bool restrictsBefore[256];
+    bool cleavesBefore[256];
+    bool restrictsAfter[256];
+};
+
+struct ProteinRecord {
+    string header;
+    string accession;
+    string sequence;
+};
+
+/* Class: FastaReader
+ *
+ * Reads proteins from a FASTA stream one record at a time, so that whole proteomes never
+ * have to be held in memory. Whitespace and '*' stop codons are removed from the sequences.
+ */
+class FastaReader {
+
+public:
+    FastaReader(istream& input) : input(input) {}
+
+    bool next(ProteinRecord& protein);
+
+    /**
+     * @brief read up to maxProteins records into proteins (cleared first), returns the number read
+     */
+    size_t nextChunk(vector<ProteinRecord>& proteins, size_t maxProteins);
+
+private:
+    istream& input;
+    string pendingHeader;
+};
+
+struct DigestionParameters {
+
+    Enzyme enzyme = Enzyme::trypsin();
+
+    int maxMissedCleavages = 2;
+    int minLength = 5;
+    int maxLength = 30;  // capped at 64, see PeptideIndex::Entry
+
+    double minMass = 0;
+    double maxMass = 10000;
+
+    // mass deltas by residue. fixed mods are always applied; any maxVariableMods of the sites
+    // of the variable mods can be modified at a time.
+    map<char, double> fixedMods = {{'C', 57.02146}};
+    map<char, double> variableMods = {};
+    int maxVariableMods = 2;
+    double nTermFixedModMass = 0;
+
+    bool isClipNTermMethionine = false;
+
+    // reversed sequences, with decoyPrefix prepended to their accessions
+    bool isIncludeDecoys = false;
+    string decoyPrefix = "REV_";
+
+    // proteins read and digested (in parallel) at a time
+    size_t numProteinsPerChunk = 1024;
+};
+
+/* Class: PeptideIndex
+ *
+ * Non-redundant in-silico digest of a protein database. Peptide sequences are stored once, in a
+ * single string pool, with compressed lists of the proteins they occur in, and every (peptide,
+ * variable mod form) is an Entry in a table sorted by neutral monoisotopic mass.
+ */
+class PeptideIndex {
+
+public:
+    struct Entry {
+        double mass;         // neutral monoisotopic mass
+        uint32_t peptideId;
+        uint32_t modFormId;  // 0 for no variable mods, else index into modSiteMasks
+    };
+
+    DigestionParameters params;
+    vector<string> proteinAccessions;
+
+    /**
+     * @brief digest all proteins of a FASTA stream (or file). Proteins are read in chunks of
+     * params.numProteinsPerChunk, and each chunk is digested in parallel.
+     */
+    static PeptideIndex build(istream& fasta, const DigestionParameters& params);
+    static PeptideIndex build(const string& fastaFile, const DigestionParameters& params);
+    static PeptideIndex build(const vector<ProteinRecord>& proteins, const DigestionParameters& params);
+
+    /**
+     * @brief cut sites of seq for the enzyme of params, as [start, end) ranges of the peptides
+     * within the length and missed cleavage limits
+     */
+    static void digest(const string& seq, const DigestionParameters& params, vector<pair<uint32_t, uint32_t> >& peptides);
+
+    size_t numPeptides() const { return sequenceOffsets.empty() ? 0 : sequenceOffsets.size() - 1; }
+    size_t numEntries() const { return entries.size(); }
+    const vector<Entry>& getEntries() const { return entries; }
+
+    string getSequence(uint32_t peptideId) const;
+    vector<uint32_t> getProteinIds(uint32_t peptideId) const;
+
+    /**
+     * @brief positions of the variable mods of an entry, as a bitmask over the residues
+     */
+    uint64_t getModSiteMask(const Entry& entry) const { return modSiteMasks[entry.modFormId]; }
+
+    /**
+     * @brief interact-style sequence with nominal mod masses (e.g. n[230]AC[160]DEM[147]K),
+     * that can be passed to the Peptide constructor
+     */
+    string getModifiedSequence(const Entry& entry) const;
+
+    /**
+     * @brief [first, last) range of entries with mass in [minMass, maxMass]
+     */
+    pair<size_t, size_t> getEntryRange(double minMass, double maxMass) const;
+    pair<size_t, size_t> getEntryRangeByPpm(double mass, double ppm) const;
+
+private:
+    friend class PeptideIndexBuilder;
+
+    string sequencePool;
+    vector<uint32_t> sequenceOffsets;
+    vector<uint32_t> proteinOffsets;
+    vector<uint32_t> proteinIds;
+    vector<uint64_t> modSiteMasks;
+    vector<Entry> entries;
+
+    void addEntries();
+};
+
+#endif
@@ -40,5 +40,6 @@ namespace mzUtils
         ~SavGolSmoother() ;
         void Smooth(std::vector<float> *mzs, std::vector<float> *intensities) ;
         std::vector<float> Smooth(std::vector<float>& intensities);
+        const std::vector<float>& GetCoefficients() const { return mvect_coefficients; }
     };
 }
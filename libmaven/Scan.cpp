@@ -1,5 +1,7 @@
 #include "mzSample.h"
 
+#include <thread>
+
 Scan::Scan(mzSample* sample, int scannum, int mslevel, float rt, float precursorMz, int polarity) {
     this->sample = sample;
     this->rt = rt;
@@ -42,6 +44,8 @@ void Scan::deepcopy(Scan* b) {
     this->isolationWindow = b->isolationWindow;
     this->injectionTime = b->injectionTime;
     this->ms1PrecursorForMs3 = b->ms1PrecursorForMs3;
+    this->scanSummary = b->scanSummary;
+    this->scanSummaryState = b->scanSummaryState;
 }
 
 int Scan::findHighestIntensityPos(float _mz, float ppm) {
@@ -181,6 +185,44 @@ float Scan::findClosestMzIntensity(float queryMz, float ppm) {
     return queryIntensity;
 }
 
+//returns -1 for each m/z that is not found
+//queryMzs must be sorted in increasing order
+vector<float> Scan::findClosestMzIntensities(const vector<float>& queryMzs, float ppm) {
+
+    vector<float> queryIntensities(queryMzs.size(), -1.0f);
+
+    float minMz = getMinMz();
+    float maxMz = getMaxMz();
+
+    //lower bound of each query window only moves forward, as queries are sorted.
+    auto lbQuery = mz.begin();
+
+    for (unsigned int j = 0; j < queryMzs.size(); j++) {
+
+        float queryMz = queryMzs[j];
+
+        //m/zs cannot possibly be found in the range
+        if (queryMz < minMz || queryMz > maxMz) continue;
+
+        float minQueryMz = queryMz - queryMz*ppm/1e6f;
+        float maxQueryMz = queryMz + queryMz*ppm/1e6f;
+
+        if (lbQuery != mz.begin() && *(lbQuery-1) >= minQueryMz) {
+            lbQuery = lower_bound(mz.begin(), lbQuery, minQueryMz);
+        } else {
+            lbQuery = lower_bound(lbQuery, mz.end(), minQueryMz);
+        }
+
+        //findClosestMzIntensity() retains the first m/z in the window:
+        //every subsequent m/z is further from the query m/z, or on the other side of it.
+        if (lbQuery != mz.end() && *lbQuery <= maxQueryMz) {
+            queryIntensities[j] = intensity[static_cast<unsigned int>(lbQuery - mz.begin())];
+        }
+    }
+
+    return queryIntensities;
+}
+
 //returns -1 if not found
 //find closest m/z to queryMz if multiple hits
 float Scan::findNormalizedIntensity(float queryMz, float standardMz, float ppm, float minScanIntensity){
@@ -241,24 +283,30 @@ float Scan::findNormalizedIntensity(float queryMz, float standardMz, float ppm,
 }
 
 //removes intensities from scan that lower than X
-void Scan::quantileFilter(int minQuantile) {
-        if (intensity.size() == 0 ) return;
-        if( minQuantile <= 0 || minQuantile >= 100 ) return;
-
+//keeps the points with intensity above minIntensity, in place
+static void keepIntensitiesAbove(vector<float>& mz, vector<float>& intensity, float minIntensity) {
         int vsize=intensity.size();
-        vector<float>dist = quantileDistribution(this->intensity);
-        vector<float>cMz;
-        vector<float>cIntensity;
+        int n=0;
         for(int i=0; i<vsize; i++ ) {
-            if ( intensity[i] > dist[ minQuantile ]) {
-                cMz.push_back(mz[i]);
-                cIntensity.push_back(intensity[i]);
+            if ( intensity[i] > minIntensity) {
+                mz[n] = mz[i];
+                intensity[n] = intensity[i];
+                n++;
             }
         }
-        vector<float>(cMz).swap(cMz);
-        vector<float>(cIntensity).swap(cIntensity);
-        mz.swap(cMz);
-        intensity.swap(cIntensity);
+        mz.resize(n);
+        intensity.resize(n);
+}
+
+void Scan::quantileFilter(int minQuantile) {
+        if (intensity.size() == 0 ) return;
+        if( minQuantile <= 0 || minQuantile >= 100 ) return;
+
+        vector<float> buffer;
+        keepIntensitiesAbove(mz, intensity, ScanFilterPipeline::getQuantile(intensity, minQuantile, buffer));
+        invalidateScanSummary();
+        mz.shrink_to_fit();
+        intensity.shrink_to_fit();
 }
 
 
@@ -266,62 +314,153 @@ void Scan::quantileFilter(int minQuantile) {
 void Scan::intensityFilter(int minIntensity) {
         if (intensity.size() == 0 ) return;
 
-        //first pass.. find local maxima in intensity space
-        int vsize=intensity.size();
-        vector<float>cMz;
-        vector<float>cIntensity;
-        for(int i=0; i<vsize; i++ ) {
-           if ( intensity[i] > minIntensity) { //local maxima
-                cMz.push_back(mz[i]);
-                cIntensity.push_back(intensity[i]);
-            }
-        }
-        vector<float>(cMz).swap(cMz);
-        vector<float>(cIntensity).swap(cIntensity);
-        mz.swap(cMz);
-        intensity.swap(cIntensity);
+        keepIntensitiesAbove(mz, intensity, minIntensity);
+        invalidateScanSummary();
+        mz.shrink_to_fit();
+        intensity.shrink_to_fit();
 }
 
 void Scan::simpleCentroid() { //centroid data
+    ScanCentroider centroider;
+    centroider.centroid(this);
+    mz.shrink_to_fit();
+    intensity.shrink_to_fit();
+}
+
+float ScanFilterPipeline::getQuantile(const vector<float>& values, int quantile, vector<float>& buffer) {
+    int ysize = values.size();
+    int pos = (float) quantile/100 * ysize;
+    if (pos < 0 || pos >= ysize) return 0;
+
+    buffer.assign(values.begin(), values.end());
+    std::nth_element(buffer.begin(), buffer.begin() + pos, buffer.end());
+    return buffer[pos];
+}
+
+void ScanFilterPipeline::apply(Scan* scan) {
+    vector<float>& mz = scan->mz;
+    vector<float>& intensity = scan->intensity;
+    bool isChanged = false;
+
+    if (params.isCentroidScans) {
+        centroider.centroid(scan);
+        isChanged = true;
+    }
+
+    //a point passes quantileFilter() and intensityFilter() if it is above both thresholds
+    if (!intensity.empty() and (params.minIntensityQuantile > 0 or params.minIntensity > 0)) {
+        float minIntensity = -std::numeric_limits<float>::infinity();
+        if (params.minIntensityQuantile > 0 and params.minIntensityQuantile < 100) {
+            minIntensity = getQuantile(intensity, params.minIntensityQuantile, buffer);
+        }
+        if (params.minIntensity > 0) {
+            minIntensity = max(minIntensity, static_cast<float>(params.minIntensity));
+        }
+        keepIntensitiesAbove(mz, intensity, minIntensity);
+        scan->invalidateScanSummary();
+        isChanged = true;
+    }
+
+    if (isChanged) {
+        mz.shrink_to_fit();
+        intensity.shrink_to_fit();
+    }
+}
+
+void ScanCentroider::smooth(const vector<float>& in, vector<float>& out, int window) {
 
-        if (intensity.size() < 5 ) return;
-
-        //pass zero smooth..
-		int smoothWindow = intensity.size() / 20;
-		int order=2;
-
-		if (smoothWindow < 1 )  { smoothWindow = 2; }
-		if (smoothWindow > 10 ) { smoothWindow = 10; }
-
-        mzUtils::SavGolSmoother smoother(smoothWindow,smoothWindow,order);
-		//smooth once
-        vector<float>spline = smoother.Smooth(intensity);
-		//smooth twice
-        spline = smoother.Smooth(spline);
-
-        //find local maxima in intensity space
-        int vsize=spline.size();
-        vector<float>cMz;
-        vector<float>cIntensity;
-        for(int i=1; i<vsize-2; i++ ) {
-            if ( spline[i] > spline[i-1] &&  spline[i] > spline[i+1] ) { //local maxima in spline space
-					//local maxima in real intensity space
-					float maxMz=mz[i]; float maxIntensity=intensity[i];
-					for(int j=i-1; j<i+1; j++) {
-							if (intensity[i] > maxIntensity) { maxIntensity=intensity[i]; maxMz=mz[i]; }
-					}
-                	cMz.push_back(maxMz);
-                	cIntensity.push_back(maxIntensity);
+    static const vector<vector<float> > coefficients = [](){
+        vector<vector<float> > table(maxSmoothWindow+1);
+        for (int w = minSmoothWindow; w <= maxSmoothWindow; w++) {
+            table[w] = mzUtils::SavGolSmoother(w, w, 2).GetCoefficients();
+        }
+        return table;
+    }();
+
+    const vector<float>& c = coefficients[window];
+    int numCoeffs = c.size();
+    int size = in.size();
+    out.resize(size);
+
+    //points without a full window (including the last window-th point, as SavGolSmoother) are kept
+    int first = window;
+    int last = size - window - 2;
+    for (int i = 0; i < size; i++) {
+        if (i < first || i > last) out[i] = in[i];
+    }
+    if (last < first) return;
+
+    //one coefficient at a time over a block of points: same order of terms per point as
+    //SavGolSmoother, vectorized over points
+    const int blockSize = 256;
+    float sums[blockSize];
+    for (int start = first; start <= last; start += blockSize) {
+        int n = min(blockSize, last - start + 1);
+        for (int i = 0; i < n; i++) sums[i] = 0;
+        for (int j = 0; j < numCoeffs; j++) {
+            const float cj = c[j];
+            const float* x = in.data() + start - window + j;
+            for (int i = 0; i < n; i++) sums[i] += x[i] * cj;
+        }
+        for (int i = 0; i < n; i++) out[start + i] = sums[i] < 0 ? 0 : sums[i];
+    }
+}
+
+void ScanCentroider::centroid(Scan* scan) {
+
+    vector<float>& mz = scan->mz;
+    vector<float>& intensity = scan->intensity;
+
+    if (intensity.size() < 5 ) return;
+
+    int smoothWindow = intensity.size() / 20;
+    if (smoothWindow < 1) smoothWindow = 2;
+    if (smoothWindow > maxSmoothWindow) smoothWindow = maxSmoothWindow;
+
+    //smooth twice
+    smooth(intensity, smoothed, smoothWindow);
+    smooth(smoothed, spline, smoothWindow);
+
+    //local maxima in spline space
+    int vsize = spline.size();
+    maxima.clear();
+    for (int i = 1; i < vsize-2; i++) {
+        if (spline[i] > spline[i-1] && spline[i] > spline[i+1]) maxima.push_back(i);
+    }
+
+    //centroid k is written at position k, maxima[k] >= 2k+1: positions read later are not overwritten
+    for (unsigned int k = 0; k < maxima.size(); k++) {
+        //highest raw intensity at the maximum
+        int p = maxima[k];
+        if (intensity[p-1] > intensity[p]) p = p-1;
+        if (intensity[maxima[k]+1] > intensity[p]) p = maxima[k]+1;
+
+        float apexMz = mz[p];
+        if (p > 0 && p+1 < vsize) {
+            double y0 = intensity[p-1], y1 = intensity[p], y2 = intensity[p+1];
+            if (y0 > 0 && y1 > 0 && y2 > 0) {
+                y0 = log(y0); y1 = log(y1); y2 = log(y2);
+            }
+            double curvature = y0 - 2*y1 + y2;
+            if (curvature < 0) {
+                double delta = 0.5 * (y0 - y2) / curvature;
+                if (delta > 0.5) delta = 0.5;
+                if (delta < -0.5) delta = -0.5;
+                apexMz = delta > 0 ? mz[p] + delta * (mz[p+1] - mz[p]) : mz[p] + delta * (mz[p] - mz[p-1]);
             }
         }
 
-        vector<float>(cMz).swap(cMz);
-        vector<float>(cIntensity).swap(cIntensity);
-        mz.swap(cMz);
-        intensity.swap(cIntensity);
+        float apexIntensity = intensity[p];
+        mz[k] = apexMz;
+        intensity[k] = apexIntensity;
+    }
+
+    mz.resize(maxima.size());
+    intensity.resize(maxima.size());
+    scan->invalidateScanSummary();
 
-        centroided = true;
-} 
+    scan->centroided = true;
+}
 
 bool Scan::hasMz(float _mz, float ppm) {
     float mzmin = _mz - _mz/1e6*ppm;
@@ -569,74 +708,125 @@ string Scan::toMGF() {
 
 
 vector<int> Scan::assignCharges(float ppmTolr) {
-    if ( nobs() == 0) {
+    ChargeStateDetector detector;
+    return detector.assignCharges(this, ppmTolr);
+}
+
+void ChargeStateDetector::fillNeighbours(const vector<float>& mz, const vector<float>& intensity, float ppm) {
+
+    int N = mz.size();
+    double NMASS=C13_MASS-12.00;
+
+    neighbours.resize(static_cast<size_t>(numSpacings) * N);
+
+    for(int z=maxCharge; z>=1; z--) {
+        float delta = NMASS/z;
+
+        //forward isotopes 1, 2, .. then back isotopes -1, -2, ..
+        for(int k=0; k < numForwardIsotopes + numBackIsotopes; k++) {
+            int j = k < numForwardIsotopes ? k + 1 : numForwardIsotopes - k - 1;
+            int* spacingNeighbours = &neighbours[static_cast<size_t>(spacingIndex(z, j)) * N];
+
+            //assignCharges() only reaches isotope j of a series if isotope j-1 (j+1 going back) matched
+            const int* previousNeighbours = nullptr;
+            if (j > 1) previousNeighbours = &neighbours[static_cast<size_t>(spacingIndex(z, j-1)) * N];
+            if (j < -1) previousNeighbours = &neighbours[static_cast<size_t>(spacingIndex(z, j+1)) * N];
+
+            //[lo, hi) are the positions within tolerance of the current query
+            int lo=0; int hi=0;
+
+            for(int pos=0; pos < N; pos++) {
+                if (previousNeighbours) {
+                    int previousPos = previousNeighbours[pos];
+                    if (previousPos <= 0 || intensity[previousPos] >= intensity[pos]) {
+                        spacingNeighbours[pos] = -1;
+                        continue;
+                    }
+                }
+
+                //same query and tolerance as Scan::findHighestIntensityPos(mz, ppm)
+                float queryMz = j > 0 ? mz[pos]+(j*delta) : mz[pos]-((-j)*delta);
+                float mzmin = queryMz - queryMz/1e6*ppm;
+                float mzmax = queryMz + queryMz/1e6*ppm;
+
+                while (lo < N && mz[lo] < mzmin) lo++;
+                if (hi < lo) hi = lo;
+                while (hi < N && mz[hi] <= mzmax) hi++;
+
+                int bestPos=-1;  float highestIntensity=0;
+                for(int k=lo; k < hi; k++) {
+                    if (intensity[k] > highestIntensity) {
+                        highestIntensity=intensity[k];
+                        bestPos=k;
+                    }
+                }
+                spacingNeighbours[pos] = bestPos;
+            }
+        }
+    }
+}
+
+vector<int> ChargeStateDetector::assignCharges(Scan* scan, float ppmTolr) {
+    if ( scan->nobs() == 0) {
         vector<int>empty;
         return empty;
     }
 
-    int N = nobs(); //current scan size
-    vector<int>chargeStates (N,0);
-    vector<int>peakClusters = vector<int>(N,0);
+    const vector<float>& mz = scan->mz;
+    const vector<float>& intensity = scan->intensity;
+
+    int N = scan->nobs(); //current scan size
+    chargeStates.assign(N,0);
     vector<int>parentPeaks = vector<int>(N,0);
-    int clusterNumber=0;
+
+    float ppm = ppmTolr*2;
+    fillNeighbours(mz, intensity, ppm);
 
     //order intensities from high to low
-    vector<int>intensityOrder = intensityOrderDesc();
-    double NMASS=C13_MASS-12.00;
+    vector<int>intensityOrder = scan->intensityOrderDesc();
 
     //a little silly, required number of peaks in a series in already to call a charge
                           //z=0,   z=1,    z=2,   z=3,    z=4,   z=5,    z=6,     z=7,   z=8,
     int minSeriesSize[9] = { 1,     2,     3,      3,      3,     4,      4,       4,     5  } ;
 
+    vector<int>series; series.reserve(numForwardIsotopes + numBackIsotopes);
+    vector<int>bestSeries; bestSeries.reserve(numForwardIsotopes + numBackIsotopes);
+
     //for every position in a scan
     for(int i=0; i < N; i++ ) {
         int pos=intensityOrder[i];
-        float centerMz = mz[pos];
         float centerInts = intensity[pos];
-       // float ppm = (0.125/centerMz)*1e6;
-        float ppm = ppmTolr*2;
-       // cerr << pos << " " <<  centerMz << " " << centerInts << " " << clusterNumber << endl;
         if (chargeStates[pos] != 0) continue;  //charge already assigned
 
         //check for charged peak groups
         int bestZ=0; int maxSeriesIntenisty=0;
-        vector<int>bestSeries;
-
+        bestSeries.clear();
 
         //determine most likely charge state
-        for(int z=5; z>=1; z--) {
-            float delta = NMASS/z;
+        for(int z=maxCharge; z>=1; z--) {
             int zSeriesIntensity=centerInts;
-            vector<int>series;
-
+            series.clear();
 
-            for(int j=1; j<6; j++) { //forward
-                float mz=centerMz+(j*delta);
-
-                int matchedPos = findHighestIntensityPos(mz,ppm);
+            for(int j=1; j<=numForwardIsotopes; j++) { //forward
+                int matchedPos = neighbours[static_cast<size_t>(spacingIndex(z, j)) * N + pos];
                 if (matchedPos>0 && intensity[matchedPos]<centerInts) {
                     series.push_back(matchedPos);
                     zSeriesIntensity += intensity[matchedPos];
                 } else break;
             }
 
-            for(int j=1; j<3; j++) {  //back
-                float mz=centerMz-(j*delta);
-                int matchedPos = findHighestIntensityPos(mz,ppm);
+            for(int j=1; j<=numBackIsotopes; j++) {  //back
+                int matchedPos = neighbours[static_cast<size_t>(spacingIndex(z, -j)) * N + pos];
                 if (matchedPos>0 && intensity[matchedPos]<centerInts) {
                     series.push_back(matchedPos);
                     zSeriesIntensity += intensity[matchedPos];
                 } else break;
-            } 
-            //cerr << endl;
+            }
             if (zSeriesIntensity>maxSeriesIntenisty) { bestZ=z; maxSeriesIntenisty=zSeriesIntensity; bestSeries=series; }
         }
 
-        //if ( i < 50) cerr << centerMz << " " << bestZ << " " << bestSeries.size() << " " << minSeriesSize[bestZ] << endl;
-
         //series with highest intensity is taken to be be the right one
         if(bestZ > 0 and bestSeries.size() >= minSeriesSize[bestZ] ) {
-            clusterNumber++;
             int parentPeakPos=pos;
             for(unsigned int j=0; j<bestSeries.size();j++) {
                 int brother_pos =bestSeries[j];
@@ -645,21 +835,39 @@ vector<int> Scan::assignCharges(float ppmTolr) {
                         and intensity[brother_pos] > intensity[parentPeakPos]*0.25)
                         parentPeakPos=brother_pos;
                 chargeStates[brother_pos]=bestZ;
-                peakClusters[brother_pos]=clusterNumber;
              }
 
-           //if ( i < 50 ) cerr << "c12parent: " << mz[parentPeakPos] << endl;
-            peakClusters[parentPeakPos]=clusterNumber;
             parentPeaks[parentPeakPos]=bestZ;
-
-
-            //cerr << "z-series: " <<  mz[pos] << endl;
-            //cerr << "parentPeak=" << mz[parentPeakPos] << " " << bestZ << endl;
         }
     }
     return parentPeaks;
 }
 
+/**
+ * @brief compute the scan summary, and publish it unless another thread is already doing so.
+ * Concurrent callers on the same scan wait for the thread that publishes, other scans are not blocked.
+ */
+void Scan::updateScanSummary() {
+    ScanSummary x;
+    for(unsigned int i=0; i < nobs(); i++ ) {
+        x.totalIntensity += intensity[i];
+        if (intensity[i] > x.basePeakIntensity) {
+            x.basePeakIntensity = intensity[i];
+            x.basePeakMz = mz[i];
+        }
+        if (i == 0 || mz[i] < x.minMz) x.minMz = mz[i];
+        if (i == 0 || mz[i] > x.maxMz) x.maxMz = mz[i];
+    }
+
+    int expected = ScanSummaryState::Invalid;
+    if (scanSummaryState.state.compare_exchange_strong(expected, ScanSummaryState::Computing, memory_order_acq_rel)) {
+        setScanSummary(x);
+        return;
+    }
+
+    while (scanSummaryState.state.load(memory_order_acquire) != ScanSummaryState::Valid) this_thread::yield();
+}
+
 float Scan::baseMz() {
     float maxIntensity = 0;
     float baseMz = 0;
@@ -770,6 +978,7 @@ void Scan::log10Transform() {
             this->intensity[i] = log10(this->intensity[i]);
         }
     }
+    invalidateScanSummary();
 }
 
 
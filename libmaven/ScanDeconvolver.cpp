@@ -0,0 +1,412 @@
+#include "ScanDeconvolver.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+ScanDeconvolver::ScanDeconvolver(Scan* scan, const DeconvolutionParameters& params) : scan(scan), params(params) {
+
+    const vector<float>& mz = scan->mz;
+    int N = mz.size();
+
+    noiseLevel = params.noiseLevel;
+    if (noiseLevel <= 0 && N > 0) {
+        vector<float> intensities = scan->intensity;
+        nth_element(intensities.begin(), intensities.begin() + N/2, intensities.end());
+        noiseLevel = intensities[N/2];
+        if (noiseLevel <= 0) noiseLevel = 1;
+    }
+
+    peakIndex.build(mz);
+
+    for (int k = 0; k < N; k++) {
+        float snRatio = scan->intensity[k]/noiseLevel;
+        if (snRatio > 2) {
+            significantMzs.push_back(mz[k]);
+            significantPositions.push_back(k);
+        }
+    }
+    significantIndex.build(significantMzs);
+
+    //bins overlapping [mz - tolr, mz + tolr] of each significant peak, where tolr bounds the
+    //tolerance window of any query that can match it (with margin for float rounding)
+    int numSignificant = significantMzs.size();
+    if (numSignificant > 0) {
+        double maxTolr = significantMzs.back() * (params.ppmMerge * 1.01 / 1e6 + 1e-6);
+        int numBins = 8 * numSignificant;
+        occupancyMinMz = significantMzs.front() - maxTolr;
+        occupancyBinsPerMz = numBins / (significantMzs.back() + maxTolr - occupancyMinMz);
+        isOccupied.assign(numBins, false);
+
+        for (float significantMz : significantMzs) {
+            double tolr = significantMz * (params.ppmMerge * 1.01 / 1e6 + 1e-6);
+            int first = max(0, static_cast<int>((significantMz - tolr - occupancyMinMz) * occupancyBinsPerMz));
+            int last = min(numBins-1, static_cast<int>((significantMz + tolr - occupancyMinMz) * occupancyBinsPerMz));
+            for (int b = first; b <= last; b++) isOccupied[b] = true;
+        }
+    }
+}
+
+void ScanDeconvolver::BucketIndex::build(const vector<float>& mzs) {
+
+    int N = mzs.size();
+    int numBuckets = max(1, N);
+    minMz = N > 0 ? mzs[0] : 0;
+    double mzRange = N > 0 ? mzs[N-1] - minMz : 0;
+    bucketsPerMz = mzRange > 0 ? numBuckets / mzRange : 0;
+
+    bucketStarts.assign(numBuckets, N);
+    for (int k = N-1; k >= 0; k--) bucketStarts[getBucket(mzs[k])] = k;
+    for (int b = numBuckets-2; b >= 0; b--) bucketStarts[b] = min(bucketStarts[b], bucketStarts[b+1]);
+}
+
+int ScanDeconvolver::findHighestIntensityPos(float _mz, float ppm) const {
+    float mzmin = _mz - _mz/1e6*ppm;
+    float mzmax = _mz + _mz/1e6*ppm;
+
+    const vector<float>& mz = scan->mz;
+    const vector<float>& intensity = scan->intensity;
+    int N = mz.size();
+
+    int bestPos=-1;  float highestIntensity=0;
+    for(int k = peakIndex.lowerBound(mz, mzmin); k < N && mz[k] <= mzmax; k++) {
+        if (intensity[k] > highestIntensity ) {
+            highestIntensity=intensity[k];
+            bestPos=k;
+        }
+    }
+    return bestPos;
+}
+
+/**
+ * @brief findHighestIntensityPos() if that peak has signal to noise ratio > 2, else -1.
+ * Only valid for ppm = params.ppmMerge (see isOccupied).
+ */
+int ScanDeconvolver::findSignificantPos(float _mz, float ppm) const {
+    double bin = (_mz - occupancyMinMz) * occupancyBinsPerMz;
+    if (bin < 0 || bin >= isOccupied.size() || !isOccupied[static_cast<size_t>(bin)]) return -1;
+
+    float mzmin = _mz - _mz/1e6*ppm;
+    float mzmax = _mz + _mz/1e6*ppm;
+
+    const vector<float>& intensity = scan->intensity;
+    int N = significantMzs.size();
+
+    int bestPos=-1;  float highestIntensity=0;
+    for(int k = significantIndex.lowerBound(significantMzs, mzmin); k < N && significantMzs[k] <= mzmax; k++) {
+        int pos = significantPositions[k];
+        if (intensity[pos] > highestIntensity ) {
+            highestIntensity=intensity[pos];
+            bestPos=pos;
+        }
+    }
+    return bestPos;
+}
+
+int ScanDeconvolver::findLadderPos(float expectedMass, int charge) {
+    if (charge < 0 || charge >= static_cast<int>(ladderPositions.size())) {
+        return findSignificantPos((expectedMass+charge)/charge, params.ppmMerge);
+    }
+    if (ladderStamps[charge] != ladderStamp) {
+        ladderPositions[charge] = findSignificantPos((expectedMass+charge)/charge, params.ppmMerge);
+        ladderStamps[charge] = ladderStamp;
+    }
+    return ladderPositions[charge];
+}
+
+ChargedSpecies* ScanDeconvolver::deconvolute(float mzfocus) {
+    return deconvolute(mzfocus, nullptr);
+}
+
+ChargedSpecies* ScanDeconvolver::deconvolute(float mzfocus, vector<int>* observedPositions) {
+
+    //same algorithm as Scan::deconvolute()
+    const vector<float>& mz = scan->mz;
+    const vector<float>& intensity = scan->intensity;
+
+    float ppmMerge = params.ppmMerge;
+    int minDeconvolutionCharge = params.minDeconvolutionCharge;
+    int maxDeconvolutionCharge = params.maxDeconvolutionCharge;
+    int minChargedStates = params.minChargedStates;
+
+    int mzfocus_pos = findHighestIntensityPos(mzfocus,ppmMerge);
+    if (mzfocus_pos < 0 ) return NULL;
+    float parentPeakIntensity=intensity[mzfocus_pos];
+    float parentPeakSN=parentPeakIntensity/noiseLevel;
+    if(parentPeakSN <=params.minSigNoiseRatio) return NULL;
+
+    ChargedSpecies* x = new ChargedSpecies();
+    int bestZ = 0;
+
+    ladderPositions.resize(max(0, maxDeconvolutionCharge) + 1);
+    ladderStamps.resize(ladderPositions.size(), ladderStamp);
+
+    for(int z=minDeconvolutionCharge; z <= maxDeconvolutionCharge; z++ ) {
+        float expectedMass = (mzfocus*z)-z;     //predict what M ought to be
+        int countMatches=0;
+        float totalIntensity=0;
+        int upCount=0;
+        int downCount=0;
+        int minZ=z;
+        int maxZ=z;
+
+        if (expectedMass >= params.maxDeconvolutionMass || expectedMass <= params.minDeconvolutionMass ) continue;
+
+        ladderStamp++;
+
+        bool lastMatched=false;
+        float lastIntensity=parentPeakIntensity;
+        for(int ii=z; ii < z+50 && ii<maxDeconvolutionCharge; ii++ ) {
+            //a peak with signal to noise ratio <= 2 does not match, same as no peak
+            int pos = findLadderPos(expectedMass, ii);
+            float brotherIntensity = pos>=0?intensity[pos]:0;
+            float snRatio = brotherIntensity/noiseLevel;
+            if (brotherIntensity < 1.1*lastIntensity && snRatio > 2 && withinXppm(mz[pos]*ii-ii,expectedMass,ppmMerge)) {
+                maxZ = ii;
+                countMatches++;
+                upCount++;
+                totalIntensity += brotherIntensity;
+                lastMatched=true;
+                lastIntensity=brotherIntensity;
+            } else if (lastMatched == true) {   //last charge matched ..but this one didn't..
+                break;
+            }
+        }
+
+        lastMatched = false;
+        lastIntensity=parentPeakIntensity;
+        for(int ii=z-1; ii > z-50 && ii>minDeconvolutionCharge; ii--) {
+            int pos = findLadderPos(expectedMass, ii);
+            float brotherIntensity = pos>=0?intensity[pos]:0;
+            float snRatio = brotherIntensity/noiseLevel;
+            if (brotherIntensity < 1.1*lastIntensity && snRatio > 2 && withinXppm(mz[pos]*ii-ii,expectedMass,ppmMerge)) {
+                minZ = ii;
+                countMatches++;
+                downCount++;
+                totalIntensity += brotherIntensity;
+                lastMatched=true;
+                lastIntensity=brotherIntensity;
+            } else if (lastMatched == true) {   //last charge matched ..but this one didn't..
+                break;
+            }
+        }
+
+        if (x->totalIntensity < totalIntensity && countMatches>minChargedStates && upCount >= 2 && downCount >= 2 ) {
+            x->totalIntensity = totalIntensity;
+            x->countMatches=countMatches;
+            x->deconvolutedMass = (mzfocus*z)-z;
+            x->minZ = minZ;
+            x->maxZ = maxZ;
+            x->scan = scan;
+            x->observedCharges.clear();
+            x->observedMzs.clear();
+            x->observedIntensities.clear();
+            x->upCount = upCount;
+            x->downCount = downCount;
+            bestZ = z;
+
+            if (observedPositions) observedPositions->clear();
+
+            float qscore=0;
+            for(int ii=minZ; ii <= maxZ; ii++ ) {
+                //charges between ladder matches need not have a signal to noise ratio > 2
+                int pos = findLadderPos(expectedMass, ii);
+                if (pos < 0) pos = findHighestIntensityPos((expectedMass+ii)/ii, ppmMerge);
+                if (pos > 0 ) {
+                    x->observedCharges.push_back(ii);
+                    x->observedMzs.push_back( mz[pos] );
+                    x->observedIntensities.push_back( intensity[pos] );
+                    float snRatio = intensity[pos]/noiseLevel;
+                    qscore += log(pow(0.97,(int)snRatio));
+                    if (observedPositions) observedPositions->push_back(pos);
+                }
+            }
+            x->qscore = -20*qscore;
+        }
+    }
+
+    if ( x->countMatches > minChargedStates ) {
+        float totalError=0;
+        for(unsigned int i=0; i < x->observedCharges.size(); i++ ) {
+            float My = (x->observedMzs[i]*x->observedCharges[i]) - x->observedCharges[i];
+            float deltaM = abs(x->deconvolutedMass - My);
+            totalError += deltaM*deltaM;
+        }
+        x->error = sqrt(totalError/x->countMatches);
+
+        if (params.isFitIsotopes) fitIsotopes(x, mzfocus_pos, bestZ);
+        return x;
+    } else {
+        delete(x);
+        return NULL;
+    }
+}
+
+void ScanDeconvolver::fitIsotopes(ChargedSpecies* x, int parentPos, int charge) {
+
+    const vector<float>& isotopeTemplate = getAveragineTemplate(x->deconvolutedMass);
+    int numIsotopes = isotopeTemplate.size();
+    if (numIsotopes == 0 || charge <= 0) return;
+
+    int apex = max_element(isotopeTemplate.begin(), isotopeTemplate.end()) - isotopeTemplate.begin();
+
+    //observed envelope around the parent peak, at offsets -numIsotopes..numIsotopes
+    float parentMz = scan->mz[parentPos];
+    vector<float> observed(2*numIsotopes+1, 0);
+    observed[numIsotopes] = scan->intensity[parentPos];
+    for (int k = 1; k <= numIsotopes; k++) {
+        int up = findHighestIntensityPos(parentMz + k*ISOTOPE_SPACING/charge, params.ppmMerge);
+        int down = findHighestIntensityPos(parentMz - k*ISOTOPE_SPACING/charge, params.ppmMerge);
+        if (up >= 0) observed[numIsotopes+k] = scan->intensity[up];
+        if (down >= 0) observed[numIsotopes-k] = scan->intensity[down];
+    }
+
+    //parent peak as isotope i of the template, near its most abundant isotope
+    float bestScore = -1; int bestIsotope = apex;
+    for (int i = max(0, apex-2); i <= min(numIsotopes-1, apex+2); i++) {
+        double dot = 0, observedSumSq = 0, templateSumSq = 0;
+        for (int t = 0; t < numIsotopes; t++) {
+            float o = observed[numIsotopes + t - i];
+            dot += o * isotopeTemplate[t];
+            observedSumSq += o * o;
+            templateSumSq += isotopeTemplate[t] * isotopeTemplate[t];
+        }
+        float score = observedSumSq > 0 ? dot / sqrt(observedSumSq * templateSumSq) : 0;
+        if (score > bestScore) { bestScore = score; bestIsotope = i; }
+    }
+
+    x->isotopeScore = bestScore;
+    x->monoisotopicMass = x->deconvolutedMass - bestIsotope*ISOTOPE_SPACING;
+}
+
+const vector<float>& ScanDeconvolver::getAveragineTemplate(float mass) {
+
+    static unordered_map<int, vector<float> > cache;
+    static mutex cacheMutex;
+
+    int bin = max(0, static_cast<int>(mass / averagineMassBinWidth));
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        auto it = cache.find(bin);
+        if (it != cache.end()) return it->second;
+    }
+
+    //averagine: C4.9384 H7.7583 N1.3577 O1.4773 S0.0417 per 111.1254 Da
+    double numResidues = (bin + 0.5) * averagineMassBinWidth / 111.1254;
+    Composition averagine;
+    averagine.add(Composition::getElementIndex("C"), static_cast<int>(round(4.9384 * numResidues)));
+    averagine.add(Composition::getElementIndex("H"), static_cast<int>(round(7.7583 * numResidues)));
+    averagine.add(Composition::getElementIndex("N"), static_cast<int>(round(1.3577 * numResidues)));
+    averagine.add(Composition::getElementIndex("O"), static_cast<int>(round(1.4773 * numResidues)));
+    averagine.add(Composition::getElementIndex("S"), static_cast<int>(round(0.0417 * numResidues)));
+
+    vector<double> distribution = MassCalculator::computeNominalIsotopeDistribution(averagine);
+    double maxAbundance = *max_element(distribution.begin(), distribution.end());
+
+    //isotopes below 1% of the most abundant one are left out of the fit
+    vector<float> isotopeTemplate(distribution.size(), 0);
+    for (unsigned int i = 0; i < distribution.size(); i++) {
+        if (distribution[i] >= 0.01 * maxAbundance) isotopeTemplate[i] = distribution[i] / maxAbundance;
+    }
+    while (!isotopeTemplate.empty() && isotopeTemplate.back() == 0) isotopeTemplate.pop_back();
+
+    lock_guard<mutex> lock(cacheMutex);
+    return cache.insert(make_pair(bin, isotopeTemplate)).first->second;
+}
+
+vector<ChargedSpecies*> ScanDeconvolver::deconvoluteAll() {
+
+    vector<ChargedSpecies*> results;
+    int N = scan->nobs();
+    if (N == 0) return results;
+
+    vector<bool> isExplained(N, false);
+    vector<int> observedPositions;
+
+    //parent peak candidates, in Scan::intensityOrderDesc() order
+    vector<int> parentPositions;
+    for (int pos = 0; pos < N; pos++) {
+        if (scan->intensity[pos] / noiseLevel > params.minSigNoiseRatio) parentPositions.push_back(pos);
+    }
+    const vector<float>& intensity = scan->intensity;
+    sort(parentPositions.begin(), parentPositions.end(), [&intensity](int lhs, int rhs) {
+        return intensity[lhs] > intensity[rhs] || (intensity[lhs] == intensity[rhs] && lhs < rhs);
+    });
+
+    int numParentPeaks = 0;
+    for (int pos : parentPositions) {
+        if (numParentPeaks >= params.maxParentPeaksPerScan) break;
+        if (isExplained[pos]) continue;
+        numParentPeaks++;
+
+        ChargedSpecies* x = deconvolute(scan->mz[pos], &observedPositions);
+        if (!x) continue;
+
+        results.push_back(x);
+
+        //each ladder rung, and the peaks of its isotope envelope, cannot start another ladder
+        int numIsotopes = getAveragineTemplate(x->deconvolutedMass).size();
+        for (unsigned int i = 0; i < observedPositions.size(); i++) {
+            int observedPos = observedPositions[i];
+            int charge = x->observedCharges[i];
+            isExplained[observedPos] = true;
+            for (int k = 1; k <= numIsotopes; k++) {
+                int up = findHighestIntensityPos(scan->mz[observedPos] + k*ISOTOPE_SPACING/charge, params.ppmMerge);
+                int down = findHighestIntensityPos(scan->mz[observedPos] - k*ISOTOPE_SPACING/charge, params.ppmMerge);
+                if (up >= 0) isExplained[up] = true;
+                if (down >= 0) isExplained[down] = true;
+            }
+        }
+    }
+
+    sort(results.begin(), results.end(), ChargedSpecies::compIntensity);
+
+    //a ladder of isotope peaks or of every other charge of a more intense result is not a separate species
+    vector<ChargedSpecies*> species;
+    for (ChargedSpecies* x : results) {
+        bool isDuplicate = false;
+        for (ChargedSpecies* y : species) {
+            if (isSameSpecies(x->deconvolutedMass, y->deconvolutedMass)) {
+                isDuplicate = true;
+                break;
+            }
+        }
+        if (isDuplicate) {
+            delete(x);
+        } else {
+            species.push_back(x);
+        }
+    }
+
+    return species;
+}
+
+bool ScanDeconvolver::isSameSpecies(float mass, float speciesMass) const {
+
+    //harmonics: ladders through every 2nd or 3rd charge state, or a half or third of the charges
+    static const float harmonics[] = {1.0f, 0.5f, 2.0f, 1.0f/3.0f, 3.0f};
+
+    int numIsotopes = getAveragineTemplate(speciesMass).size();
+
+    for (float harmonic : harmonics) {
+        double expectedMass = speciesMass * harmonic;
+        double diff = mass - expectedMass;
+        double tolr = expectedMass * params.ppmMerge / 1e6;
+        int isotope = static_cast<int>(round(diff / ISOTOPE_SPACING));
+        if (abs(isotope) <= numIsotopes && fabs(diff - isotope*ISOTOPE_SPACING) <= tolr) return true;
+    }
+    return false;
+}
+
+vector<vector<ChargedSpecies*> > ScanDeconvolver::deconvoluteScans(const vector<Scan*>& scans, const DeconvolutionParameters& params) {
+
+    vector<vector<ChargedSpecies*> > results(scans.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < scans.size(); i++) {
+        ScanDeconvolver deconvolver(scans[i], params);
+        results[i] = deconvolver.deconvoluteAll();
+    }
+
+    return results;
+}
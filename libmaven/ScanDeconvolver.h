@@ -0,0 +1,138 @@
+#ifndef SCANDECONVOLVER_H
+#define SCANDECONVOLVER_H
+
+#include "mzSample.h"
+
+struct DeconvolutionParameters {
+
+    float noiseLevel = 0;   // <= 0: median intensity of each scan (1 if that is 0)
+    float ppmMerge = 20;
+    float minSigNoiseRatio = 3;
+
+    int minDeconvolutionCharge = 5;
+    int maxDeconvolutionCharge = 50;
+    int minDeconvolutionMass = 5000;
+    int maxDeconvolutionMass = 100000;
+    int minChargedStates = 6;
+
+    // ScanDeconvolver::deconvoluteAll(): most intense peaks tried as parent peaks
+    int maxParentPeaksPerScan = 100;
+
+    // fit averagine isotope envelopes to the parent peaks of the results
+    bool isFitIsotopes = true;
+};
+
+/* Class: ScanDeconvolver
+ *
+ * Charge state deconvolution of a single scan, for intact protein / top-down spectra.
+ *
+ * deconvolute() gives the same ChargedSpecies as Scan::deconvolute(). Peak lookups go through
+ * an index of the sorted m/z array in uniform m/z buckets, so a lookup starts at the first peak of
+ * its tolerance window instead of binary searching and then scanning from 0.1 m/z below it. Charge
+ * ladders only search the peaks with signal to noise ratio > 2 (the only peaks that can extend a
+ * ladder), and the lookups shared between the ladder walk and the quality score are only done once.
+ *
+ * With params.isFitIsotopes, the isotope envelope at the parent peak of each result is matched
+ * against an averagine isotope template (cached per averagineMassBinWidth mass bin), to estimate
+ * the monoisotopic mass.
+ */
+class ScanDeconvolver {
+
+public:
+    ScanDeconvolver(Scan* scan, const DeconvolutionParameters& params);
+
+    /**
+     * @brief deconvolution of the charge ladders through the peak at mzfocus, NULL if there
+     * is none (owned by the caller)
+     */
+    ChargedSpecies* deconvolute(float mzfocus);
+
+    /**
+     * @brief deconvolute the scan with every peak above the signal to noise cutoff as parent peak,
+     * most intense first, skipping peaks that are part of an earlier result (ladder peaks and their
+     * isotope envelopes). Results whose mass is an isotope peak or a charge harmonic of a more intense
+     * result are dropped. Results are sorted by decreasing total intensity.
+     */
+    vector<ChargedSpecies*> deconvoluteAll();
+
+    /**
+     * @brief deconvoluteAll() of each scan, scans are processed in parallel
+     */
+    static vector<vector<ChargedSpecies*> > deconvoluteScans(const vector<Scan*>& scans, const DeconvolutionParameters& params);
+
+    /**
+     * @brief same result as Scan::findHighestIntensityPos(mz, ppm)
+     */
+    int findHighestIntensityPos(float mz, float ppm) const;
+
+    float getNoiseLevel() const { return noiseLevel; }
+
+    /**
+     * @brief relative abundances (max 1) of the isotopes of an averagine molecule of the given
+     * neutral mass, by nominal mass shift from the monoisotopic peak. Thread-safe.
+     */
+    static const vector<float>& getAveragineTemplate(float mass);
+
+    static constexpr float averagineMassBinWidth = 25.0f;
+
+    //averagine mean isotope spacing
+    static constexpr double ISOTOPE_SPACING = 1.00235;
+
+private:
+    Scan* scan;
+    DeconvolutionParameters params;
+    float noiseLevel;
+
+    // index of a sorted m/z array in uniform m/z buckets, about one peak per bucket.
+    // bucketStarts[b] is the first peak with getBucket(mz) >= b.
+    struct BucketIndex {
+        double minMz = 0;
+        double bucketsPerMz = 0;
+        vector<int> bucketStarts;
+
+        void build(const vector<float>& mzs);
+
+        inline int getBucket(float mz) const {
+            double b = (static_cast<double>(mz) - minMz) * bucketsPerMz;
+            if (b <= 0) return 0;
+            if (b >= bucketStarts.size()) return static_cast<int>(bucketStarts.size() - 1);
+            return static_cast<int>(b);
+        }
+
+        //first position with mzs[pos] >= mz
+        inline int lowerBound(const vector<float>& mzs, float mz) const {
+            int N = mzs.size();
+            if (N == 0) return 0;
+            int k = bucketStarts[getBucket(mz)];
+            while (k < N && mzs[k] < mz) k++;
+            return k;
+        }
+    };
+
+    BucketIndex peakIndex;
+
+    // peaks with signal to noise ratio > 2, the only ones that can extend a charge ladder
+    vector<float> significantMzs;
+    vector<int> significantPositions;
+    BucketIndex significantIndex;
+
+    // m/z bins within tolerance of a significant peak: most ladder lookups miss, and are answered here
+    double occupancyMinMz = 0;
+    double occupancyBinsPerMz = 0;
+    vector<bool> isOccupied;
+
+    // ladder lookups of the current charge of deconvolute(), valid where ladderStamps == ladderStamp
+    vector<int> ladderPositions;
+    vector<int> ladderStamps;
+    int ladderStamp = 0;
+
+    int findSignificantPos(float mz, float ppm) const;
+    int findLadderPos(float expectedMass, int charge);
+    ChargedSpecies* deconvolute(float mzfocus, vector<int>* observedPositions);
+    void fitIsotopes(ChargedSpecies* x, int parentPos, int charge);
+
+    // mass is within params.ppmMerge of speciesMass times a charge harmonic, give or take isotope spacings
+    bool isSameSpecies(float mass, float speciesMass) const;
+};
+
+#endif
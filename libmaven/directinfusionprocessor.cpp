@@ -89,6 +89,15 @@ shared_ptr<DirectInfusionSearchSet> DirectInfusionProcessor::getSearchSet(mzSamp
         }
     }
 
+    //resolve lipid class and adduct specific search criteria once, instead of once per sample
+    for (auto it = directInfusionSearchSet->compoundsByMapKey.begin(); it != directInfusionSearchSet->compoundsByMapKey.end(); ++it) {
+        vector<DirectInfusionSearchThresholds> thresholds(it->second.size());
+        for (unsigned int i = 0; i < it->second.size(); i++) {
+            thresholds[i] = getSearchThresholds(it->second[i].first, it->second[i].second, params);
+        }
+        directInfusionSearchSet->thresholdsByMapKey.insert(make_pair(it->first, thresholds));
+    }
+
     if (directInfusionSearchSet->compoundsByMapKey.find(DirectInfusionSearchSet::getNoMs2ScansMapKey()) != directInfusionSearchSet->compoundsByMapKey.end()) {
 
         //Currently, support any possible precursor m/z for compounds missing MS2 scans,
@@ -100,6 +109,43 @@ shared_ptr<DirectInfusionSearchSet> DirectInfusionProcessor::getSearchSet(mzSamp
 
 }
 
+DirectInfusionSearchThresholds DirectInfusionProcessor::getSearchThresholds(Compound *compound,
+                                                                            Adduct *adduct,
+                                                                            const shared_ptr<DirectInfusionSearchParameters> params) {
+
+    DirectInfusionSearchThresholds thresholds;
+
+    thresholds.minNumMatches = params->ms2MinNumMatches;
+    thresholds.minNumDiagnosticMatches = params->ms2MinNumDiagnosticMatches;
+    thresholds.minNumSn1Matches = params->ms2sn1MinNumMatches;
+    thresholds.minNumSn2Matches = params->ms2sn2MinNumMatches;
+
+    //Issue 316: check for lipid class specific, or lipid class and adduct specific search criteria.
+    auto lipidClassIt = compound->metaDataMap.find(LipidSummarizationUtils::getLipidClassSummaryKey());
+    if (lipidClassIt == compound->metaDataMap.end()) return thresholds;
+
+    thresholds.lipidClass = lipidClassIt->second;
+
+    pair<string, string> lipidClassAndAdductKey = make_pair(thresholds.lipidClass, adduct->name);
+    pair<string, string> lipidClassKey = make_pair(thresholds.lipidClass, "*");
+
+    auto resolve = [&lipidClassAndAdductKey, &lipidClassKey](const map<pair<string, string>, int>& overrides, int& value){
+        if (overrides.empty()) return;
+        auto it = overrides.find(lipidClassAndAdductKey);
+        if (it == overrides.end()) it = overrides.find(lipidClassKey);
+        if (it != overrides.end()) value = it->second;
+    };
+
+    resolve(params->ms2MinNumMatchesByLipidClassAndAdduct, thresholds.minNumMatches);
+    resolve(params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct, thresholds.minNumDiagnosticMatches);
+
+    //Issue 359
+    resolve(params->ms2sn1MinNumMatchesByLipidClassAndAdduct, thresholds.minNumSn1Matches);
+    resolve(params->ms2sn2MinNumMatchesByLipidClassAndAdduct, thresholds.minNumSn2Matches);
+
+    return thresholds;
+}
+
 vector<Ms3Compound*> DirectInfusionProcessor::getMs3CompoundSet(const vector<Compound*>& compounds,
                                                                 bool debug){
     vector<Ms3Compound*> ms3Compounds(compounds.size());
@@ -143,55 +189,29 @@ vector<vector<tuple<double, double, Scan*>>> DirectInfusionProcessor::organizeMs
     });
 
     vector<vector<tuple<double, double, Scan*>>> ms3ScanGroups;
-    vector<tuple<double,double,Scan*>> scanGroup;
 
-    pair<double,double> lastPrecMz = make_pair(0.0, 0.0);
+    //Each group is anchored by its first (lowest precursor m/z) scan.
+    //Scans are added to the group until a scan is found that is outside of the anchor tolerances.
+    unsigned int anchor = 0;
     unsigned int numProcessedPairs = 0;
 
-    for (unsigned int i = 0; i < allMs3Scans.size(); i++) {
-
-        scanGroup = vector<tuple<double,double,Scan*>>();
-
-        tuple<double, double, Scan*> ithScanPair = allMs3Scans[i];
+    for (unsigned int i = 1; i <= allMs3Scans.size(); i++) {
 
-        lastPrecMz = make_pair(get<0>(ithScanPair), get<1>(ithScanPair));
+        if (i < allMs3Scans.size()) {
+            bool isMatchingMs1PrecursorTolr = mzUtils::ppmDist(get<0>(allMs3Scans[anchor]), get<0>(allMs3Scans[i])) <= ms3AnalysisMs1PrecursorPpmTolr;
+            bool isMatchingMs2PrecursorTolr = mzUtils::ppmDist(get<1>(allMs3Scans[anchor]), get<1>(allMs3Scans[i])) <= ms3PrecursorPpmTolr;
 
-        scanGroup.push_back(ithScanPair);
-
-        for (unsigned int j = i+1; j < allMs3Scans.size(); j++) {
-
-            tuple<double, double, Scan*> jthScanPair = allMs3Scans[j];
-
-            bool isMatchingMs1PrecursorTolr = mzUtils::ppmDist(get<0>(ithScanPair), get<0>(jthScanPair)) <= ms3AnalysisMs1PrecursorPpmTolr;
-            bool isMatchingMs2PrecursorTolr = mzUtils::ppmDist(get<1>(ithScanPair), get<1>(jthScanPair)) <= ms3PrecursorPpmTolr;
-
-            if (isMatchingMs1PrecursorTolr && isMatchingMs2PrecursorTolr) {
-                scanGroup.push_back(jthScanPair);
-                lastPrecMz = make_pair(get<0>(jthScanPair), get<1>(jthScanPair));
-
-                if (j == allMs3Scans.size()-1) {
-                    i = static_cast<unsigned int>(allMs3Scans.size()); // avoid outer loop
-                    break;
-                }
-            } else {
+            if (isMatchingMs1PrecursorTolr && isMatchingMs2PrecursorTolr) continue;
+        }
 
-                i = j;
-                ms3ScanGroups.push_back(scanGroup);
+        if (anchor >= allMs3Scans.size()) break;
 
-                numProcessedPairs += scanGroup.size();
+        ms3ScanGroups.push_back(vector<tuple<double, double, Scan*>>(allMs3Scans.begin() + anchor, allMs3Scans.begin() + i));
+        numProcessedPairs += (i - anchor);
 
-                if (debug) cout << "i=" << i << ", numProcessedPairs= " << numProcessedPairs << endl;
+        if (debug) cout << "i=" << i << ", numProcessedPairs= " << numProcessedPairs << endl;
 
-                i--; // necessary b/c outer for loop will increment i
-                break;
-            }
-        }
-    }
-
-    if (!scanGroup.empty()){
-        ms3ScanGroups.push_back(scanGroup);
-        numProcessedPairs += scanGroup.size();
-        if (debug) cout << "i=" << allMs3Scans.size() << ", numProcessedPairs="<< numProcessedPairs << endl;
+        anchor = i;
     }
 
     //debugging
@@ -217,42 +237,36 @@ vector<vector<tuple<double, double, Scan*>>> DirectInfusionProcessor::organizeMs
     return ms3ScanGroups;
 }
 
-vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mzSample* sample,
-                                                                                  const vector<Ms3Compound*>& ms3Compounds,
-                                                                                  shared_ptr<DirectInfusionSearchParameters> params,
-                                                                                  bool debug){
-
-    //initialize output
-    vector<Ms3SingleSampleMatch*> output;
-
-    map<int, vector<Scan>> ms3ScansByMzPrecursor{};
-
-    //          <ms1Pre, ms2Pre>
-    vector<tuple<double, double, Scan*>> allMs3Scans;
+Fragment* DirectInfusionProcessor::getMs1Fragment(const vector<Scan*>& validMs1Scans,
+                                                  shared_ptr<DirectInfusionSearchParameters> params){
 
-    vector<Scan*> validMs1Scans;
+    if (params->consensusIsStreamingMs1) {
+        if (validMs1Scans.empty()) return nullptr;
 
-    for (Scan* scan : sample->scans) {
+        ConsensusSpectrumBuilder builder(params->consensusMs1PpmTolr,
+                                         params->consensusIntensityAgglomerationType,
+                                         params->consensusIsIntensityAvgByObserved,
+                                         params->consensusIsNormalizeTo10K,
+                                         params->consensusMinNumMs1Scans,
+                                         params->consensusMinFractionMs1Scans);
 
-        if (scan->mslevel == 3 &&
-                (params->scanFilterMs3MinRt <= -1.0f || scan->rt >= params->scanFilterMs3MinRt) &&
-                (params->scanFilterMs3MaxRt <= -1.0f || scan->rt <= params->scanFilterMs3MaxRt)) {
-
-            tuple<double, double, Scan*> ms3ScanData = tuple<double, double, Scan*>(scan->ms1PrecursorForMs3, scan->precursorMz, scan);
-            allMs3Scans.push_back(ms3ScanData);
+        for (auto & scan : validMs1Scans) {
+            builder.addScan(scan,
+                            params->scanFilterMinFracIntensity,
+                            params->scanFilterMinSNRatio,
+                            params->scanFilterMaxNumberOfFragments,
+                            params->scanFilterBaseLinePercentile,
+                            params->scanFilterIsRetainFragmentsAbovePrecursorMz,
+                            params->scanFilterPrecursorPurityPpm,
+                            params->scanFilterMinIntensity);
+        }
 
-        } else if (scan->mslevel == 1 &&
-                              scan->filterString.find(params->ms1ScanFilter) != string::npos &&
-                              (params->scanFilterMs1MinRt <= -1.0f || scan->rt >= params->scanFilterMs1MinRt) &&
-                              (params->scanFilterMs1MaxRt <= -1.0f || scan->rt <= params->scanFilterMs1MaxRt)) {
+        Fragment *ms1Fragment = new Fragment();
+        ms1Fragment->consensus = builder.getConsensus();
 
-            validMs1Scans.push_back(scan);
-            if (debug) cout << "Added valid MS1 scan: " << scan->scannum << " " << scan->filterString << endl;
-        }
+        return ms1Fragment;
     }
 
-    if (debug) cout << "Computing consensus MS1 scan from " << validMs1Scans.size() << " MS1 scans..." << endl;
-
     Fragment *ms1Fragment = nullptr;
     for (auto & scan: validMs1Scans) {
         if (!ms1Fragment) {
@@ -290,6 +304,47 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
         ms1Fragment->consensus->sortByMz();
     }
 
+    return ms1Fragment;
+}
+
+vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mzSample* sample,
+                                                                                  const vector<Ms3Compound*>& ms3Compounds,
+                                                                                  shared_ptr<DirectInfusionSearchParameters> params,
+                                                                                  bool debug){
+
+    //initialize output
+    vector<Ms3SingleSampleMatch*> output;
+
+    map<int, vector<Scan>> ms3ScansByMzPrecursor{};
+
+    //          <ms1Pre, ms2Pre>
+    vector<tuple<double, double, Scan*>> allMs3Scans;
+
+    vector<Scan*> validMs1Scans;
+
+    for (Scan* scan : sample->scans) {
+
+        if (scan->mslevel == 3 &&
+                (params->scanFilterMs3MinRt <= -1.0f || scan->rt >= params->scanFilterMs3MinRt) &&
+                (params->scanFilterMs3MaxRt <= -1.0f || scan->rt <= params->scanFilterMs3MaxRt)) {
+
+            tuple<double, double, Scan*> ms3ScanData = tuple<double, double, Scan*>(scan->ms1PrecursorForMs3, scan->precursorMz, scan);
+            allMs3Scans.push_back(ms3ScanData);
+
+        } else if (scan->mslevel == 1 &&
+                              scan->filterString.find(params->ms1ScanFilter) != string::npos &&
+                              (params->scanFilterMs1MinRt <= -1.0f || scan->rt >= params->scanFilterMs1MinRt) &&
+                              (params->scanFilterMs1MaxRt <= -1.0f || scan->rt <= params->scanFilterMs1MaxRt)) {
+
+            validMs1Scans.push_back(scan);
+            if (debug) cout << "Added valid MS1 scan: " << scan->scannum << " " << scan->filterString << endl;
+        }
+    }
+
+    if (debug) cout << "Computing consensus MS1 scan from " << validMs1Scans.size() << " MS1 scans..." << endl;
+
+    Fragment *ms1Fragment = getMs1Fragment(validMs1Scans, params);
+
     if (debug) cout << "Finished computing consensus MS1 scan." << endl;
     if (debug){
         cout << "ms1Fragment->buildConsensus() parameters:" << endl;
@@ -311,7 +366,7 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
 
     //                  ms1Pre, ms2Pre
     vector<vector<tuple<double, double, Scan*>>> ms3ScanGroups = DirectInfusionProcessor::organizeMs3ScansByPrecursor(
-                allMs3Scans,
+                move(allMs3Scans),
                 static_cast<double>(params->ms3AnalysisMs1PrecursorPpmTolr),            //refers to ms1 target m/z
                 static_cast<double>(params->ms3PrecursorPpmTolr),   //refers to ms2 target m/z
                 debug);
@@ -342,9 +397,33 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
 
     }
 
-    unsigned int compoundCounter = 0;
+    //two-level precursor index: distinct ms1 precursor m/zs, then ms2 precursor m/zs for each ms1 precursor m/z.
+    //Both levels are sorted, and traversal order matches ms3ScanGroupMap order.
+    vector<double> ms3GroupMs1PrecMzs{};
+    vector<vector<pair<double, const vector<Scan*>*>>> ms3GroupsByMs1PrecMz{};
 
-    for (auto ms3Compound : ms3Compounds) {
+    for (auto it = ms3ScanGroupMap.begin(); it != ms3ScanGroupMap.end(); ++it) {
+        if (ms3GroupMs1PrecMzs.empty() || ms3GroupMs1PrecMzs.back() != it->first.first) {
+            ms3GroupMs1PrecMzs.push_back(it->first.first);
+            ms3GroupsByMs1PrecMz.push_back(vector<pair<double, const vector<Scan*>*>>());
+        }
+        ms3GroupsByMs1PrecMz.back().push_back(make_pair(it->first.second, &(it->second)));
+    }
+
+    //ppmDist(target, query) <= tolr <==> target is within [query/(1+tolr), query/(1-tolr)].
+    //windows are widened slightly, and exact tolerance checks are applied to all candidates in the window.
+    auto getTargetMzRange = [](double queryMz, double ppmTolr){
+        double fraction = ppmTolr/1000000.0;
+        return make_pair(queryMz/(1.0 + fraction) * (1.0 - 1e-9), queryMz/max(1.0 - fraction, 1e-9) * (1.0 + 1e-9));
+    };
+
+    vector<Ms3SingleSampleMatch*> matchesByCompound(ms3Compounds.size(), nullptr);
+    unsigned int numMatches = 0;
+
+    #pragma omp parallel for schedule(dynamic) if(!debug)
+    for (unsigned int compoundCounter = 0; compoundCounter < ms3Compounds.size(); compoundCounter++) {
+
+        Ms3Compound *ms3Compound = ms3Compounds[compoundCounter];
 
         map<int, vector<float>> scanIntensitiesByMs3Mz{};
         map<pair<int, int>, vector<float>> scanIntensitiesByMs1Ms2Ms3Mzs{};
@@ -353,15 +432,47 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
 
         double ms1PrecMz = ms3Compound->baseCompound->precursorMz;
 
-        double ms1MinMz = ms1PrecMz - ms1PrecMz * params->ms3AnalysisMs1PrecursorPpmTolr/1000000.0;
-        double ms1MaxMz = ms1PrecMz + ms1PrecMz * params->ms3AnalysisMs1PrecursorPpmTolr/1000000.0;
+        pair<double, double> ms1TargetMzRange = getTargetMzRange(ms1PrecMz, params->ms3AnalysisMs1PrecursorPpmTolr);
+
+        vector<unsigned int> matchingMs1Coords{};
+        for (auto ms1It = lower_bound(ms3GroupMs1PrecMzs.begin(), ms3GroupMs1PrecMzs.end(), ms1TargetMzRange.first);
+             ms1It != ms3GroupMs1PrecMzs.end() && *ms1It <= ms1TargetMzRange.second;
+             ++ms1It) {
+            if (mzUtils::ppmDist(*ms1It, ms1PrecMz) <= params->ms3AnalysisMs1PrecursorPpmTolr) {
+                matchingMs1Coords.push_back(static_cast<unsigned int>(ms1It - ms3GroupMs1PrecMzs.begin()));
+            }
+        }
 
         for (auto it = ms3Compound->ms3_fragment_mzs.begin(); it != ms3Compound->ms3_fragment_mzs.end(); ++it){
 
+            if (matchingMs1Coords.empty()) break;
+
             int ms2MzKey = it->first;
 
             double ms2PrecMz = mzUtils::intKeyToMz(ms2MzKey);
 
+            pair<double, double> ms2TargetMzRange = getTargetMzRange(ms2PrecMz, params->ms3PrecursorPpmTolr);
+
+            //scan groups matching both ms1 and ms2 precursor m/z, in ms3ScanGroupMap order
+            vector<const vector<Scan*>*> matchingScanGroups{};
+            for (auto ms1Coord : matchingMs1Coords) {
+
+                const vector<pair<double, const vector<Scan*>*>>& ms2Groups = ms3GroupsByMs1PrecMz[ms1Coord];
+
+                auto ms2It = lower_bound(ms2Groups.begin(), ms2Groups.end(), ms2TargetMzRange.first,
+                                         [](const pair<double, const vector<Scan*>*>& lhs, const double& rhs){
+                    return lhs.first < rhs;
+                });
+
+                for (; ms2It != ms2Groups.end() && ms2It->first <= ms2TargetMzRange.second; ++ms2It) {
+                    if (mzUtils::ppmDist(ms2It->first, ms2PrecMz) <= params->ms3PrecursorPpmTolr) {
+                        matchingScanGroups.push_back(ms2It->second);
+                    }
+                }
+            }
+
+            if (matchingScanGroups.empty()) continue;
+
             for (unsigned int i = 0; i < it->second.size(); i++) {
 
                 float ms3_mz = it->second[i];
@@ -371,78 +482,68 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
 
                 long ms3MzKey = mzUtils::mzToIntKey(ms3_mz);
 
-                for (auto it2 = ms3ScanGroupMap.begin(); it2 != ms3ScanGroupMap.end(); ++it2) {
-
-                    double targetMs1PrecMz = it2->first.first;
-                    double targetMs2PrecMz = it2->first.second;
-
-                    bool isMatchingMs1PrecursorTolr = mzUtils::ppmDist(targetMs1PrecMz, ms1PrecMz) <= params->ms3AnalysisMs1PrecursorPpmTolr;
-                    bool isMatchingMs2PrecursorTolr = mzUtils::ppmDist(targetMs2PrecMz, ms2PrecMz) <= params->ms3PrecursorPpmTolr;
+                for (auto matchingScanGroup : matchingScanGroups) {
 
-                    if (isMatchingMs1PrecursorTolr && isMatchingMs2PrecursorTolr) {
+                    const vector<Scan*>& scans = *matchingScanGroup;
 
-                        vector<Scan*> scans = it2->second;
+                    vector<float> ms3Intensities{};
 
-                        vector<float> ms3Intensities{};
+                    for (auto scan : scans) {
 
-                        for (auto scan : scans) {
+                      auto lb_ms3 = lower_bound(scan->mz.begin(), scan->mz.end(), ms3_mz_min);
 
-                          auto lb_ms3 = lower_bound(scan->mz.begin(), scan->mz.end(), ms3_mz_min);
+                      float ms3_intensity = 0.0f;
+                      float deltaMz = 99999;
+                      bool isFoundMatch = false;
 
-                          float ms3_intensity = 0.0f;
-                          float deltaMz = 99999;
-                          bool isFoundMatch = false;
+                      for (unsigned int ms3_pos = lb_ms3 - scan->mz.begin(); ms3_pos < scan->mz.size(); ms3_pos++) {
 
-                          for (unsigned int ms3_pos = lb_ms3 - scan->mz.begin(); ms3_pos < scan->mz.size(); ms3_pos++) {
-
-                            if (scan->mz[ms3_pos] > ms3_mz_max) {
-                              break;
-                            }
+                        if (scan->mz[ms3_pos] > ms3_mz_max) {
+                          break;
+                        }
 
-                            if (params->ms3IntensityType == Ms3IntensityType::ALL_MATCHES) {
-                              ms3_intensity += scan->intensity[ms3_pos];
-                              isFoundMatch = true;
-                            } else if (params->ms3IntensityType == Ms3IntensityType::MAX_INTENSITY) {
-                              if (scan->intensity[ms3_pos] > ms3_intensity) {
-                                ms3_intensity = scan->intensity[ms3_pos];
-                                isFoundMatch = true;
-                              }
-                            } else if (params->ms3IntensityType == Ms3IntensityType::CLOSEST_MZ) {
-                              if (abs(scan->mz[ms3_pos] - ms3_mz) < deltaMz) {
-                                deltaMz = abs(scan->mz[ms3_pos] - ms3_mz);
-                                ms3_intensity = scan->mz[ms3_pos];
-                                isFoundMatch = true;
-                              }
-                            }
+                        if (params->ms3IntensityType == Ms3IntensityType::ALL_MATCHES) {
+                          ms3_intensity += scan->intensity[ms3_pos];
+                          isFoundMatch = true;
+                        } else if (params->ms3IntensityType == Ms3IntensityType::MAX_INTENSITY) {
+                          if (scan->intensity[ms3_pos] > ms3_intensity) {
+                            ms3_intensity = scan->intensity[ms3_pos];
+                            isFoundMatch = true;
+                          }
+                        } else if (params->ms3IntensityType == Ms3IntensityType::CLOSEST_MZ) {
+                          if (abs(scan->mz[ms3_pos] - ms3_mz) < deltaMz) {
+                            deltaMz = abs(scan->mz[ms3_pos] - ms3_mz);
+                            ms3_intensity = scan->mz[ms3_pos];
+                            isFoundMatch = true;
+                          }
+                        }
 
-                          } // END scans->mz
+                      } // END scans->mz
 
-                          if (ms3_intensity >= params->ms3MinIntensity && isFoundMatch) {
-                              ms3Intensities.push_back(ms3_intensity);
-                          }
+                      if (ms3_intensity >= params->ms3MinIntensity && isFoundMatch) {
+                          ms3Intensities.push_back(ms3_intensity);
+                      }
 
-                        } // END scans
+                    } // END scans
 
-                        float ms3IntensityFraction = static_cast<float>(ms3Intensities.size())/static_cast<float>(scans.size());
+                    float ms3IntensityFraction = static_cast<float>(ms3Intensities.size())/static_cast<float>(scans.size());
 
-                        if (ms3IntensityFraction >= params->ms3MinFractionScans && static_cast<int>(ms3Intensities.size()) >= params->ms3MinNumScans) {
-                            for (auto ms3_intensity : ms3Intensities) {
-                                if (scanIntensitiesByMs3Mz.find(ms3MzKey) == scanIntensitiesByMs3Mz.end()) {
-                                    scanIntensitiesByMs3Mz.insert(make_pair(ms3MzKey, vector<float>()));
-                                }
-                                scanIntensitiesByMs3Mz[ms3MzKey].push_back(ms3_intensity);
+                    if (ms3IntensityFraction >= params->ms3MinFractionScans && static_cast<int>(ms3Intensities.size()) >= params->ms3MinNumScans) {
+                        for (auto ms3_intensity : ms3Intensities) {
+                            if (scanIntensitiesByMs3Mz.find(ms3MzKey) == scanIntensitiesByMs3Mz.end()) {
+                                scanIntensitiesByMs3Mz.insert(make_pair(ms3MzKey, vector<float>()));
+                            }
+                            scanIntensitiesByMs3Mz[ms3MzKey].push_back(ms3_intensity);
 
-                                pair<int, int> mzKey(ms2MzKey, i);
-                                if (scanIntensitiesByMs1Ms2Ms3Mzs.find(mzKey) == scanIntensitiesByMs1Ms2Ms3Mzs.end()) {
-                                    scanIntensitiesByMs1Ms2Ms3Mzs.insert(make_pair(mzKey, vector<float>()));
-                                }
-                                scanIntensitiesByMs1Ms2Ms3Mzs[mzKey].push_back(ms3_intensity);
+                            pair<int, int> mzKey(ms2MzKey, i);
+                            if (scanIntensitiesByMs1Ms2Ms3Mzs.find(mzKey) == scanIntensitiesByMs1Ms2Ms3Mzs.end()) {
+                                scanIntensitiesByMs1Ms2Ms3Mzs.insert(make_pair(mzKey, vector<float>()));
                             }
+                            scanIntensitiesByMs1Ms2Ms3Mzs[mzKey].push_back(ms3_intensity);
                         }
+                    }
 
-                    } //END matching precursor m/z
-
-                } // END ms3ScanGroupMap
+                } // END matchingScanGroups
 
             } // END ms3Compound->ms3_fragment_mzs vector<float>
 
@@ -555,7 +656,11 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
             ms3SingleSampleMatch->ms3MatchesByMs2Mz = ms3MatchesByMs2Mz;
             ms3SingleSampleMatch->sumMs3IntensityByMs2Mz = sumMs3IntensityByMs2Mz;
 
-            output.push_back(ms3SingleSampleMatch);
+            matchesByCompound[compoundCounter] = ms3SingleSampleMatch;
+
+            #pragma omp atomic
+            numMatches++;
+
             if (debug) cout << ms3Compound->baseCompound->name << " " << ms3Compound->baseCompound->adductString << ": " << intensityByMs1Ms2Ms3Mzs.size() << " matches; observedMs1Intensity=" << ms3SingleSampleMatch->observedMs1Intensity << endl;
             if (debug) cout << matchInfoDebugString;
         }
@@ -563,11 +668,13 @@ vector<Ms3SingleSampleMatch*> DirectInfusionProcessor::processSingleMs3Sample(mz
         //Issue 244
         if (debug) cout << "Finished comparing compound #" << (compoundCounter+1)
                         << " (" << ms3Compound->baseCompound->name << " " << ms3Compound->baseCompound->adductString
-                        << "). number of Ms3SingleSampleMatch matches so far: " << output.size() << endl;
+                        << "). number of Ms3SingleSampleMatch matches so far: " << numMatches << endl;
 
-        compoundCounter++;
+    } // END for (unsigned int compoundCounter = 0; compoundCounter < ms3Compounds.size(); compoundCounter++)
 
-    } // END for (auto ms3Compound : ms3Compounds)
+    for (auto match : matchesByCompound) {
+        if (match) output.push_back(match);
+    }
 
     if (debug){
         long numOutputRows = 0;
@@ -627,42 +734,7 @@ map<int, DirectInfusionAnnotation*> DirectInfusionProcessor::processSingleSample
     //For MS1 quant
     if (debug) cerr << "Computing consensus MS1 scan..." << endl;
 
-    Fragment *ms1Fragment = nullptr;
-    for (auto & scan: validMs1Scans) {
-        if (!ms1Fragment) {
-            ms1Fragment = new Fragment(scan,
-                                       params->scanFilterMinFracIntensity,
-                                       params->scanFilterMinSNRatio,
-                                       params->scanFilterMaxNumberOfFragments,
-                                       params->scanFilterBaseLinePercentile,
-                                       params->scanFilterIsRetainFragmentsAbovePrecursorMz,
-                                       params->scanFilterPrecursorPurityPpm,
-                                       params->scanFilterMinIntensity);
-        } else {
-            Fragment *ms1Brother = new Fragment(scan,
-                                             params->scanFilterMinFracIntensity,
-                                             params->scanFilterMinSNRatio,
-                                             params->scanFilterMaxNumberOfFragments,
-                                             params->scanFilterBaseLinePercentile,
-                                             params->scanFilterIsRetainFragmentsAbovePrecursorMz,
-                                             params->scanFilterPrecursorPurityPpm,
-                                             params->scanFilterMinIntensity);
-
-            ms1Fragment->addFragment(ms1Brother);
-        }
-    }
-
-    if (ms1Fragment){
-        ms1Fragment->buildConsensus(params->consensusMs1PpmTolr,
-                                    params->consensusIntensityAgglomerationType,
-                                    params->consensusIsIntensityAvgByObserved,
-                                    params->consensusIsNormalizeTo10K,
-                                    params->consensusMinNumMs1Scans,
-                                    params->consensusMinFractionMs1Scans
-                                    );
-
-        ms1Fragment->consensus->sortByMz();
-    }
+    Fragment *ms1Fragment = getMs1Fragment(validMs1Scans, params);
 
     if (debug) cerr << "Finished computing consensus MS1 scan." << endl;
 
@@ -675,6 +747,7 @@ map<int, DirectInfusionAnnotation*> DirectInfusionProcessor::processSingleSample
                                                                           ms2ScansByBlockNumber[mapKey],
                                                                           ms1Fragment,
                                                                           directInfusionSearchSet->compoundsByMapKey[mapKey],
+                                                                          directInfusionSearchSet->thresholdsByMapKey[mapKey],
                                                                           params,
                                                                           debug);
 
@@ -696,7 +769,8 @@ DirectInfusionAnnotation* DirectInfusionProcessor::processBlock(int blockNum,
                                        const vector<Scan*>& ms1Scans,
                                        const vector<Scan*>& ms2Scans,
                                        const Fragment *ms1Fragment,
-                                       const vector<pair<Compound*, Adduct*>> library,
+                                       const vector<pair<Compound*, Adduct*>>& library,
+                                       const vector<DirectInfusionSearchThresholds>& libraryThresholds,
                                        const shared_ptr<DirectInfusionSearchParameters> params,
                                        const bool debug){
 
@@ -747,18 +821,19 @@ DirectInfusionAnnotation* DirectInfusionProcessor::processBlock(int blockNum,
 
     vector<shared_ptr<DirectInfusionMatchData>> libraryMatches;
 
+    bool isPrecomputedThresholds = libraryThresholds.size() == library.size();
+
     //Compare data to library
-    for (auto libraryEntry : library){
+    for (unsigned int i = 0; i < library.size(); i++){
+
+        const pair<Compound*, Adduct*>& libraryEntry = library[i];
 
         Compound *compound = libraryEntry.first;
         Adduct *adduct = libraryEntry.second;
 
-        int minNumMatches = params->ms2MinNumMatches;
-        int minNumDiagnosticMatches = params->ms2MinNumDiagnosticMatches;
-        int minNumSn1Matches = params->ms2sn1MinNumMatches;
-        int minNumSn2Matches = params->ms2sn2MinNumMatches;
-
-        string lipidClass;
+        //Issue 316: lipid class specific, or lipid class and adduct specific search criteria.
+        DirectInfusionSearchThresholds thresholds = isPrecomputedThresholds ?
+                    libraryThresholds[i] : getSearchThresholds(compound, adduct, params);
 
         //Issue 316: ensure that compounds have all metadata by this point
         if (debug) {
@@ -766,49 +841,10 @@ DirectInfusionAnnotation* DirectInfusionProcessor::processBlock(int blockNum,
             for (auto it = compound->metaDataMap.begin(); it != compound->metaDataMap.end(); ++it){
                 cout << it->first << ": " << it->second << endl;
             }
-        }
-
-        //Issue 316: check for lipid class specific, or lipid class and adduct specific search criteria.
-        if (compound->metaDataMap.find(LipidSummarizationUtils::getLipidClassSummaryKey()) != compound->metaDataMap.end()) {
-            lipidClass = compound->metaDataMap[LipidSummarizationUtils::getLipidClassSummaryKey()];
-
-            string adductName = adduct->name;
-
-            pair<string, string> lipidClassAndAdductKey = make_pair(lipidClass, adductName);
-            pair<string, string> lipidClassKey = make_pair(lipidClass, "*");
-
-            if (params->ms2MinNumMatchesByLipidClassAndAdduct.find(lipidClassAndAdductKey) != params->ms2MinNumMatchesByLipidClassAndAdduct.end()) {
-                minNumMatches = params->ms2MinNumMatchesByLipidClassAndAdduct[lipidClassAndAdductKey];
-            } else if (params->ms2MinNumMatchesByLipidClassAndAdduct.find(lipidClassKey) != params->ms2MinNumMatchesByLipidClassAndAdduct.end()) {
-                minNumMatches = params->ms2MinNumMatchesByLipidClassAndAdduct[lipidClassKey];
-            }
-
-            if (debug) cout << "ms2MinNumMatches for lipidClass=" << lipidClass << ", adduct=" << adductName << ": " << minNumMatches << endl;
-
-            if (params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct.find(lipidClassAndAdductKey) != params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct.end()) {
-                minNumDiagnosticMatches = params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct[lipidClassAndAdductKey];
-            } else if (params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct.find(lipidClassKey) != params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct.end()) {
-                minNumDiagnosticMatches = params->ms2MinNumDiagnosticMatchesByLipidClassAndAdduct[lipidClassKey];
-            }
-
-            if (debug) cout << "ms2MinNumDiagnosticMatches for lipidClass=" << lipidClass << ", adduct=" << adductName << ": " << minNumDiagnosticMatches << endl;
-
-            //Issue 359
-            if (params->ms2sn1MinNumMatchesByLipidClassAndAdduct.find(lipidClassAndAdductKey) != params->ms2sn1MinNumMatchesByLipidClassAndAdduct.end()) {
-                minNumSn1Matches = params->ms2sn1MinNumMatchesByLipidClassAndAdduct[lipidClassAndAdductKey];
-            } else if (params->ms2sn1MinNumMatchesByLipidClassAndAdduct.find(lipidClassKey) != params->ms2sn1MinNumMatchesByLipidClassAndAdduct.end()) {
-                minNumSn1Matches = params->ms2sn1MinNumMatchesByLipidClassAndAdduct[lipidClassKey];
-            }
-
-            if (debug) cout << "ms2MinNumSn1Matches for lipidClass=" << lipidClass << ", adduct=" << adductName << ": " << minNumSn1Matches << endl;
-
-            if (params->ms2sn2MinNumMatchesByLipidClassAndAdduct.find(lipidClassAndAdductKey) != params->ms2sn2MinNumMatchesByLipidClassAndAdduct.end()) {
-                minNumSn2Matches = params->ms2sn2MinNumMatchesByLipidClassAndAdduct[lipidClassAndAdductKey];
-            } else if (params->ms2sn2MinNumMatchesByLipidClassAndAdduct.find(lipidClassKey) != params->ms2sn2MinNumMatchesByLipidClassAndAdduct.end()) {
-                minNumSn2Matches = params->ms2sn2MinNumMatchesByLipidClassAndAdduct[lipidClassKey];
-            }
-
-            if (debug) cout << "ms2MinNumSn2Matches for lipidClass=" << lipidClass << ", adduct=" << adductName << ": " << minNumSn2Matches << endl;
+            cout << "ms2MinNumMatches for lipidClass=" << thresholds.lipidClass << ", adduct=" << adduct->name << ": " << thresholds.minNumMatches << endl;
+            cout << "ms2MinNumDiagnosticMatches for lipidClass=" << thresholds.lipidClass << ", adduct=" << adduct->name << ": " << thresholds.minNumDiagnosticMatches << endl;
+            cout << "ms2MinNumSn1Matches for lipidClass=" << thresholds.lipidClass << ", adduct=" << adduct->name << ": " << thresholds.minNumSn1Matches << endl;
+            cout << "ms2MinNumSn2Matches for lipidClass=" << thresholds.lipidClass << ", adduct=" << adduct->name << ": " << thresholds.minNumSn2Matches << endl;
         }
 
         unique_ptr<DirectInfusionMatchAssessment> matchAssessment = assessMatch(ms1Scans, ms1Fragment, ms2Fragment, libraryEntry, params, debug);
@@ -821,10 +857,10 @@ DirectInfusionAnnotation* DirectInfusionProcessor::processBlock(int blockNum,
 
         //individual compound matches
         if (!matchAssessment->isDisqualifyThisMatch &&
-                s.numMatches >= minNumMatches &&
-                s.numDiagnosticMatches >= minNumDiagnosticMatches &&
-                s.numSn1Matches >= minNumSn1Matches &&
-                s.numSn2Matches >= minNumSn2Matches &&
+                s.numMatches >= thresholds.minNumMatches &&
+                s.numDiagnosticMatches >= thresholds.minNumDiagnosticMatches &&
+                s.numSn1Matches >= thresholds.minNumSn1Matches &&
+                s.numSn2Matches >= thresholds.minNumSn2Matches &&
                 params->isDiagnosticFragmentMapAgreement(matchAssessment->diagnosticFragmentMatchMap)) {
 
             shared_ptr<DirectInfusionMatchData> directInfusionMatchData = shared_ptr<DirectInfusionMatchData>(new DirectInfusionMatchData());
@@ -2218,11 +2254,65 @@ void DirectInfusionMatchInformation::computeMs1PartitionFractions(const vector<S
     //Issue 318
     map<int, float> fragMzToSumObservedMs1ScanIntensity= getFragToSumObservedMs1ScanIntensity(debug);
 
+    auto getSumObservedMs1ScanIntensity = [&fragMzToSumObservedMs1ScanIntensity](float fragMzVal){
+        int fragKey = static_cast<int>(mzUtils::mzToIntKey(static_cast<double>(fragMzVal)));
+        auto it = fragMzToSumObservedMs1ScanIntensity.find(fragKey);
+        return it != fragMzToSumObservedMs1ScanIntensity.end() ? it->second : 0.0f;
+    };
+
     map<int, vector<shared_ptr<DirectInfusionMatchData>>> partitionMap = getPrecMzPartitionMap(debug);
 
-    map<int, set<int>> partitionMapMzs{};
+    //Issue 313: use marked sn1/sn2 fragment label tags instead of explicit list of fragment labels
+    //Determine sn1/sn2 fragments once per compound, and collect all of their m/zs for a single sweep per scan.
+    map<shared_ptr<DirectInfusionMatchData>, vector<bool>> isPartitionFragmentByCompound{};
+    vector<float> allPartitionFragmentMzs{};
 
     for (auto it = partitionMap.begin(); it != partitionMap.end(); ++it){
+        for (auto matchData : it->second) {
+
+            if (isPartitionFragmentByCompound.find(matchData) != isPartitionFragmentByCompound.end()) continue;
+
+            vector<bool> isPartitionFragment(matchData->compound->fragment_labels.size(), false);
+
+            for (unsigned int i = 0; i < matchData->compound->fragment_labels.size(); i++) {
+
+                vector<string> fragmentLabelTags = DirectInfusionMatchAssessment::getFragmentLabelTags(matchData->compound->fragment_labels[i], params, debug);
+
+                if (find(fragmentLabelTags.begin(), fragmentLabelTags.end(), "ms2sn1FragmentLabelTag") != fragmentLabelTags.end() ||
+                    find(fragmentLabelTags.begin(), fragmentLabelTags.end(), "ms2sn2FragmentLabelTag") != fragmentLabelTags.end()) {
+
+                    isPartitionFragment[i] = true;
+                    allPartitionFragmentMzs.push_back(matchData->compound->fragment_mzs[i]);
+                }
+            }
+
+            isPartitionFragmentByCompound.insert(make_pair(matchData, isPartitionFragment));
+        }
+    }
+
+    sort(allPartitionFragmentMzs.begin(), allPartitionFragmentMzs.end());
+    allPartitionFragmentMzs.erase(unique(allPartitionFragmentMzs.begin(), allPartitionFragmentMzs.end()), allPartitionFragmentMzs.end());
+
+    //<ms2 scan index, <partition fragment m/z index, intensity>>; -1 indicates absence
+    vector<vector<float>> partitionFragmentIntensitiesByScan(ms2Scans.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int k = 0; k < ms2Scans.size(); k++) {
+        partitionFragmentIntensitiesByScan[k] = ms2Scans[k]->findClosestMzIntensities(allPartitionFragmentMzs, params->ms2PpmTolr);
+    }
+
+    //Each partition writes only to its own compounds, so partitions may be processed concurrently.
+    vector<map<int, vector<shared_ptr<DirectInfusionMatchData>>>::iterator> partitions{};
+    for (auto it = partitionMap.begin(); it != partitionMap.end(); ++it){
+        partitions.push_back(it);
+    }
+
+    vector<set<int>> partitionMzsByPartition(partitions.size());
+
+    #pragma omp parallel for schedule(dynamic) if(!debug)
+    for (unsigned int p = 0; p < partitions.size(); p++){
+
+        auto it = partitions[p];
 
         float allFragIntensity = 0.0f;
         float allFragIntensitySAF = 0.0f;
@@ -2244,10 +2334,12 @@ void DirectInfusionMatchInformation::computeMs1PartitionFractions(const vector<S
                 cout << "compound: " << matchData->compound->name << ", adduct: " << matchData->compound->adductString << endl;
             }
 
+            const vector<bool>& isPartitionFragment = isPartitionFragmentByCompound.at(matchData);
+
             float compoundFragIntensity = 0.0f;
             float compoundFragIntensitySAF = 0.0f;
 
-            vector<int> ranks = matchData->fragmentationMatchScore.ranks;
+            const vector<int>& ranks = matchData->fragmentationMatchScore.ranks;
 
             for (unsigned int i = 0; i < ranks.size(); i++) {
                 int y = ranks[i];
@@ -2256,37 +2348,23 @@ void DirectInfusionMatchInformation::computeMs1PartitionFractions(const vector<S
 
                 float fragObservedIntensity = ms2Fragment->consensus->intensity_array[y];
 
-                if (fragObservedIntensity >= params->ms2MinIntensity) {
-
-                    string fragmentLabel = matchData->compound->fragment_labels[i];
-
-                    vector<string> fragmentLabelTags = DirectInfusionMatchAssessment::getFragmentLabelTags(fragmentLabel, params, debug);
+                if (fragObservedIntensity >= params->ms2MinIntensity && i < isPartitionFragment.size() && isPartitionFragment[i]) {
 
-                    //Issue 313: use marked sn1/sn2 fragment label tags instead of explicit list of fragment labels
-                    if (find(fragmentLabelTags.begin(), fragmentLabelTags.end(), "ms2sn1FragmentLabelTag") != fragmentLabelTags.end() ||
-                        find(fragmentLabelTags.begin(), fragmentLabelTags.end(), "ms2sn2FragmentLabelTag") != fragmentLabelTags.end()) {
+                    compoundFragIntensity += fragObservedIntensity;
 
-                        compoundFragIntensity += fragObservedIntensity;
+                    //Issue 318: split ambiguous fragments to avoid multiple-counting errors
+                    float sumObservedMs1ScanIntensity = getSumObservedMs1ScanIntensity(matchData->compound->fragment_mzs[i]);
 
-                        //Issue 318: split ambiguous fragments to avoid multiple-counting errors
-                        int fragKey = static_cast<int>(mzUtils::mzToIntKey(static_cast<double>(matchData->compound->fragment_mzs[i])));
-                        float sumObservedMs1ScanIntensity = fragMzToSumObservedMs1ScanIntensity[fragKey];
+                    compoundFragIntensitySAF += (fragObservedIntensity * (matchData->observedMs1ScanIntensity/sumObservedMs1ScanIntensity));
 
-                        compoundFragIntensitySAF += (fragObservedIntensity * (matchData->observedMs1ScanIntensity/sumObservedMs1ScanIntensity));
+                    long key = mzUtils::mzToIntKey(static_cast<double>(matchData->compound->fragment_mzs[i]));
+                    partitionMzsByPartition[p].insert(static_cast<int>(key));
 
-                        if (partitionMapMzs.find(it->first) == partitionMapMzs.end()) {
-                            partitionMapMzs.insert(make_pair(it->first, set<int>()));
-                        }
-
-                        long key = mzUtils::mzToIntKey(static_cast<double>(matchData->compound->fragment_mzs[i]));
-                        partitionMapMzs[it->first].insert(static_cast<int>(key));
-
-                        if (debug) {
-                            cout << "fragment label: " << fragmentLabel
-                                 << ", intensity=" << fragObservedIntensity
-                                 << ", compoundFragIntensity=" << compoundFragIntensity
-                                 << endl;
-                        }
+                    if (debug) {
+                        cout << "fragment label: " << matchData->compound->fragment_labels[i]
+                             << ", intensity=" << fragObservedIntensity
+                             << ", compoundFragIntensity=" << compoundFragIntensity
+                             << endl;
                     }
                 }
             }
@@ -2299,28 +2377,22 @@ void DirectInfusionMatchInformation::computeMs1PartitionFractions(const vector<S
 
             //SCAN-BASED QUANT APPROACH
 
-            map<int, vector<float>> partitionFractionsByNumFragmentsPresent{};
-
             vector<float> partitionFragmentMzs;
-            for (unsigned int i = 0; i < matchData->compound->fragment_labels.size(); i++) {
-
-                string fragmentLabel = matchData->compound->fragment_labels[i];
-                float fragmentMz = matchData->compound->fragment_mzs[i];
-
-                //Issue 313: use marked sn1/sn2 fragment label tags instead of explicit list of fragment labels
-                vector<string> fragmentLabelTags = DirectInfusionMatchAssessment::getFragmentLabelTags(fragmentLabel, params, debug);
+            vector<unsigned int> partitionFragmentMzIndexes;
+            for (unsigned int i = 0; i < isPartitionFragment.size(); i++) {
 
-                if (find(fragmentLabelTags.begin(), fragmentLabelTags.end(), "ms2sn1FragmentLabelTag") != fragmentLabelTags.end() ||
+                if (!isPartitionFragment[i]) continue;
 
-                    find(fragmentLabelTags.begin(), fragmentLabelTags.end(), "ms2sn2FragmentLabelTag") != fragmentLabelTags.end()) {
+                float fragmentMz = matchData->compound->fragment_mzs[i];
 
-                    partitionFragmentMzs.push_back(fragmentMz);
+                partitionFragmentMzs.push_back(fragmentMz);
+                partitionFragmentMzIndexes.push_back(static_cast<unsigned int>(
+                    lower_bound(allPartitionFragmentMzs.begin(), allPartitionFragmentMzs.end(), fragmentMz) - allPartitionFragmentMzs.begin()));
 
-                    if (debug) {
-                        cout << "fragment label: " << fragmentLabel
-                             << ", fragmentMz: " << fragmentMz
-                             << endl;
-                    }
+                if (debug) {
+                    cout << "fragment label: " << matchData->compound->fragment_labels[i]
+                         << ", fragmentMz: " << fragmentMz
+                         << endl;
                 }
             }
 
@@ -2332,20 +2404,22 @@ void DirectInfusionMatchInformation::computeMs1PartitionFractions(const vector<S
                 cout << endl;
             }
 
-            for (auto scan : ms2Scans) {
+            for (unsigned int k = 0; k < ms2Scans.size(); k++) {
+
+                Scan *scan = ms2Scans[k];
 
                 if (debug) cout << "scan #" << scan->scannum << ": ";
 
                 float scanSumIntensity = 0.0f;
                 float scanSumSAFIntensity = 0.0f;
 
-                for (auto queryMz : partitionFragmentMzs) {
+                for (unsigned int j = 0; j < partitionFragmentMzs.size(); j++) {
+                    float queryMz = partitionFragmentMzs[j];
                     if (debug) cout << "mz=" << queryMz << ": ";
-                    float queryIntensity = scan->findClosestMzIntensity(queryMz, params->ms2PpmTolr);
+                    float queryIntensity = partitionFragmentIntensitiesByScan[k][partitionFragmentMzIndexes[j]];
                     if (queryIntensity > 0) {
 
-                        long fragKey = mzUtils::mzToIntKey(static_cast<double>(queryMz));
-                        float sumObservedMs1ScanIntensity = fragMzToSumObservedMs1ScanIntensity[static_cast<int>(fragKey)];
+                        float sumObservedMs1ScanIntensity = getSumObservedMs1ScanIntensity(queryMz);
 
                         float queryIntensitySAF = queryIntensity * (matchData->observedMs1ScanIntensity/sumObservedMs1ScanIntensity);
 
@@ -2469,7 +2543,14 @@ void DirectInfusionMatchInformation::computeMs1PartitionFractions(const vector<S
             it->second[0]->ms1PartitionFractionByScanSplitAmbiguousFragments = 1;
         }
 
-    } // END for (auto it = partitionMap.begin(); it != partitionMap.end(); ++it)
+    } // END for (unsigned int p = 0; p < partitions.size(); p++)
+
+    map<int, set<int>> partitionMapMzs{};
+    for (unsigned int p = 0; p < partitions.size(); p++) {
+        if (!partitionMzsByPartition[p].empty()) {
+            partitionMapMzs.insert(make_pair(partitions[p]->first, partitionMzsByPartition[p]));
+        }
+    }
 
     //Issue 314: If any m/zs are shared between sets,
     //all compounds associated with the shared m/z are invalidated -
@@ -13,6 +13,19 @@ class DirectInfusionAnnotation;
 class Ms3SingleSampleMatch;
 enum class SpectralCompositionAlgorithm;
 
+/**
+ * @brief The DirectInfusionSearchThresholds struct
+ * MS2 match requirements for a single <Compound, Adduct> library entry,
+ * after resolving any lipid class or lipid class and adduct specific overrides.
+ */
+struct DirectInfusionSearchThresholds {
+    string lipidClass = "";
+    int minNumMatches = 0;
+    int minNumDiagnosticMatches = 0;
+    int minNumSn1Matches = 0;
+    int minNumSn2Matches = 0;
+};
+
 /**
  * @brief The DirectInfusionSearchSet class
  * Data container class
@@ -40,6 +53,13 @@ public:
      */
      map<int, vector<pair<Compound*, Adduct*>>> compoundsByMapKey = {};
 
+     /**
+      * <key, value> = <map_key, search thresholds>
+      * thresholdsByMapKey[map_key][i] corresponds to compoundsByMapKey[map_key][i].
+      * Computed once per search, instead of once per library entry per sample.
+      */
+     map<int, vector<DirectInfusionSearchThresholds>> thresholdsByMapKey = {};
+
      //Issue 319:
      //Every adduct will become a column in a matrix of observed intensities.
      set<Adduct*> allAdducts{};
@@ -100,6 +120,13 @@ public:
     float ms1MMinusOnePeakMaxIntensityFraction = 1.0f;
     float ms1MinScanIntensity = 0;
 
+    /** ===================
+     * CONSENSUS SPECTRUM RELATED
+     * @param consensusIsStreamingMs1: build the consensus MS1 spectrum with ConsensusSpectrumBuilder
+     *      (incremental, no per-scan Fragment objects) instead of Fragment::buildConsensus().
+     * ==================== */
+    bool consensusIsStreamingMs1 = false;
+
     /** ===================
      * MS2 SEARCH RELATED
      * labels
@@ -188,20 +215,17 @@ public:
     //Issue 270
     bool isReduceBySimpleParsimony = false;
 
-    bool isDiagnosticFragmentMapAgreement(map<string, int> observedNumDiagnosticMatchesMap){
+    bool isDiagnosticFragmentMapAgreement(const map<string, int>& observedNumDiagnosticMatchesMap){
 
         for (auto it = ms2MinNumDiagnosticMatchesMap.begin(); it != ms2MinNumDiagnosticMatchesMap.end(); ++it) {
-            string key = it->first;
 
-            if (observedNumDiagnosticMatchesMap.find(key) != observedNumDiagnosticMatchesMap.end()){
-                int numObservedDiagnosticMatches = observedNumDiagnosticMatchesMap[key];
-                if (numObservedDiagnosticMatches < it->second){
-                    return false;   //insufficient count
-                }
-            } else {
-                if (it->second > 0) {
-                    return false; //not finding a key implies count of 0
-                }
+            if (it->second <= 0) continue; //any observed count (including none) satisfies the requirement
+
+            auto observed = observedNumDiagnosticMatchesMap.find(it->first);
+
+            //not finding a key implies count of 0
+            if (observed == observedNumDiagnosticMatchesMap.end() || observed->second < it->second){
+                return false;   //insufficient count
             }
         }
 
@@ -264,6 +288,7 @@ public:
         encodedParams = encodedParams + "consensusMs1PpmTolr" + "=" + to_string(consensusMs1PpmTolr) + ";";
         encodedParams = encodedParams + "consensusMinNumMs1Scans" + "=" + to_string(consensusMinNumMs1Scans) + ";";
         encodedParams = encodedParams + "consensusMinFractionMs1Scans" + "=" + to_string(consensusMinFractionMs1Scans) + ";";
+        encodedParams = encodedParams + "consensusIsStreamingMs1" + "=" + to_string(consensusIsStreamingMs1) + ";";
 
         //ms2 consensus spectrum params
         encodedParams = encodedParams + "consensusPpmTolr" + "=" + to_string(consensusPpmTolr) + ";";
@@ -520,6 +545,9 @@ public:
         if (decodedMap.find("consensusMinFractionMs1Scans") != decodedMap.end()){
             directInfusionSearchParameters->consensusMinFractionMs1Scans = stof(decodedMap["consensusMinFractionMs1Scans"]);
         }
+        if (decodedMap.find("consensusIsStreamingMs1") != decodedMap.end()){
+            directInfusionSearchParameters->consensusIsStreamingMs1 = decodedMap["consensusIsStreamingMs1"] == "1";
+        }
 
         //ms2 consensus spectrum params
         if (decodedMap.find("consensusPpmTolr") != decodedMap.end()){
@@ -915,6 +943,20 @@ public:
              shared_ptr<DirectInfusionSearchParameters> params,
              bool debug);
 
+     /**
+      * @brief getSearchThresholds
+      * @param compound
+      * @param adduct
+      * @param params
+      * @return DirectInfusionSearchThresholds
+      * --> MS2 match requirements for this <Compound, Adduct>, with the most specific
+      * <lipidClass, adductName> or <lipidClass, *> override applied.
+      */
+     static DirectInfusionSearchThresholds getSearchThresholds(
+             Compound *compound,
+             Adduct *adduct,
+             const shared_ptr<DirectInfusionSearchParameters> params);
+
      /**
       * @brief getMs3CompoundSet
       * @param compounds
@@ -960,6 +1002,17 @@ public:
              shared_ptr<DirectInfusionSearchParameters> params,
              bool debug);
 
+     /**
+      * @brief getMs1Fragment
+      * @param validMs1Scans
+      * @param params
+      * @return Fragment* with consensus MS1 spectrum in Fragment->consensus, or nullptr if there are no scans.
+      *
+      * Caller is responsible for deleting the returned Fragment*.
+      */
+     static Fragment* getMs1Fragment(const vector<Scan*>& validMs1Scans,
+                                     shared_ptr<DirectInfusionSearchParameters> params);
+
      /**
       * @brief organizeMs3ScansByPrecursor
       * @param allMs3Scans
@@ -1078,7 +1131,8 @@ public:
                               const vector<Scan*>& ms1Scans,
                               const vector<Scan*>& ms2Scans,
                               const Fragment *ms1Fragment, //only one per sample, computed at the same time that ms1 scans are retrieved.
-                              const vector<pair<Compound*, Adduct*>> library,
+                              const vector<pair<Compound*, Adduct*>>& library,
+                              const vector<DirectInfusionSearchThresholds>& libraryThresholds, //if empty, computed on the fly
                               const shared_ptr<DirectInfusionSearchParameters> params,
                               const bool debug);
 
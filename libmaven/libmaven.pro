@@ -24,13 +24,17 @@ SOURCES=base64.cpp mzMassCalculator.cpp mzSample.cpp  mzUtils.cpp statistics.cpp
        Fragment.cpp \
        BondBreaker.cpp \
        Peptide.cpp \
+       ProteinDigest.cpp \
+       CompoundLibrary.cpp \
+       ScanDeconvolver.cpp \
+       PeakGroupArena.cpp \
        sha1.cpp \
        ThreadSafeSmoother.cpp \
        directinfusionprocessor.cpp \
        lipidsummarizationutils.cpp
 
 
-HEADERS += base64.h mzFit.h mzMassCalculator.h mzSample.h mzPatterns.h mzUtils.h  statistics.h SavGolSmoother.h PolyAligner.h Fragment.h parallelmassSlicer.h BondBreaker.h Peptide.h sha1.hpp \
+HEADERS += base64.h mzFit.h mzMassCalculator.h mzSample.h mzPatterns.h mzUtils.h  statistics.h SavGolSmoother.h PolyAligner.h Fragment.h parallelmassSlicer.h BondBreaker.h Peptide.h ProteinDigest.h CompoundLibrary.h ScanDeconvolver.h PeakGroupArena.h sha1.hpp \
     ThreadSafeSmoother.h \
     directinfusionprocessor.h \
     lipidsummarizationutils.h
@@ -1,8 +1,33 @@
 #include "lipidsummarizationutils.h"
-#include <regex>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
 
 using namespace std;
 
+/**
+ * @brief splitLipidNameField
+ * split a lipid name field on a single character, the way the names were tokenized
+ * with std::regex before: empty fields are kept, except for a trailing one.
+ */
+static vector<string> splitLipidNameField(const string& field, char delimiter) {
+
+    vector<string> tokens;
+
+    string::size_type start = 0;
+    string::size_type pos;
+    while ((pos = field.find(delimiter, start)) != string::npos) {
+        tokens.push_back(field.substr(start, pos-start));
+        start = pos+1;
+    }
+
+    if (tokens.empty() || start < field.size()) {
+        tokens.push_back(field.substr(start));
+    }
+
+    return tokens;
+}
+
 /**
  * @brief LipidSummarizationUtils::getNameComponents
  * @param lipidName
@@ -64,17 +89,9 @@ LipidNameComponents LipidSummarizationUtils::getNameComponents(string lipidName)
 
     string chainsSubstring = lipidName.substr(startChains, endChains);
 
-    regex rx("/");
-    regex rxSemiColonNum(".*;[0-9]+.*");
-
-    sregex_token_iterator iter(chainsSubstring.begin(), chainsSubstring.end(), rx, -1);
-
-    vector<string> chains;
+    vector<string> chains = splitLipidNameField(chainsSubstring, '/');
 
-    sregex_token_iterator end;
-    for(; iter != end; ++iter){
-        string chain = *(iter);
-        chains.push_back(chain);
+    for (const string& chain : chains) {
 
         //Issue 321: additional oxygenation information
         if (
@@ -86,8 +103,14 @@ LipidNameComponents LipidSummarizationUtils::getNameComponents(string lipidName)
                 chain.find(";COOH") != string::npos
              ) {
             initialLevel = 5;
-        } else if (std::regex_match(chain, rxSemiColonNum)) {
-            initialLevel = 6;
+        } else {
+            //oxidation positions, e.g. 20:4;5OH
+            for (string::size_type i = 0; i+1 < chain.size(); i++) {
+                if (chain[i] == ';' && isdigit(chain[i+1])) {
+                    initialLevel = 6;
+                    break;
+                }
+            }
         }
     }
 
@@ -104,15 +127,7 @@ LipidNameComponents LipidSummarizationUtils::getNameComponents(string lipidName)
  * @return level 5 summary (structure defined with oxidation positions)
  */
 string LipidSummarizationUtils::getStrucDefSummary(string lipidName){
-
-    LipidNameComponents lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-
-    if (lipidNameComponents.initialLevel < 6) {
-        return lipidName;
-    }
-
-    return getSummaryLevel6ToLevel5(lipidNameComponents);
-
+    return getSummaries(lipidName).strucDefSummary;
 }
 
 /**
@@ -121,20 +136,7 @@ string LipidSummarizationUtils::getStrucDefSummary(string lipidName){
  * @return Level 4 summary (sn position, with oxygenation information summarized)
  */
 string LipidSummarizationUtils::getSnPositionSummary(std::string lipidName){
-
-    LipidNameComponents lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-
-    if (lipidNameComponents.initialLevel < 5) {
-        return lipidName;
-    }
-
-    //Issue 321: If the initial lipid is at level 5 or 6, downgrade until level 4.
-    if (lipidNameComponents.initialLevel == 6) {
-        lipidName = LipidSummarizationUtils::getSummaryLevel6ToLevel5(lipidNameComponents);
-        lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-    }
-
-    return getSummaryLevel5ToLevel4(lipidNameComponents);
+    return getSummaries(lipidName).snPositionSummary;
 }
 
 /**
@@ -143,23 +145,7 @@ string LipidSummarizationUtils::getSnPositionSummary(std::string lipidName){
  * @return Level 3 summary (acyl chain lengths, but not information about attachment to head group)
  */
 string LipidSummarizationUtils::getAcylChainLengthSummary(string lipidName){
-
-    LipidNameComponents lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-
-    //Issue 321: If the initial lipid is at level 5 or 6, downgrade until level 4.
-    if (lipidNameComponents.initialLevel == 6) {
-        lipidName = LipidSummarizationUtils::getSummaryLevel6ToLevel5(lipidNameComponents);
-        lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-    }
-
-    //Issue 321: If the initial lipid is at level 5, first downgrade to level 4.
-    if (lipidNameComponents.initialLevel == 5) {
-        lipidName = LipidSummarizationUtils::getSummaryLevel5ToLevel4(lipidNameComponents);
-        lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-    }
-
-    string summarizedLipidName = LipidSummarizationUtils::getSummary(LipidSummarizationUtils::getNameComponents(lipidName), 3);
-    return summarizedLipidName == "" ? lipidName : summarizedLipidName;
+    return getSummaries(lipidName).acylChainLengthSummary;
 }
 
 /**
@@ -168,34 +154,96 @@ string LipidSummarizationUtils::getAcylChainLengthSummary(string lipidName){
  * @return  Level 2 summary (# of C-C and C=C bonds)
  */
 string LipidSummarizationUtils::getAcylChainCompositionSummary(string lipidName){
+    return getSummaries(lipidName).acylChainCompositionSummary;
+}
 
-    LipidNameComponents lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
+/**
+ * @brief LipidSummarizationUtils::getLipidClassSummary
+ * @param lipidName
+ * @return Level 1 summary (lipid class name)
+ */
+string LipidSummarizationUtils::getLipidClassSummary(string lipidName){
+    return getSummaries(lipidName).lipidClassSummary;
+}
 
-    //Issue 321: If the initial lipid is at level 5 or 6, downgrade until level 4.
-    if (lipidNameComponents.initialLevel == 6) {
-        lipidName = LipidSummarizationUtils::getSummaryLevel6ToLevel5(lipidNameComponents);
-        lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
-    }
+/**
+ * @brief LipidSummarizationUtils::getSummaries
+ * @param lipidName
+ * @return all summary levels of the lipid name.
+ *
+ * Libraries are summarized at every level for every search, so the summaries are
+ * memoized by name. The cache is only locked for lookup and insertion.
+ */
+LipidNameSummaries LipidSummarizationUtils::getSummaries(const string& lipidName){
+
+    static unordered_map<string, LipidNameSummaries> summariesByName{};
+    static mutex summariesMutex;
 
-    if (lipidNameComponents.initialLevel == 5) {
-        lipidName = LipidSummarizationUtils::getSummaryLevel5ToLevel4(lipidNameComponents);
-        lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
+    {
+        lock_guard<mutex> lock(summariesMutex);
+        auto it = summariesByName.find(lipidName);
+        if (it != summariesByName.end()) return it->second;
     }
 
-    string summarizedLipidName = LipidSummarizationUtils::getSummary(LipidSummarizationUtils::getNameComponents(lipidName), 2);
-    return summarizedLipidName == "" ? lipidName : summarizedLipidName;
+    LipidNameSummaries summaries = computeSummaries(lipidName);
+
+    lock_guard<mutex> lock(summariesMutex);
+    summariesByName.insert(make_pair(lipidName, summaries));
+
+    return summaries;
 }
 
 /**
- * @brief LipidSummarizationUtils::getLipidClassSummary
+ * @brief LipidSummarizationUtils::computeSummaries
  * @param lipidName
- * @return Level 1 summary (lipid class name)
+ * @return all summary levels of the lipid name. Each level starts from the highest level
+ * available in the name, downgraded one level at a time (6 --> 5 --> 4), and the
+ * intermediate names are shared between levels.
  */
-string LipidSummarizationUtils::getLipidClassSummary(string lipidName){
+LipidNameSummaries LipidSummarizationUtils::computeSummaries(const string& lipidName){
+
+    LipidNameSummaries summaries;
 
-    LipidNameComponents lipidNameComponents = LipidSummarizationUtils::getNameComponents(lipidName);
+    LipidNameComponents lipidNameComponents = getNameComponents(lipidName);
 
-    return lipidNameComponents.lipidClass == "" ? lipidName : lipidNameComponents.lipidClass;
+    //Level 1
+    summaries.lipidClassSummary = lipidNameComponents.lipidClass == "" ? lipidName : lipidNameComponents.lipidClass;
+
+    //Level 5
+    string level5Name = lipidName;
+    LipidNameComponents level5Components = lipidNameComponents;
+
+    if (lipidNameComponents.initialLevel == 6) {
+        level5Name = getSummaryLevel6ToLevel5(lipidNameComponents);
+        level5Components = getNameComponents(level5Name);
+    }
+
+    summaries.strucDefSummary = level5Name;
+
+    //Level 4
+    if (lipidNameComponents.initialLevel < 5) {
+        summaries.snPositionSummary = lipidName;
+    } else {
+        summaries.snPositionSummary = getSummaryLevel5ToLevel4(level5Components);
+    }
+
+    //Levels 3 and 2
+    string level4Name = level5Name;
+    LipidNameComponents level4Components = level5Components;
+
+    //Issue 321: If the initial lipid is at level 5, first downgrade to level 4.
+    if (level5Components.initialLevel == 5) {
+        level4Name = getSummaryLevel5ToLevel4(level5Components);
+        level4Components = getNameComponents(level4Name);
+    }
+
+    string acylChainLengthSummary = getSummary(level4Components, 3);
+    summaries.acylChainLengthSummary = acylChainLengthSummary == "" ? level4Name : acylChainLengthSummary;
+
+    string acylChainCompositionSummary = getSummary(level4Components, 2);
+    summaries.acylChainCompositionSummary = acylChainCompositionSummary == "" ? level4Name : acylChainCompositionSummary;
+
+    return summaries;
 }
 
 string LipidSummarizationUtils::getStrucDefOxPosFromRikenLibrary(string rikenLipidName){
@@ -275,7 +323,7 @@ string LipidSummarizationUtils::getStrucDefOxPosFromRikenLibrary(string rikenLip
  *  Summary level 1: lipid class only (all chain information unknown)
  * @return
  */
-string LipidSummarizationUtils::getSummary(LipidNameComponents lipidNameComponents, int summaryLevel) {
+string LipidSummarizationUtils::getSummary(const LipidNameComponents& lipidNameComponents, int summaryLevel) {
 
     //Currently only summary levels 1-3 are supported
     if (summaryLevel < 1 || summaryLevel > 3) {
@@ -308,7 +356,7 @@ string LipidSummarizationUtils::getSummary(LipidNameComponents lipidNameComponen
     return "";
 }
 
-string LipidSummarizationUtils::getSummaryLevel6ToLevel5(LipidNameComponents lipidNameComponents){
+string LipidSummarizationUtils::getSummaryLevel6ToLevel5(const LipidNameComponents& lipidNameComponents){
 
     string lipidNameSummarized("");
     lipidNameSummarized.append(lipidNameComponents.lipidClass);
@@ -316,21 +364,9 @@ string LipidSummarizationUtils::getSummaryLevel6ToLevel5(LipidNameComponents lip
 
     vector<string> updatedChains = vector<string>(lipidNameComponents.chains.size());
 
-    regex rx(";");
-    regex rxComma(",");
-
     for (unsigned int i = 0; i < updatedChains.size(); i++) {
 
-        string chain = lipidNameComponents.chains[i];
-
-        sregex_token_iterator iter(chain.begin(), chain.end(), rx, -1);
-        vector<string> oxBits{};
-
-        sregex_token_iterator end;
-        for (; iter != end; ++iter){
-            string component = *(iter);
-            oxBits.push_back(component);
-        }
+        vector<string> oxBits = splitLipidNameField(lipidNameComponents.chains[i], ';');
 
         if (oxBits.size() == 1) {
             //no oxidation of any kind
@@ -345,7 +381,7 @@ string LipidSummarizationUtils::getSummaryLevel6ToLevel5(LipidNameComponents lip
 
                 updatedChain.append(";");
 
-                string oxBit = oxBits[j];
+                const string& oxBit = oxBits[j];
 
                 int numOH = 0;
                 int numEp = 0;
@@ -354,9 +390,7 @@ string LipidSummarizationUtils::getSummaryLevel6ToLevel5(LipidNameComponents lip
                 int numOxo = 0;
                 int numCOOH = 0;
 
-                sregex_token_iterator iter(oxBit.begin(), oxBit.end(), rxComma, -1);
-                for (; iter != end; ++iter) {
-                    string oxidationEvent = *(iter);
+                for (const string& oxidationEvent : splitLipidNameField(oxBit, ',')) {
 
                     for (unsigned int k = 0; k < oxidationEvent.size(); k++) {
                         if (!isdigit(oxidationEvent[k])) {
@@ -421,7 +455,7 @@ string LipidSummarizationUtils::getSummaryLevel6ToLevel5(LipidNameComponents lip
     return lipidNameSummarized;
 }
 
-string LipidSummarizationUtils::getSummaryLevel5ToLevel4(LipidNameComponents lipidNameComponents){
+string LipidSummarizationUtils::getSummaryLevel5ToLevel4(const LipidNameComponents& lipidNameComponents){
 
    string lipidNameSummarized("");
    lipidNameSummarized.append(lipidNameComponents.lipidClass);
@@ -429,19 +463,9 @@ string LipidSummarizationUtils::getSummaryLevel5ToLevel4(LipidNameComponents lip
 
    vector<string> updatedChains = vector<string>(lipidNameComponents.chains.size());
 
-   regex rx(";");
    for (unsigned int i = 0; i < updatedChains.size(); i++) {
 
-       string chain = lipidNameComponents.chains[i];
-
-       sregex_token_iterator iter(chain.begin(), chain.end(), rx, -1);
-       vector<string> oxBits{};
-
-       sregex_token_iterator end;
-       for (; iter != end; ++iter){
-           string component = *(iter);
-           oxBits.push_back(component);
-       }
+       vector<string> oxBits = splitLipidNameField(lipidNameComponents.chains[i], ';');
 
        if (oxBits.size() == 1) {
            //no oxidation of any kind
@@ -470,7 +494,7 @@ string LipidSummarizationUtils::getSummaryLevel5ToLevel4(LipidNameComponents lip
 
            for (unsigned int j = 1; j < oxBits.size(); j++) {
 
-               string oxBit = oxBits[j];
+               const string& oxBit = oxBits[j];
 
                //single hydroxyl
                if (oxBit == "OH") {
@@ -541,7 +565,7 @@ string LipidSummarizationUtils::getSummaryLevel5ToLevel4(LipidNameComponents lip
    return lipidNameSummarized;
 }
 
-string LipidSummarizationUtils::getSummaryLevel4ToLevel3(LipidNameComponents lipidNameComponents) {
+string LipidSummarizationUtils::getSummaryLevel4ToLevel3(const LipidNameComponents& lipidNameComponents) {
 
     string lipidNameSummarized("");
     lipidNameSummarized.append(lipidNameComponents.lipidClass);
@@ -550,19 +574,9 @@ string LipidSummarizationUtils::getSummaryLevel4ToLevel3(LipidNameComponents lip
     string linkageType = "";
     vector<string> chains;
 
-    for (auto chain : lipidNameComponents.chains){
-
-        regex rx("-");
-        sregex_token_iterator iter(chain.begin(), chain.end(), rx, -1);
+    for (const string& chain : lipidNameComponents.chains){
 
-        vector<string> chainComponents{};
-
-        sregex_token_iterator end;
-
-        for (; iter != end; ++iter){
-            string component = *(iter);
-            chainComponents.push_back(component);
-        }
+        vector<string> chainComponents = splitLipidNameField(chain, '-');
 
         if (chainComponents.size() == 1) {
             chains.push_back(chain);
@@ -625,7 +639,7 @@ string LipidSummarizationUtils::getSummaryLevel4ToLevel3(LipidNameComponents lip
     return lipidNameSummarized;
 }
 
-string LipidSummarizationUtils::getSummaryLevel4ToLevel2(LipidNameComponents lipidNameComponents) {
+string LipidSummarizationUtils::getSummaryLevel4ToLevel2(const LipidNameComponents& lipidNameComponents) {
 
     string lipidNameSummarized("");
     lipidNameSummarized.append(lipidNameComponents.lipidClass);
@@ -636,22 +650,11 @@ string LipidSummarizationUtils::getSummaryLevel4ToLevel2(LipidNameComponents lip
     string linkageType = "";
     int numOxygenations = 0;
 
-    for (auto chain : lipidNameComponents.chains){
+    for (const string& chain : lipidNameComponents.chains){
 
         vector<string> chainBits;
 
-        regex rx(":");
-        sregex_token_iterator iter(chain.begin(), chain.end(), rx, -1);
-        vector<string> chainBitsRaw{};
-
-        sregex_token_iterator end;
-
-        for (; iter != end; ++iter){
-            string component = *(iter);
-            chainBitsRaw.push_back(component);
-        }
-
-        for (auto chainBit : chainBitsRaw) {
+        for (const string& chainBit : splitLipidNameField(chain, ':')) {
 
             string chainBitOHCorrected = chainBit;
 
@@ -697,17 +700,7 @@ string LipidSummarizationUtils::getSummaryLevel4ToLevel2(LipidNameComponents lip
 
 
             //Issue 124: for plasmalogens (e.g.PE(p-16:0/18:2) or PE(o-16:0/18:2))
-            regex rx("-");
-            sregex_token_iterator iter(chainBitOHCorrected.begin(), chainBitOHCorrected.end(), rx, -1);
-
-            vector<string> chainBitPieces{};
-
-            sregex_token_iterator end;
-
-            for (; iter != end; ++iter){
-                string component = *(iter);
-                chainBitPieces.push_back(component);
-            }
+            vector<string> chainBitPieces = splitLipidNameField(chainBitOHCorrected, '-');
 
             if (chainBitPieces.size() == 1) {
                 chainBits.push_back(chainBitOHCorrected);
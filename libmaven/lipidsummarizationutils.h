@@ -11,6 +11,15 @@ struct LipidNameComponents {
     int initialLevel = 4; //sn-position level
 };
 
+//all summary levels of a lipid name, see LipidSummarizationUtils::getSummaries()
+struct LipidNameSummaries {
+    std::string strucDefSummary = "";               //level 5
+    std::string snPositionSummary = "";             //level 4
+    std::string acylChainLengthSummary = "";        //level 3
+    std::string acylChainCompositionSummary = "";   //level 2
+    std::string lipidClassSummary = "";             //level 1
+};
+
 class LipidSummarizationUtils {
 
 private:
@@ -21,6 +30,9 @@ public:
 
     static std::string getStrucDefOxPosFromRikenLibrary(std::string rikenLipidName);
 
+    //Levels 1-5, computed once per lipid name and cached (thread-safe)
+    static LipidNameSummaries getSummaries(const std::string& lipidName);
+
     //Level 5 (Expects struc def + oxidation positions --> struc def)
     static std::string getStrucDefSummary(std::string lipidName);
 
@@ -61,12 +73,14 @@ public:
     static std::string getSummarizationLevelAttributeKey(int summarizationLevel);
 
 private:
-    static std::string getSummary(LipidNameComponents lipidNameComponents, int summaryLevel);
+    static LipidNameSummaries computeSummaries(const std::string& lipidName);
+
+    static std::string getSummary(const LipidNameComponents& lipidNameComponents, int summaryLevel);
 
-    static std::string getSummaryLevel6ToLevel5(LipidNameComponents lipidNameComponents);
-    static std::string getSummaryLevel5ToLevel4(LipidNameComponents lipidNameComponents);
-    static std::string getSummaryLevel4ToLevel3(LipidNameComponents lipidNameComponents);
-    static std::string getSummaryLevel4ToLevel2(LipidNameComponents lipidNameComponents);
+    static std::string getSummaryLevel6ToLevel5(const LipidNameComponents& lipidNameComponents);
+    static std::string getSummaryLevel5ToLevel4(const LipidNameComponents& lipidNameComponents);
+    static std::string getSummaryLevel4ToLevel3(const LipidNameComponents& lipidNameComponents);
+    static std::string getSummaryLevel4ToLevel2(const LipidNameComponents& lipidNameComponents);
 
 };
 
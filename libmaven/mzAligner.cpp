@@ -33,15 +33,20 @@ void Aligner::doAlignment(vector<PeakGroup*>& peakgroups) {
         samples[i]->saveOriginalRetentionTimes();
     }
 
+    //groups and samples are fixed from here on
+    buildSamplePeaks();
+
 	 saveFit();
-	 double R2_before = checkFit();
+	 vector<double> groupRt = groupMeanRt();
+	 double R2_before = checkFit(groupRt);
 
 
      cerr << "Max Iterations: " << maxItterations << endl;
      for(int iter=0; iter < maxItterations; iter++) {
 
-       PolyFit(polynomialDegree);
-        double R2_after = checkFit();
+       PolyFit(polynomialDegree, groupRt);
+        groupRt = groupMeanRt();
+        double R2_after = checkFit(groupRt);
         cerr << "Iteration:" << iter << " R2_before" << R2_before << " R2_after=" << R2_after << endl;
 
 		if (R2_after > R2_before) {
@@ -55,6 +60,37 @@ void Aligner::doAlignment(vector<PeakGroup*>& peakgroups) {
 	 }
 }
 
+void Aligner::buildSamplePeaks() {
+	//a sample listed more than once is only fitted at its first position
+	map<mzSample*, int> sampleIndex;
+	for (unsigned int s=0; s < samples.size(); s++ ) {
+		if (samples[s] && !sampleIndex.count(samples[s])) sampleIndex[samples[s]] = s;
+	}
+
+	samplePeaks.assign(samples.size(), vector<pair<int, Peak*> >());
+
+	//first peak of each sample in each group, as PeakGroup::getPeak()
+	mzSample* lastSample = NULL;
+	int lastIndex = -1;
+	for (unsigned int j=0; j < allgroups.size(); j++ ) {
+		for (unsigned int k=0; k < allgroups[j]->peaks.size(); k++ ) {
+			Peak& p = allgroups[j]->peaks[k];
+			mzSample* sample = p.getSample();
+			if (!sample) continue;
+			if (sample != lastSample) {
+				map<mzSample*, int>::iterator itr = sampleIndex.find(sample);
+				lastSample = sample;
+				lastIndex = itr == sampleIndex.end() ? -1 : itr->second;
+			}
+			if (lastIndex < 0) continue;
+
+			vector<pair<int, Peak*> >& peaks = samplePeaks[lastIndex];
+			if (peaks.empty() || peaks.back().first != static_cast<int>(j)) peaks.push_back(make_pair(j, &p));
+		}
+	}
+
+}
+
 
 void Aligner::saveFit() {
 	cerr << "saveFit()" << endl;
@@ -74,18 +110,23 @@ void Aligner::restoreFit() {
 		for(unsigned int ii=0; ii < samples[i]->scans.size(); ii++ ) {
 			samples[i]->scans[ii]->rt = fit[i][ii];
 		}
+		samples[i]->invalidatePrecursorIndex();
 	}
 }
 vector<double> Aligner::groupMeanRt() {
 		//find retention time deviation
-		vector<double> groupRt(allgroups.size());
-		for (unsigned int i=0; i < allgroups.size(); i++ ) groupRt[i]=allgroups[i]->medianRt();
+		int numGroups = allgroups.size();
+		vector<double> groupRt(numGroups);
+		#pragma omp parallel for schedule(dynamic, 64)
+		for (int i=0; i < numGroups; i++ ) groupRt[i]=allgroups[i]->medianRt();
 		return(groupRt);
 }
 
 double Aligner::checkFit() { 
-	vector<double> groupRt  = groupMeanRt();
+	return checkFit(groupMeanRt());
+}
 
+double Aligner::checkFit(const vector<double>& groupRt) {
 	double sumR2=0;
 	for(unsigned int i=0; i < allgroups.size(); i++ ) {
 		for(unsigned int j=0; j < allgroups[i]->peakCount(); j++ ) {
@@ -97,24 +138,32 @@ double Aligner::checkFit() {
 }
 
 void Aligner::PolyFit(int poly_align_degree) {
+	if (allgroups.size() < 2 ) return;
+	buildSamplePeaks();
+	PolyFit(poly_align_degree, groupMeanRt());
+}
+
+void Aligner::PolyFit(int poly_align_degree, const vector<double>& allGroupsMeansRt) {
 
 	if (allgroups.size() < 2 ) return;
 	cerr << "Align: " << allgroups.size() << endl;
 
-	vector<double> allGroupsMeansRt  = groupMeanRt();
-
-	for (unsigned int s=0; s < samples.size(); s++ ) {
+	//each sample only moves its own scans and peaks, the reference group times are fixed
+	int numSamples = samples.size();
+	#pragma omp parallel for schedule(dynamic)
+	for (int s=0; s < numSamples; s++ ) {
 			mzSample* sample = samples[s];
 			if (sample == NULL) continue;
+			const vector<pair<int, Peak*> >& peaks = samplePeaks[s];
 
 			StatisticsVector<float>subj;
 			StatisticsVector<float>ref;
 			int n=0;
 
             map<int,int>duplicates;
-			for(unsigned int j=0; j < allgroups.size(); j++ ) {
-				Peak* p = allgroups[j]->getPeak(sample);
-				if (!p) continue;
+			for(unsigned int k=0; k < peaks.size(); k++ ) {
+				int j = peaks[k].first;
+				Peak* p = peaks[k].second;
                 if (!p || p->rt <= 0 || allGroupsMeansRt[j] <=0 ) continue;
 
                 int intTime = (int) p->rt*100;
@@ -143,15 +192,18 @@ void Aligner::PolyFit(int poly_align_degree) {
                     for(unsigned int ii=0; ii < sample->scans.size(); ii++ ) {
                         sample->scans[ii]->rt = stats->predict(sample->scans[ii]->rt);
                     }
+                    sample->invalidatePrecursorIndex();
 
-                    for(unsigned int ii=0; ii < allgroups.size(); ii++ ) {
-                        Peak* p = allgroups[ii]->getPeak(sample);
+                    for(unsigned int k=0; k < peaks.size(); k++ ) {
+                        Peak* p = peaks[k].second;
                         if (p)  p->rt = stats->predict(p->rt);
                     }
                 }
             } else 	{
+                #pragma omp critical
                 cerr << "APPLYTING TRANSFORM FAILED! " << endl;
             }
+            delete stats;
     }
 }
 
@@ -160,40 +212,38 @@ void Aligner::Fit(int ideg) {
 	if (allgroups.size() < 2 ) return;
 	cerr << "Align: " << allgroups.size() << endl;
 
-	double* x  = new double[allgroups.size()];
-	double* ref =  new double[allgroups.size()];
-    double* b =  new double[allgroups.size()];
-	double* c =  new double[allgroups.size()];
-	double* d =  new double[allgroups.size()];
-
-//	ofstream temp;
-//	temp.open("/tmp/fit.csv");
-
     //polynomial fit with maximum possible degree 5
     int maxdeg=5;
     if(ideg > maxdeg) ideg=maxdeg;
-	double* result = new double[maxdeg];
-	double* w = new double[maxdeg*maxdeg];
 
-	//vector<double> groupRt  = groupMeanRt();
+	buildSamplePeaks();
+	vector<double> groupRt  = groupMeanRt();
 
-	for (unsigned int s=0; s < samples.size(); s++ ) {
+	//each sample only moves its own scans and peaks, the reference group times are fixed
+	int numSamples = samples.size();
+	#pragma omp parallel for schedule(dynamic)
+	for (int s=0; s < numSamples; s++ ) {
 			mzSample* sample = samples[s];
 			if (sample == NULL) continue;
+			const vector<pair<int, Peak*> >& peaks = samplePeaks[s];
 			map<int,int>duplicates;
 
+			vector<double> x(peaks.size());
+			vector<double> ref(peaks.size());
+			vector<double> result(maxdeg);
+			vector<double> w(maxdeg*maxdeg);
+
 			int n=0;
 			StatisticsVector<float>diff;
-			for(unsigned int j=0; j < allgroups.size(); j++ ) {
-				Peak* p = allgroups[j]->getPeak(sample);
-				if (!p) continue;
+			for(unsigned int k=0; k < peaks.size(); k++ ) {
+				Peak* p = peaks[k].second;
 				if (p->rt <= 0) continue;
                 //if (p->quality < 0.5 ) continue;
                 int intTime = (int) p->rt*100;
                 duplicates[intTime]++;
                 if ( duplicates[intTime] > 5 ) continue;
 
-				ref[n]=allgroups[j]->medianRt();
+				ref[n]=groupRt[peaks[k].first];
 				x[n]=p->rt; 
 
                 diff.push_back(POW2(x[n]-ref[n]));
@@ -220,6 +270,7 @@ void Aligner::Fit(int ideg) {
 				}
 			}
 			if (n - removedCount < 10) {
+				#pragma omp critical
 				cerr << "\t Can't align.. too few peaks n=" << n << " removed=" << removedCount << endl;
 				continue;
 			}
@@ -230,20 +281,12 @@ void Aligner::Fit(int ideg) {
 
 			double R_after=0;   
             int transformedFailed=0;
-            sort_xy(x, ref, n, 1, 0);
-            leasqu(n, x, ref, ideg, w, maxdeg, result);	//polynomial fit
-            //for(int ii=0; ii < ideg; ii++ ) { cerr << "Fit: " << ii << " " << result[ii] << endl; }
-
-
-            //for(int ii=0; ii < n; ii++) d[ii]=c[ii]=b[ii]=0;
-            //spline(n, x, ref, b, c, d);
+            sort_xy(x.data(), ref.data(), n, 1, 0);
+            leasqu(n, x.data(), ref.data(), ideg, w.data(), maxdeg, result.data());	//polynomial fit
 
 			for(int ii=0; ii < n; ii++)  { 
-                double newrt = leasev(result, ideg, x[ii]);
-                //float newrt = seval(n, x[ii], x, ref, b, c, d);
-				//temp << s << ", " << x[ii] << "," << ref[ii] << "," <<  newrt << endl;
+                double newrt = leasev(result.data(), ideg, x[ii]);
                 if (newrt != newrt || !std::isinf(newrt)) {
-                    //cerr << "Polynomical transform failed! (A) " << x[ii] << "-->" << newrt <<  endl;
                     transformedFailed++;
 				}  else {
 					R_after  += POW2(ref[ii] - newrt);
@@ -251,54 +294,40 @@ void Aligner::Fit(int ideg) {
 			}
 
             if(R_after > R_before ) {
+                #pragma omp critical
                 cerr << "Skipping alignment of " << sample->sampleName << " failed=" << transformedFailed << endl;
-                 continue;
+                continue;
             }
 
             int failedTransformation=0;
-            double zeroOffset =  leasev(result, ideg, 0);
+            double zeroOffset =  leasev(result.data(), ideg, 0);
 
-            //cerr << "Alignment Sample: n=" << n << " mean=" << meanDiv << " std=" << stdDiv;
-            //cerr << "\t improved R2" << R_before-R_after << " BAD=" << transformedFailed << endl;
-            // cerr << "zeroOffset=" << zeroOffset << endl;
             for(unsigned int ii=0; ii < sample->scans.size(); ii++ ) {
-                //float newrt = seval(n, sample->scans[ii]->rt, x, ref, b, c, d);
-                double newrt =  leasev(result, ideg, sample->scans[ii]->rt)-zeroOffset;
+                double newrt =  leasev(result.data(), ideg, sample->scans[ii]->rt)-zeroOffset;
                 if (!std::isnan(newrt) && !std::isinf(newrt)) { //nan check
                     sample->scans[ii]->rt = newrt;
                 } else {
+                    #pragma omp critical
                     cerr << "error: " << sample->scans[ii]->rt << " " << newrt << endl;
                     failedTransformation++;
                 }
             }
+            sample->invalidatePrecursorIndex();
 
-            for(unsigned int ii=0; ii < allgroups.size(); ii++ ) {
-                Peak* p = allgroups[ii]->getPeak(sample);
-                if (p) {
-                    //float newrt = seval(n, p->rt, x, ref, b, c, d);
-                    double newrt = leasev(result, ideg, p->rt)-zeroOffset;
-                    if (!std::isnan(newrt) && !std::isinf(newrt)) { //nan check
-                        p->rt = newrt;
-                    } else {
-                        //cerr << "Polynomial transformed failed! (peak)" << p->rt << endl;
-                    }
+            for(unsigned int k=0; k < peaks.size(); k++ ) {
+                Peak* p = peaks[k].second;
+                double newrt = leasev(result.data(), ideg, p->rt)-zeroOffset;
+                if (!std::isnan(newrt) && !std::isinf(newrt)) { //nan check
+                    p->rt = newrt;
                 }
             }
 
             if (failedTransformation) {
+                #pragma omp critical
                 cerr << "APPLYTING TRANSFORM FAILED: " << failedTransformation << endl;
             }
 
 	}
-
-	delete[] result;
-	delete[] w;
-	delete[] x;
-	delete[] ref;
-	//temp.close();
-	delete[] b;
-	delete[] c;
-	delete[] d;
 }
 
 void Aligner::loadAlignmentFile(string alignmentFile) { 
@@ -392,6 +421,7 @@ void Aligner::doSegmentedAligment() {
 				cerr << "Can't find segment for: " << sampleName << "\t" << scan->rt << endl;
 			}
 		}
+		sample->invalidatePrecursorIndex();
 
         cerr << "doSegmentedAligment: " << sampleName << "\tcorrected=" << corcount << endl;
 	}
@@ -458,84 +488,132 @@ string AnchorPointSet::toString() {
  * @param eic_smoothingWindow
  */
 void AnchorPointSet::compute(const vector<mzSample*>& allSamples){
+    vector<AnchorPointSet*> sets(1, this);
+    computeAll(sets, allSamples);
+}
 
-//    //debugging
-//    cout << this->toString() << endl;
-
-    //This flag is set in the constructor, or in this method.
-    if (!isValid) return;
-
-    vector<mzSample*> foundEICSamples;
+/**
+ * @brief AnchorPointSet::computeAll
+ *
+ * Same anchor points as calling compute() on each set: EIC rts are looked up in
+ * a (set x sample) table filled sample by sample, and interpolation brackets a sample id
+ * with a binary search of the sorted found sample ids.
+ *
+ * @param sets
+ * @param allSamples
+ */
+void AnchorPointSet::computeAll(const vector<AnchorPointSet*>& sets, const vector<mzSample*>& allSamples){
+
+    //This flag is set in the constructor, or in compute().
+    vector<AnchorPointSet*> validSets;
+    for (auto set : sets) if (set->isValid) validSets.push_back(set);
+
+    unsigned int numSets = validSets.size();
+    unsigned int numSamples = allSamples.size();
+    if (numSets == 0) return;
+
+    // if some samples have been designated as EIC-containing samples,
+    // only try to extract an EIC for these samples.
+    vector<vector<mzSample*> > sortedEICSamples(numSets);
+    for (unsigned int j = 0; j < numSets; j++) {
+        sortedEICSamples[j] = validSets[j]->eicSamples;
+        sort(sortedEICSamples[j].begin(), sortedEICSamples[j].end());
+    }
 
     //Retrieve RTs for anchor points from samples
-    for (auto &x : allSamples) {
-        AnchorPoint *anchorPoint = new AnchorPoint(x);
+    vector<float> eicRts(static_cast<size_t>(numSets) * numSamples, 0.0f);
+    vector<char> isFoundEIC(static_cast<size_t>(numSets) * numSamples, 0);
 
-        bool isComputeEIC = false;
-        if (eicSamples.empty()) {
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int s = 0; s < numSamples; s++) {
+        mzSample* x = allSamples[s];
 
+        vector<unsigned int> setIndexes;
+        vector<mzSlice*> slices;
+        for (unsigned int j = 0; j < numSets; j++) {
             //if no EIC samples are specified, try to extract an EIC from all samples.
-            isComputeEIC = true;
+            if (sortedEICSamples[j].empty() || binary_search(sortedEICSamples[j].begin(), sortedEICSamples[j].end(), x)) {
+                setIndexes.push_back(j);
+                slices.push_back(validSets[j]->slice);
+            }
+        }
 
-        } else {
+        vector<EIC*> eics = x->getEICs(slices, 1);
 
-            // if some samples have been designated as EIC-containing samples,
-            // only try to extract an EIC for these samples.
-            auto it = find(eicSamples.begin(), eicSamples.end(), x);
-            isComputeEIC = it != eicSamples.end();
+        for (unsigned int k = 0; k < eics.size(); k++) {
+            AnchorPointSet* set = validSets[setIndexes[k]];
+            EIC* eic = eics[k];
 
+            eic->getSingleGlobalMaxPeak(set->eic_smoothingWindow);
+
+            if (!eic->peaks.empty() && eic->peaks[0].peakIntensity >= set->minPeakIntensity){
+                size_t pos = static_cast<size_t>(setIndexes[k]) * numSamples + s;
+                eicRts[pos] = eic->peaks[0].rt;
+                isFoundEIC[pos] = 1;
+            }
+
+            delete(eic);
         }
+    }
 
-//        //debugging
-//        cout << "isComputeEIC? " << (isComputeEIC ? "true" : "false") << endl;
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int j = 0; j < numSets; j++) {
+        AnchorPointSet* set = validSets[j];
+        map<mzSample*, AnchorPoint*>& sampleToPoints = set->sampleToPoints;
+
+        vector<mzSample*> foundEICSamples;
 
-        if (isComputeEIC) {
-            bool isFoundEIC = anchorPoint->setEICRtValue(slice, eic_smoothingWindow, minPeakIntensity);
+        for (unsigned int s = 0; s < numSamples; s++) {
+            size_t pos = static_cast<size_t>(j) * numSamples + s;
+            if (!isFoundEIC[pos]) continue;
 
-//            //debugging
-//            cout << "isFoundEIC? " << (isFoundEIC ? "true" : "false") << endl;
+            mzSample* x = allSamples[s];
+            foundEICSamples.push_back(x);
 
-            if (isFoundEIC) {
-                foundEICSamples.push_back(x);
+            if (sampleToPoints.find(x) == sampleToPoints.end()) {
+                AnchorPoint *anchorPoint = new AnchorPoint(x);
+                anchorPoint->rt = eicRts[pos];
+                anchorPoint->isRtFromEIC = true;
                 sampleToPoints.insert(make_pair(x, anchorPoint));
             }
         }
 
-//        //debugging
-//        cout << x->sampleName << " ==> " << anchorPoint->rt << endl;
-    }
-
-    if (foundEICSamples.size() < minNumObservedSamples) {
-        isValid = false; //will not use if no signal could be extracted for any samples.
-        if (slice) {
-            cerr << "Did not find enough samples for anchor point: " << toString() << endl;
+        if (foundEICSamples.size() < set->minNumObservedSamples) {
+            set->isValid = false; //will not use if no signal could be extracted for any samples.
+            if (set->slice) {
+                #pragma omp critical
+                cerr << "Did not find enough samples for anchor point: " << set->toString() << endl;
+            }
+            continue;
         }
-        return;
-    }
 
-    sort(foundEICSamples.begin(), foundEICSamples.end(), [](const mzSample* lhs, const mzSample* rhs){
-        return lhs->sampleId < rhs->sampleId;
-    });
+        sort(foundEICSamples.begin(), foundEICSamples.end(), [](const mzSample* lhs, const mzSample* rhs){
+            return lhs->sampleId < rhs->sampleId;
+        });
 
-    //interpolate for all samples that do not have RT values from the EIC.
-    for (auto &x : allSamples) {
+        vector<int> foundIds(foundEICSamples.size());
+        for (unsigned int i = 0; i < foundEICSamples.size(); i++) foundIds[i] = foundEICSamples[i]->sampleId;
 
-        int sampleId = x->sampleId;
-        float rt;
+        //interpolate for all samples that do not have RT values from the EIC.
+        for (auto &x : allSamples) {
 
-        bool addInterpolatedSample = false;
+            int sampleId = x->sampleId;
+            float rt = 0.0f;
 
-        if (sampleId <= foundEICSamples[0]->sampleId) {
-            rt = sampleToPoints[foundEICSamples[0]]->rt;
-            addInterpolatedSample = (sampleId != foundEICSamples[0]->sampleId);
-        } else if (sampleId > foundEICSamples[foundEICSamples.size()-1]->sampleId){
-            rt = sampleToPoints[foundEICSamples[foundEICSamples.size()-1]]->rt;
-            addInterpolatedSample = true;
-        } else {
-            for (unsigned int i = 1; i < foundEICSamples.size(); i++){
-                if (sampleId > foundEICSamples[i-1]->sampleId && sampleId < foundEICSamples[i]->sampleId) {
-                    int firstId = foundEICSamples[i-1]->sampleId;
-                    int secondId = foundEICSamples[i]->sampleId;
+            bool addInterpolatedSample = false;
+
+            if (sampleId <= foundIds.front()) {
+                rt = sampleToPoints[foundEICSamples.front()]->rt;
+                addInterpolatedSample = (sampleId != foundIds.front());
+            } else if (sampleId > foundIds.back()){
+                rt = sampleToPoints[foundEICSamples.back()]->rt;
+                addInterpolatedSample = true;
+            } else {
+                //only samples strictly between two found sample ids are interpolated
+                unsigned int i = upper_bound(foundIds.begin(), foundIds.end(), sampleId) - foundIds.begin();
+                if (i < foundIds.size() && foundIds[i-1] < sampleId) {
+                    int firstId = foundIds[i-1];
+                    int secondId = foundIds[i];
 
                     float firstRt = sampleToPoints[foundEICSamples[i-1]]->rt;
                     float secondRt = sampleToPoints[foundEICSamples[i]]->rt;
@@ -546,22 +624,18 @@ void AnchorPointSet::compute(const vector<mzSample*>& allSamples){
 
                     rt = interpolatedRt;
                     addInterpolatedSample = true;
-                    break;
-
-                } else {
-                    rt = sampleToPoints[foundEICSamples[i]]->rt;
                 }
             }
-        }
 
-        if (addInterpolatedSample) {
+            if (addInterpolatedSample && sampleToPoints.find(x) == sampleToPoints.end()) {
 
-            AnchorPoint *anchorPoint = new AnchorPoint(x);
-            anchorPoint->setInterpolatedRtValue(rt);
+                AnchorPoint *anchorPoint = new AnchorPoint(x);
+                anchorPoint->setInterpolatedRtValue(rt);
 
-            sampleToPoints.insert(make_pair(x, anchorPoint));
-        }
+                sampleToPoints.insert(make_pair(x, anchorPoint));
+            }
 
+        }
     }
 }
 
@@ -600,6 +674,8 @@ vector<AnchorPointSet> Aligner::groupsToAnchorPoints(vector<mzSample*>& samples,
     //extra position for last RT in file
     vector<AnchorPointSet> anchorPointSetVector(peakGroups.size()+1);
 
+    vector<AnchorPointSet*> anchorPointSets(peakGroups.size());
+
     for (unsigned int i = 0; i < peakGroups.size(); i++) {
 
         PeakGroup *group = peakGroups[i];
@@ -608,11 +684,12 @@ vector<AnchorPointSet> Aligner::groupsToAnchorPoints(vector<mzSample*>& samples,
         anchorPointSet.eic_smoothingWindow = eic_smoothingWindow;
         anchorPointSet.minPeakIntensity = minPeakIntensity;
 
-        anchorPointSet.compute(samples);
-
         anchorPointSetVector[i] = anchorPointSet;
+        anchorPointSets[i] = &anchorPointSetVector[i];
     }
 
+    AnchorPointSet::computeAll(anchorPointSets, samples);
+
     //last point in file
     AnchorPointSet lastAnchorPointSet = AnchorPointSet::lastRt(samples);
     anchorPointSetVector[peakGroups.size()] = lastAnchorPointSet;
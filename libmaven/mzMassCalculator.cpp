@@ -1,4 +1,7 @@
 #include "mzMassCalculator.h"
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
 
 using namespace mzUtils;
 using namespace std;
@@ -32,35 +35,138 @@ Adduct* MassCalculator::PlusHAdduct  = new Adduct("[M+H]+",  PROTON , 1, 1);
 Adduct* MassCalculator::MinusHAdduct = new Adduct("[M-H]-", -PROTON, -1, 1);
 Adduct* MassCalculator::ZeroMassAdduct = new Adduct("[M]",0 ,1, 1);
 
+constexpr const char* const Composition::ELEMENT_SYMBOLS[];
+constexpr double Composition::ELEMENT_MASSES[];
+
+int Composition::getElementIndex(const char* symbol, size_t length) {
+
+    if (length == 1) {
+        switch (symbol[0]) {
+            case 'C': return 2;
+            case 'D': return 5;
+            case 'F': return 6;
+            case 'H': return 8;
+            case 'I': return 9;
+            case 'K': return 10;
+            case 'N': return 13;
+            case 'O': return 15;
+            case 'P': return 16;
+            case 'S': return 17;
+        }
+    } else if (length == 2) {
+        switch (symbol[0]) {
+            case 'A': if (symbol[1] == 's') return 0; break;
+            case 'B': if (symbol[1] == 'r') return 1; break;
+            case 'C': if (symbol[1] == 'a') return 3; if (symbol[1] == 'l') return 4; break;
+            case 'F': if (symbol[1] == 'e') return 7; break;
+            case 'L': if (symbol[1] == 'i') return 11; break;
+            case 'M': if (symbol[1] == 'g') return 12; break;
+            case 'N': if (symbol[1] == 'a') return 14; break;
+            case 'S': if (symbol[1] == 'e') return 18; if (symbol[1] == 'i') return 19; break;
+        }
+    }
+
+    return -1;
+}
+
+//same tokenization as MassCalculator::getComposition(string), without intermediate strings or maps.
+Composition Composition::fromFormula(const string& formula) {
+
+    Composition composition;
+
+    /* define allowed characters for formula */
+    static const string UPP("ABCDEFGHIKLMNOPRSTUVWXYZ");
+    static const string LOW("abcdefghiklmnoprstuy");
+
+    const char* f = formula.c_str();
+    size_t SIZE = formula.length();
+
+    for (size_t i = 0; i < SIZE; i++) {
+
+        const char* symbol = f + i;
+        size_t symbolLength = 0;
+
+        /* start of symbol must be uppercase letter */
+        if (UPP.find(f[i]) != string::npos) {
+            symbolLength = 1;
+            if (f[i+1] != '\0' && LOW.find(f[i+1]) != string::npos) {
+                symbolLength = 2;
+                i++;
+            }
+        }
+
+        bool isHasCoeff = false;
+        long coeff = 0;
+        while (f[i+1] >= '0' && f[i+1] <= '9') {
+            if (coeff <= INT_MAX) coeff = coeff * 10 + (f[i+1] - '0');
+            isHasCoeff = true;
+            i++;
+        }
+
+        if (!isHasCoeff) coeff = 1;
+
+        int elementIndex = getElementIndex(symbol, symbolLength);
+        if (elementIndex >= 0) {
+            composition.counts[static_cast<unsigned int>(elementIndex)] += static_cast<int>(min(coeff, static_cast<long>(INT_MAX)));
+        }
+    }
+
+    return composition;
+}
+
+Composition Composition::fromMap(const map<string, int>& atoms) {
+    Composition composition;
+    for (auto it = atoms.begin(); it != atoms.end(); ++it) {
+        int elementIndex = getElementIndex(it->first);
+        if (elementIndex >= 0) composition.counts[static_cast<unsigned int>(elementIndex)] += it->second;
+    }
+    return composition;
+}
+
+int Composition::count(const string& symbol) const {
+    int elementIndex = getElementIndex(symbol);
+    return elementIndex >= 0 ? counts[static_cast<unsigned int>(elementIndex)] : 0;
+}
+
+double Composition::getMass() const {
+    double mass = 0;
+    for (unsigned int i = 0; i < NUM_ELEMENTS; i++) {
+        if (counts[i] != 0) mass += ELEMENT_MASSES[i] * counts[i];
+    }
+    return mass;
+}
+
+map<string, int> Composition::toMap() const {
+    map<string, int> atoms;
+    for (unsigned int i = 0; i < NUM_ELEMENTS; i++) {
+        if (counts[i] != 0) atoms.insert(make_pair(string(ELEMENT_SYMBOLS[i]), counts[i]));
+    }
+    return atoms;
+}
+
+Composition& Composition::operator+=(const Composition& b) {
+    for (unsigned int i = 0; i < NUM_ELEMENTS; i++) counts[i] += b.counts[i];
+    return *this;
+}
+
+Composition& Composition::operator-=(const Composition& b) {
+    for (unsigned int i = 0; i < NUM_ELEMENTS; i++) counts[i] -= b.counts[i];
+    return *this;
+}
+
+Composition& Composition::operator*=(int factor) {
+    for (unsigned int i = 0; i < NUM_ELEMENTS; i++) counts[i] *= factor;
+    return *this;
+}
+
 /*---------- function to get molar weight of an element or group --------*/
 double MassCalculator::getElementMass(string elmnt){
 
     /* default behavior is to ignore string */
-    double val_atome(0);
-
-/* Check for atoms */
-    if (elmnt == "H")        val_atome = 1.0078250321;
-    else if (elmnt == "D")   val_atome = 2.01410178;
-    else if (elmnt == "C")   val_atome = 12.00000000;
-    else if (elmnt == "N")   val_atome = 14.0030740052;
-    else if (elmnt == "O")   val_atome = 15.9949146221;
-    else if (elmnt == "S")   val_atome = 31.97207069;
-    else if (elmnt == "P")   val_atome = 30.97376151;
-    else if (elmnt == "F")   val_atome = 18.9984032;
-    else if (elmnt == "Na")  val_atome = 22.98976967;
-    else if (elmnt == "Mg")  val_atome = 24.98583702;
-    else if (elmnt == "Ca")  val_atome = 39.962591;
-    else if (elmnt == "Cl")  val_atome = 34.96885271;
-    else if (elmnt == "Br")  val_atome = 78.918336;
-    else if (elmnt == "I")   val_atome = 126.904477;
-    else if (elmnt == "K")   val_atome = 38.96399867;
-    else if (elmnt == "Ca")  val_atome = 39.9625912;
-    else if (elmnt == "Se")  val_atome = 79.916521;
-    else if (elmnt == "As")  val_atome = 74.921596;
-    else if (elmnt == "Si")  val_atome = 27.9769265325;
-    else if (elmnt == "Fe")  val_atome = 55.934939;
-    else if (elmnt == "Li")  val_atome = 7.016003437;
-    return(val_atome);
+    int elementIndex = Composition::getElementIndex(elmnt);
+    if (elementIndex < 0) return 0;
+
+    return Composition::ELEMENT_MASSES[elementIndex];
 }
 /*-----------------------------------------------------------------------*/
 
@@ -306,15 +412,40 @@ map<string,int> MassCalculator::getComposition(string formula) {
 	/* send back value to main.cpp */
 }
 
-double MassCalculator::computeNeutralMass(string formula) {
-	map<string,int> atoms = getComposition(formula);
-	map<string,int>::iterator itr;
+double MassCalculator::computeNeutralMass(const string& formula) {
+    return getCachedComposition(formula).getMass();
+}
+
+Composition MassCalculator::getCachedComposition(const string& formula) {
 
-	double mass=0;
-	for( itr = atoms.begin(); itr != atoms.end(); itr++ ) {
-			mass += getElementMass((*itr).first) * (*itr).second;
-	}
-	return mass;
+    static thread_local unordered_map<string, Composition> compositionCache{};
+
+    auto it = compositionCache.find(formula);
+    if (it != compositionCache.end()) return it->second;
+
+    if (compositionCache.size() >= maxCachedCompositions) compositionCache.clear();
+
+    Composition composition = Composition::fromFormula(formula);
+    compositionCache.insert(make_pair(formula, composition));
+
+    return composition;
+}
+
+Composition MassCalculator::getCachedComposition(Adduct* adduct) {
+
+    if (!adduct) return Composition();
+
+    static thread_local unordered_map<string, Composition> adductCompositionCache{};
+
+    auto it = adductCompositionCache.find(adduct->name);
+    if (it != adductCompositionCache.end()) return it->second;
+
+    if (adductCompositionCache.size() >= maxCachedCompositions) adductCompositionCache.clear();
+
+    Composition composition = Composition::fromMap(getComposition(adduct));
+    adductCompositionCache.insert(make_pair(adduct->name, composition));
+
+    return composition;
 }
 
 
@@ -356,19 +487,19 @@ vector<Isotope> MassCalculator::computeIsotopes(string compoundFormula, Adduct*
 
     //Issue 120: atoms are adjusted based on molarity and additions/losses.
     //eg, [3M + H2O - H]- --> 3* formula + H2O -H
-    map<string, int> atoms = getComposition(compoundFormula);
-    multiplyAtoms(atoms, adduct->nmol);
-    addAtoms(atoms, getComposition(adduct));
+    Composition atoms = getCachedComposition(compoundFormula);
+    atoms *= adduct->nmol;
+    atoms += getCachedComposition(adduct);
 
     //note that this already includes any mass adjustment from the # of electrons
     double parentMz = adduct->computeAdductMass(computeNeutralMass(compoundFormula));
 
     float chgNum = abs(adduct->charge); //necessary for transforming from mass space to m/z space
 
-    int CatomCount  =  max(atoms["C"], 0);
-    int NatomCount  =  max(atoms["N"], 0);
-    int SatomCount  =  max(atoms["S"], 0);
-    int HatomCount  =  max(atoms["H"], 0);
+    int CatomCount  =  max(atoms.count("C"), 0);
+    int NatomCount  =  max(atoms.count("N"), 0);
+    int SatomCount  =  max(atoms.count("S"), 0);
+    int HatomCount  =  max(atoms.count("H"), 0);
 
      vector<Isotope> isotopes;
 
@@ -463,6 +594,221 @@ vector<Isotope> MassCalculator::computeIsotopes(string compoundFormula, Adduct*
     return isotopes;
 }
 
+/*-------------- natural abundance isotope patterns ----------------------*/
+
+//<mass, abundance> of naturally occurring isotopes, indexed as Composition::ELEMENT_SYMBOLS.
+//D is a label, and is treated as a single isotope.
+static const vector<pair<double, double>>& getNaturalIsotopes(int elementIndex) {
+    static const vector<pair<double, double>> naturalIsotopes[Composition::NUM_ELEMENTS] = {
+        {{74.9215965, 1.0}},                                                                        //As
+        {{78.9183371, 0.5069}, {80.9162906, 0.4931}},                                               //Br
+        {{12.0, 0.9893}, {13.0033548378, 0.0107}},                                                  //C
+        {{39.96259098, 0.96941}, {41.95861801, 0.00647}, {42.9587666, 0.00135},
+         {43.9554818, 0.02086}, {45.9536926, 0.00004}, {47.952534, 0.00187}},                       //Ca
+        {{34.96885268, 0.7576}, {36.96590259, 0.2424}},                                             //Cl
+        {{2.01410178, 1.0}},                                                                        //D
+        {{18.99840322, 1.0}},                                                                       //F
+        {{53.9396105, 0.05845}, {55.9349375, 0.91754}, {56.9353940, 0.02119}, {57.9332756, 0.00282}}, //Fe
+        {{1.0078250321, 0.999885}, {2.0141017778, 0.000115}},                                       //H
+        {{126.904473, 1.0}},                                                                        //I
+        {{38.96370668, 0.932581}, {39.96399848, 0.000117}, {40.96182576, 0.067302}},               //K
+        {{6.015122795, 0.0759}, {7.01600455, 0.9241}},                                              //Li
+        {{23.985041700, 0.7899}, {24.98583692, 0.1000}, {25.982592929, 0.1101}},                    //Mg
+        {{14.0030740052, 0.99636}, {15.0001088982, 0.00364}},                                       //N
+        {{22.9897692809, 1.0}},                                                                     //Na
+        {{15.9949146221, 0.99757}, {16.99913170, 0.00038}, {17.9991610, 0.00205}},                  //O
+        {{30.97376151, 1.0}},                                                                       //P
+        {{31.97207069, 0.9499}, {32.97145876, 0.0075}, {33.96786690, 0.0425}, {35.96708076, 0.0001}}, //S
+        {{73.9224764, 0.0089}, {75.9192136, 0.0937}, {76.9199140, 0.0763},
+         {77.9173091, 0.2377}, {79.9165213, 0.4961}, {81.9166994, 0.0873}},                         //Se
+        {{27.9769265325, 0.92223}, {28.976494700, 0.04685}, {29.97377017, 0.03092}}                 //Si
+    };
+    return naturalIsotopes[elementIndex];
+}
+
+//convolve two <mass, abundance> distributions, discarding peaks below minAbundance,
+//and merging peaks that correspond to the same isotopic composition (identical masses).
+static vector<pair<double, double>> convolveIsotopeDistributions(const vector<pair<double, double>>& a,
+                                                                 const vector<pair<double, double>>& b,
+                                                                 double minAbundance) {
+    vector<pair<double, double>> product;
+    product.reserve(a.size() * b.size());
+
+    for (auto& x : a) {
+        for (auto& y : b) {
+            double abundance = x.second * y.second;
+            if (abundance >= minAbundance) product.push_back(make_pair(x.first + y.first, abundance));
+        }
+    }
+
+    sort(product.begin(), product.end());
+
+    vector<pair<double, double>> merged;
+    merged.reserve(product.size());
+
+    for (auto& peak : product) {
+        if (!merged.empty() && peak.first - merged.back().first < 1e-7) {
+            merged.back().second += peak.second;
+        } else {
+            merged.push_back(peak);
+        }
+    }
+
+    return merged;
+}
+
+IsotopePattern MassCalculator::computeIsotopePattern(const string& compoundFormula, Adduct* adduct, double minAbundance) {
+    return computeIsotopePattern(getCachedComposition(compoundFormula), adduct, minAbundance);
+}
+
+IsotopePattern MassCalculator::computeIsotopePattern(const Composition& composition, Adduct* adduct, double minAbundance) {
+
+    static map<tuple<array<int, Composition::NUM_ELEMENTS>, string, double>, IsotopePattern> isotopePatternCache{};
+    static mutex isotopePatternCacheMutex;
+
+    auto key = make_tuple(composition.getCounts(), adduct ? adduct->name : string(""), minAbundance);
+
+    {
+        lock_guard<mutex> lock(isotopePatternCacheMutex);
+        auto it = isotopePatternCache.find(key);
+        if (it != isotopePatternCache.end()) return it->second;
+    }
+
+    //isotopes of every atom in the ion: nmol copies of the compound, plus the atoms gained
+    //(or minus the atoms lost) in adduct formation.
+    Composition ion = composition;
+    int nmol = adduct ? adduct->nmol : 1;
+    ion *= nmol;
+    if (adduct) ion += getCachedComposition(adduct);
+
+    //intermediate distributions are pruned more conservatively than the final distribution
+    double intermediateMinAbundance = minAbundance * 1e-3;
+
+    vector<pair<double, double>> distribution{make_pair(0.0, 1.0)};
+
+    //mass of the isotopologue made of the Composition::ELEMENT_MASSES isotope of every element,
+    //the one whose m/z is parentMz (not always the lightest isotope: 56Fe, not 54Fe)
+    double parentMass = 0.0;
+
+    for (int i = 0; i < Composition::NUM_ELEMENTS; i++) {
+
+        int numAtoms = ion.count(i);
+        if (numAtoms <= 0) continue;
+
+        const vector<pair<double, double>>& isotopes = getNaturalIsotopes(i);
+
+        unsigned int parentIsotope = 0;
+        for (unsigned int j = 1; j < isotopes.size(); j++) {
+            if (fabs(isotopes[j].first - Composition::ELEMENT_MASSES[i]) < fabs(isotopes[parentIsotope].first - Composition::ELEMENT_MASSES[i])) parentIsotope = j;
+        }
+        parentMass += isotopes[parentIsotope].first * numAtoms;
+
+        if (isotopes.size() == 1) {
+            for (auto& peak : distribution) peak.first += isotopes[0].first * numAtoms;
+            continue;
+        }
+
+        //distribution of numAtoms atoms of this element, by repeated squaring
+        vector<pair<double, double>> elementDistribution{make_pair(0.0, 1.0)};
+        vector<pair<double, double>> power = isotopes;
+
+        for (int n = numAtoms; n > 0; n >>= 1) {
+            if (n & 1) elementDistribution = convolveIsotopeDistributions(elementDistribution, power, intermediateMinAbundance);
+            if (n > 1) power = convolveIsotopeDistributions(power, power, intermediateMinAbundance);
+        }
+
+        distribution = convolveIsotopeDistributions(distribution, elementDistribution, intermediateMinAbundance);
+    }
+
+    double neutralMass = composition.getMass();
+    double parentMz = adduct ? adduct->computeAdductMass(neutralMass) : neutralMass;
+    double chgNum = adduct && adduct->charge != 0 ? abs(adduct->charge) : 1.0;
+
+    IsotopePattern isotopePattern;
+
+    for (auto& peak : distribution) {
+
+        if (peak.second < minAbundance) continue;
+
+        IsotopePattern::Peak finePeak;
+        finePeak.mz = parentMz + (peak.first - parentMass)/chgNum;
+        finePeak.abundance = peak.second;
+        finePeak.nominalShift = static_cast<int>(round(peak.first - parentMass));
+
+        isotopePattern.finePeaks.push_back(finePeak);
+    }
+
+    //fine peaks are sorted by m/z, and nominal shifts are non-decreasing with m/z
+    for (auto& finePeak : isotopePattern.finePeaks) {
+        if (isotopePattern.aggregatePeaks.empty() || isotopePattern.aggregatePeaks.back().nominalShift != finePeak.nominalShift) {
+            IsotopePattern::Peak aggregatePeak;
+            aggregatePeak.nominalShift = finePeak.nominalShift;
+            isotopePattern.aggregatePeaks.push_back(aggregatePeak);
+        }
+        isotopePattern.aggregatePeaks.back().mz += finePeak.mz * finePeak.abundance;
+        isotopePattern.aggregatePeaks.back().abundance += finePeak.abundance;
+    }
+
+    for (auto& aggregatePeak : isotopePattern.aggregatePeaks) {
+        aggregatePeak.mz /= aggregatePeak.abundance;
+    }
+
+    lock_guard<mutex> lock(isotopePatternCacheMutex);
+    if (isotopePatternCache.size() >= maxCachedIsotopePatterns) isotopePatternCache.clear();
+    isotopePatternCache.insert(make_pair(key, isotopePattern));
+
+    return isotopePattern;
+}
+
+//convolve two distributions by nominal shift, dropping the tail below minAbundance
+static vector<double> convolveNominalDistributions(const vector<double>& a, const vector<double>& b, double minAbundance) {
+
+    vector<double> product(a.size() + b.size() - 1, 0.0);
+    for (unsigned int i = 0; i < a.size(); i++) {
+        for (unsigned int j = 0; j < b.size(); j++) product[i+j] += a[i] * b[j];
+    }
+
+    while (product.size() > 1 && product.back() < minAbundance) product.pop_back();
+    return product;
+}
+
+vector<double> MassCalculator::computeNominalIsotopeDistribution(const Composition& composition, double minAbundance) {
+
+    //intermediate distributions are pruned more conservatively than the final distribution
+    double intermediateMinAbundance = minAbundance * 1e-3;
+
+    vector<double> distribution{1.0};
+
+    for (int i = 0; i < Composition::NUM_ELEMENTS; i++) {
+
+        int numAtoms = composition.count(i);
+        if (numAtoms <= 0) continue;
+
+        const vector<pair<double, double>>& isotopes = getNaturalIsotopes(i);
+        if (isotopes.size() == 1) continue;
+
+        //isotopes are listed lightest first
+        vector<double> power;
+        for (auto& isotope : isotopes) {
+            unsigned int shift = static_cast<unsigned int>(round(isotope.first - isotopes[0].first));
+            if (shift >= power.size()) power.resize(shift + 1, 0.0);
+            power[shift] += isotope.second;
+        }
+
+        //distribution of numAtoms atoms of this element, by repeated squaring
+        vector<double> elementDistribution{1.0};
+        for (int n = numAtoms; n > 0; n >>= 1) {
+            if (n & 1) elementDistribution = convolveNominalDistributions(elementDistribution, power, intermediateMinAbundance);
+            if (n > 1) power = convolveNominalDistributions(power, power, intermediateMinAbundance);
+        }
+
+        distribution = convolveNominalDistributions(distribution, elementDistribution, intermediateMinAbundance);
+    }
+
+    while (distribution.size() > 1 && distribution.back() < minAbundance) distribution.pop_back();
+    return distribution;
+}
+
 vector<MassCalculator::Match> MassCalculator::enumerateMasses(double inputMass, double charge, double maxdiff) {
 
     vector<MassCalculator::Match>matches;
@@ -478,7 +824,18 @@ vector<MassCalculator::Match> MassCalculator::enumerateMasses(double inputMass,
                 for(int p=0; p<6;p++) { //P
                     for(int s=0; s<6;s++) { //S
                         int hmax = c*4+o*2+n*4+p*3+s*3;
-                        for(int h=0; h<hmax;h++) { //H
+
+                        //only hydrogen counts that place the mass near the ppm window need to be checked
+                        int hmin = 0;
+                        if (maxdiff < 1e6) {
+                            double base = c*12.0 +  o*15.9949146221 + n*14.0030740052 + p*30.97376151 + s*31.97207069;
+                            double minMass = inputMass/(1.0 + maxdiff/1e6);
+                            double maxMass = inputMass/(1.0 - maxdiff/1e6);
+                            hmin = max(hmin, static_cast<int>(floor((minMass - base)/1.0078250321)) - 1);
+                            hmax = min(hmax, max(0, static_cast<int>(ceil((maxMass - base)/1.0078250321)) + 2));
+                        }
+
+                        for(int h=hmin; h<hmax;h++) { //H
                             //double du = ((c*2+n+p)+2-h)/2;
                             //if (du < -0.5 ) continue;
                             //if (round(du / 0.5) != (du/0.5) ) continue;
@@ -508,6 +865,223 @@ vector<MassCalculator::Match> MassCalculator::enumerateMasses(double inputMass,
     return matches;
 }
 
+//valences used for RDBE and Senior's rules, indexed as Composition::ELEMENT_SYMBOLS.
+static const int ELEMENT_VALENCES[Composition::NUM_ELEMENTS] = {
+    3, 1, 4, 2, 1, 1, 1, 2, 1, 1,   //As, Br, C, Ca, Cl, D, F, Fe, H, I
+    1, 1, 2, 3, 1, 2, 3, 2, 2, 4    //K, Li, Mg, N, Na, O, P, S, Se, Si
+};
+
+struct FormulaEnumerationState {
+    vector<int> elementIndexes;     //Composition element index, heaviest element first
+    vector<int> paramsIndexes;      //position in FormulaEnumerationParameters::elements
+    vector<double> masses;
+    vector<int> minCounts;
+    vector<int> maxCounts;
+    vector<double> minSuffixMass;   //lightest possible contribution of elements [i, N)
+    vector<double> maxSuffixMass;   //heaviest possible contribution of elements [i, N)
+    vector<int> counts;
+    double neutralMass;
+    double minMass;
+    double maxMass;
+};
+
+static bool isPassesFormulaFilters(const FormulaEnumerationState& state, const FormulaEnumerationParameters& params) {
+
+    Composition composition;
+    for (unsigned int i = 0; i < state.counts.size(); i++) {
+        composition.add(state.elementIndexes[i], state.counts[i]);
+    }
+
+    long sumValence = 0;
+    long numAtoms = 0;
+    int maxValence = 0;
+    for (int i = 0; i < Composition::NUM_ELEMENTS; i++) {
+        int num = composition.count(i);
+        if (num == 0) continue;
+        sumValence += static_cast<long>(num) * ELEMENT_VALENCES[i];
+        numAtoms += num;
+        maxValence = max(maxValence, ELEMENT_VALENCES[i]);
+    }
+
+    if (numAtoms == 0) return false;
+
+    //RDBE = 1 + sum(n_i * (v_i - 2))/2
+    long twiceRdbeMinusTwo = sumValence - 2 * numAtoms;
+
+    if (params.isRequireEvenElectron && (twiceRdbeMinusTwo % 2 != 0)) return false;
+
+    if (params.isApplyRdbeFilter) {
+        double rdbe = 1.0 + 0.5 * twiceRdbeMinusTwo;
+        if (rdbe < params.minRdbe || rdbe > params.maxRdbe) return false;
+    }
+
+    if (params.isApplySeniorRules) {
+        if (sumValence < 2 * maxValence) return false;
+        if (sumValence < 2 * (numAtoms - 1)) return false;
+    }
+
+    if (params.isApplyElementRatioFilter) {
+        double numC = composition.count("C");
+        if (numC > 0) {
+            double hc = composition.count("H") / numC;
+            if (hc < 0.2 || hc > 3.1) return false;
+            if (composition.count("N") / numC > 1.3) return false;
+            if (composition.count("O") / numC > 1.2) return false;
+            if (composition.count("P") / numC > 0.3) return false;
+            if (composition.count("S") / numC > 0.8) return false;
+            if (composition.count("F") / numC > 1.5) return false;
+            if (composition.count("Cl") / numC > 0.8) return false;
+            if (composition.count("Br") / numC > 0.8) return false;
+            if (composition.count("Si") / numC > 0.5) return false;
+        }
+    }
+
+    return true;
+}
+
+//Hill notation: C, then H, then all other elements alphabetically. Without C, all elements alphabetically.
+static string getHillFormula(const Composition& composition) {
+
+    string formula;
+
+    auto appendElement = [&formula, &composition](int elementIndex){
+        int num = composition.count(elementIndex);
+        if (num <= 0) return;
+        formula += Composition::ELEMENT_SYMBOLS[elementIndex];
+        if (num > 1) formula += to_string(num);
+    };
+
+    int C = Composition::getElementIndex("C");
+    int H = Composition::getElementIndex("H");
+    bool isHasCarbon = composition.count(C) > 0;
+
+    if (isHasCarbon) {
+        appendElement(C);
+        appendElement(H);
+    }
+
+    for (int i = 0; i < Composition::NUM_ELEMENTS; i++) {
+        if (isHasCarbon && (i == C || i == H)) continue;
+        appendElement(i);
+    }
+
+    return formula;
+}
+
+static void enumerateFormulasRecursive(FormulaEnumerationState& state,
+                                       unsigned int depth,
+                                       double partialMass,
+                                       const FormulaEnumerationParameters& params,
+                                       vector<MassCalculator::Match>& matches) {
+
+    if (depth == state.elementIndexes.size()) {
+
+        double diff = ppmDist(partialMass, state.neutralMass);
+        if (diff > params.ppmTolr) return;
+        if (!isPassesFormulaFilters(state, params)) return;
+
+        Composition composition;
+        vector<int> atomCounts(state.counts.size(), 0);
+        for (unsigned int i = 0; i < state.counts.size(); i++) {
+            composition.add(state.elementIndexes[i], state.counts[i]);
+            atomCounts[static_cast<unsigned int>(state.paramsIndexes[i])] = state.counts[i];
+        }
+
+        MassCalculator::Match m;
+        m.mass = partialMass;
+        m.diff = diff;
+        m.compoundLink = NULL;
+        m.adductLink = NULL;
+        m.formula = m.name = getHillFormula(composition);
+        m.atomCounts = atomCounts;
+        matches.push_back(m);
+
+        return;
+    }
+
+    double mass = state.masses[depth];
+
+    //bound this element's count by the lightest and heaviest possible completions of the formula
+    double minCount = (state.minMass - partialMass - state.maxSuffixMass[depth+1]) / mass;
+    double maxCount = (state.maxMass - partialMass - state.minSuffixMass[depth+1]) / mass;
+
+    double start = max(static_cast<double>(state.minCounts[depth]), floor(minCount));
+    double end = min(static_cast<double>(state.maxCounts[depth]), ceil(maxCount));
+
+    for (int count = static_cast<int>(start); count <= static_cast<int>(end) && start <= end; count++) {
+        state.counts[depth] = count;
+        enumerateFormulasRecursive(state, depth+1, partialMass + count * mass, params, matches);
+    }
+    state.counts[depth] = 0;
+}
+
+vector<MassCalculator::Match> MassCalculator::enumerateFormulas(double neutralMass, const FormulaEnumerationParameters& params) {
+
+    vector<MassCalculator::Match> matches;
+
+    FormulaEnumerationState state;
+
+    vector<pair<double, unsigned int>> elementOrder{};
+    for (unsigned int i = 0; i < params.elements.size(); i++) {
+        int elementIndex = Composition::getElementIndex(params.elements[i].first);
+        if (elementIndex < 0) {
+            cerr << "MassCalculator::enumerateFormulas(): element '" << params.elements[i].first << "' is not supported." << endl;
+            return matches;
+        }
+        elementOrder.push_back(make_pair(Composition::ELEMENT_MASSES[elementIndex], i));
+    }
+
+    //heaviest elements first: the fewest candidate counts at the top of the tree
+    sort(elementOrder.begin(), elementOrder.end(), [](const pair<double, unsigned int>& lhs, const pair<double, unsigned int>& rhs){
+        return lhs.first > rhs.first;
+    });
+
+    for (auto& element : elementOrder) {
+        const pair<string, pair<int, int>>& range = params.elements[element.second];
+        state.elementIndexes.push_back(Composition::getElementIndex(range.first));
+        state.paramsIndexes.push_back(static_cast<int>(element.second));
+        state.masses.push_back(element.first);
+        state.minCounts.push_back(max(0, range.second.first));
+        state.maxCounts.push_back(range.second.second);
+    }
+
+    unsigned int N = static_cast<unsigned int>(state.elementIndexes.size());
+
+    state.minSuffixMass = vector<double>(N+1, 0.0);
+    state.maxSuffixMass = vector<double>(N+1, 0.0);
+    for (int i = static_cast<int>(N)-1; i >= 0; i--) {
+        unsigned int j = static_cast<unsigned int>(i);
+        state.minSuffixMass[j] = state.minSuffixMass[j+1] + state.minCounts[j] * state.masses[j];
+        state.maxSuffixMass[j] = state.maxSuffixMass[j+1] + state.maxCounts[j] * state.masses[j];
+    }
+
+    state.counts = vector<int>(N, 0);
+    state.neutralMass = neutralMass;
+
+    //ppmDist(candidate, neutralMass) <= ppmTolr <==> candidate within [neutralMass/(1+tolr), neutralMass/(1-tolr)]
+    double fraction = params.ppmTolr / 1e6;
+    state.minMass = neutralMass / (1.0 + fraction);
+    state.maxMass = fraction < 1.0 ? neutralMass / (1.0 - fraction) : DBL_MAX;
+
+    enumerateFormulasRecursive(state, 0, 0.0, params, matches);
+
+    sort(matches.begin(), matches.end(), compDiff);
+
+    return matches;
+}
+
+vector<vector<MassCalculator::Match>> MassCalculator::enumerateFormulas(const vector<double>& neutralMasses, const FormulaEnumerationParameters& params) {
+
+    vector<vector<MassCalculator::Match>> matches(neutralMasses.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int i = 0; i < neutralMasses.size(); i++) {
+        matches[i] = enumerateFormulas(neutralMasses[i], params);
+    }
+
+    return matches;
+}
+
 std::string MassCalculator::prettyName(int c, int h, int n, int o, int p, int s, int d) {
 		char buf[1000];
 		string name;
@@ -6,6 +6,7 @@
 #include <string>
 #include <stdexcept>
 #include <map>
+#include <array>
 #include "mzSample.h" 
 #include "mzUtils.h"
 #include "Fragment.h"
@@ -27,6 +28,101 @@ using namespace std;
 
 
 
+/**
+ * @brief The Composition class
+ * Element counts of a formula, stored as a fixed array indexed by a compile-time element table.
+ * Elements are ordered by symbol, so getMass() sums contributions in the same order
+ * as iterating over a map<string,int> composition.
+ * Symbols outside of the element table have no mass, and are not retained.
+ */
+class Composition {
+
+    public:
+        static constexpr int NUM_ELEMENTS = 20;
+        static constexpr const char* const ELEMENT_SYMBOLS[NUM_ELEMENTS] = {
+            "As", "Br", "C", "Ca", "Cl", "D", "F", "Fe", "H", "I",
+            "K", "Li", "Mg", "N", "Na", "O", "P", "S", "Se", "Si"
+        };
+        static constexpr double ELEMENT_MASSES[NUM_ELEMENTS] = {
+            74.921596, 78.918336, 12.00000000, 39.962591, 34.96885271, 2.01410178, 18.9984032, 55.934939, 1.0078250321, 126.904477,
+            38.96399867, 7.016003437, 24.98583702, 14.0030740052, 22.98976967, 15.9949146221, 30.97376151, 31.97207069, 79.916521, 27.9769265325
+        };
+
+        Composition() { counts.fill(0); }
+
+        static Composition fromFormula(const string& formula);
+        static Composition fromMap(const map<string, int>& atoms);
+
+        //returns -1 if the symbol is not in the element table
+        static int getElementIndex(const char* symbol, size_t length);
+        static int getElementIndex(const string& symbol) { return getElementIndex(symbol.c_str(), symbol.length()); }
+
+        inline int count(int elementIndex) const { return counts[static_cast<unsigned int>(elementIndex)]; }
+        int count(const string& symbol) const;
+        void add(int elementIndex, int num) { counts[static_cast<unsigned int>(elementIndex)] += num; }
+        inline const array<int, NUM_ELEMENTS>& getCounts() const { return counts; }
+
+        double getMass() const;
+        map<string, int> toMap() const;
+
+        Composition& operator+=(const Composition& b);
+        Composition& operator-=(const Composition& b);
+        Composition& operator*=(int factor);
+
+    private:
+        array<int, NUM_ELEMENTS> counts;
+};
+
+/**
+ * @brief The IsotopePattern struct
+ * Natural abundance isotope distribution of an ion.
+ * finePeaks: every isotopic composition retained after pruning, sorted by m/z.
+ * aggregatePeaks: finePeaks combined by nominal mass shift from the parent peak
+ *      (abundance-weighted m/z, summed abundance), sorted by m/z.
+ * The parent peak (nominalShift 0) is the isotopologue of Composition::ELEMENT_MASSES isotopes,
+ * at the m/z of MassCalculator::computeMass(). Lighter isotopes (54Fe, 74Se, 6Li, 24Mg)
+ * give peaks with negative nominal shifts.
+ * Abundances are probabilities: all peaks of an unpruned distribution sum to 1.
+ */
+struct IsotopePattern {
+
+    struct Peak {
+        double mz = 0;
+        double abundance = 0;
+        int nominalShift = 0;
+    };
+
+    vector<Peak> finePeaks;
+    vector<Peak> aggregatePeaks;
+};
+
+/**
+ * @brief The FormulaEnumerationParameters struct
+ * Element set and filters used by MassCalculator::enumerateFormulas().
+ *
+ * @param elements: <element symbol, <min count, max count>>. Symbols must be in Composition::ELEMENT_SYMBOLS.
+ * @param ppmTolr: maximum ppm difference between candidate formula mass and query mass.
+ * @param isApplyRdbeFilter: retain formulas with minRdbe <= RDBE <= maxRdbe.
+ * @param isRequireEvenElectron: retain formulas with integer RDBE (even-electron neutral molecules).
+ * @param isApplySeniorRules: retain formulas satisfying Senior's rules
+ *      (sum of valences >= 2 * max valence, and sum of valences >= 2 * (number of atoms - 1)).
+ * @param isApplyElementRatioFilter: retain formulas within common element / carbon ratios
+ *      (H/C in [0.2, 3.1], N/C <= 1.3, O/C <= 1.2, P/C <= 0.3, S/C <= 0.8, F/C <= 1.5, Cl/C <= 0.8, Br/C <= 0.8, Si/C <= 0.5).
+ *      Formulas without carbon are not filtered by ratio.
+ */
+struct FormulaEnumerationParameters {
+    vector<pair<string, pair<int, int>>> elements = {
+        {"C", {0, 100}}, {"H", {0, 200}}, {"N", {0, 20}}, {"O", {0, 40}}, {"P", {0, 4}}, {"S", {0, 4}}
+    };
+    double ppmTolr = 5;
+    bool isApplyRdbeFilter = true;
+    double minRdbe = 0;
+    double maxRdbe = 60;
+    bool isRequireEvenElectron = true;
+    bool isApplySeniorRules = true;
+    bool isApplyElementRatioFilter = true;
+};
+
 class MassCalculator { 
 
     public:
@@ -71,9 +167,15 @@ class MassCalculator {
 
 
     MassCalculator(){}
-    static double computeNeutralMass(string formula);
+    static double computeNeutralMass(const string& formula);
     static map<string,int> getComposition(string formula);
     static map<string,int> getComposition(Adduct* adduct);
+
+    //memoized: each distinct formula or adduct is parsed once per thread (no locking in parallel searches).
+    //Each thread keeps at most maxCachedCompositions entries, the cache is emptied when it is full.
+    static Composition getCachedComposition(const string& formula);
+    static Composition getCachedComposition(Adduct* adduct);
+    static const unsigned int maxCachedCompositions = 50000;
     static void addAtoms(map<string, int>& reference, map<string, int> toAdd);
     static void subtractAtoms(map<string, int>& reference, map<string, int> toSubtract);
     static void multiplyAtoms(map<string, int>& reference, int factor);
@@ -86,9 +188,42 @@ class MassCalculator {
     void matchMass(double mass, double ppm);
     string prettyName(int c, int h, int n, int o, int p, int s, int d=0);
     vector<Match> enumerateMasses(double inputMass, double charge, double maxdiff);
+
+    /**
+     * @brief enumerateFormulas
+     * All formulas over params.elements whose monoisotopic mass is within params.ppmTolr of neutralMass,
+     * and which pass the enabled filters. Branch-and-bound over elements (heaviest first),
+     * pruning any partial formula that cannot reach the mass window with the remaining elements.
+     * Match::atomCounts follow the order of params.elements. Output is sorted by ppm difference.
+     */
+    static vector<Match> enumerateFormulas(double neutralMass, const FormulaEnumerationParameters& params);
+
+    //one set of matches per neutral mass, computed concurrently.
+    static vector<vector<Match>> enumerateFormulas(const vector<double>& neutralMasses, const FormulaEnumerationParameters& params);
     double adjustMass(double mass,int charge);
 
     vector<Isotope> computeIsotopes(string compoundFormula, Adduct* adduct, int maxNumProtons=INT_MAX, bool isUse13C=true, bool isUse15N=true, bool isUse34S=true, bool isUse2H=true);
+
+    /**
+     * @brief computeIsotopePattern
+     * Fine structure and aggregated natural abundance isotope distribution of compoundFormula ionized as adduct,
+     * computed by per-element convolution, discarding isotopic compositions less abundant than minAbundance.
+     * m/z values are placed relative to adduct->computeAdductMass(computeNeutralMass(compoundFormula)).
+     * Results are cached by <Composition, adduct, minAbundance>, at most maxCachedIsotopePatterns of them
+     * (the cache is emptied when it is full). Thread-safe.
+     */
+    static IsotopePattern computeIsotopePattern(const string& compoundFormula, Adduct* adduct, double minAbundance=1e-6);
+    static IsotopePattern computeIsotopePattern(const Composition& composition, Adduct* adduct, double minAbundance=1e-6);
+    static const unsigned int maxCachedIsotopePatterns = 10000;
+
+    /**
+     * @brief computeNominalIsotopeDistribution
+     * Natural abundance isotope distribution of a neutral composition aggregated by nominal mass shift:
+     * element [i] is the abundance of all isotopic compositions i Da above the monoisotopic mass.
+     * Only the nominal shifts of the isotopes are convolved (no fine structure), so this is cheap even for
+     * intact proteins. The tail beyond the last shift with abundance >= minAbundance is dropped.
+     */
+    static vector<double> computeNominalIsotopeDistribution(const Composition& composition, double minAbundance=1e-6);
     map<string,int> getPeptideComposition(const string& peptideSeq);
 
     static bool compDiff(const Match& a, const Match& b ) { return a.diff < b.diff; }
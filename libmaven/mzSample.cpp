@@ -26,6 +26,12 @@ mzSample::mzSample() {
     sampleId = -1;
     color[0]=color[1]=color[2]=0;
     color[3]=1.0;
+
+    scanFilters.mslevel = filter_mslevel;
+    scanFilters.polarity = filter_polarity;
+    scanFilters.isCentroidScans = filter_centroidScans;
+    scanFilters.minIntensityQuantile = filter_intensityQuantile;
+    scanFilters.minIntensity = filter_minIntensity;
 }
 
 mzSample::~mzSample() { 
@@ -40,34 +46,25 @@ void mzSample::addScan(Scan*s ) {
     //cerr << "addScan=" << "\tms="<< s->mslevel << "\tprecMz=" << s->precursorMz << "\trt=" << s->rt << endl;
 
 	//skip scans that do not match mslevel
-	if (mzSample::filter_mslevel and s->mslevel != mzSample::filter_mslevel ) {
+	if (scanFilters.mslevel and s->mslevel != scanFilters.mslevel ) {
 		return;
 	}
 	//skip scans that do not match polarity 
-	if (mzSample::filter_polarity and s->getPolarity() != mzSample::filter_polarity ) {
+	if (scanFilters.polarity and s->getPolarity() != scanFilters.polarity ) {
 		return;
 	}
 
-        //unsigned int sizeBefore = s->intensity.size();
-        if ( mzSample::filter_centroidScans == true ) {
-            s->simpleCentroid();
-        }
-
-        //unsigned int sizeAfter1 = s->intensity.size();
-
-        if ( mzSample::filter_intensityQuantile > 0) {
-            s->quantileFilter(mzSample::filter_intensityQuantile);
+        if (isDeferScanFilters) {
+            pendingScans.push_back(s);
+            if (pendingScans.size() >= pendingScansBatchSize) filterPendingScans();
+        } else if (scanFilters.isChangingScans()) {
+            ScanFilterPipeline pipeline(scanFilters);
+            pipeline.apply(s);
         }
-        //unsigned int sizeAfter2 = s->intensity.size();
-
-        if ( mzSample::filter_minIntensity > 0) {
-            s->intensityFilter(mzSample::filter_minIntensity);
-        }
-        //unsigned int sizeAfter3 = s->intensity.size();
-        //cerr << "addScan " << sizeBefore <<  " " << sizeAfter1 << " " << sizeAfter2 << " " << sizeAfter3 << endl;
 
         scans.push_back(s);
         s->scannum=scans.size()-1;
+        invalidatePrecursorIndex();
 }
 
 string mzSample::cleanSampleName(string sampleName) {
@@ -84,6 +81,21 @@ string mzSample::cleanSampleName(string sampleName) {
 
 }
 
+void mzSample::filterPendingScans() {
+    if (pendingScans.empty()) return;
+
+    if (scanFilters.isChangingScans()) {
+        int N = pendingScans.size();
+        #pragma omp parallel
+        {
+            ScanFilterPipeline pipeline(scanFilters);
+            #pragma omp for schedule(dynamic, 4)
+            for (int i = 0; i < N; i++) pipeline.apply(pendingScans[i]);
+        }
+    }
+    pendingScans.clear();
+}
+
 void mzSample::loadSample(const char* filename) {
     loadSample(filename, true);
 }
@@ -94,6 +106,9 @@ void mzSample::loadSample(const char* filename, bool isCorrectPrecursor) {
     this->sampleName = cleanSampleName(filename);
     this->fileName = filenameString;
 
+    //mzCSV and mzData parsers fill in scan data after addScan(), their scans are filtered right away
+    isDeferScanFilters = mystrcasestr(filename,".mzCSV") == NULL and mystrcasestr(filename,".mzdata") == NULL;
+
     if (mystrcasestr(filename,".mzCSV") != NULL ) {
         parseMzCSV(filename);
     } else if(mystrcasestr(filename,".mzdata") != NULL or mystrcasestr(filename,".mzdata.gz") != NULL ) {
@@ -108,15 +123,16 @@ void mzSample::loadSample(const char* filename, bool isCorrectPrecursor) {
         parseMzXML(filename);
     }
 
+    filterPendingScans();
+    isDeferScanFilters = false;
+
     //set min and max values for rt
     calculateMzRtRange();
 
     //recalculate precursor masses
     if (isCorrectPrecursor) {
         //cerr << "Recalculating Ms2 Precursor Masses" << endl;
-        for(Scan* ms2scan: scans) {
-            ms2scan->precursorMz=getMS1PrecursorMass(ms2scan,20);
-        }
+        correctPrecursorMzs(20);
     }
 
     if (mystrcasestr(filename,"blan") != NULL) {
@@ -136,6 +152,8 @@ using namespace MSToolkit;
     MSToolkit::Spectrum spec;           // For holding spectrum.
     MSToolkit::MSReader mstReader;
 
+   isDeferScanFilters = true;
+
    int iFirstScan=0;
    mstReader.readFile(filename, spec, iFirstScan);
 
@@ -200,16 +218,15 @@ using namespace MSToolkit;
         this->addScan(scan);
     }
 
+   this->filterPendingScans();
+   isDeferScanFilters = false;
+
     //set min and max values for rt
    this->calculateMzRtRange();
 
     //recalculate precursor masses
     //cerr << "Recalculating Ms2 Precursor Masses" << endl;
-    for(Scan* ms2scan: this->scans) {
-        if(ms2scan->mslevel==2) {
-            ms2scan->precursorMz=this->getMS1PrecursorMass(ms2scan,20);
-        }
-    }
+    this->correctPrecursorMzs(20);
 
     if (mystrcasestr(filename,"blan") != NULL) {
         this->isBlank = true;
@@ -970,16 +987,28 @@ void mzSample::calculateMzRtRange() {
 		totalIntensity = 0;
 		int nobs = 0;
 
+		//same pass: peak totals of each scan, see Scan::getScanSummary()
 		for (unsigned int j=0; j < scans.size(); j++ ) {
+			ScanSummary summary;
 			for (unsigned int i=0; i < scans[j]->mz.size(); i++ ) {
-				totalIntensity +=  scans[j]->intensity[i];
+				float intensity = scans[j]->intensity[i];
+				totalIntensity +=  intensity;
 				float mz = scans[j]->mz[i]; 
 				if( mz < minMz && mz > 0   ) minMz = mz; //sanity check must be greater > 0
 				if (mz > maxMz && mz < 1e9 ) maxMz = mz; //sanity check m/z over a billion
-				if (scans[j]->intensity[i] < minIntensity ) minIntensity = scans[j]->intensity[i];
-				if (scans[j]->intensity[i] > maxIntensity ) maxIntensity = scans[j]->intensity[i];
+				if (intensity < minIntensity ) minIntensity = intensity;
+				if (intensity > maxIntensity ) maxIntensity = intensity;
 				nobs++;
+
+				summary.totalIntensity += intensity;
+				if (intensity > summary.basePeakIntensity) {
+					summary.basePeakIntensity = intensity;
+					summary.basePeakMz = mz;
+				}
+				if (i == 0 || mz < summary.minMz) summary.minMz = mz;
+				if (i == 0 || mz > summary.maxMz) summary.maxMz = mz;
 			}
+			scans[j]->setScanSummary(summary);
 		}
 		//sanity check
 		if (minRt <= 0 ) minRt = 0;
@@ -1335,6 +1364,113 @@ EIC* mzSample::getEIC(float mzmin, float mzmax, float rtmin, float rtmax, int ms
 }
 
 
+vector<EIC*> mzSample::getEICs(const vector<mzSlice*>& slices, int mslevel) {
+
+    vector<EIC*> eics(slices.size(), NULL);
+
+    bool isRtSorted = true;
+    for (unsigned int j = 1; j < scans.size() && isRtSorted; j++) {
+        if (!(scans[j]->rt >= scans[j-1]->rt)) isRtSorted = false;
+    }
+
+    if (!isRtSorted || scans.empty()) {
+        for (unsigned int i = 0; i < slices.size(); i++) {
+            eics[i] = getEIC(slices[i]->mzmin, slices[i]->mzmax, slices[i]->rtmin, slices[i]->rtmax, mslevel);
+        }
+        return eics;
+    }
+
+    //windows adjusted to the sample as in getEIC()
+    vector<float> rtmins(slices.size()), rtmaxs(slices.size());
+    vector<int> order;
+    order.reserve(slices.size());
+
+    for (unsigned int i = 0; i < slices.size(); i++) {
+        float mzmin = slices[i]->mzmin;
+        float mzmax = slices[i]->mzmax;
+        float rtmin = slices[i]->rtmin;
+        float rtmax = slices[i]->rtmax;
+        if (rtmin < this->minRt ) rtmin = this->minRt;
+        if (rtmax > this->maxRt ) rtmax = this->maxRt;
+        if (mzmin < this->minMz ) mzmin = this->minMz;
+        if (mzmax > this->maxMz ) mzmax = this->maxMz;
+
+        EIC* e = new EIC();
+        e->sampleName = sampleName;
+        e->sample = this;
+        e->mzmin = mzmin;
+        e->mzmax = mzmax;
+        e->totalIntensity=0;
+        e->maxIntensity = 0;
+        eics[i] = e;
+
+        rtmins[i] = rtmin;
+        rtmaxs[i] = rtmax;
+        order.push_back(i);
+    }
+
+    //with sorted retention times, a slice takes the scans with rtmin <= rt <= rtmax
+    sort(order.begin(), order.end(), [&rtmins](int a, int b) { return rtmins[a] < rtmins[b]; });
+
+    vector<int> active;
+    unsigned int next = 0;
+
+    for (unsigned int scanNum = 0; scanNum < scans.size(); scanNum++) {
+        Scan* scan = scans[scanNum];
+        if (scan->mslevel != mslevel) continue;
+        if (scan->mz.size() == 0) continue;
+
+        while (next < order.size() && rtmins[order[next]] <= scan->rt) active.push_back(order[next++]);
+        if (active.empty() && next == order.size()) break;
+
+        for (unsigned int k = 0; k < active.size(); ) {
+            int i = active[k];
+            if (scan->rt > rtmaxs[i]) {
+                active[k] = active.back();
+                active.pop_back();
+                continue;
+            }
+            k++;
+
+            EIC* e = eics[i];
+
+            //sim scan outside the range
+            if (mslevel == 1 && (scan->mz.front() > e->mzmax || scan->mz.back() < e->mzmin)) continue;
+
+            float __maxMz=0;
+            float __maxIntensity=0;
+
+            vector<float>::iterator mzItr = lower_bound(scan->mz.begin(), scan->mz.end(), e->mzmin);
+            for(unsigned int j=mzItr-scan->mz.begin(); j < scan->nobs(); j++ ) {
+                if (scan->mz[j] < e->mzmin) continue;
+                if (scan->mz[j] > e->mzmax) break;
+                if (scan->intensity[j] > __maxIntensity ) {
+                    __maxIntensity=scan->intensity[j];
+                    __maxMz = scan->mz[j];
+                }
+            }
+
+            e->scannum.push_back(scanNum);
+            e->rt.push_back(scan->rt);
+            e->intensity.push_back(__maxIntensity);
+            e->mz.push_back(__maxMz);
+            e->totalIntensity += __maxIntensity;
+            if (__maxIntensity>e->maxIntensity) e->maxIntensity = __maxIntensity;
+        }
+    }
+
+    float scale = getNormalizationConstant();
+    for (EIC* e : eics) {
+        if ( e->rt.size() > 0 ) {
+            e->rtmin = e->rt[0];
+            e->rtmax = e->rt[ e->size()-1];
+        }
+        if(scale != 1.0) for (unsigned int j=0; j < e->size(); j++) { e->intensity[j] *= scale; }
+    }
+
+    return eics;
+}
+
 EIC* mzSample::getTIC(float rtmin, float rtmax, int mslevel) { 
 
     //ajust EIC retention time window to match sample retentention times
@@ -1358,7 +1494,7 @@ EIC* mzSample::getTIC(float rtmin, float rtmax, int mslevel) {
     {
         if (scans[i]->mslevel == mslevel) {
             Scan* scan = scans[i];
-            float y = scan->totalIntensity();
+            float y = scan->getScanSummary().totalIntensity;
             e->mz.push_back(0);
             e->scannum.push_back(i);
             e->rt.push_back(scan->rt);
@@ -1397,11 +1533,9 @@ EIC* mzSample::getBIC(float rtmin, float rtmax, int mslevel) {
     {
         if (scans[i]->mslevel == mslevel) {
             Scan* scan = scans[i];
-			float maxMz=0;
-			float maxIntensity=0;
-    		for(unsigned int i=0;i<scan->intensity.size();i++)  {
-					if(scan->intensity[i] >maxIntensity) { maxIntensity=scan->intensity[i]; maxMz=scan->mz[i] ; }
-			}
+            const ScanSummary& summary = scan->getScanSummary();
+			float maxMz=summary.basePeakMz;
+			float maxIntensity=summary.basePeakIntensity;
             e->mz.push_back(maxMz);
             e->scannum.push_back(i);
             e->rt.push_back(scan->rt);
@@ -1657,41 +1791,149 @@ int mzSample::parseCDF (char* filename, int is_verbose)
     return 1;
 }
 
+//points of one scan in getAverageScan(), in order of their m/z bins
+struct AverageScanRun {
+    const Scan* scan;
+    vector<float> bins;     //bin of each point, sorted
+    vector<int> order;      //point of each bin, empty if the scan is already in bin order
+
+    inline int pointAt(int k) const { return order.empty() ? k : order[k]; }
+};
+
+static void buildAverageScanRun(const Scan* scan, float sd, AverageScanRun& run) {
+    run.scan = scan;
+    int n = scan->mz.size();
+    run.bins.resize(n);
+    for (int i = 0; i < n; i++) run.bins[i] = FLOATROUND(scan->mz[i], sd);
+    if (std::is_sorted(run.bins.begin(), run.bins.end())) return;
+
+    //stable: points of the same bin stay in scan order
+    run.order.resize(n);
+    for (int i = 0; i < n; i++) run.order[i] = i;
+    const vector<float>& bins = run.bins;
+    std::stable_sort(run.order.begin(), run.order.end(), [&bins](int a, int b) { return bins[a] < bins[b]; });
+    vector<float> sortedBins(n);
+    for (int k = 0; k < n; k++) sortedBins[k] = bins[run.order[k]];
+    run.bins.swap(sortedBins);
+}
+
+//average m/z and intensity of the bins in [binmin, binmax), merged over all runs. Each bin sums its
+//points scan by scan, in scan order, as the std::map accumulation getAverageScan() used to do.
+static void mergeAverageScanRuns(const vector<AverageScanRun>& runs, float binmin, float binmax,
+                                 vector<float>& mzs, vector<float>& intensities) {
+
+    typedef pair<float, int> RunHead;   //next bin of a run, run index
+    priority_queue<RunHead, vector<RunHead>, greater<RunHead> > heads;
+
+    int numRuns = runs.size();
+    vector<int> cursor(numRuns), end(numRuns);
+    for (int r = 0; r < numRuns; r++) {
+        const vector<float>& bins = runs[r].bins;
+        cursor[r] = lower_bound(bins.begin(), bins.end(), binmin) - bins.begin();
+        end[r] = lower_bound(bins.begin(), bins.end(), binmax) - bins.begin();
+        if (cursor[r] < end[r]) heads.push(RunHead(bins[cursor[r]], r));
+    }
+
+    float currentBin = 0;
+    double totalIntensity = 0;
+    double mzIntensity = 0;
+    int count = 0;
+
+    while (!heads.empty()) {
+        float bin = heads.top().first;
+        int r = heads.top().second;
+        heads.pop();
+
+        if (count > 0 && bin != currentBin) {
+            mzs.push_back((float) (mzIntensity / totalIntensity));
+            intensities.push_back((float) totalIntensity / count);
+            totalIntensity = mzIntensity = 0;
+            count = 0;
+        }
+        currentBin = bin;
+
+        const AverageScanRun& run = runs[r];
+        int k = cursor[r];
+        for (; k < end[r] && run.bins[k] == bin; k++) {
+            int i = run.pointAt(k);
+            totalIntensity += ((double) run.scan->intensity[i]);
+            mzIntensity += ((double)(run.scan->intensity[i])*(run.scan->mz[i]));
+            count++;
+        }
+        cursor[r] = k;
+        if (k < end[r]) heads.push(RunHead(run.bins[k], r));
+    }
+
+    if (count > 0) {
+        mzs.push_back((float) (mzIntensity / totalIntensity));
+        intensities.push_back((float) totalIntensity / count);
+    }
+}
+
 Scan* mzSample::getAverageScan(float rtmin, float rtmax, int mslevel, int polarity, float sd ) {
 
     float rt=rtmin + (rtmax-rtmin)/2;
-    int scanCount=0;
     int scannum=0;
 
-    map<float,double> mz_intensity_map;
-    map<float,double> mz_bin_map;
-    map<float,int> mz_count;
+    //scans in [rtmin, rtmax], from a binary search for rtmin when retention times are sorted
+    bool isRtSorted = true;
+    for (unsigned int s = 1; s < scans.size() && isRtSorted; s++) {
+        if (!(scans[s]->rt >= scans[s-1]->rt)) isRtSorted = false;
+    }
 
-    for(unsigned int s=0; s < scans.size(); s++) {
+    unsigned int first = 0;
+    if (isRtSorted) {
+        first = lower_bound(scans.begin(), scans.end(), rtmin,
+                            [](const Scan* scan, float x) { return scan->rt < x; }) - scans.begin();
+    }
+
+    vector<Scan*> selected;
+    for (unsigned int s = first; s < scans.size(); s++) {
+        if (isRtSorted && scans[s]->rt > rtmax) break;
         if(scans[s]->getPolarity() != polarity
                 || scans[s]->mslevel != mslevel
                 || scans[s]->rt < rtmin
                 || scans[s]->rt > rtmax) continue;
+        selected.push_back(scans[s]);
+    }
+    int scanCount = selected.size();
 
-        Scan* scan = scans[s];
-        scanCount++;
-        for(unsigned int i=0; i < scan->mz.size(); i++) {
-                float bin = FLOATROUND(scan->mz[i],sd);
-                mz_intensity_map[bin] += ((double) scan->intensity[i]);
-                mz_bin_map[bin] += ((double)(scan->intensity[i])*(scan->mz[i]));
-                mz_count[bin]++;
-        }
+    vector<AverageScanRun> runs(scanCount);
+    size_t numPoints = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:numPoints)
+    for (int s = 0; s < scanCount; s++) {
+        buildAverageScanRun(selected[s], sd, runs[s]);
+        numPoints += runs[s].bins.size();
+    }
+
+    //wide windows: disjoint bin ranges are merged in parallel
+    const size_t minPointsPerChunk = 250000;
+    const int maxChunks = 16;
+    int numChunks = min(static_cast<size_t>(maxChunks), max(numPoints / minPointsPerChunk, static_cast<size_t>(1)));
+
+    float minBin = FLT_MAX;
+    float maxBin = -FLT_MAX;
+    for (const AverageScanRun& run : runs) {
+        if (run.bins.empty()) continue;
+        minBin = min(minBin, run.bins.front());
+        maxBin = max(maxBin, run.bins.back());
+    }
+
+    vector<vector<float> > chunkMzs(numChunks);
+    vector<vector<float> > chunkIntensities(numChunks);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < numChunks; c++) {
+        float binmin = c == 0 ? -numeric_limits<float>::infinity() : minBin + (maxBin - minBin) * c / numChunks;
+        float binmax = c == numChunks - 1 ? numeric_limits<float>::infinity() : minBin + (maxBin - minBin) * (c + 1) / numChunks;
+        mergeAverageScanRuns(runs, binmin, binmax, chunkMzs[c], chunkIntensities[c]);
     }
 
     Scan* avgScan = new Scan(this,scannum,mslevel,rt/scanCount, 0, polarity);
 
-    map<float,double>::iterator itr;
-    for(itr = mz_intensity_map.begin(); itr != mz_intensity_map.end(); ++itr ) {
-        float bin = (*itr).first;
-        double totalIntensity=(*itr).second;
-        double avgMz =  mz_bin_map[bin] / totalIntensity;
-        avgScan->mz.push_back((float)avgMz);
-        avgScan->intensity.push_back((float) totalIntensity / mz_count[bin]);
+    for (int c = 0; c < numChunks; c++) {
+        avgScan->mz.insert(avgScan->mz.end(), chunkMzs[c].begin(), chunkMzs[c].end());
+        avgScan->intensity.insert(avgScan->intensity.end(), chunkIntensities[c].begin(), chunkIntensities[c].end());
     }
     //cout << "getAverageScan() from:" << from << " to:" << to << " scanCount:" << scanCount << "scans. mzs=" << avgScan->nobs() << endl;
     return avgScan;
@@ -1713,6 +1955,7 @@ void mzSample::restoreOriginalRetentionTimes() {
     for(unsigned int ii=0; ii < scans.size(); ii++ ) {
         scans[ii]->rt = originalRetentionTimes[ii];
     }
+    invalidatePrecursorIndex();
 }
 
 
@@ -1742,6 +1985,7 @@ void mzSample::applyPolynomialTransform() {
 		//cerr << "applyPolynomialTransform() " << scans[i]->rt << "\t" << newrt << endl;
 		scans[i]->rt = newrt;
 	}
+	invalidatePrecursorIndex();
 }
 
 double mzSample::getMS1PrecursorMass(Scan* ms2scan,float ppm) {
@@ -1777,16 +2021,141 @@ double mzSample::getMS1PrecursorMass(Scan* ms2scan,float ppm) {
     }
 }
 
+/**
+ * @brief findMS1PrecursorMz
+ * Same result as trying scan->findHighestIntensityPos(precursorMz, ppm*mult) for mult = 1..5
+ * until a position > 0 is found, in a single pass over the widest window: every peak is assigned
+ * to the narrowest window containing it, and the best peak of each window is the best of its own
+ * and all narrower ones.
+ *
+ * @return m/z of the matched peak, or 0 if there is none
+ */
+static float findMS1PrecursorMz(Scan* scan, float precursorMz, float ppm) {
+    const int numWindows = 5;
+    float mzmins[numWindows], mzmaxs[numWindows];
+    int bestPos[numWindows];
+    float bestIntensity[numWindows];
+
+    for (int m = 0; m < numWindows; m++) {
+        float windowPpm = ppm * static_cast<float>(m+1);
+        mzmins[m] = precursorMz - precursorMz/1e6*windowPpm;
+        mzmaxs[m] = precursorMz + precursorMz/1e6*windowPpm;
+        bestPos[m] = -1;
+        bestIntensity[m] = 0;
+    }
+
+    const vector<float>& mz = scan->mz;
+    const vector<float>& intensity = scan->intensity;
+
+    unsigned int N = mz.size();
+    unsigned int k = lower_bound(mz.begin(), mz.end(), mzmins[numWindows-1]) - mz.begin();
+    for (; k < N && mz[k] <= mzmaxs[numWindows-1]; k++) {
+        int m = 0;
+        while (m < numWindows-1 && (mz[k] < mzmins[m] || mz[k] > mzmaxs[m])) m++;
+        if (intensity[k] > bestIntensity[m]) {
+            bestIntensity[m] = intensity[k];
+            bestPos[m] = k;
+        }
+    }
+
+    int pos = -1;
+    float highestIntensity = 0;
+    for (int m = 0; m < numWindows; m++) {
+        //ties go to the lowest m/z, as in findHighestIntensityPos()
+        if (bestPos[m] >= 0 && (bestIntensity[m] > highestIntensity || (bestIntensity[m] == highestIntensity && bestPos[m] < pos))) {
+            highestIntensity = bestIntensity[m];
+            pos = bestPos[m];
+        }
+        if (pos > 0) return mz[pos];
+    }
+    return 0;
+}
+
+void mzSample::correctPrecursorMzs(float ppm) {
+
+    int N = scans.size();
+    if (N == 0) return;
+
+    //position of the last MS1 scan at or before each position, -1 if none
+    vector<int> previousMs1(N, -1);
+    int lastMs1 = -1;
+    for (int i = 0; i < N; i++) {
+        if (scans[i] and scans[i]->mslevel <= 1) lastMs1 = i;
+        previousMs1[i] = lastMs1;
+    }
+
+    vector<Scan*> ms2scans;
+    for (Scan* scan : scans) {
+        if (scan and scan->mslevel == 2 and scan->precursorMz != 0) ms2scans.push_back(scan);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < static_cast<int>(ms2scans.size()); i++) {
+        Scan* ms2scan = ms2scans[i];
+
+        //same MS1 scan as getMS1PrecursorMass(): the first one in getScan(scannum) .. getScan(scannum-49)
+        int scanNum = ms2scan->scannum;
+        if (scanNum < 0) continue;
+        int ms1Pos = previousMs1[min(scanNum, N-1)];
+        if (ms1Pos < 0 || scanNum - ms1Pos >= 50) continue;
+
+        float adjPreMass = findMS1PrecursorMz(scans[ms1Pos], ms2scan->precursorMz, ppm);
+        if (adjPreMass > 0) ms2scan->precursorMz = adjPreMass;
+    }
+    invalidatePrecursorIndex();
+}
+
 vector<Scan*> mzSample::getFragmentationEvents(mzSlice* slice) {
-    vector<Scan*>matchedscans;
-    for( unsigned int j=0; j < scans.size(); j++ ) {
-            Scan* scan = scans[j];
-            if (!scan or scan->mslevel <= 1 or scan->rt < slice->rtmin) continue; //skip ms1 events
-            if (scan->rt > slice->rtmax) break;
-            if (scan->precursorMz >= slice->mzmin and scan->precursorMz <= slice->mzmax) {
-                matchedscans.push_back(scan);
-            }
-     }
+    return getFragmentationEvents(slice->rtmin, slice->rtmax, slice->mzmin, slice->mzmax);
+}
+
+vector<Scan*> mzSample::getFragmentationEvents(float rtmin, float rtmax, double mzmin, double mzmax, bool isMs2Only) {
+    if (!isPrecursorIndexValid.load(memory_order_acquire)) {
+        lock_guard<mutex> lock(precursorIndexMutex);
+        if (!isPrecursorIndexValid.load(memory_order_relaxed)) {
+            precursorIndex.build(scans);
+            isPrecursorIndexValid.store(true, memory_order_release);
+        }
+    }
+    return precursorIndex.find(rtmin, rtmax, mzmin, mzmax, isMs2Only);
+}
+
+void PrecursorIndex::build(const deque<Scan*>& sampleScans) {
+    scans.clear();
+    rts.clear();
+    precursorMzs.clear();
+    mslevels.clear();
+
+    for (Scan* scan : sampleScans) {
+        if (!scan or scan->mslevel <= 1) continue;
+        scans.push_back(scan);
+        rts.push_back(scan->rt);
+        precursorMzs.push_back(scan->precursorMz);
+        mslevels.push_back(scan->mslevel);
+    }
+
+    //NaN retention times are never skipped nor stop the walk, so they need the linear walk
+    isRtSorted = true;
+    for (unsigned int i = 0; i < rts.size(); i++) {
+        if (std::isnan(rts[i]) or (i > 0 and rts[i] < rts[i-1])) { isRtSorted = false; break; }
+    }
+}
+
+vector<Scan*> PrecursorIndex::find(float rtmin, float rtmax, double mzmin, double mzmax, bool isMs2Only) const {
+    vector<Scan*> matchedscans;
+
+    unsigned int N = scans.size();
+    unsigned int first = 0;
+    if (isRtSorted) first = lower_bound(rts.begin(), rts.end(), rtmin) - rts.begin();
+
+    for (unsigned int j = first; j < N; j++) {
+        if (isMs2Only and mslevels[j] != 2) continue;
+        if (rts[j] < rtmin) continue;
+        if (rts[j] > rtmax) break;
+        if (precursorMzs[j] >= mzmin and precursorMzs[j] <= mzmax) {
+            matchedscans.push_back(scans[j]);
+        }
+    }
     return matchedscans;
 }
 
@@ -8,11 +8,14 @@
 #include <deque>
 #include <set>
 #include <map>
+#include <queue>
 #include <sstream>
 #include <cstring>
 #include  <limits.h>
 #include  <float.h>
 #include <iomanip>
+#include <atomic>
+#include <mutex>
 #include "assert.h"
 
 #include "pugixml.hpp"
@@ -78,6 +81,29 @@ class mzPoint {
 };
 
 
+/**
+ * @brief peak totals of a scan, see Scan::getScanSummary()
+ */
+struct ScanSummary {
+    double totalIntensity = 0;      //same as Scan::totalIntensity()
+    float basePeakMz = 0;           //same as Scan::baseMz()
+    float basePeakIntensity = 0;    //same as Scan::maxIntensity()
+    float minMz = 0;                //lowest and highest m/z of the scan, 0 if empty
+    float maxMz = 0;
+};
+
+/**
+ * @brief state of Scan::getScanSummary(), an atomic that can be copied with its Scan.
+ * A copy of a summary that is being computed is invalid.
+ */
+struct ScanSummaryState {
+    enum { Invalid = 0, Computing = 1, Valid = 2 };
+    atomic<int> state{Invalid};
+    ScanSummaryState() = default;
+    ScanSummaryState(const ScanSummaryState& b) : state(b.state.load(memory_order_acquire) == Valid ? Valid : Invalid) {}
+    ScanSummaryState& operator=(const ScanSummaryState& b) { state.store(b.state.load(memory_order_acquire) == Valid ? Valid : Invalid, memory_order_release); return *this; }
+};
+
 class Scan { 
     public:
 
@@ -107,6 +133,10 @@ class Scan {
     float findNormalizedIntensity(float queryMz, float standardMz, float ppm, float minScanIntensity=0.0f);
     float findClosestMzIntensity(float queryMz, float ppm);
 
+    //same as findClosestMzIntensity() for every query, in one sweep over the scan.
+    //queryMzs must be sorted in increasing order.
+    vector<float> findClosestMzIntensities(const vector<float>& queryMzs, float ppm);
+
     bool hasMz(float mz, float ppm);
     bool isCentroided() { return centroided; }
     bool isProfile()    { return !centroided; }
@@ -115,6 +145,17 @@ class Scan {
 
     double totalIntensity(){ double sum=0; for(unsigned int i=0;i<intensity.size();i++) sum += intensity[i]; return sum; }
     float maxIntensity()  { float max=0; for(unsigned int i=0;i<intensity.size();i++) if(intensity[i] > max) max=intensity[i]; return max; }
+    /**
+     * @brief totals of the peaks of the scan, computed at load by mzSample::calculateMzRtRange()
+     * or on first use. Scan filters keep it up to date, call invalidateScanSummary() after
+     * changing mz or intensity directly. Safe to call from several threads at once, as long
+     * as no thread is changing the scan.
+     */
+    inline const ScanSummary& getScanSummary() { if (scanSummaryState.state.load(memory_order_acquire) != ScanSummaryState::Valid) updateScanSummary(); return scanSummary; }
+    void setScanSummary(const ScanSummary& x) { scanSummary = x; scanSummaryState.state.store(ScanSummaryState::Valid, memory_order_release); }
+    void invalidateScanSummary() { scanSummaryState.state.store(ScanSummaryState::Invalid, memory_order_release); }
+    void updateScanSummary();
+
     float minMz()  { if(nobs() > 0) return mz[0]; return 0; }
     float maxMz()  { if(nobs() > 0) return mz[nobs()-1]; return 0; }
     float baseMz();
@@ -178,7 +219,7 @@ class Scan {
 
     static bool compRt(Scan* a, Scan* b ) { return a->rt < b->rt; }
     static bool compPrecursor(Scan* a, Scan* b ) { return a->precursorMz < b->precursorMz; }
-    static bool compIntensity(Scan* a, Scan* b ) { return a->totalIntensity() > b->totalIntensity(); }
+    static bool compIntensity(Scan* a, Scan* b ) { return a->getScanSummary().totalIntensity > b->getScanSummary().totalIntensity; }
     bool operator< (const Scan& b) { return rt < b.rt; }  //default comparision operation
 
     vector<Isotope> getIsotopicPattern(float centerMz, float ppm, int maxZ, int maxIsotopes);
@@ -192,7 +233,137 @@ private:
     	vector<Scan*> children;
         int polarity;
 
+        ScanSummary scanSummary;
+        ScanSummaryState scanSummaryState;
+
+
+};
+
+/**
+ * @brief Scan::assignCharges() kernel.
+ *
+ * For every peak, assignCharges() looks up the highest intensity peak at each isotope spacing
+ * (z = 5..1, 5 spacings forward and 2 back). The isotope queries of all peaks at one spacing are
+ * in increasing m/z order, so instead of a binary search per peak and spacing, every spacing is a
+ * single two-pointer sweep over the scan, filling a neighbour table with the same positions as
+ * Scan::findHighestIntensityPos(). Isotopes that can't be reached (the previous isotope of the
+ * series did not match) are skipped.
+ *
+ * Buffers are kept between calls: use one detector per thread for many scans.
+ */
+class ChargeStateDetector {
+    public:
+        vector<int> assignCharges(Scan* scan, float ppmTolr);
+
+        static const int maxCharge = 5;
+        static const int numForwardIsotopes = 5;
+        static const int numBackIsotopes = 2;
+        static const int numSpacings = maxCharge * (numForwardIsotopes + numBackIsotopes);
+
+    private:
+        //neighbours[spacing*N + pos]: findHighestIntensityPos() of isotope spacing from peak pos, or -1
+        vector<int> neighbours;
+        vector<int> chargeStates;
+
+        //spacing index of isotope j (1-based, negative for back isotopes) of charge z
+        static inline int spacingIndex(int z, int j) {
+            return (maxCharge - z) * (numForwardIsotopes + numBackIsotopes) + (j > 0 ? j - 1 : numForwardIsotopes - j - 1);
+        }
+
+        void fillNeighbours(const vector<float>& mz, const vector<float>& intensity, float ppm);
+};
+
+/**
+ * @brief Scan::simpleCentroid() kernel.
+ *
+ * Profile spectra are smoothed twice with a Savitzky-Golay filter (window = 1/20 of the points,
+ * at most 10 each side, order 2), and every local maximum of the smoothed intensities becomes a centroid.
+ * The centroid is placed at the apex of a Gaussian fit (a parabola in log intensity) through the
+ * highest raw point of the maximum and its two neighbours, with a parabolic fit as fallback, and
+ * keeps the intensity of that raw point.
+ *
+ * Filter coefficients are computed once per window size and shared by all centroiders. Buffers are
+ * kept between calls: use one centroider per thread for many scans.
+ */
+class ScanCentroider {
+    public:
+        //centroids are written over the profile data, the capacity of scan->mz and scan->intensity is kept
+        void centroid(Scan* scan);
+
+        static const int minSmoothWindow = 1;
+        static const int maxSmoothWindow = 10;
+
+    private:
+        vector<float> smoothed;
+        vector<float> spline;
+        vector<int> maxima;
+
+        //same values as mzUtils::SavGolSmoother(window, window, 2).Smooth(in)
+        static void smooth(const vector<float>& in, vector<float>& out, int window);
+};
+
+/**
+ * @brief scan filters of a sample, applied by mzSample::addScan()
+ */
+struct ScanFilterParameters {
+    int mslevel = 0;                //skip scans of other ms levels, 0: keep all
+    int polarity = 0;               //skip scans of other polarity, 0: keep all
+    bool isCentroidScans = false;   //Scan::simpleCentroid()
+    int minIntensityQuantile = 0;   //Scan::quantileFilter(), 0: off
+    int minIntensity = 0;           //Scan::intensityFilter(), 0: off
+
+    bool isChangingScans() const { return isCentroidScans or minIntensityQuantile > 0 or minIntensity > 0; }
+};
+
+/**
+ * @brief in place filtering of scans with ScanFilterParameters.
+ *
+ * Same result as simpleCentroid(), quantileFilter() and intensityFilter(), in that order, but
+ * the two intensity filters are one compaction pass over the points, above the larger of both
+ * thresholds. The quantile threshold comes from nth_element instead of sorting a copy of the
+ * intensities. mz and intensity are shrunk to fit once, at the end.
+ *
+ * Buffers are kept between calls: use one pipeline per thread for many scans.
+ */
+class ScanFilterPipeline {
+    public:
+        explicit ScanFilterPipeline(const ScanFilterParameters& params) : params(params) {}
+
+        void apply(Scan* scan);
+
+        /**
+         * @brief same value as mzUtils::quantileDistribution(values)[quantile], for 0 <= quantile < 100
+         */
+        static float getQuantile(const vector<float>& values, int quantile, vector<float>& buffer);
+
+    private:
+        ScanFilterParameters params;
+        ScanCentroider centroider;
+        vector<float> buffer;
+};
+
+/**
+ * @brief MSn scans (mslevel > 1) of a sample, in scan order, with their retention times and
+ * precursor m/z, for MS2 lookups by retention time and precursor m/z window.
+ *
+ * find() gives the same scans, in the same order, as walking all scans of the sample from the
+ * start: skipping scans before rtmin, stopping at the first one past rtmax and keeping those with
+ * a precursor m/z in [mzmin, mzmax]. When retention times increase with scan number (the usual
+ * case), the walk starts at a binary search for rtmin.
+ */
+class PrecursorIndex {
+    public:
+        void build(const deque<Scan*>& sampleScans);
 
+        //with isMs2Only, only mslevel 2 scans are considered (also for stopping past rtmax)
+        vector<Scan*> find(float rtmin, float rtmax, double mzmin, double mzmax, bool isMs2Only=false) const;
+
+    private:
+        vector<Scan*> scans;
+        vector<float> rts;
+        vector<float> precursorMzs;
+        vector<int> mslevels;
+        bool isRtSorted = true;
 };
 
 //Issue 347
@@ -302,17 +473,44 @@ public:
     void  setNormalizationConstant(float x) { _normalizationConstant = x; }
 
     Scan* getScan(unsigned int scanNum);				//get indexes for a given scan
+    /**
+     * @brief intensity weighted average of the scans in [rtmin, rtmax], with points binned by
+     * FLOATROUND(mz, resolution). Scans are merged in bin order (k-way merge), wide windows
+     * in parallel over disjoint bin ranges. Owned by the caller.
+     */
     Scan* getAverageScan(float rtmin, float rtmax, int mslevel, int polarity, float resolution);
 
     EIC* getEIC(float minMz, float maxMz, float minRt, float maxRt, int mslevel, string scanFilterString="");	//get eic based on minMz, maxMz, minRt, maxRt, mslevel
     EIC* getEIC(string srmId);	//get eic based on srmId
     EIC* getEIC(float precursorMz, float collisionEnergy, float productMz, float amuQ1, float amuQ2 );
     EIC* getEIC(pair<float, float> mzKey); //get eic based on SRM precursor, product ion mzs
+
+    /**
+     * @brief same EICs as getEIC(slice->mzmin, slice->mzmax, slice->rtmin, slice->rtmax, mslevel) for
+     * each slice, in one pass over the scans when retention times are sorted. Owned by the caller.
+     */
+    vector<EIC*> getEICs(const vector<mzSlice*>& slices, int mslevel);
+
     EIC* getTIC(float,float,int);		//get Total Ion Chromatogram
     EIC* getBIC(float,float,int);		//get Base Peak Chromatogram
     double getMS1PrecursorMass(Scan* ms2scan,float ppm);
+
+    /**
+     * @brief replace the precursor m/z of every MS2 scan by the m/z of the matching peak in the
+     * previous MS1 scan, as getMS1PrecursorMass(), with MS2 scans processed in parallel.
+     */
+    void correctPrecursorMzs(float ppm);
     vector<Scan*> getFragmentationEvents(mzSlice* slice);
 
+    /**
+     * @brief MSn scans in [rtmin, rtmax] with precursor m/z in [mzmin, mzmax], see PrecursorIndex::find().
+     * The index is built on first use.
+     */
+    vector<Scan*> getFragmentationEvents(float rtmin, float rtmax, double mzmin, double mzmax, bool isMs2Only=false);
+
+    //call after changing scan retention times outside of mzSample and Aligner
+    void invalidatePrecursorIndex() { isPrecursorIndexValid = false; }
+
     deque <Scan*> scans;
     int sampleId;
     string sampleName;
@@ -371,6 +569,10 @@ public:
     static mzSlice getMinMaxDimentions(const vector<mzSample*>& samples);
 
 
+    //scan filters of this sample, set them before loading
+    ScanFilterParameters scanFilters;
+
+    //default scanFilters of samples created afterwards
     static void setFilter_minIntensity(int x ) { filter_minIntensity=x; }
     static void setFilter_centroidScans( bool x) { filter_centroidScans=x; }
     static void setFilter_intensityQuantile(int x ) { filter_intensityQuantile=x; }
@@ -393,6 +595,18 @@ public:
         static int filter_polarity;
         ifstream   _iostream;
 
+        //addScan() leaves the scan filters to filterPendingScans(), which runs them in parallel.
+        //only for parsers that fill in the scan data before addScan()
+        bool isDeferScanFilters = false;
+        vector<Scan*> pendingScans;
+        static const size_t pendingScansBatchSize = 256;
+
+        void filterPendingScans();
+
+        PrecursorIndex precursorIndex;
+        atomic<bool> isPrecursorIndexValid{false};
+        mutex precursorIndexMutex;
+
 };
 
 class EIC {
@@ -485,6 +699,8 @@ class Peak {
 		Peak(EIC* e, int p);
         Peak(const Peak& p);
 		Peak& operator=(const Peak& o);
+        Peak(Peak&& o) noexcept = default;
+        Peak& operator=(Peak&& o) noexcept = default;
                 void copyObj(const Peak& o);
 
 		//~Peak() { cerr << "~Peak() " << this << endl; }
@@ -579,9 +795,12 @@ class PeakGroup {
 		PeakGroup();
 		PeakGroup(const PeakGroup& o);
 		PeakGroup& operator=(const PeakGroup& o);
+        PeakGroup(PeakGroup&& o) noexcept;
+        PeakGroup& operator=(PeakGroup&& o) noexcept;
 		bool operator==(const PeakGroup* o);
         bool operator==(const PeakGroup& o);
         void copyObj(const PeakGroup& o);
+        void moveObj(PeakGroup& o);
 
 		~PeakGroup();
 
@@ -706,6 +925,7 @@ class PeakGroup {
 
 		inline void addPeak(const Peak& peak) { peaks.push_back(peak); peaks.back().groupNum=groupId; }
 		inline void addChild(const PeakGroup& child) { children.push_back(child); children.back().parent = this;   }
+		inline void addChild(PeakGroup&& child) { children.push_back(std::move(child)); children.back().parent = this;   }
 		Peak* getPeak(mzSample* sample);
 
 		GroupType _type;
@@ -790,6 +1010,13 @@ class Compound {
             bool groupUnlinked() { return _groupUnlinked; }
             FragmentationMatchScore scoreCompoundHit(Fragment* f, float productPpmTolr, bool searchProton);
 
+            /**
+             * @brief scoreCompoundHit() of each compound against one observed spectrum,
+             * in parallel and without annotating f. Opt-in: callers that score many compounds
+             * against the same spectrum use this instead of a scoreCompoundHit() loop.
+             */
+            static vector<FragmentationMatchScore> scoreCompoundHits(const vector<Compound*>& compounds, Fragment* f, float productPpmTolr, bool searchProton);
+
             int    cid;
             string id;
             string name;
@@ -1027,6 +1254,12 @@ public:
      */
     void compute(const vector<mzSample*>& allSamples);
 
+    /**
+     * @brief compute() of each set. EICs of all anchor slices of a sample are extracted
+     * together with mzSample::getEICs(), samples are processed in parallel.
+     */
+    static void computeAll(const vector<AnchorPointSet*>& sets, const vector<mzSample*>& allSamples);
+
     /**
      * @brief minNumObservedSamples
      */
@@ -1052,6 +1285,11 @@ class Aligner {
 		void doAlignment(vector<PeakGroup*>& peakgroups);
 		vector<double> groupMeanRt();
 		double checkFit();
+
+		/**
+		 * @brief polynomial fit of each sample to the median group retention times, samples are
+		 * fitted in parallel against the medians from before the fit
+		 */
         void Fit(int ideg);
 		void PolyFit(int maxdegree);
 		void saveFit();
@@ -1078,6 +1316,13 @@ class Aligner {
 		vector< vector<float> > fit;
 		vector<mzSample*> samples;
 		vector<PeakGroup*> allgroups;
+
+		//per sample: (group index, first peak of the sample in that group), in group order
+		vector< vector<pair<int, Peak*> > > samplePeaks;
+		void buildSamplePeaks();
+
+		double checkFit(const vector<double>& groupRt);
+		void PolyFit(int maxdegree, const vector<double>& groupRt);
         map<string,vector<AlignmentSegment*> > alignmentSegments;
 		int maxItterations;
 		int polynomialDegree;
@@ -1090,7 +1335,7 @@ public:
     ChargedSpecies(){
         deconvolutedMass=0; minZ=0; maxZ=0; countMatches=0; error=0; upCount=0; downCount=0; scan=NULL; totalIntensity=0; isotopicClusterId=0;
         minRt=maxRt=meanRt=0; istotopicParentFlag=false; minIsotopeMass=0; maxIsotopeMass=0; massDiffectCluster=-100; filterOutFlag=false;
-        qscore=0;
+        qscore=0; monoisotopicMass=0; isotopeScore=0;
     }
 
     float deconvolutedMass;     //parent mass guess
@@ -1120,6 +1365,10 @@ public:
     int minIsotopeMass;
     int maxIsotopeMass;
 
+    //averagine fit of the isotope envelope at the parent peak, see ScanDeconvolver
+    float monoisotopicMass;
+    float isotopeScore;
+
     static bool compIntensity(ChargedSpecies* a, ChargedSpecies* b ) { return a->totalIntensity > b->totalIntensity; }
     static bool compMass(ChargedSpecies* a, ChargedSpecies* b ) { return a->deconvolutedMass < b->deconvolutedMass; }
     static bool compMatches(ChargedSpecies* a, ChargedSpecies* b ) { return a->countMatches > b->countMatches; }
@@ -52,6 +52,7 @@ void ParallelMassSlicer::algorithmB(float userPPM, float minIntensity, int rtSte
         //Scan* lastScan = NULL;
 		cerr << "#algorithmB:" << samples[i]->sampleName << endl;
 
+		ChargeStateDetector chargeDetector;
 		for(unsigned int j=0; j < samples[i]->scans.size(); j++ ) {
 			Scan* scan = samples[i]->scans[j];
 			if (scan->mslevel != 1 ) continue;
@@ -59,7 +60,7 @@ void ParallelMassSlicer::algorithmB(float userPPM, float minIntensity, int rtSte
 			float rt = scan->rt;
 
                 vector<int> charges;
-                if (_minCharge > 0 or _maxCharge > 0) charges = scan->assignCharges(userPPM);
+                if (_minCharge > 0 or _maxCharge > 0) charges = chargeDetector.assignCharges(scan, userPPM);
 
                 for(unsigned int k=0; k < scan->nobs(); k++ ){
                 if (_maxMz and !isBetweenInclusive(scan->mz[k],_minMz,_maxMz)) continue;
@@ -136,11 +137,12 @@ void ParallelMassSlicer::algorithmC(float ppm, float minIntensity, float rtWindo
 
         for(unsigned int i=0; i < samples.size(); i++) {
             mzSample* s = samples[i];
+            ChargeStateDetector chargeDetector;
             for(unsigned int j=0; j < s->scans.size(); j++) {
                 Scan* scan = samples[i]->scans[j];
 
                 if (scan->mslevel != 1 ) continue;
-                vector<int>chargeState = scan->assignCharges(ppm);
+                vector<int>chargeState = chargeDetector.assignCharges(scan, ppm);
 
                 vector<int> positions = scan->intensityOrderDesc();
                 for(unsigned int k=0; k< positions.size() && k<topN; k++ ) {
@@ -192,7 +194,7 @@ void ParallelMassSlicer::algorithmD(float ppm, float rtWindow) {        //featur
 
                 if(! sliceExists(mz,rt) ) {
                     mzSlice* s = new mzSlice(mzmin,mzmax, rt-2*rtWindow, rt+2*rtWindow);
-                    s->ionCount = scan->totalIntensity();
+                    s->ionCount = scan->getScanSummary().totalIntensity;
                     s->rt=scan->rt;
                     s->mz=mz;
                     slices.push_back(s);
@@ -8,6 +8,10 @@ SOURCES=neuron.cc nnwork.cc
 HEADERS=neuron.h  nnwork.h
 INCLUDEPATH += ./
 
+# nnwork::runBatch() must give the same bits as nnwork::runMultiThreaded():
+# do not let the compiler fuse multiply-adds differently in scalar and vectorized loops
+QMAKE_CXXFLAGS += -ffp-contract=off
+
 
 contains(MEEGO_EDITION,harmattan) {
     target.path = /opt/libneural/lib
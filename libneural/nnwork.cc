@@ -28,6 +28,7 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#include <algorithm>
 
 using namespace std;
 // This class implements a simple three-layer backpropagation network.
@@ -268,7 +269,7 @@ void nnwork::run (float data [], float result [])
  * @param data
  * @return weight-adjusted output vector, coming from results of pretrained neural net
  */
-vector<float> nnwork::runMultiThreaded(vector<float> data) {
+vector<float> nnwork::runMultiThreaded(const vector<float>& data) {
 
     vector<float> result = vector<float>(output_size, 0);
 
@@ -323,6 +324,92 @@ vector<float> nnwork::runMultiThreaded(vector<float> data) {
     return result;
 }
 
+// Rows scored together by runBatch(). Sums are accumulated across the rows of a block
+// (one SIMD lane per row), in the same order of terms as runMultiThreaded().
+
+#define NN_BATCH_BLOCK 16
+
+/**
+ * @brief nnwork::runBatch
+ * Score many input vectors with a pre-trained network, e.g. the features of every peak of a run.
+ *
+ * The weights are packed into contiguous row-major arrays, and rows are processed in blocks of
+ * NN_BATCH_BLOCK: inputs of a block are transposed so that every weight multiplies a contiguous
+ * run of NN_BATCH_BLOCK values, a loop the compiler vectorizes. Blocks are processed in parallel.
+ *
+ * @param data num_rows x input_size inputs, row-major
+ * @param num_rows
+ * @param result num_rows x output_size outputs, row-major
+ */
+void nnwork::runBatch(const float data [], int num_rows, float result [])
+{
+    if (input_size == 0 || hidden_size == 0 || output_size == 0) {
+        cerr << "nnwork::runBatch() Warning: stupid dimensions. No action taken." << endl;
+        return;
+    }
+    if (num_rows <= 0) return;
+
+    vector<float> hidden_weights(static_cast<size_t>(hidden_size) * input_size);
+    for (int j = 0; j < hidden_size; j++)
+        for (int i = 0; i < input_size; i++)
+            hidden_weights[j * input_size + i] = hidden_nodes -> nodes[j].weights[i];
+
+    vector<float> output_weights(static_cast<size_t>(output_size) * hidden_size);
+    for (int k = 0; k < output_size; k++)
+        for (int j = 0; j < hidden_size; j++)
+            output_weights[k * hidden_size + j] = output_nodes -> nodes[k].weights[j];
+
+    int num_blocks = (num_rows + NN_BATCH_BLOCK - 1) / NN_BATCH_BLOCK;
+
+    #pragma omp parallel
+    {
+        // column-major blocks: value of row b at [i * NN_BATCH_BLOCK + b]
+        vector<float> inputs(static_cast<size_t>(input_size) * NN_BATCH_BLOCK, 0);
+        vector<float> hidden(static_cast<size_t>(hidden_size) * NN_BATCH_BLOCK, 0);
+        float sums [NN_BATCH_BLOCK];
+
+        #pragma omp for schedule(static)
+        for (int block = 0; block < num_blocks; block++) {
+            int first_row = block * NN_BATCH_BLOCK;
+            int block_rows = min(NN_BATCH_BLOCK, num_rows - first_row);
+
+            for (int b = 0; b < block_rows; b++) {
+                const float* row = data + static_cast<size_t>(first_row + b) * input_size;
+                for (int i = 0; i < input_size; i++) inputs[i * NN_BATCH_BLOCK + b] = row[i];
+            }
+
+            for (int j = 0; j < hidden_size; j++) {
+                const float* w = &hidden_weights[static_cast<size_t>(j) * input_size];
+                for (int b = 0; b < NN_BATCH_BLOCK; b++) sums[b] = 0;
+                for (int i = 0; i < input_size; i++) {
+                    const float* x = &inputs[i * NN_BATCH_BLOCK];
+                    for (int b = 0; b < NN_BATCH_BLOCK; b++) sums[b] += w[i] * x[b];
+                }
+                for (int b = 0; b < NN_BATCH_BLOCK; b++) hidden[j * NN_BATCH_BLOCK + b] = sigmoid(sums[b]);
+            }
+
+            for (int k = 0; k < output_size; k++) {
+                const float* w = &output_weights[static_cast<size_t>(k) * hidden_size];
+                for (int b = 0; b < NN_BATCH_BLOCK; b++) sums[b] = 0;
+                for (int j = 0; j < hidden_size; j++) {
+                    const float* h = &hidden[j * NN_BATCH_BLOCK];
+                    for (int b = 0; b < NN_BATCH_BLOCK; b++) sums[b] += w[j] * h[b];
+                }
+                for (int b = 0; b < block_rows; b++)
+                    result[static_cast<size_t>(first_row + b) * output_size + k] = sigmoid(sums[b]);
+            }
+        }
+    }
+}
+
+vector<float> nnwork::runBatch(const vector<float>& data)
+{
+    int num_rows = input_size > 0 ? static_cast<int>(data.size() / input_size) : 0;
+    vector<float> result(static_cast<size_t>(num_rows) * output_size, 0);
+    if (num_rows > 0) runBatch(data.data(), num_rows, result.data());
+    return result;
+}
+
 /* 
 	Restore the values of the connection weights from a file. Format:
 
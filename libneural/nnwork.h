@@ -61,7 +61,14 @@ public:
 	
 //Threading-safe NN
 
-    std::vector<float> runMultiThreaded(std::vector<float> data);
+    std::vector<float> runMultiThreaded(const std::vector<float>& data);
+
+// Batch version of runMultiThreaded(): data holds num_rows input vectors back to back
+// (num_rows x input_size, row-major), result receives num_rows x output_size values.
+// Each row gives exactly the same output as runMultiThreaded(). Thread-safe.
+
+    void runBatch(const float data [], int num_rows, float result []);
+    std::vector<float> runBatch(const std::vector<float>& data);
 
 // Arg for load and save is just the filename.
 
@@ -0,0 +1,106 @@
+//CompoundLibrary snapshots: round trip, and corrupt snapshots are rejected
+#include "mzSample.h"
+#include "CompoundLibrary.h"
+#include <fstream>
+#include <cstring>
+
+string readFile(const string& fileName) {
+    ifstream in(fileName.c_str(), ios::binary);
+    return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+void writeFile(const string& fileName, const string& data) {
+    ofstream out(fileName.c_str(), ios::binary);
+    out.write(data.data(), static_cast<streamsize>(data.size()));
+}
+
+//position of the first element of the column-th column after the string pool (0 = string offsets)
+size_t columnStart(const string& data, unsigned int column, const vector<size_t>& elementSizes) {
+    size_t pos = 8 + sizeof(uint32_t);  //magic, version
+
+    uint64_t n = 0;
+    memcpy(&n, data.data() + pos, sizeof(n));
+    pos += sizeof(n) + n;               //string pool characters
+
+    for (unsigned int i = 0; i < column; i++) {
+        memcpy(&n, data.data() + pos, sizeof(n));
+        pos += sizeof(n) + n * elementSizes[i];
+    }
+
+    return pos + sizeof(uint64_t);
+}
+
+int main(int argc, char** argv) {
+
+    string snapshotFile = "compound_library_test.snapshot";
+    string corruptFile = "compound_library_test.corrupt.snapshot";
+
+    CompoundLibrary library;
+    for (int i = 0; i < 10; i++) {
+        Compound compound("id" + to_string(i), "compound" + to_string(i), "C" + to_string(6+i) + "H12O6", 0);
+        compound.precursorMz = 181.07 + i*14.01;
+        for (int j = 0; j <= i % 4; j++) {
+            compound.fragment_mzs.push_back(50 + 10*j);
+            compound.fragment_intensity.push_back(100 - j);
+            compound.fragment_labels.push_back("frag" + to_string(j));
+        }
+        library.add(&compound);
+    }
+
+    Adduct adduct("[M+H]+", PROTON, 1, 1);
+    vector<Adduct*> adducts(1, &adduct);
+    library.buildMzIndex(adducts, false);
+
+    if (!library.saveSnapshot(snapshotFile)) return 1;
+
+    //round trip
+    CompoundLibrary loaded;
+    if (!loaded.loadSnapshot(snapshotFile) || loaded.size() != library.size()
+            || loaded.getName(3) != library.getName(3) || loaded.getNumFragments(3) != library.getNumFragments(3)
+            || loaded.findByMz("[M+H]+", 0, 10000).size() != library.size()) {
+        cerr << "FAIL: snapshot round trip" << endl;
+        return 1;
+    }
+
+    string snapshot = readFile(snapshotFile);
+
+    //string offsets, 8 string id columns, 6 float columns, 2 int columns, flags, fragment offsets
+    vector<size_t> elementSizes = {4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 1};
+    const unsigned int fragmentOffsetsColumn = 18;
+
+    //non-monotonic fragment offsets, with consistent column sizes and last offset
+    string corrupt = snapshot;
+    size_t pos = columnStart(corrupt, fragmentOffsetsColumn, elementSizes);
+    uint32_t offsets[3];
+    memcpy(offsets, corrupt.data() + pos, sizeof(offsets));
+    if (offsets[0] != 0 || offsets[2] <= offsets[1]) {
+        cerr << "FAIL: unexpected snapshot layout" << endl;
+        return 1;
+    }
+    offsets[1] = offsets[2] + 1;
+    memcpy(&corrupt[pos], offsets, sizeof(offsets));
+    writeFile(corruptFile, corrupt);
+
+    CompoundLibrary corruptLibrary;
+    if (corruptLibrary.loadSnapshot(corruptFile) || corruptLibrary.size() != 0) {
+        cerr << "FAIL: snapshot with non-monotonic fragment offsets was loaded" << endl;
+        return 1;
+    }
+
+    //m/z index entry of a compound out of range (the index is the last column)
+    corrupt = snapshot;
+    uint32_t compoundId = static_cast<uint32_t>(library.size());
+    memcpy(&corrupt[corrupt.size() - sizeof(uint32_t)], &compoundId, sizeof(compoundId));
+    writeFile(corruptFile, corrupt);
+
+    if (corruptLibrary.loadSnapshot(corruptFile) || corruptLibrary.size() != 0) {
+        cerr << "FAIL: snapshot with an out of range m/z index compound id was loaded" << endl;
+        return 1;
+    }
+
+    remove(snapshotFile.c_str());
+    remove(corruptFile.c_str());
+
+    cerr << "PASS" << endl;
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "Peptide.h"
+#include "ProteinDigest.h"
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -7,147 +8,54 @@
 
 //globals
 //
-int  MINLENGTH=5;
-int  MAXLENTH=30;
-int  MAXMISSED=3;
 bool TMT_LABELED=false;
 bool PRINT_IONS=false;
 bool BUILD_INDEX=false;
 bool TRYPTIC_DIGEST=false;
 bool REVERSE=false;
+bool DECOYS=false;
 
 using namespace std;
 
-class Protein { 
+void printTheoryFragmentaiton(Peptide& pep) {
 
-    public:
-        string header; 
-        string seq; 
+    cout << "PEPTIDE:\"" << pep.interactStyleWithCharge() << "\"\tpreMz:" << setprecision(7) << pep.monoisotopicMZ() << endl;
 
-        Protein(string h, string s) { 
-            header=h; 
-            seq=s; 
-            seq.erase(std::remove_if(seq.begin(), seq.end(), [](char x){return std::isspace(x);}),seq.end());
-        }
-
-        string reverse_sequence() {
-          string rev = seq;
-          std::reverse(rev.begin(),rev.end());
-          return rev;
-        }
-
-        void trypticDigest() { 
-            vector<int>cuts;
-
-            string sequence = this->seq;
-            if (REVERSE) sequence = this->reverse_sequence();
+    vector<FragmentIon*> theoreticalIons;
+    pep.generateFragmentIonsCID(theoreticalIons);
 
-            //find cut points
-            cuts.push_back(0);
-            for(int i=0; i<sequence.length(); i++ ) {
-                if(sequence[i] == 'R' or sequence[i] == 'K')  cuts.push_back(i); 
-            }
-            cuts.push_back(sequence.length()-1);
-
-            for(int i=0; i < cuts.size()-1; i++ ) {
-                int pos1 =  cuts[i];
-                for(int j=i+1; j <= cuts.size(); j++ ) {
-                    int pos2 =  cuts[j];
-                    if (pos2-pos1 > MAXLENTH) break;
-                    if (j-i > MAXMISSED) break;
+    for(FragmentIon* f: theoreticalIons ) {
+        if (f->m_prominence < 4 or f->m_charge >= 3) continue;
+        cout << "\t" << f->m_mz << "\t" << f->m_ion << endl;
+    }
 
-		    int nTerm=0;
-		    if( pos1 == 0) nTerm=1;
+    for(int i=0; i < theoreticalIons.size(); i++ ) delete theoreticalIons[i];
+}
 
-                    if (pos2-pos1+nTerm >=MINLENGTH and pos2-pos1 <= MAXLENTH) { 
-                        string peptideSeq;
-                        if(i>0) peptideSeq = sequence.substr(pos1+1,pos2-pos1);
-			else if(nTerm)  peptideSeq = sequence.substr(pos1,pos2+1);
+void printDigest(PeptideIndex& index) {
 
-                       calculateMZ(peptideSeq);
+    for(const PeptideIndex::Entry& entry: index.getEntries()) {
+        Peptide pep(index.getModifiedSequence(entry),1);
 
-                    }
-                }
-            }
+        for(int z=2; z<5; z++) {
+            pep.charge = z;
+            if(PRINT_IONS) printTheoryFragmentaiton(pep);
+            else cout << pep.interactStyleWithCharge() << endl;
         }
+    }
+}
 
-	void printTheoryFragmentaiton(Peptide& pep) {
-
-                cout << "PEPTIDE:\"" << pep.interactStyleWithCharge() << "\"\tpreMz:" << setprecision(7) << pep.monoisotopicMZ() << endl;
-
-		vector<FragmentIon*> theoreticalIons;
-		pep.generateFragmentIonsCID(theoreticalIons);
-
-		for(FragmentIon* f: theoreticalIons ) {
-			if (f->m_prominence < 4 or f->m_charge >= 3) continue;
-			cout << "\t" << f->m_mz << "\t" << f->m_ion << endl;
-		}
-
-		if(theoreticalIons.size()) { 
-			for(int i=0; i < theoreticalIons.size(); i++ ) delete theoreticalIons[i];
-		}
-	}
-
-
-        void calculateMZ(string seq) {
-
-            string modPeptideString;
-            if (TMT_LABELED) modPeptideString = "n[230]";
-
-            //fixed mods
-            for(int i=0; i<seq.size(); i++ ) {
-                if      (seq[i] == 'C') modPeptideString += "C[160]";
-                else if (TMT_LABELED and seq[i] == 'K')  { modPeptideString += "K[357]"; }
-                else  modPeptideString += seq[i];
-            }
-            //variable mods
-
-            Peptide pep(modPeptideString,1);
-
-            auto SAVE_COPY=pep.mods;
-            for(int z=2; z<5; z++) {
-                pep.charge = z;
-		if(PRINT_IONS) printTheoryFragmentaiton(pep);
-		else cout << pep.interactStyleWithCharge() << endl;
+void printIndex(PeptideIndex& index) {
 
-                //add oxidation
-                for(int i=0; i<seq.size(); i++ ) {
-                    if (seq[i] == 'M') { 
-                        pep.mods[i] = "Oxidation";
-			if(PRINT_IONS) printTheoryFragmentaiton(pep);
-			else cout << pep.interactStyleWithCharge() << endl;
+    for(const PeptideIndex::Entry& entry: index.getEntries()) {
+        cout << setprecision(10) << entry.mass << "\t" << index.getModifiedSequence(entry) << "\t";
 
-                    }
-                }
-                pep.mods = SAVE_COPY;
-            }
+        vector<uint32_t> proteinIds = index.getProteinIds(entry.peptideId);
+        for(int i=0; i < proteinIds.size(); i++ ) {
+            if (i) cout << ";";
+            cout << index.proteinAccessions[proteinIds[i]];
         }
-};
-
-std::vector<Protein*> proteins;
-
-void loadFastaFile(string filename) { 
-
-    ifstream fastafile(filename);
-    if(! fastafile.is_open() ) { cerr << "Can't open file " << filename; return; }
-
-    string line;
-    string header;
-    string sequence;
-
-    while ( getline(fastafile,line) ) {
-        if (line[0] == '>') { 
-            if(!header.empty() and !sequence.empty()) { 
-                proteins.push_back( new Protein(header,sequence)); 
-            } 
-
-            header = line; 
-            sequence=string(); 
-        } else sequence += line;
-    }
-
-    if(!header.empty() and !sequence.empty()) { 
-      proteins.push_back( new Protein(header,sequence)); 
+        cout << endl;
     }
 }
 
@@ -157,36 +65,70 @@ int main(int argc, char** argv) {
     // process options
     //
     string fastafile;
+    string enzyme = "trypsin";
     for(int i=1; i< argc; i++ ) {
         string optionString(argv[i]);
         if (optionString == "-i" and i+1<argc) fastafile=string(argv[i+1]);
+        if (optionString == "-enzyme" and i+1<argc) enzyme=string(argv[i+1]);
         if (optionString == "-tmt")     TMT_LABELED=true;
         if (optionString == "-ions")    PRINT_IONS=true;
         if (optionString == "-digest")  TRYPTIC_DIGEST=true;
         if (optionString == "-reverse") REVERSE=true;
+        if (optionString == "-decoys")  DECOYS=true;
         if (optionString == "-index")   BUILD_INDEX=true;
     }
 
     if (argc <= 2) {
-        cerr << "usage: ./digest -i file.fasta -digest -reverse";
+        cerr << "usage: ./digest -i file.fasta [-enzyme trypsin] -digest|-index -reverse|-decoys -tmt -ions\n"
+             << "  -reverse: digest the reversed protein sequences only\n"
+             << "  -decoys:  digest the proteins and their reversed sequences (accessions prefixed with REV_)\n";
+        return 1;
     }
 
     //
-    //load fasta file
+    // digestion parameters
     //
-    if(!fastafile.empty()) loadFastaFile(fastafile);
- 
+    DigestionParameters params;
+    params.enzyme = Enzyme::fromName(enzyme);
+    params.minLength = 5;
+    params.maxLength = 30;
+    params.maxMissedCleavages = 2;
+    params.fixedMods['C'] = 57.02146;
+    params.variableMods['M'] = 15.99491;   //oxidation
+    params.maxVariableMods = 1;
+    params.isIncludeDecoys = DECOYS;
+
+    if (TMT_LABELED) {
+        params.nTermFixedModMass = 229.16293;
+        params.fixedMods['K'] = 229.16293;
+    }
+
     //
-    //digest
+    // load and digest fasta file
     //
-    if (TRYPTIC_DIGEST) { 
-    	for(Protein* p: proteins)  p->trypticDigest();
+    if (fastafile.empty()) return 1;
+
+    PeptideIndex index;
+    if (REVERSE) {
+        ifstream fasta(fastafile);
+        if (!fasta.is_open()) { cerr << "Can't open file " << fastafile; return 1; }
+
+        vector<ProteinRecord> proteins;
+        ProteinRecord protein;
+        for (FastaReader reader(fasta); reader.next(protein); ) {
+            std::reverse(protein.sequence.begin(), protein.sequence.end());
+            proteins.push_back(protein);
+        }
+        index = PeptideIndex::build(proteins, params);
+    } else {
+        index = PeptideIndex::build(fastafile, params);
     }
-    
-   //
-   //build index
-   //
-   if (BUILD_INDEX) { 
-    	for(Protein* p: proteins)  p->trypticDigest();
-   }
+    cerr << index.proteinAccessions.size() << " proteins, " << index.numPeptides() << " peptides, " << index.numEntries() << " entries" << endl;
+
+    if (TRYPTIC_DIGEST) printDigest(index);
+
+    //
+    //print index
+    //
+    if (BUILD_INDEX) printIndex(index);
 }
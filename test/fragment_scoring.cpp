@@ -0,0 +1,99 @@
+//compare FragmentBatchScorer / Compound::scoreCompoundHits() against per-pair Fragment::scoreMatch()
+#include "mzSample.h"
+#include <random>
+#include <chrono>
+
+bool isClose(double a, double b, double relTolr) {
+    return fabs(a-b) <= relTolr * max(1.0, max(fabs(a), fabs(b)));
+}
+
+int main(int argc, char** argv) {
+
+    int numCompounds = 500;
+    if (argc > 1) numCompounds = atoi(argv[1]);
+
+    mt19937 rng(1);
+    uniform_real_distribution<float> uniform(0, 1);
+
+    //observed spectrum
+    Fragment observed;
+    observed.precursorMz = 800;
+    for (int i = 0; i < 300; i++) {
+        observed.mzs.push_back(50 + uniform(rng)*1000);
+        observed.intensity_array.push_back(uniform(rng)*1e4);
+        observed.fragment_labels.push_back("");
+    }
+
+    //library compounds, half of their fragments are taken from the observed spectrum
+    vector<Compound*> compounds;
+    for (int c = 0; c < numCompounds; c++) {
+        Compound* cpd = new Compound("id" + to_string(c), "compound" + to_string(c), "", 1);
+        cpd->precursorMz = 800 + (uniform(rng)-0.5f)*0.01f;
+        int numFragments = c % 17 == 0 ? 1 : 2 + c % 30;
+        for (int i = 0; i < numFragments; i++) {
+            float mz = i % 2 == 0 ? observed.mzs[static_cast<unsigned int>(uniform(rng)*299)] * (1 + (uniform(rng)-0.5f)*1e-5f) : 50 + uniform(rng)*2100;
+            cpd->fragment_mzs.push_back(mz);
+            cpd->fragment_intensity.push_back(uniform(rng)*100);
+            cpd->fragment_labels.push_back("frag" + to_string(i));
+        }
+        sort(cpd->fragment_mzs.begin(), cpd->fragment_mzs.end());
+        compounds.push_back(cpd);
+    }
+    compounds.push_back(new Compound("empty", "empty", "", 1));
+
+    for (bool searchProton : {false, true}) {
+
+        auto t0 = chrono::steady_clock::now();
+
+        vector<FragmentationMatchScore> expected;
+        for (Compound* cpd : compounds) {
+            Fragment f(observed);
+            expected.push_back(cpd->scoreCompoundHit(&f, 20, searchProton));
+        }
+
+        auto t1 = chrono::steady_clock::now();
+
+        Fragment f(observed);
+        vector<FragmentationMatchScore> scores = Compound::scoreCompoundHits(compounds, &f, 20, searchProton);
+
+        auto t2 = chrono::steady_clock::now();
+
+        int numMismatches = 0;
+        for (unsigned int i = 0; i < compounds.size(); i++) {
+            FragmentationMatchScore& a = expected[i];
+            FragmentationMatchScore& b = scores[i];
+
+            bool isMatch = a.ranks == b.ranks
+                    && a.numMatches == b.numMatches
+                    && a.fractionMatched == b.fractionMatched
+                    && a.ppmError == b.ppmError
+                    && a.spearmanRankCorrelation == b.spearmanRankCorrelation
+                    && a.ticMatched == b.ticMatched
+                    && a.mzFragError == b.mzFragError
+                    && a.matchedQuantiles == b.matchedQuantiles
+                    && isClose(a.dotProduct, b.dotProduct, 1e-4)
+                    && isClose(a.hypergeomScore, b.hypergeomScore, 1e-9)
+                    && isClose(a.mvhScore, b.mvhScore, 1e-9)
+                    && isClose(a.weightedDotProduct, b.weightedDotProduct, 1e-9);
+
+            if (!isMatch) {
+                numMismatches++;
+                cerr << compounds[i]->name << "\tdotProduct=" << a.dotProduct << "/" << b.dotProduct
+                     << "\thypergeom=" << a.hypergeomScore << "/" << b.hypergeomScore
+                     << "\tmvh=" << a.mvhScore << "/" << b.mvhScore << endl;
+            }
+        }
+
+        cerr << "searchProton=" << searchProton
+             << "\tcompounds=" << compounds.size()
+             << "\tmismatches=" << numMismatches
+             << "\tscoreCompoundHit=" << chrono::duration<double, milli>(t1-t0).count() << "ms"
+             << "\tscoreCompoundHits=" << chrono::duration<double, milli>(t2-t1).count() << "ms" << endl;
+
+        if (numMismatches > 0) return 1;
+    }
+
+    for (Compound* cpd : compounds) delete cpd;
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+//benchmark MassCalculator::computeIsotopePattern() against computeIsotopes(), and check glucose and heme abundances
+#include "mzMassCalculator.h"
+#include <random>
+#include <chrono>
+
+int main(int argc, char** argv) {
+
+    int numFormulas = 2000;
+    if (argc > 1) numFormulas = atoi(argv[1]);
+
+    MassCalculator massCalc;
+    Adduct* adduct = new Adduct("[M+H]+", PROTON, 1, 1);
+
+    //phosphatidylcholine-like formulas
+    mt19937 rng(1);
+    vector<string> formulas;
+    for (int i = 0; i < numFormulas; i++) {
+        int c = 30 + rng() % 20;
+        int db = rng() % 7;
+        formulas.push_back("C" + to_string(c) + "H" + to_string(2*c + 2 - 2*db) + "N1O8P1");
+    }
+
+    auto t0 = chrono::steady_clock::now();
+
+    unsigned long numIsotopes = 0;
+    for (string& formula : formulas) {
+        numIsotopes += massCalc.computeIsotopes(formula, adduct).size();
+    }
+
+    auto t1 = chrono::steady_clock::now();
+
+    unsigned long numFinePeaks = 0;
+    for (string& formula : formulas) {
+        numFinePeaks += MassCalculator::computeIsotopePattern(formula, adduct, 1e-6).finePeaks.size();
+    }
+
+    auto t2 = chrono::steady_clock::now();
+
+    for (string& formula : formulas) {
+        numFinePeaks += MassCalculator::computeIsotopePattern(formula, adduct, 1e-6).finePeaks.size();
+    }
+
+    auto t3 = chrono::steady_clock::now();
+
+    cerr << "formulas=" << formulas.size()
+         << "\tcomputeIsotopes=" << chrono::duration<double, milli>(t1-t0).count() << "ms (" << numIsotopes << " isotopes)"
+         << "\tcomputeIsotopePattern=" << chrono::duration<double, milli>(t2-t1).count() << "ms"
+         << "\tcached=" << chrono::duration<double, milli>(t3-t2).count() << "ms (" << numFinePeaks << " fine peaks)" << endl;
+
+    //glucose [M+H]+: M+1 is mostly 13C (6 x 1.07%), with 17O, 2H contributions
+    IsotopePattern glucose = MassCalculator::computeIsotopePattern("C6H12O6", adduct, 1e-6);
+    if (glucose.aggregatePeaks.size() < 3) {
+        cerr << "glucose: expected at least 3 aggregate peaks" << endl;
+        return 1;
+    }
+
+    double ratio = glucose.aggregatePeaks[1].abundance / glucose.aggregatePeaks[0].abundance;
+    double mzDiff = glucose.aggregatePeaks[0].mz - massCalc.computeMass("C6H12O6", 1);
+
+    cerr << "glucose [M+H]+ M+1/M+0=" << ratio*100 << "%\tM+0 m/z error=" << mzDiff << endl;
+
+    if (fabs(ratio - 0.0687) > 0.002 || fabs(mzDiff) > 1e-4) return 1;
+
+    //heme [M+H]+: the parent peak is 56Fe, 54Fe (5.8%) gives a peak 2 Da lighter
+    IsotopePattern heme = MassCalculator::computeIsotopePattern("C34H32FeN4O4", adduct, 1e-6);
+
+    const IsotopePattern::Peak* hemeParent = nullptr;
+    const IsotopePattern::Peak* heme54Fe = nullptr;
+    for (auto& peak : heme.aggregatePeaks) {
+        if (peak.nominalShift == 0) hemeParent = &peak;
+        if (peak.nominalShift == -2) heme54Fe = &peak;
+    }
+    if (!hemeParent || !heme54Fe) {
+        cerr << "heme: expected aggregate peaks at nominal shifts 0 and -2" << endl;
+        return 1;
+    }
+
+    double hemeRatio = heme54Fe->abundance / hemeParent->abundance;
+    double hemeMzDiff = hemeParent->mz - massCalc.computeMass("C34H32FeN4O4", 1);
+
+    cerr << "heme [M+H]+ 54Fe/56Fe=" << hemeRatio*100 << "%\tparent m/z error=" << hemeMzDiff << endl;
+
+    for (auto& peak : heme.aggregatePeaks) {
+        if (peak.abundance > hemeParent->abundance) {
+            cerr << "heme: the parent peak is not the most abundant" << endl;
+            return 1;
+        }
+    }
+
+    if (fabs(hemeRatio - 0.05845/0.91754) > 0.005 || fabs(hemeMzDiff) > 1e-3) return 1;
+
+    delete adduct;
+
+    return 0;
+}